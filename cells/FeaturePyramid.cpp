@@ -0,0 +1,54 @@
+#include <ecto/ecto.hpp>
+#include <opencv2/core/core.hpp>
+#include <boost/format.hpp>
+#include "mmod_color.h"
+using ecto::tendrils;
+namespace mmod
+{
+    struct FeaturePyramid
+    {
+        static void
+        declare_params(tendrils& p)
+        {
+            p.declare(&FeaturePyramid::n_levels,"n_levels","The number of pyramid levels", 2);
+            p.declare(&FeaturePyramid::mode,"mode","\"test\" to clean up and spread every level, \"train\" to clean up only, \"none\"", std::string("test"));
+            p.declare(&FeaturePyramid::majority,"majority","Pool 2x2 blocks to their most common orientation instead of ORing them (always so in \"train\" mode)", false);
+        }
+
+        static void 
+        declare_io(const tendrils& p, tendrils& i, tendrils& o)
+        {
+            int n_levels;
+            p["n_levels"] >> n_levels;
+            for(int iter = 0; iter < n_levels; iter++)
+            {
+                std::string name = boost::str( boost::format("level_%d")%iter );
+                o.declare<cv::Mat>(name,"A level of the feature pyramid");
+            }
+            i.declare(&FeaturePyramid::features,"features","Binarized features (extractor run with mode \"none\") of the full scale image");
+        }
+
+        int process(const tendrils& i,const tendrils& o)
+        {
+            pyr.setPooling(*majority ? POOL_MAJORITY : POOL_OR);
+            //Fresh images every frame: the levels handed out last frame may still be in use downstream
+            std::vector<cv::Mat> levels;
+            if(pyr.build(*features,*n_levels - 1,levels,*mode) < 0)
+                return ecto::OK;
+            for(int iter = 0, end = *n_levels; iter != end; iter++)
+            {
+                std::string name = boost::str( boost::format("level_%d")%iter );
+                o[name] << levels[iter];
+            }
+            return ecto::OK;
+        }     
+        ecto::spore<int> n_levels;
+        ecto::spore<std::string> mode;
+        ecto::spore<bool> majority;
+        ecto::spore<cv::Mat> features;
+        feature_pyramid pyr;
+    };
+
+}
+
+ECTO_CELL(mmod, mmod::FeaturePyramid, "FeaturePyramid","Feature images of all pyramid levels, pooled from the full scale features");
@@ -41,25 +41,29 @@ namespace mmod
     int
     process(const ecto::tendrils& inputs, const ecto::tendrils& outputs)
     {
+      if(!*objects_ || !*filters_) return ecto::OK;
       {
         std::stringstream objects_stream;
         boost::archive::binary_oarchive objects_archive(objects_stream);
-        objects_archive << *objects_;
+        objects_archive << **objects_;
         db_document_->set_attachment_stream("objects", objects_stream);
       }
       {
         std::stringstream filters_stream;
         boost::archive::binary_oarchive filters_archive(filters_stream);
-        filters_archive << *filters_;
+        filters_archive << **filters_;
         db_document_->set_attachment_stream("filters", filters_stream);
       }
+      //done with these snapshots, let go so the trainer can keep learning without copying the model
+      objects_->reset();
+      filters_->reset();
 
       return ecto::OK;
     }
   private:
     /** The JSON parameters used to compute the model */
-    ecto::spore<mmod_objects> objects_;
-    ecto::spore<mmod_filters> filters_;
+    ecto::spore<mmod_objects_snapshot> objects_;
+    ecto::spore<mmod_filters_snapshot> filters_;
     ecto::spore<object_recognition::db::Document> db_document_;
   };
 }
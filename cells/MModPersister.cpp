@@ -8,6 +8,7 @@
 #include "mmod_mode.h"
 #include "mmod_features.h"
 #include "mmod_color.h"
+#include "mmod_journal.h"
 
 //For serialization
 #include <fstream>
@@ -19,11 +20,27 @@ namespace mmod
 {
   struct MModPersister
   {
+    MModPersister()
+      :
+        journal_open(false)
+    {
+    }
+    //Leave complete files behind: merge the views still only in the journal into them
+    ~MModPersister()
+    {
+      if(journal.pending() > 0)
+        journal.fold();
+    }
     static void
     declare_params(tendrils& params)
     {
       params.declare(&MModPersister::filename_objects,"filename_objects");
       params.declare(&MModPersister::filename_filter,"filename_filter");
+      params.declare(&MModPersister::filename_journal,"filename_journal","Append the views learned since the last call"
+                                              " to this journal instead of rewriting both files each time (empty =>"
+                                              " rewrite). After a crash, mmod_recover merges it into the files","");
+      params.declare(&MModPersister::compact_every,"compact_every","Rewrite both files, emptying the journal, once it"
+                                              " holds this many views",200);
     }
     static void
     declare_io(const tendrils& params, tendrils& in, tendrils& out)
@@ -33,21 +50,43 @@ namespace mmod
     }
     int process(const tendrils& /*in*/, const tendrils& /*out*/)
     {
+      if(!*objects_in || !*filters_in) return ecto::OK;
+      if(!filename_journal->empty())
       {
-        std::ofstream filter_out(filename_filter->c_str());
-		    boost::archive::binary_oarchive oa(filter_out);
-		    oa << *filters_in;
+        if(!journal_open)
+        {
+          //A journal left by an interrupted run must be recovered before we write over it
+          if(journal.open(*filename_objects, *filename_filter, *filename_journal) < 0)
+            return ecto::QUIT;
+          journal_open = true;
+        }
+        if(journal.append(**objects_in, **filters_in) >= 0 && journal.pending() >= *compact_every)
+          journal.compact(**objects_in, **filters_in);
       }
+      else
       {
-        std::ofstream objects_out(filename_objects->c_str());
-		    boost::archive::binary_oarchive oa(objects_out);
-		    oa << *objects_in;
+        {
+          std::ofstream filter_out(filename_filter->c_str());
+          boost::archive::binary_oarchive oa(filter_out);
+          oa << **filters_in;
+        }
+        {
+          std::ofstream objects_out(filename_objects->c_str());
+          boost::archive::binary_oarchive oa(objects_out);
+          oa << **objects_in;
+        }
       }
+      //done with these snapshots, let go so the trainer can keep learning without copying the model
+      objects_in->reset();
+      filters_in->reset();
       return ecto::OK;
     }
-    spore<std::string> filename_filter,filename_objects;
-    spore<mmod_objects> objects_in;
-    spore<mmod_filters> filters_in;
+    spore<std::string> filename_filter,filename_objects,filename_journal;
+    spore<int> compact_every;
+    spore<mmod_objects_snapshot> objects_in;
+    spore<mmod_filters_snapshot> filters_in;
+    mmod_journal journal;
+    bool journal_open;
   };
 }
 
@@ -1,6 +1,10 @@
 #include <fstream>
+#include <sstream>
 
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <ecto/ecto.hpp>
 #include <opencv2/core/core.hpp>
@@ -11,6 +15,8 @@
 
 #include "mmod_objects.h"  //For train and test (includes mmod_mode.h, mmod_features.h, mmod_general.h
 #include "mmod_color.h"    //For depth and color processing (yes, I should change the name)
+#include "mmod_compiled.h" //Read only runtime model we match with
+#include "mmod_library.h"  //Loads those on first use
 using namespace std;
 using namespace cv;
 using object_recognition::db::Documents;
@@ -23,31 +29,78 @@ namespace mmod
   using ecto::spore;
   struct MModTester : public object_recognition::db::bases::ModelReaderImpl
   {
+    /** Load the model of a DB document: its objects compiled together with their filters.
+     * Models load on several threads (load_threads): the DB fetches are serialized, only the deserialization and the
+     * compilation run in parallel */
+    bool
+    load_document(const object_recognition::db::Document & document, mmod_compiled & model) const
+    {
+      std::stringstream objects_stream, filters_stream;
+      {
+        boost::mutex::scoped_lock lock(db_mutex());
+        std::cout << "Loading model for object id: " << document.get_value<std::string>("object_id") << std::endl;
+        document.get_attachment_stream("objects", objects_stream);
+        // Store the 3d positions
+        document.get_attachment_stream("filters", filters_stream);
+      }
+      mmod_objects templates;
+      mmod_filters filters;
+      {
+        objects_stream.seekg(0);
+        boost::archive::binary_iarchive ia(objects_stream);
+        ia >> templates;
+      }
+      {
+        filters_stream.seekg(0);
+        boost::archive::binary_iarchive ia(filters_stream);
+        ia >> filters;
+      }
+
+      // Compile both for matching, with pointer offsets for the feature images of the size we will be given
+      std::vector<cv::Size> resolutions;
+      if (layout_size_.width > 0 && layout_size_.height > 0)
+        resolutions.push_back(layout_size_);
+      model = mmod_compiled(templates, &filters, resolutions);
+      return true;
+    }
+
+    /** Guards the DB connection the documents share */
+    static boost::mutex &
+    db_mutex()
+    {
+      static boost::mutex m;
+      return m;
+    }
+
     void
     ParameterCallback(const Documents & db_documents)
     {
-      templates_.reserve(db_documents.size());
-      filters_.reserve(db_documents.size());
-      object_ids_.reserve(db_documents.size());
-
-      // Re-load the data from the DB
-      std::cout << "Loading models. This may take some time..." << std::endl;
+      // Only index the models here: each is loaded from the DB when first matched against
       BOOST_FOREACH (const object_recognition::db::Document & document, db_documents)
           {
             ObjectId object_id = document.get_value<std::string>("object_id");
-            std::cout << "Loading model for object id: " << object_id << std::endl;
-            mmod_objects templates;
-            document.get_attachment<mmod_objects>("objects", templates);
-            templates_.push_back(templates);
-
-            // Store the id conversion
-            object_ids_.push_back(object_id);
-
-            // Store the 3d positions
-            mmod_filters filters;
-            document.get_attachment<mmod_filters>("filters", filters);
-            filters_.push_back(filters);
+            library_.add(object_id, boost::bind(&MModTester::load_document, this, document, _1));
           }
+      std::cout << "Indexed " << db_documents.size() << " models" << std::endl;
+      start_loading();
+    }
+
+    /** Load the indexed models ahead of use as load_mode says, once both the models and the parameters are known */
+    void
+    start_loading()
+    {
+      if (load_mode_.empty() || load_mode_ == "lazy")
+        return;
+      if (load_mode_ == "progressive")
+      {
+        std::cout << "Loading models in the background, detecting with those loaded so far" << std::endl;
+        library_.load_in_background(std::vector<std::string>(), load_threads_);
+        return;
+      }
+      double t = (double) cv::getTickCount();
+      int n = library_.load(std::vector<std::string>(), load_threads_);
+      std::cout << "Loaded " << n << " models in " << ((double) cv::getTickCount() - t) / cv::getTickFrequency() << " s"
+                << std::endl;
     }
 
     static void
@@ -61,12 +114,24 @@ namespace mmod
       p.declare<float>("color_filter_thresh", "The color filter threshold to confirm a match", 0.91);
       p.declare<int>("skip_x", "Control sparse testing of the feature images", 8);
       p.declare<int>("skip_y", "Control sparse testing of the feature images", 8);
+      p.declare<int>("max_model_memory",
+                     "MB of models to keep loaded, least recently used ones are evicted beyond that (0: no limit)", 0);
+      p.declare<std::string>(
+          "load_mode",
+          "lazy: load each model when first used, eager: load all in parallel at startup, "
+          "progressive: load all in parallel in the background, detecting with those loaded so far",
+          "lazy");
+      p.declare<int>("load_threads", "Threads to load models with (0: one per hardware thread)", 0);
+      p.declare<int>("image_width",
+                     "Width of the images to detect in: models are compiled for it (other sizes work, slower; 0: none)",
+                     640);
+      p.declare<int>("image_height", "Height of the images to detect in, as image_width", 480);
     }
 
     static void
     declare_io(const tendrils& p, tendrils& i, tendrils& o)
     {
-      i.declare<std::vector<ObjectId> >("ids", "The matching object ids");
+      i.declare<std::vector<ObjectId> >("ids", "The object ids to look for (all models if empty)");
 
       i.declare(&MModTester::image_, "image", "An image. BGR image of type CV_8UC3").required(true);
       i.declare(&MModTester::depth_, "depth", "Depth image of type CV_16UC1").required(true);
@@ -84,6 +149,16 @@ namespace mmod
       color_filter_thresh_ = p["color_filter_thresh"];
       skip_x_ = p["skip_x"];
       skip_y_ = p["skip_y"];
+      library_.set_max_bytes(size_t(std::max(p.get<int>("max_model_memory"), 0)) << 20);
+      load_threads_ = p.get<int>("load_threads");
+      layout_size_ = cv::Size(p.get<int>("image_width"), p.get<int>("image_height"));
+      load_mode_ = p.get<std::string>("load_mode");
+      if (load_mode_ != "lazy" && load_mode_ != "eager" && load_mode_ != "progressive")
+      {
+        std::cerr << "ERROR, MModTester: unknown load_mode " << load_mode_ << ", using lazy" << std::endl;
+        load_mode_ = "lazy";
+      }
+      start_loading();
       modesCD.push_back("Grad");
       //      modesCD.push_back("Color");
       //      modesCD.push_back("Depth");
@@ -99,48 +174,55 @@ namespace mmod
 
       //run detections.
       //TEST (note that you can also match_all_objects_at_a_point(...):
-      calcHLS.computeColorHLS(image, colorfeat, noMask);
-      calcGrad.computeGradients(image, gradfeat, noMask);
+      calcFeat.compute(image, depth, noMask, FEAT_GRADIENTS | FEAT_COLORHLS, gradfeat, colorfeat, depthfeat);
 
       FeatModes.clear();
       FeatModes.push_back(gradfeat);
       //      FeatModes.push_back(colorfeat);
       //      FeatModes.push_back(depthfeat);
-      for (unsigned int i = 0; i < templates_.size(); ++i)
+      std::vector<ObjectId> ids = i.get<std::vector<ObjectId> >("ids");
+      if (ids.empty())
+        ids = library_.ids();
+      std::vector<mmod_library::model> models;
+      std::vector<mmod_matches> matches;
+      bool loading = library_.loading(); //Progressive: don't wait for the models still loading
+      BOOST_FOREACH (const ObjectId & id, ids)
+          {
+            mmod_library::model model = loading ? library_.get_loaded(id) : library_.get(id);
+            if (model)
+              models.push_back(model);
+          }
+      matches.resize(models.size());
+      for (unsigned int i = 0; i < models.size(); ++i)
       {
-        mmod_objects & mmod_object = templates_[i];
-        mmod_filters & mmod_filter = filters_[i];
+        const mmod_compiled & mmod_object = *models[i];
 
         int numrawmatches = 0; //Number of matches before non-max suppression
         cout << "num_matches = " << numrawmatches << endl;
         int num_matches = mmod_object.match_all_objects(FeatModes, modesCD, noMask, *thresh_match_, *frac_overlap_,
-                                                        *skip_x_, *skip_y_, &numrawmatches);
+                                                        *skip_x_, *skip_y_, matches[i], &numrawmatches);
         cout << "num_matches = " << num_matches << ", selected from # of raw matches = " << numrawmatches << endl;
-        //      vector<float> scs = templates_.scores; //Copy the scores over
+        //      vector<float> scs = matches[i].scores; //Copy the scores over
 
         //FILTER RECOGNITIONS BY COLOR
-        mmod_filter.filter_object_recognitions(colorfeat, mmod_object, *color_filter_thresh_);
+        mmod_object.filter_object_recognitions(colorfeat, matches[i], *color_filter_thresh_);
 
       }
 
       //TO DISPLAY MATCHES (NON-MAX SUPPRESSED)
       cv::Mat debug_image;
       image.copyTo(debug_image);
-      for (unsigned int i = 0; i < templates_.size(); ++i)
+      for (unsigned int i = 0; i < models.size(); ++i)
       {
-        mmod_objects & mmod_object = templates_[i];
-
-        mmod_object.draw_matches(debug_image); //draw results...
-        mmod_object.cout_matches();
+        models[i]->draw_matches(debug_image, matches[i]); //draw results...
+        matches[i].cout_matches();
       }
 
       *debug_image_ = debug_image;
       return ecto::OK;
     }
 
-    colorhls calcHLS; //Color feature processing
-    //  depthgrad  calcDepth; //Depth feature processing
-    gradients calcGrad; //Gradient feature processing
+    feature_scheduler calcFeat; //Gradient, color (and depth) feature processing, run concurrently
     std::vector<cv::Mat> FeatModes; //List of images
     std::vector<std::string> modesCD; //Names of modes (color and depth)
     cv::Mat gradfeat, colorfeat, depthfeat; //To hold feature outputs. These will be CV_8UC1 images
@@ -156,12 +238,11 @@ namespace mmod
     //outputs
     spore<cv::Mat> debug_image_;
 
-    /** The filters */
-    std::vector<mmod_filters> filters_;
-    /** The templates */
-    std::vector<mmod_objects> templates_;
-    /** Matching between an OpenCV integer ID and the ids found in the JSON */
-    std::vector<ObjectId> object_ids_;
+    /** The templates, compiled together with their filters, by object id */
+    mmod_library library_;
+    std::string load_mode_;
+    int load_threads_;
+    cv::Size layout_size_; //Image size the models are compiled for, set before any model loads
   };
 }
 ECTO_CELL(mmod, object_recognition::db::bases::ModelReaderBase<mmod::MModTester>, "MModTester", "An mmod template detector.");
@@ -25,14 +25,14 @@ namespace mmod
 #ifdef output_data
     MModTrainer()
       :
-        color_filter("Color"), framenum(0), objID("foo")
+        Objs(new mmod_objects()), color_filter(new mmod_filters("Color")), framenum(0), objID("foo")
     {
       modesCD.push_back("Grad");
     }
 #else
     MModTrainer()
       :
-        color_filter("Color")
+        Objs(new mmod_objects()), color_filter(new mmod_filters("Color"))
     {
       modesCD.push_back("Grad");
     }
@@ -43,6 +43,8 @@ namespace mmod
     {
       params.declare(&MModTrainer::thresh_learn,"thresh_learn","The threshold"
                                               "for learning a new template",0.0); //Zero thresh_learn => learn every view
+      params.declare(&MModTrainer::feature_budget,"feature_budget","Keep at most this many (well spread) features"
+                                              " per template, 0 => keep all",0);
       params.declare(&MModTrainer::object_id,"object_id",
                                              "The object id, to learn.")
                                              .required(true);
@@ -61,8 +63,8 @@ namespace mmod
               "A visualization of the gradient feature.");
       out.declare(&MModTrainer::filter_vis,"filter_vis",
               "A visualization of the gradient feature.");
-      out.declare(&MModTrainer::objects_out,"objects");
-      out.declare(&MModTrainer::filters_out,"filters");
+      out.declare(&MModTrainer::objects_out,"objects", "Snapshot of the learned objects (shared, not copied).");
+      out.declare(&MModTrainer::filters_out,"filters", "Snapshot of the learned filters (shared, not copied).");
     }
 #ifdef output_data
     string Int2string(int number)
@@ -91,22 +93,31 @@ namespace mmod
       //reset our outputs, so that we can be thread safe.
       *filter_vis = cv::Mat();
       *grad_vis = cv::Mat();
-      if(!cv::countNonZero(*mask_in)) return ecto::OK;
+      //let go of our last snapshots, so unless a downstream cell still holds them we learn in place (no model copy)
+      objects_out->reset();
+      filters_out->reset();
+      if(!cv::countNonZero(*mask_in))
+      {
+        *filters_out = color_filter;
+        *objects_out = Objs;
+        return ecto::OK;
+      }
 
       //PROCESS TO GET FEATURES
       cv::Mat colorfeat, gradfeat;
-      calcHLS.computeColorHLS(*image_in,colorfeat,*mask_in,"train");
-      calcGrad.computeGradients(*image_in,gradfeat,*mask_in,"train");
+      calcFeat.compute(*image_in,*mask_in,FEAT_GRADIENTS | FEAT_COLORHLS,gradfeat,colorfeat,"train");
       g.visualize_binary_image(gradfeat, *grad_vis);
       FeatModes.clear();
       FeatModes.push_back(gradfeat);
       float Score;
-      int num_templ = Objs.learn_a_template(FeatModes,modesCD, *mask_in,
+      mmod_objects &objs = mutable_model(Objs);
+      objs.util.feature_budget = *feature_budget;
+      int num_templ = objs.learn_a_template(FeatModes,modesCD, *mask_in,
 	      *object_id, *object_id, *frame_number_in, *thresh_learn, &Score);
       std::cout << "#"<<*frame_number_in
           <<": Number of templates learned = " << num_templ
           <<", Score = "<<Score<< std::endl;
-      int num_fs = color_filter.learn_a_template(colorfeat,*mask_in,*object_id,
+      int num_fs = mutable_model(color_filter).learn_a_template(colorfeat,*mask_in,*object_id,
                                                  *frame_number_in);
       std::cout << "Filter templates = " << num_fs << std::endl;
       g.visualize_binary_image(colorfeat,*filter_vis);
@@ -121,14 +132,14 @@ namespace mmod
     spore<int> frame_number_in;
     spore<std::string> object_id;
     spore<float> thresh_learn;
-    spore<mmod_objects> objects_out;
-    spore<mmod_filters> filters_out;
-    //training instances
-    mmod_objects Objs;
+    spore<int> feature_budget;
+    spore<mmod_objects_snapshot> objects_out;
+    spore<mmod_filters_snapshot> filters_out;
+    //training instances, shared with the snapshots above and copied on write
+    boost::shared_ptr<mmod_objects> Objs;
     mmod_general g;
-    mmod_filters color_filter;
-    gradients calcGrad;    //Gradient feature processing
-    colorhls calcHLS;
+    boost::shared_ptr<mmod_filters> color_filter;
+    feature_pipeline calcFeat;    //Gradient and color feature processing
 
     std::vector<cv::Mat> FeatModes; //List of images
     std::vector<std::string> modesCD; //Names of modes (color and depth)
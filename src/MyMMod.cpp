@@ -152,9 +152,7 @@ int main(int argc, char* argv[]) {
 	mmod_objects Objs; //Object train and test.
 	mmod_general g;    //General utilities
 	mmod_filters filt("Color"); //For post filter tests
-	colorhls calcHLS;	//Color feature processing
-//	depthgrad  calcDepth;	//Depth feature processing
-	gradients calcGrad;    //Gradient feature processing
+	feature_scheduler calcFeat;	//Color, gradient (and depth) feature processing, run concurrently
 	Mat colorfeat, depthfeat, gradfeat;  //To hold feature outputs. These will be CV_8UC1 images
 	Mat ColorRaw0,Mask0,ColorRaw,Mask,noMask;
 	Mat Ivis,Gvis;
@@ -233,8 +231,7 @@ int main(int argc, char* argv[]) {
 		imshow("raw",ColorRaw);
 
 		//PROCESS TO GET FEATURES
-		calcHLS.computeColorHLS(ColorRaw,colorfeat,Mask,"train");
-		calcGrad.computeGradients(ColorRaw,gradfeat,Mask,"train");
+		calcFeat.compute(ColorRaw,Mat(),Mask,FEAT_GRADIENTS | FEAT_COLORHLS,gradfeat,colorfeat,depthfeat,"train");
 
 		g.visualize_binary_image(gradfeat, Gvis);
 		imshow("GradFeat",Gvis);
@@ -273,8 +270,7 @@ int main(int argc, char* argv[]) {
 
 		//PROCESS TO GET FEATURES
 		colorfeat= Scalar::all(0);
-		calcHLS.computeColorHLS(ColorRaw,colorfeat,Mask,"train");
-		calcGrad.computeGradients(ColorRaw,gradfeat,Mask,"train");
+		calcFeat.compute(ColorRaw,Mat(),Mask,FEAT_GRADIENTS | FEAT_COLORHLS,gradfeat,colorfeat,depthfeat,"train");
 
 		g.visualize_binary_image(gradfeat, Gvis);
 		imshow("GradFeat",Gvis);
@@ -352,8 +348,7 @@ int main(int argc, char* argv[]) {
 		}
 		imshow("raw",ColorRaw);
 
-		calcHLS.computeColorHLS(ColorRaw,colorfeat,noMask);
-		calcGrad.computeGradients(ColorRaw,gradfeat,noMask);
+		calcFeat.compute(ColorRaw,Mat(),noMask,FEAT_GRADIENTS | FEAT_COLORHLS,gradfeat,colorfeat,depthfeat);
 		g.visualize_binary_image(colorfeat,Ivis);
 		imshow("ColorFeatPreOR",Mask);//Ivis);
 		g.visualize_binary_image(gradfeat,Gvis);
@@ -0,0 +1,736 @@
+// Micro-benchmarks of the mmod hot paths on reproducible synthetic inputs: template matching, feature spreading,
+// feature extraction, non-max suppression / filtering of recognitions and learning. Results come out as JSON, one
+// entry per kernel and parameter set, so that runs of different releases can be compared.
+//
+// console application.
+//
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+
+#include "mmod_general.h"
+#include "mmod_color.h"
+#include "mmod_objects.h"
+#include "mmod_compiled.h"
+
+using namespace cv;
+using namespace std;
+
+#define BENCH_SEED 0x12345		//Every input is made from this, so runs compare
+#define BENCH_FORMAT 1			//Version of the JSON layout
+#define BENCH_VIEWS 32			//Views (templates) per object in the matching benchmarks
+#define BENCH_POINTS 64			//Points matched at per repetition
+#define BENCH_OBJECTS 5			//Objects in the filtering benchmarks
+
+static void help()
+{
+	cout << "Usage: mmod_bench [-r reps] [-o results.json] [-k kernel]\n"
+	        "  Times the mmod hot paths on synthetic inputs and writes the results as JSON (default to stdout).\n"
+	        "  -r reps    timed repetitions of each benchmark, default 20 (the median is reported)\n"
+	        "  -o file    write the JSON here instead\n"
+	        "  -k kernel  only the kernels whose name contains this\n"
+	        "  Returns 1 if a kernel disagrees with its reference implementation." << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//SYNTHETIC INPUTS
+//Make a CV_8UC1 feature image where frac_on of the pixels have a single (random) bit on
+static void synthetic_feature_image(Mat &I, Size sz, float frac_on, RNG &rng)
+{
+	I.create(sz, CV_8UC1);
+	for (int y = 0; y < I.rows; y++) {
+		uchar *o = I.ptr<uchar>(y);
+		for (int x = 0; x < I.cols; ++x, ++o) {
+			if (rng.uniform(0.f, 1.f) < frac_on)
+				*o = (uchar)(1 << rng.uniform(0, 8));
+			else
+				*o = 0;
+		}
+	}
+}
+
+//A BGR scene: shaded background, random filled rectangles and circles, a little noise
+static void synthetic_scene(Mat &I, Size sz, RNG &rng)
+{
+	I.create(sz, CV_8UC3);
+	for (int y = 0; y < I.rows; y++) {
+		uchar *o = I.ptr<uchar>(y);
+		for (int x = 0; x < I.cols; ++x, o += 3) {
+			o[0] = (uchar)(64 + 64 * x / I.cols);
+			o[1] = (uchar)(64 + 64 * y / I.rows);
+			o[2] = 96;
+		}
+	}
+	int shapes = sz.area() / 4000 + 4;
+	for (int i = 0; i < shapes; ++i) {
+		Point p(rng.uniform(0, sz.width), rng.uniform(0, sz.height));
+		int r = rng.uniform(sz.width / 40 + 2, sz.width / 8 + 4);
+		Scalar c(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+		if (i % 2)
+			circle(I, p, r, c, -1);
+		else
+			rectangle(I, Point(p.x - r, p.y - r / 2), Point(p.x + r, p.y + r / 2), c, -1);
+	}
+	for (int y = 0; y < I.rows; y++) {
+		uchar *o = I.ptr<uchar>(y);
+		for (int x = 0; x < I.cols * 3; ++x)
+			o[x] = saturate_cast<uchar>(o[x] + rng.uniform(-6, 7));
+	}
+}
+
+//A CV_16UC1 depth image (mm): a tilted plane with boxes in front of it, a little noise
+static void synthetic_depth(Mat &D, Size sz, RNG &rng)
+{
+	D.create(sz, CV_16UC1);
+	for (int y = 0; y < D.rows; y++) {
+		ushort *o = D.ptr<ushort>(y);
+		for (int x = 0; x < D.cols; ++x)
+			o[x] = (ushort)(1500 + 1000 * y / D.rows);
+	}
+	int boxes = sz.area() / 8000 + 3;
+	for (int i = 0; i < boxes; ++i) {
+		Point p(rng.uniform(0, sz.width), rng.uniform(0, sz.height));
+		int r = rng.uniform(sz.width / 40 + 2, sz.width / 8 + 4);
+		rectangle(D, Point(p.x - r, p.y - r), Point(p.x + r, p.y + r), Scalar(rng.uniform(700, 1400)), -1);
+	}
+	for (int y = 0; y < D.rows; y++) {
+		ushort *o = D.ptr<ushort>(y);
+		for (int x = 0; x < D.cols; ++x)
+			o[x] = (ushort)(o[x] + rng.uniform(-3, 4));
+	}
+}
+
+//views views of a size x size object: each learned from a random feature image inside a disc mask
+static void synthetic_views(mmod_features &f, int size, int views, RNG &rng, vector<Mat> *patches = 0)
+{
+	mmod_general g;
+	g.feature_budget = 0; //Keep every feature, so the views (and what the matching kernels time) stay the same
+	Mat mask = Mat::zeros(size, size, CV_8UC1);
+	circle(mask, Point(size / 2, size / 2), size / 2 - 1, Scalar(255), -1);
+	for (int v = 0; v < views; ++v) {
+		Mat feat, m = mask.clone();
+		synthetic_feature_image(feat, Size(size, size), 0.3f, rng);
+		g.learn_a_template(feat, m, v, f);
+		if (patches) patches->push_back(feat);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//TIMING
+/**
+ * \brief One benchmark: setup() runs before each repetition, untimed; run() is timed and makes calls calls of the kernel
+ */
+struct bench_case
+{
+	int calls;			//Kernel calls per run()
+	double check;		//Summary of the outputs (scores, survivors...), to see that a faster kernel still computes the same
+	bench_case() : calls(1), check(0) {}
+	virtual ~bench_case() {}
+	virtual void setup() {}
+	virtual void run() = 0;
+};
+
+/**
+ * \brief A benchmark's timings
+ */
+struct bench_result
+{
+	string kernel, params;		//params: JSON object members
+	int calls, reps;
+	double median_ms, min_ms, mean_ms, check;	//Per kernel call
+};
+
+/**
+ * \brief The benchmarks to run, writing the results
+ */
+class bench_suite
+{
+public:
+	int reps;
+	string only;				//Run the kernels whose name contains this
+	vector<bench_result> results;
+	int failures;				//Kernels that disagree with their reference
+
+	bench_suite(int nreps, const string &kernels) : reps(nreps), only(kernels), failures(0) {}
+
+	bool wanted(const string &kernel) const { return only.empty() || kernel.find(only) != string::npos; }
+
+	/**
+	 * \brief Time c: one warm up run, then reps timed runs
+	 * @param kernel	Name of the kernel
+	 * @param params	Its parameters, as JSON object members ("\"width\": 640, ...")
+	 */
+	void time(const string &kernel, const string &params, bench_case &c)
+	{
+		c.setup();
+		c.run();
+		vector<double> ms;
+		double sum = 0;
+		for (int r = 0; r < reps; ++r) {
+			c.check = 0;
+			c.setup();
+			double t = (double)getTickCount();
+			c.run();
+			t = ((double)getTickCount() - t) * 1000.0 / (getTickFrequency() * c.calls);
+			ms.push_back(t);
+			sum += t;
+		}
+		sort(ms.begin(), ms.end());
+		bench_result b;
+		b.kernel = kernel;
+		b.params = params;
+		b.calls = c.calls;
+		b.reps = reps;
+		b.median_ms = ms[ms.size() / 2];
+		b.min_ms = ms[0];
+		b.mean_ms = sum / reps;
+		b.check = c.check;
+		results.push_back(b);
+		fprintf(stderr, "  %-40s %-50s %10.4f ms\n", kernel.c_str(), params.c_str(), b.median_ms);
+	}
+
+	/**
+	 * \brief Write the results as JSON
+	 */
+	void write_json(ostream &os) const
+	{
+		os << "{\n  \"suite\": \"mmod_bench\",\n  \"format\": " << BENCH_FORMAT << ",\n  \"seed\": " << BENCH_SEED
+		   << ",\n  \"reps\": " << reps << ",\n  \"failures\": " << failures << ",\n  \"results\": [";
+		char num[64];
+		for (size_t i = 0; i < results.size(); ++i) {
+			const bench_result &b = results[i];
+			os << (i ? ",\n" : "\n") << "    {\"kernel\": \"" << b.kernel << "\", \"params\": {" << b.params << "}, ";
+			os << "\"calls_per_rep\": " << b.calls << ", ";
+			sprintf(num, "%.6f", b.median_ms); os << "\"median_ms\": " << num << ", ";
+			sprintf(num, "%.6f", b.min_ms); os << "\"min_ms\": " << num << ", ";
+			sprintf(num, "%.6f", b.mean_ms); os << "\"mean_ms\": " << num << ", ";
+			sprintf(num, "%.9g", b.check); os << "\"check\": " << num << "}";
+		}
+		os << "\n  ]\n}" << endl;
+	}
+};
+
+//"\"name\": value" JSON members
+static string member(const char *name, int v)
+{
+	ostringstream s;
+	s << "\"" << name << "\": " << v;
+	return s.str();
+}
+
+static string member(const char *name, double v)
+{
+	ostringstream s;
+	s << "\"" << name << "\": " << v;
+	return s.str();
+}
+
+static string member(const char *name, const string &v)
+{
+	return string("\"") + name + "\": \"" + v + "\"";
+}
+
+static string size_members(Size sz)
+{
+	return member("width", sz.width) + ", " + member("height", sz.height);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//MATCHING
+struct match_bruteforce_case : bench_case
+{
+	mmod_general g;
+	Mat I;
+	mmod_features *f;
+	vector<Point> pts;
+	void run()
+	{
+		int match_index;
+		for (size_t i = 0; i < pts.size(); ++i)
+			check += g.match_a_patch_bruteforce(I, pts[i], *f, match_index);
+	}
+};
+
+struct match_one_case : bench_case
+{
+	mmod_general g;
+	Mat I;
+	mmod_features *f;
+	vector<Rect> rects;
+	void run()
+	{
+		for (size_t i = 0; i < rects.size(); ++i)
+			for (int v = 0; v < f->size(); ++v)
+				check += g.match_one_feature(I, rects[i], *f, v);
+	}
+};
+
+//Matching a spread 640x480 feature image, templates of each size
+static void bench_matching(bench_suite &s)
+{
+	int sizes[] = { 32, 64, 128 };
+	for (int k = 0; k < 3; ++k) {
+		RNG rng(BENCH_SEED + sizes[k]);
+		mmod_features f;
+		synthetic_views(f, sizes[k], BENCH_VIEWS, rng);
+		long features = 0;
+		for (int v = 0; v < f.size(); ++v)
+			features += (long)f.features[v].size();
+		Mat I;
+		mmod_general g;
+		synthetic_feature_image(I, Size(640, 480), 0.3f, rng);
+		g.SumAroundEachPixel8UC1(I, I, ORAMT, 0); //Spread as the test images are
+		string params = member("template", sizes[k]) + ", " + member("views", BENCH_VIEWS) + ", "
+				+ member("features_per_view", (int)(features / BENCH_VIEWS)) + ", " + size_members(I.size());
+
+		if (s.wanted("match_a_patch_bruteforce")) {
+			match_bruteforce_case c;
+			c.I = I;
+			c.f = &f;
+			for (int i = 0; i < BENCH_POINTS; ++i)
+				c.pts.push_back(Point(rng.uniform(0, I.cols), rng.uniform(0, I.rows)));
+			c.calls = BENCH_POINTS;
+			s.time("match_a_patch_bruteforce", params, c);
+		}
+		if (s.wanted("match_one_feature")) {
+			match_one_case c;
+			c.I = I;
+			c.f = &f;
+			for (int i = 0; i < BENCH_POINTS / 8; ++i)
+				c.rects.push_back(Rect(rng.uniform(0, I.cols - sizes[k]), rng.uniform(0, I.rows - sizes[k]), sizes[k], sizes[k]));
+			c.calls = (int)c.rects.size() * BENCH_VIEWS;
+			s.time("match_one_feature", params, c);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//SPREADING
+struct spread_case : bench_case
+{
+	mmod_general g;
+	Mat feat, in, out;
+	int span, Or0_Max1;
+	bool boxsum;
+	void setup() { feat.copyTo(in); }
+	void run()
+	{
+		if (boxsum)
+			g.BoxSumAroundEachPixel8UC1(in, out, span, Or0_Max1);
+		else
+			g.SumAroundEachPixel8UC1(in, out, span, Or0_Max1);
+		check += countNonZero(out);
+	}
+};
+
+//SumAroundEachPixel8UC1 ORing (0) and majority (1), against the box sum it replaces for the majority
+static void bench_spreading(bench_suite &s)
+{
+	Size sizes[] = { Size(160, 120), Size(320, 240), Size(640, 480) };
+	int spans[] = { 3, 5, 7 };
+	for (int z = 0; z < 3; ++z) {
+		RNG rng(BENCH_SEED + z);
+		Mat feat;
+		synthetic_feature_image(feat, sizes[z], 0.3f, rng);
+		for (int k = 0; k < 3; ++k)
+			for (int mode = 0; mode < 2; ++mode) {
+				string params = size_members(sizes[z]) + ", " + member("span", spans[k]) + ", "
+						+ member("mode", string(mode ? "majority" : "or"));
+				spread_case c;
+				c.feat = feat;
+				c.span = spans[k];
+				c.Or0_Max1 = mode;
+				c.boxsum = false;
+				if (s.wanted("SumAroundEachPixel8UC1"))
+					s.time("SumAroundEachPixel8UC1", params, c);
+				if (mode == 1 && s.wanted("BoxSumAroundEachPixel8UC1")) {
+					spread_case b;
+					b.feat = feat;
+					b.span = spans[k];
+					b.Or0_Max1 = 1;
+					b.boxsum = true;
+					s.time("BoxSumAroundEachPixel8UC1", params, b);
+					c.setup();
+					c.run();
+					if (countNonZero(c.out != b.out)) {
+						fprintf(stderr, "ERROR: SumAroundEachPixel8UC1 majority differs from BoxSumAroundEachPixel8UC1 (%s)\n",
+						        params.c_str());
+						++s.failures;
+					}
+				}
+			}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//FEATURE EXTRACTION
+struct gradients_case : bench_case
+{
+	gradients g;
+	Mat I, out;
+	void run() { g.computeGradients(I, out, Mat()); check += countNonZero(out); }
+};
+
+struct colorhls_case : bench_case
+{
+	colorhls c;
+	Mat I, out;
+	void run() { c.computeColorHLS(I, out, Mat()); check += countNonZero(out); }
+};
+
+struct depthgrad_case : bench_case
+{
+	depthgrad d;
+	Mat D, out;
+	void run() { d.computeDepthGradients(D, out, Mat()); check += countNonZero(out); }
+};
+
+//An extractor run over frames of one size should only size its work images on the first (see mmod_workspace)
+static void check_steady(bench_suite &s, const string &kernel, const string &params, int allocations)
+{
+	if (allocations != 1) {
+		fprintf(stderr, "ERROR: %s (re)allocated its work images in %d frames of the same size, not 1 (%s)\n",
+		        kernel.c_str(), allocations, params.c_str());
+		++s.failures;
+	}
+}
+
+//Gradient and color features of a frame, both at once through feature_pipeline or one after the other
+struct pipeline_case : bench_case
+{
+	feature_pipeline p;
+	Mat I, gradfeat, colorfeat;
+	void run()
+	{
+		p.compute(I, Mat(), FEAT_GRADIENTS | FEAT_COLORHLS, gradfeat, colorfeat, "test");
+		check += countNonZero(gradfeat) + countNonZero(colorfeat);
+	}
+};
+
+struct unfused_case : bench_case
+{
+	gradients g;
+	colorhls c;
+	Mat I, gradfeat, colorfeat;
+	void run()
+	{
+		g.computeGradients(I, gradfeat, Mat(), "test");
+		c.computeColorHLS(I, colorfeat, Mat(), "test");
+		check += countNonZero(gradfeat) + countNonZero(colorfeat);
+	}
+};
+
+//feature_stream handing out per orientation responses tile by tile, each tile compared with the responses of the
+//unfused extraction (gradients::computeGradients, colorhls::computeColorHLS) looked up in the same matchLUT
+struct stream_case : bench_case
+{
+	struct sink
+	{
+		stream_case *c;
+		void operator()(int modality, int y0, const vector<Mat> &resp) const { c->tile(modality, y0, resp); }
+	};
+	feature_stream fs;
+	mmod_general g;
+	Mat I, gradfeat, colorfeat;
+	Mat ref[2];					//Unfused gradient and color features, empty => don't compare
+	long mismatches;
+	stream_case() : mismatches(0) {}
+	void tile(int modality, int y0, const vector<Mat> &resp)
+	{
+		const Mat &F = ref[modality == FEAT_GRADIENTS ? 0 : 1];
+		for (int o = 0; o < (int)resp.size(); ++o) {
+			check += countNonZero(resp[o]);
+			if (F.empty()) continue;
+			for (int y = 0; y < resp[o].rows; ++y) {
+				const uchar *f = F.ptr<uchar>(y0 + y);
+				for (int x = 0; x < resp[o].cols; ++x) {
+#ifdef FLOATLUT
+					if (resp[o].at<float>(y, x) != g.matchLUT[o][f[x]]) ++mismatches;
+#else
+					if ((int)resp[o].at<uchar>(y, x) != g.matchLUT[o][f[x]]) ++mismatches;
+#endif
+				}
+			}
+		}
+	}
+	void run()
+	{
+		sink k = { this };
+		fs.compute(I, Mat(), FEAT_GRADIENTS | FEAT_COLORHLS, gradfeat, colorfeat, "test", k);
+	}
+};
+
+static void bench_extraction(bench_suite &s)
+{
+	Size sizes[] = { Size(160, 120), Size(320, 240), Size(640, 480) };
+	for (int z = 0; z < 3; ++z) {
+		RNG rng(BENCH_SEED + 100 + z);
+		string params = size_members(sizes[z]) + ", " + member("mode", string("test"));
+		Mat scene, depth;
+		synthetic_scene(scene, sizes[z], rng);
+		synthetic_depth(depth, sizes[z], rng);
+		if (s.wanted("computeGradients")) {
+			gradients_case c;
+			c.I = scene;
+			s.time("computeGradients", params, c);
+			check_steady(s, "computeGradients", params, c.g.workspace_allocations());
+		}
+		if (s.wanted("computeColorHLS")) {
+			colorhls_case c;
+			c.I = scene;
+			s.time("computeColorHLS", params, c);
+			check_steady(s, "computeColorHLS", params, c.c.workspace_allocations());
+		}
+		if (s.wanted("computeDepthGradients")) {
+			depthgrad_case c;
+			c.D = depth;
+			s.time("computeDepthGradients", params, c);
+			check_steady(s, "computeDepthGradients", params, c.d.workspace_allocations());
+		}
+		if (s.wanted("feature_pipeline") || s.wanted("unfused_grad_color")) {
+			pipeline_case p;
+			unfused_case u;
+			p.I = u.I = scene;
+			s.time("feature_pipeline", params, p);
+			s.time("unfused_grad_color", params, u);
+			check_steady(s, "feature_pipeline", params, p.p.workspace_allocations());
+			if (countNonZero(p.gradfeat != u.gradfeat) || countNonZero(p.colorfeat != u.colorfeat)) {
+				fprintf(stderr, "ERROR: feature_pipeline features differ from computeGradients, computeColorHLS (%s)\n",
+				        params.c_str());
+				++s.failures;
+			}
+		}
+		if (s.wanted("feature_stream_responses")) {
+			stream_case c;
+			c.I = scene;
+			gradients gr;
+			colorhls cl;
+			gr.computeGradients(scene, c.ref[0], Mat(), "test");
+			cl.computeColorHLS(scene, c.ref[1], Mat(), "test");
+			c.run();
+			if (c.mismatches) {
+				fprintf(stderr, "ERROR: feature_stream responses differ from the unfused ones at %ld pixels (%s)\n",
+				        c.mismatches, params.c_str());
+				++s.failures;
+			}
+			c.ref[0] = c.ref[1] = Mat();
+			s.time("feature_stream_responses", params, c);
+			check_steady(s, "feature_stream_responses", params, c.fs.workspace_allocations());
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//NON-MAX SUPPRESSION AND FILTERING
+//n candidate recognitions: templates of the objects in obj_names, clustered around a few places (as real
+//recognitions are) unless at is given: then every other one is at a random one of the places in at
+struct candidates
+{
+	vector<Rect> rv;
+	vector<float> scores;
+	vector<string> ids;
+	vector<int> frame_nums;
+	vector<vector<int> > feature_indices;
+	void make(int n, Size image, int size, const vector<string> &obj_names, int frames, RNG &rng,
+			const vector<pair<Point, pair<int, int> > > *at = 0)
+	{
+		vector<Point> centers;
+		for (int i = 0; i < n / 50 + 5; ++i)
+			centers.push_back(Point(rng.uniform(0, image.width - size), rng.uniform(0, image.height - size)));
+		for (int i = 0; i < n; ++i) {
+			int o = rng.uniform(0, (int)obj_names.size()), fr = rng.uniform(0, frames);
+			Point p = centers[rng.uniform(0, (int)centers.size())] + Point(rng.uniform(-8, 9), rng.uniform(-8, 9));
+			if (at && i % 2) {
+				const pair<Point, pair<int, int> > &a = (*at)[rng.uniform(0, (int)at->size())];
+				p = a.first;
+				o = a.second.first;
+				fr = a.second.second;
+			}
+			p.x = std::min(std::max(p.x, 0), image.width - size);
+			p.y = std::min(std::max(p.y, 0), image.height - size);
+			rv.push_back(Rect(p.x, p.y, size, size));
+			scores.push_back(rng.uniform(0.9f, 1.0f));
+			ids.push_back(obj_names[o]);
+			frame_nums.push_back(fr);
+			feature_indices.push_back(vector<int>(1, fr));
+		}
+	}
+};
+
+struct nms_case : bench_case
+{
+	mmod_general g;
+	candidates in, work;
+	void setup() { work = in; }
+	void run()
+	{
+		check += g.nonMaxRectSuppress(work.rv, work.scores, work.ids, work.frame_nums, work.feature_indices, 0.6f);
+	}
+};
+
+struct filter_case : bench_case
+{
+	mmod_filters *filters;
+	mmod_objects objs;
+	candidates in;
+	Mat I;
+	void setup()
+	{
+		objs.rv = in.rv;
+		objs.scores = in.scores;
+		objs.ids = in.ids;
+		objs.frame_nums = in.frame_nums;
+		objs.feature_indices = in.feature_indices;
+	}
+	void run() { check += filters->filter_object_recognitions(I, objs, 0.91f); }
+};
+
+struct compiled_filter_case : bench_case
+{
+	const mmod_compiled *model;
+	mmod_matches matches;
+	candidates in;
+	Mat I;
+	void setup()
+	{
+		matches.rv = in.rv;
+		matches.scores = in.scores;
+		matches.ids = in.ids;
+		matches.frame_nums = in.frame_nums;
+		matches.feature_indices = in.feature_indices;
+	}
+	void run() { check += model->filter_object_recognitions(I, matches, 0.91f); }
+};
+
+static void bench_recognitions(bench_suite &s)
+{
+	const int size = 64, frames = 16;
+	Size image(640, 480);
+	RNG rng(BENCH_SEED + 200);
+	//FILTERS: BENCH_OBJECTS objects of frames views, some of them pasted into the filter feature image
+	vector<string> names;
+	mmod_filters filters("Color");
+	mmod_objects objs;
+	Mat I;
+	synthetic_feature_image(I, image, 0.3f, rng);
+	vector<pair<Point, pair<int, int> > > at; //Where views were pasted: (place, (object, frame))
+	for (int o = 0; o < BENCH_OBJECTS; ++o) {
+		ostringstream name;
+		name << "object" << o;
+		names.push_back(name.str());
+		vector<Mat> patches;
+		mmod_features &f = filters.ObjViews[name.str()];
+		f.object_ID = name.str();
+		synthetic_views(f, size, frames, rng, &patches);
+		objs.modes["Grad"].objs[name.str()] = f;
+		for (int k = 0; k < 4; ++k) {
+			int fr = rng.uniform(0, frames);
+			Point p(rng.uniform(0, image.width - size), rng.uniform(0, image.height - size));
+			Mat roi = I(Rect(p.x, p.y, size, size));
+			patches[fr].copyTo(roi);
+			at.push_back(make_pair(p, make_pair(o, fr)));
+		}
+	}
+	filters.update_viewindex();
+	mmod_compiled compiled(objs, &filters);
+
+	int counts[] = { 100, 1000, 5000 };
+	for (int k = 0; k < 3; ++k) {
+		string params = member("candidates", counts[k]) + ", " + member("template", size);
+		if (s.wanted("nonMaxRectSuppress")) {
+			nms_case c;
+			c.in.make(counts[k], image, size, names, frames, rng);
+			s.time("nonMaxRectSuppress", params + ", " + member("frac_overlap", 0.6), c);
+		}
+		candidates cand;
+		cand.make(counts[k], image, size, names, frames, rng, &at);
+		double kept = -1;
+		if (s.wanted("filter_object_recognitions")) {
+			filter_case c;
+			c.filters = &filters;
+			c.in = cand;
+			c.I = I;
+			s.time("filter_object_recognitions", params, c);
+			kept = c.check;
+		}
+		if (s.wanted("mmod_compiled::filter_object_recognitions")) {
+			compiled_filter_case c;
+			c.model = &compiled;
+			c.in = cand;
+			c.I = I;
+			s.time("mmod_compiled::filter_object_recognitions", params, c);
+			if (kept >= 0 && kept != c.check) {
+				fprintf(stderr, "ERROR: mmod_compiled::filter_object_recognitions kept %g, mmod_filters %g (%s)\n",
+				        c.check, kept, params.c_str());
+				++s.failures;
+			}
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//LEARNING
+struct learn_case : bench_case
+{
+	mmod_general g;				//Default constructed: no feature budget, every candidate feature is kept
+	mmod_features f;
+	Mat feat, mask, m;
+	void setup() { f = mmod_features(); m = mask.clone(); }
+	void run() { g.learn_a_template(feat, m, 0, f); check += (double)f.features.back().size(); }
+};
+
+//learn_a_template, checking that without a feature budget it keeps all the candidates
+static void bench_learning(bench_suite &s)
+{
+	if (!s.wanted("learn_a_template")) return;
+	int sizes[] = { 32, 64, 128 };
+	for (int z = 0; z < 3; ++z) {
+		RNG rng(BENCH_SEED + 300 + z);
+		string params = member("template", sizes[z]) + ", " + member("feature_budget", 0);
+		learn_case c;
+		synthetic_feature_image(c.feat, Size(sizes[z], sizes[z]), 0.3f, rng);
+		c.mask = Mat::zeros(sizes[z], sizes[z], CV_8UC1);
+		circle(c.mask, Point(sizes[z] / 2, sizes[z] / 2), sizes[z] / 2 - 1, Scalar(255), -1);
+		s.time("learn_a_template", params, c);
+		if (c.f.budget.back() != 0 || (int)c.f.features.back().size() != c.f.candidates.back()) {
+			fprintf(stderr, "ERROR: learn_a_template kept %d of %d features with budget %d by default (%s)\n",
+			        (int)c.f.features.back().size(), c.f.candidates.back(), c.f.budget.back(), params.c_str());
+			++s.failures;
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[]) {
+	int reps = 20;
+	string out, only;
+	for (int a = 1; a < argc; ++a) {
+		if (!strcmp(argv[a], "-r") && a + 1 < argc) reps = atoi(argv[++a]);
+		else if (!strcmp(argv[a], "-o") && a + 1 < argc) out = argv[++a];
+		else if (!strcmp(argv[a], "-k") && a + 1 < argc) only = argv[++a];
+		else if (isdigit(argv[a][0])) reps = atoi(argv[a]); //mmod_bench reps, as before
+		else { help(); return -1; }
+	}
+	if (reps < 1) { help(); return -1; }
+
+	bench_suite s(reps, only);
+	fprintf(stderr, "mmod_bench, %d reps, median ms per call:\n", reps);
+	bench_matching(s);
+	bench_spreading(s);
+	bench_extraction(s);
+	bench_recognitions(s);
+	bench_learning(s);
+
+	if (out.empty())
+		s.write_json(cout);
+	else {
+		ofstream ofs(out.c_str());
+		if (!ofs) { cerr << "ERROR: couldn't write " << out << endl; return -1; }
+		s.write_json(ofs);
+	}
+	return s.failures ? 1 : 0;
+}
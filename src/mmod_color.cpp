@@ -8,11 +8,512 @@
  */
 #include "mmod_color.h"
 #include <iostream>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
 #include <stdexcept>
 #include <utility>
+#include <boost/bind.hpp>
 using namespace cv;
 using namespace std;
 
+////////////Row helpers shared by the feature computations////////////////////
+//Reflect index i into [0,len) the way BORDER_DEFAULT (BORDER_REFLECT_101) does
+static inline int reflect101(int i, int len)
+{
+	if(len == 1) return 0;
+	if(i < 0) return -i;
+	if(i >= len) return 2*len - i - 2;
+	return i;
+}
+
+//Lightness channel of cvtColor(CV_BGR2HLS) for rows [y0,y1) of a BGR image. Same float arithmetic as cvtColor
+//(channels scaled to [0,1], l = (max + min)/2, back to [0,255]), so the same values without converting hue and saturation.
+static void lightness_rows(const Mat &bgr, Mat &L, int y0, int y1)
+{
+	const float s = 1.f/255.f;
+	for(int y = y0; y < y1; ++y)
+	{
+		const uchar *p = bgr.ptr<uchar>(y);
+		uchar *l = L.ptr<uchar>(y);
+		for(int x = 0; x < bgr.cols; ++x, p += 3)
+		{
+			int vmax = std::max(p[0], std::max(p[1], p[2])), vmin = std::min(p[0], std::min(p[1], p[2]));
+			l[x] = saturate_cast<uchar>((vmax*s + vmin*s)*0.5f*255.f);
+		}
+	}
+}
+
+//Hue channel of cvtColor(CV_BGR2HLS) for one BGR pixel, same float arithmetic as cvtColor. In [0,180]
+static inline uchar hls_hue(const uchar *p)
+{
+	const float s = 1.f/255.f;
+	float b = p[0]*s, g = p[1]*s, r = p[2]*s;
+	float vmax = r, vmin = r, h = 0.f;
+	if(vmax < g) vmax = g;
+	if(vmax < b) vmax = b;
+	if(vmin > g) vmin = g;
+	if(vmin > b) vmin = b;
+	float diff = vmax - vmin;
+	if(diff > FLT_EPSILON)
+	{
+		diff = 60.f/diff;
+		if(vmax == r) h = (g - b)*diff;
+		else if(vmax == g) h = (b - r)*diff + 120.f;
+		else h = (r - g)*diff + 240.f;
+		if(h < 0.f) h += 360.f;
+	}
+	return saturate_cast<uchar>(h*0.5f);
+}
+
+//Hue to its color feature bit: [0,179] broken into 8 parts. A hue that rounded up to 180 gets (uchar)(1<<8) == 0, as it always has
+static struct hue_bit_lut
+{
+	uchar bit[181];
+	hue_bit_lut()
+	{
+		for(int h = 0; h <= 180; ++h)
+			bit[h] = (uchar)(1 << (int)((float)h/22.5));
+	}
+} hue_bits;
+
+//One row of the colorhls "strong gradient" image from a lightness image: Scharr of L, abs, saturate to uchar,
+//0.5|dx| + 0.5|dy|.
+static void lgrad_row(const Mat &L, int y, uchar *g)
+{
+	const int cols = L.cols;
+	const uchar *r0 = L.ptr<uchar>(reflect101(y-1,L.rows));
+	const uchar *r1 = L.ptr<uchar>(y);
+	const uchar *r2 = L.ptr<uchar>(reflect101(y+1,L.rows));
+	for(int x = 0; x < cols; ++x)
+	{
+		int xm = reflect101(x-1,cols), xp = reflect101(x+1,cols);
+		int dx = 3*(r0[xp] - r0[xm]) + 10*(r1[xp] - r1[xm]) + 3*(r2[xp] - r2[xm]);
+		int dy = 3*(r2[xm] - r0[xm]) + 10*(r2[x] - r0[x]) + 3*(r2[xp] - r0[xp]);
+		int ax = std::min(std::abs(dx),255), ay = std::min(std::abs(dy),255);
+		g[x] = saturate_cast<uchar>(ax*0.5f + ay*0.5f);
+	}
+}
+
+//L gradient image for rows [y0,y1) and its (exact, integer) sum and sum of squares
+static void lgrad_rows(const Mat &L, Mat &lgrad, int y0, int y1, int64 &s, int64 &sq)
+{
+	for(int y = y0; y < y1; ++y)
+	{
+		uchar *g = lgrad.ptr<uchar>(y);
+		lgrad_row(L, y, g);
+		for(int x = 0; x < lgrad.cols; ++x)
+		{
+			int v = g[x];
+			s += v; sq += v*v;
+		}
+	}
+}
+
+//Sum and sum of squares of each channel of rows [y0,y1) of a CV_32F image, added up in the order meanStdDev uses
+static void mag_sums(const Mat &mag, int y0, int y1, double *s, double *sq)
+{
+	const int cn = mag.channels();
+	for(int y = y0; y < y1; ++y)
+	{
+		const float *mg = mag.ptr<float>(y);
+		for(int x = 0; x < mag.cols; ++x, mg += cn)
+		{
+			for(int k = 0; k < cn; ++k)
+			{
+				double v = mg[k];
+				s[k] += v; sq[k] += v*v;
+			}
+		}
+	}
+}
+
+//mean + std*nstd from the sums of n values, with mean and std worked out as meanStdDev does
+static double mean_plus_std(double s, double sq, double n, double nstd)
+{
+	double scale = n ? 1./n : 0.;
+	double mean = s*scale;
+	double std = std::sqrt(std::max(sq*scale - mean*mean, 0.));
+	return mean + std*nstd;
+}
+
+//Strongest of the 3 planes of a BGR pixel's gradient magnitudes, or squared magnitudes (ties go as in computeGradients)
+template<typename T> static inline int grad_plane(const T *mg)
+{
+	if(mg[0] > mg[1])
+		return (mg[0] > mg[2]) ? 0 : 2;
+	return (mg[1] > mg[2]) ? 1 : 2;
+}
+
+//Orientation bin [0,8) of a gradient angle in degrees, ignoring polarity
+static inline int grad_bin(float angle)
+{
+	if(angle >= 180.0) angle -= 180.0; //We ignore polarity of the angle
+	return (int)(angle*0.044444444); //floor of angle/(180.0/8)
+}
+
+//Gradient feature bit of one BGR pixel: orientation of the strongest plane if it passes that plane's threshold
+static inline uchar grad_bit(const float *mg, const float *ph, const float *thresh)
+{
+	int k = grad_plane(mg);
+	if(mg[k] < thresh[k]) return 0; //Ignore small gradients
+	return (uchar)(1 << grad_bin(ph[k]));
+}
+
+//One row of computeGradients output from 3 channel magnitude and phase rows. m (mask row) may be NULL
+static void grad_row(const float *mg, const float *ph, const uchar *m, uchar *bit, int cols, const float *thresh)
+{
+	for(int x = 0; x < cols; ++x, mg += 3, ph += 3)
+		bit[x] = (m && !m[x]) ? 0 : grad_bit(mg, ph, thresh);
+}
+
+//Everything grad_row needs of a pixel except the thresholds: the strongest plane's magnitude and bin | plane<<3
+static void grad_winner_row(const float *mg, const float *ph, float *wm, uchar *code, int cols)
+{
+	for(int x = 0; x < cols; ++x, mg += 3, ph += 3)
+	{
+		int k = grad_plane(mg);
+		wm[x] = mg[k];
+		code[x] = (uchar)(grad_bin(ph[k]) | (k << 3));
+	}
+}
+
+//grad_row from what grad_winner_row kept
+static void grad_winner_bits(const float *wm, const uchar *code, const uchar *m, uchar *bit, int cols, const float *thresh)
+{
+	for(int x = 0; x < cols; ++x)
+		bit[x] = ((m && !m[x]) || wm[x] < thresh[code[x] >> 3]) ? 0 : (uchar)(1 << (code[x] & 7));
+}
+
+//One row of computeColorHLS output from a BGR row and its L gradient row. Hue is only worked out where it is used,
+//near strong gradients. m (mask row) may be NULL
+static void color_row(const uchar *bgr, const uchar *g, const uchar *m, uchar *c, int cols, uchar thresh)
+{
+	for(int x = 0; x < cols; ++x, bgr += 3)
+		c[x] = ((m && !m[x]) || g[x] <= thresh) ? 0 : hue_bits.bit[hls_hue(bgr)];
+}
+
+//Hue bit of every pixel of a BGR row, for color_bits_row
+static void hue_row(const uchar *bgr, uchar *hb, int cols)
+{
+	for(int x = 0; x < cols; ++x, bgr += 3)
+		hb[x] = hue_bits.bit[hls_hue(bgr)];
+}
+
+//color_row from the hue bits hue_row kept
+static void color_bits_row(const uchar *hb, const uchar *g, const uchar *m, uchar *c, int cols, uchar thresh)
+{
+	for(int x = 0; x < cols; ++x)
+		c[x] = ((m && !m[x]) || g[x] <= thresh) ? 0 : hb[x];
+}
+
+//One row of computeDepthGradients output from magnitude and phase rows. m (mask row) may be NULL
+static void depth_row(const float *mg, const float *ph, const uchar *m, uchar *bit, int cols, float thresh)
+{
+	for(int x = 0; x < cols; ++x)
+	{
+		bit[x] = 0; //Until we find a strong enough gradient
+		if(m && !m[x]) continue;
+		if(mg[x] < thresh) continue; //Ignore small gradients
+		bit[x] = (uchar)(1 << (int)(ph[x]*0.022222222)); //floor of angle/(360.0/8)
+	}
+}
+
+//Orientation bits of a row of depth gradient angles, before thresholding
+static void depth_bits_row(const float *ph, uchar *bit, int cols)
+{
+	for(int x = 0; x < cols; ++x)
+		bit[x] = (uchar)(1 << (int)(ph[x]*0.022222222));
+}
+
+//depth_row from the magnitudes and what depth_bits_row made of the angles
+static void depth_threshold_row(const float *mg, const uchar *b, const uchar *m, uchar *bit, int cols, float thresh)
+{
+	for(int x = 0; x < cols; ++x)
+		bit[x] = ((m && !m[x]) || mg[x] < thresh) ? 0 : b[x];
+}
+
+//Fixed point counterparts of cartToPolar followed by grad_bin or the depth bins. Angles at exact multiples of 45
+//degrees land in the lower bin, as they do through the 0.044444444 and 0.022222222 multipliers above. The 22.5 degree
+//edges are irrational, so the integer compares (dy < (sqrt(2)-1)dx <=> (dy+dx)^2 < 2dx^2) never tie.
+static inline int grad_bin_int(int dx, int dy)
+{
+	if(dy < 0 || (dy == 0 && dx < 0)) { dx = -dx; dy = -dy; } //We ignore polarity of the angle
+	if(dx > 0)
+	{
+		int64 dx2 = 2*(int64)dx*dx;
+		if((int64)(dy + dx)*(dy + dx) < dx2) return 0;	//below 22.5
+		if(dy <= dx) return 1;							//up to and including 45
+		if((int64)(dy - dx)*(dy - dx) < dx2) return 2;	//below 67.5
+		return 3;
+	}
+	if(dx == 0) return dy ? 3 : 0;						//90, or no gradient at all
+	int ax = -dx;
+	int64 ax2 = 2*(int64)ax*ax;
+	if(dy > ax && (int64)(dy - ax)*(dy - ax) > ax2) return 4;	//below 112.5
+	if(dy >= ax) return 5;										//up to and including 135
+	if((int64)(dy + ax)*(dy + ax) > ax2) return 6;				//below 157.5
+	return 7;
+}
+
+static inline int depth_bin_int(int dx, int dy)
+{
+	if(dy > 0)
+	{
+		if(dx > 0) return (dy <= dx) ? 0 : 1;
+		if(dx == 0) return 1;
+		return (dy >= -dx) ? 2 : 3;
+	}
+	if(dy == 0) return (dx < 0) ? 3 : 0;
+	if(dx < 0) return (dy >= dx) ? 4 : 5;
+	if(dx == 0) return 5;
+	return (dx <= -dy) ? 6 : 7;
+}
+
+//cartToPolar's float magnitude of integer derivatives (same float operations, so the same value)
+static inline float int_magnitude(int dx, int dy)
+{
+	float fx = (float)dx, fy = (float)dy;
+	return std::sqrt(fx*fx + fy*fy);
+}
+
+//Smallest integer squared magnitude that passes threshold t: mg < t <=> mg*mg < squared_thresh(t)
+static int64 squared_thresh(double t)
+{
+	if(t <= 0) return 0;
+	double q = std::ceil(t*t);
+	return q < 9.0e18 ? (int64)q : (int64)9000000000000000000LL;
+}
+
+//grad_winner_row straight from a row of 3 channel CV_16S derivatives, keeping the winner's squared magnitude (at
+//most 2*4080^2, so int). Only if mg isn't NULL are the 3 plane magnitudes worked out, into it, for the statistics
+static void grad_winner_row_16s(const short *dx, const short *dy, float *mg, int *wsq, uchar *code, int cols)
+{
+	for(int x = 0; x < cols; ++x)
+	{
+		const short *gx = dx + 3*x, *gy = dy + 3*x;
+		int sq[3] = {gx[0]*gx[0] + gy[0]*gy[0], gx[1]*gx[1] + gy[1]*gy[1], gx[2]*gx[2] + gy[2]*gy[2]};
+		int k = grad_plane(sq);
+		wsq[x] = sq[k];
+		code[x] = (uchar)(grad_bin_int(gx[k], gy[k]) | (k << 3));
+	}
+	if(mg)
+		for(int i = 0; i < 3*cols; ++i)
+			mg[i] = int_magnitude(dx[i], dy[i]);
+}
+
+//grad_winner_bits from squared magnitudes and squared_thresh of the thresholds
+static void grad_winner_bits_sq(const int *wsq, const uchar *code, const uchar *m, uchar *bit, int cols, const int64 *tsq)
+{
+	for(int x = 0; x < cols; ++x)
+		bit[x] = ((m && !m[x]) || wsq[x] < tsq[code[x] >> 3]) ? 0 : (uchar)(1 << (code[x] & 7));
+}
+
+//Magnitudes and (unthresholded) orientation bits of row y of a CV_16UC1 depth image. The Scharr is done right here in
+//integers, with BORDER_DEFAULT, so no derivative images are needed (16U derivatives don't fit in 16S anyway)
+//Squared magnitudes (up to 2*(16*65535)^2, so int64) go to sq, magnitudes only if mg isn't NULL (for the statistics)
+static void depth_row_16u(const Mat &D, int y, int64 *sq, float *mg, uchar *bit)
+{
+	const int cols = D.cols;
+	const ushort *r0 = D.ptr<ushort>(reflect101(y-1,D.rows));
+	const ushort *r1 = D.ptr<ushort>(y);
+	const ushort *r2 = D.ptr<ushort>(reflect101(y+1,D.rows));
+	for(int x = 0; x < cols; ++x)
+	{
+		int xm = reflect101(x-1,cols), xp = reflect101(x+1,cols);
+		int dx = 3*(r0[xp] - r0[xm]) + 10*(r1[xp] - r1[xm]) + 3*(r2[xp] - r2[xm]);
+		int dy = 3*(r2[xm] - r0[xm]) + 10*(r2[x] - r0[x]) + 3*(r2[xp] - r0[xp]);
+		sq[x] = (int64)dx*dx + (int64)dy*dy;
+		if(mg) mg[x] = int_magnitude(dx, dy);
+		bit[x] = (uchar)(1 << depth_bin_int(dx, dy));
+	}
+}
+
+//depth_threshold_row from squared magnitudes and squared_thresh of the threshold
+static void depth_threshold_row_sq(const int64 *sq, const uchar *b, const uchar *m, uchar *bit, int cols, int64 tsq)
+{
+	for(int x = 0; x < cols; ++x)
+		bit[x] = ((m && !m[x]) || sq[x] < tsq) ? 0 : b[x];
+}
+
+////////////Gradient threshold estimate//////////////////////////////////////////
+/**
+ * \brief Start summing a new frame
+ */
+void thresh_estimate::clear()
+{
+	for(int k = 0; k < 3; ++k) s[k] = sq[k] = 0;
+	n = 0;
+}
+
+/**
+ * \brief Add a row of magnitudes, in the order meanStdDev would
+ * @param mg	cols pixels of cn interleaved planes
+ */
+void thresh_estimate::add(const float *mg, int cols, int cn)
+{
+	for(int x = 0; x < cols; ++x, mg += cn)
+		for(int k = 0; k < cn; ++k)
+		{
+			double v = mg[k];
+			s[k] += v; sq[k] += v*v;
+		}
+	n += cols;
+}
+void thresh_estimate::add(const uchar *mg, int cols, int cn)
+{
+	//Integer sums, exact in double for any image we'll see, so the order doesn't matter
+	for(int k = 0; k < cn; ++k)
+	{
+		int64 a = 0, a2 = 0;
+		for(int x = k; x < cols*cn; x += cn)
+		{
+			int v = mg[x];
+			a += v; a2 += v*v;
+		}
+		s[k] += (double)a; sq[k] += (double)a2;
+	}
+	n += cols;
+}
+
+/**
+ * \brief mean + nstd*std of plane k of what was added since clear(), computed as meanStdDev does
+ */
+double thresh_estimate::thresh(int k, double nstd) const
+{
+	return mean_plus_std(s[k], sq[k], n, nstd);
+}
+
+/**
+ * \brief If we are in THRESH_PREVIOUS and have seen a frame, copy its cn thresholds into t and return true
+ */
+bool thresh_estimate::previous(double *t, int cn) const
+{
+	if(method != THRESH_PREVIOUS || !have_prev) return false;
+	for(int k = 0; k < cn; ++k) t[k] = prev[k];
+	return true;
+}
+
+/**
+ * \brief Remember the thresholds of what was added since clear() for the next frame
+ */
+void thresh_estimate::keep(int cn, double nstd)
+{
+	for(int k = 0; k < cn; ++k) prev[k] = thresh(k, nstd);
+	have_prev = true;
+}
+
+//8UC1 version of Mask in gray_mask if needed. Returns false (and complains) if it doesn't fit an image of size sz
+static bool mask_8UC1(const Mat &Mask, Size sz, Mat &gray_mask, Mat &temp, const char *who)
+{
+	if(Mask.empty()) { temp = Mat(); return true; }
+	if(Mask.size() != sz)
+	{
+		cerr << "ERROR: Mask in " << who << " size != Iin" << endl;
+		return false;
+	}
+	if (Mask.type() == CV_8UC3)
+	{
+		//don't write into the Mask, as its supposed to be const.
+		cv::cvtColor(Mask, gray_mask, CV_RGB2GRAY);
+		temp = gray_mask;
+	}
+	else
+		temp = Mask;
+	return true;
+}
+
+
+////////////Camera input////////////////////////////////////////////////////////
+#define BAND_ROWS 32	//Image rows the extractors work through at a time when they convert camera input themselves (feature_pipeline always)
+
+/**
+ * \brief Hand out rows of I
+ * @param I				BGR CV_8UC3 if code is -1, else CV_8UC1 NV12 (Y plane on top of interleaved UV, height*3/2 rows) or Bayer mosaic
+ * @param cvt_code		-1, CV_YUV2BGR_NV12, CV_BayerBG2BGR, CV_BayerGB2BGR, CV_BayerRG2BGR or CV_BayerGR2BGR
+ * @param band_rows		Most rows that will be asked for in one band() call
+ * @return				0, or -1 (and complains) if I and cvt_code don't go together
+ */
+int bgr_bands::set(const cv::Mat &I, int cvt_code, int band_rows)
+{
+	raw = I;
+	code = cvt_code;
+	first = 0;
+	rows = I.rows;
+	cols = I.cols;
+	if(code < 0)
+		return 0;
+	if(I.type() != CV_8UC1)
+	{
+		cerr << "ERROR: bgr_bands camera image is not of type CV_8UC1" << endl;
+		return -1;
+	}
+	switch(code)
+	{
+	case CV_YUV2BGR_NV12:
+		if(I.rows % 3 || I.cols % 2)
+		{
+			cerr << "ERROR: bgr_bands NV12 image must be height*3/2 rows of even width" << endl;
+			return -1;
+		}
+		rows = I.rows*2/3;
+		break;
+	case CV_BayerBG2BGR: case CV_BayerGB2BGR: case CV_BayerRG2BGR: case CV_BayerGR2BGR:
+		break;
+	default:
+		cerr << "ERROR: bgr_bands doesn't take cvtColor code " << code << endl;
+		return -1;
+	}
+	//NV12 bands get rounded out to even rows, Bayer bands get 2 more rows each side (also starting on an even row)
+	int brows = std::min(band_rows + 5, rows);
+	if(bgr.rows != brows || bgr.cols != cols)
+		bgr.create(brows, cols, CV_8UC3);
+	if(code == CV_YUV2BGR_NV12 && (packed.rows != brows*3/2 || packed.cols != cols))
+		packed.create(brows*3/2, cols, CV_8UC1);
+	return 0;
+}
+
+/**
+ * \brief Make image rows [a,b), clipped to the image, available in BGR
+ * @return  CV_8UC3 rows, valid until the next call. Its row 0 is image row band_first()
+ */
+const cv::Mat &bgr_bands::band(int a, int b)
+{
+	a = std::max(a, 0);
+	b = std::min(b, rows);
+	first = a;
+	if(code < 0)
+	{
+		cur = raw.rowRange(a, b);
+		return cur;
+	}
+	int a2, b2;
+	if(code == CV_YUV2BGR_NV12)
+	{
+		//Each 2x2 block of Y shares one UV pair, so whole blocks convert exactly as in the full frame
+		a2 = a & ~1;
+		b2 = std::min((b + 1) & ~1, rows);
+		int n = b2 - a2;
+		Mat Y = packed.rowRange(0, n), UV = packed.rowRange(n, n*3/2);
+		raw.rowRange(a2, b2).copyTo(Y);
+		raw.rowRange(rows + a2/2, rows + b2/2).copyTo(UV);
+		Mat P = packed.rowRange(0, n*3/2), dst = bgr.rowRange(0, n);
+		cvtColor(P, dst, code);
+	}
+	else
+	{
+		//Demosaicing reads the rows next door and makes up the outermost rows, so convert 2 more each side (from an
+		//even row so the pattern stays the same) and only hand out the rows that came out as in the full frame
+		a2 = std::max((a - 2) & ~1, 0);
+		b2 = std::min(b + 2, rows);
+		Mat R = raw.rowRange(a2, b2), dst = bgr.rowRange(0, b2 - a2);
+		cvtColor(R, dst, code);
+	}
+	cur = bgr.rowRange(a - a2, b - a2);
+	return cur;
+}
+
 ////////////COLOR HLS///////////////////////////////////////////////////////////
 /**
  * \brief Compute a color linemod feature based on Hue values near gradients
@@ -23,126 +524,176 @@ using namespace std;
  */
 void colorhls::computeColorHLS(const cv::Mat &Iin, cv::Mat &Icolorord, const cv::Mat &Mask, std::string mode)
 {
-	//CHECK INPUTS
 	CALCFEAT_DEBUG_1(cout << "In colorhls::computeColorHLS" << end;);
-	if(Itmp.empty() || Iin.rows != Itmp.rows || Iin.cols != Itmp.cols)
+	src.set(Iin, -1, Iin.rows);
+	compute(Icolorord, Mask, mode);
+}
+
+/**
+ * \brief computeColorHLS straight from a camera image, converted to BGR a band of rows at a time. Same result as
+ * converting the whole frame with cvtColor first.
+ * @param Iraw  NV12 (CV_8UC1, Y plane on top of interleaved UV) or Bayer mosaic (CV_8UC1)
+ * @param code  cvtColor code from Iraw to BGR: CV_YUV2BGR_NV12, CV_BayerBG2BGR, CV_BayerGB2BGR, CV_BayerRG2BGR or CV_BayerGR2BGR
+ * @param Icolorord Result image CV_8UC1
+ * @param Mask  compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+ * @param mode  If "test", noise reduce and blur the resulting image, "none": do nothing, else noise reduce for training
+ */
+void colorhls::computeColorHLS(const cv::Mat &Iraw, int code, cv::Mat &Icolorord, const cv::Mat &Mask, std::string mode)
+{
+	CALCFEAT_DEBUG_1(cout << "In colorhls::computeColorHLS (camera input)" << endl;);
+	if(src.set(Iraw, code, BAND_ROWS + 2) < 0)
+		return;
+	compute(Icolorord, Mask, mode);
+}
+
+//L of image rows [y, y+span) (clipped, with a row more each side for the gradient) into Lband, unless already there.
+//Returns the Lband row of image row y.
+int colorhls::load_rows(int y, int span)
+{
+	if(y < lfirst || y >= lend)
 	{
-		Itmp.create(Iin.size(),CV_8UC3);
+		lend = std::min(y + span, src.rows);
+		const Mat &B = src.band(y - 1, lend + 1);
+		Lband = Itmp.rowRange(0, B.rows);
+		lightness_rows(B, Lband, 0, B.rows);
+		lfirst = y;
 	}
-	if(Icolorord.empty() || Iin.rows != Icolorord.rows || Iin.cols != Icolorord.cols)
+	return y - src.band_first();
+}
+
+//computeColorHLS on the rows src hands out
+void colorhls::compute(cv::Mat &Icolorord, const cv::Mat &Mask, const std::string &mode)
+{
+	//CHECK INPUTS
+	const int rows = src.rows, cols = src.cols;
+	const cv::Size sz(cols, rows);
+	//Whole image L if we have it in place, else one band (and its gradient halo) at a time
+	const int span = src.in_place() ? rows : BAND_ROWS;
+	const int lrows = std::min(span + 2, rows);
+	if(Itmp.empty() || lrows != Itmp.rows || cols != Itmp.cols)
 	{
-		Icolorord.create(Iin.size(),CV_8UC1);
+		Itmp.create(lrows,cols,CV_8UC1);
+	}
+	lfirst = lend = 0;
+	if(Icolorord.empty() || rows != Icolorord.rows || cols != Icolorord.cols)
+	{
+		Icolorord.create(sz,CV_8UC1);
 	}
-	Icolorord = Scalar::all(0); //else make sure it's zero
+	//Every pixel of Icolorord gets written below, so no need to zero it first
 	cv::Mat temp;
 	if (!Mask.empty()) //We have a mask
 	{
-		if (Iin.size() != Mask.size())
+		if (sz != Mask.size())
 		{
 			cerr << "ERROR: Mask in computeColorOrder size != Iina" << endl;
+			Icolorord = Scalar::all(0);
 			return;
 		}
 		if (Mask.type() == CV_8UC3)
 		{
 			//don't write into the Mask, as its supposed to be const.
-			cv::cvtColor(Mask, temp, CV_RGB2GRAY);
+			cv::cvtColor(Mask, gray_mask, CV_RGB2GRAY);
+			temp = gray_mask;
 		}
 		else
 			temp = Mask;
 	}
-	//GET HUE
-	cvtColor(Iin, Itmp, CV_BGR2HLS);
-	vector<Mat> HLS;
-	split(Itmp, HLS);
+	//L ONLY (filled in by load_rows). Hue is worked out later, just where the L gradient says it is needed
 	double minVal = 0,maxVal = 0;
 	CALCFEAT_DEBUG_3(
-		cout << "HLS size: " << HLS.size() << endl;
-		minMaxLoc(HLS[0], &minVal, &maxVal);
-		cout << "HLS0 min = " << minVal << ", HLS max = " << maxVal << endl;
-		minMaxLoc(HLS[1], &minVal, &maxVal);
-		cout << "HLS1 min = " << minVal << ", HLS max = " << maxVal << endl;
-		minMaxLoc(HLS[2], &minVal, &maxVal);
-		cout << "HLS2 min = " << minVal << ", HLS max = " << maxVal << endl;
+		if(src.in_place())
+		{
+			cv::Mat Ihls;
+			cvtColor(src.band(0, rows), Ihls, CV_BGR2HLS);
+			split(Ihls, HLS);
+			cout << "HLS size: " << HLS.size() << endl;
+			minMaxLoc(HLS[0], &minVal, &maxVal);
+			cout << "HLS0 min = " << minVal << ", HLS max = " << maxVal << endl;
+			minMaxLoc(HLS[1], &minVal, &maxVal);
+			cout << "HLS1 min = " << minVal << ", HLS max = " << maxVal << endl;
+			minMaxLoc(HLS[2], &minVal, &maxVal);
+			cout << "HLS2 min = " << minVal << ", HLS max = " << maxVal << endl;
+		}
 	);
+	if(grad.rows != rows || grad.cols != cols)
+		grad.create(sz,CV_8UC1);
 
 	//ONLY REGISTER HUE AROUND STRONG GRADIENTS
-	Scharr( HLS[1], grad_x, CV_16S, 1, 0, 1, 0, BORDER_DEFAULT ); //dx
-	convertScaleAbs( grad_x, abs_grad_x );
-
-	Scharr( HLS[1], grad_y, CV_16S, 0, 1, 1, 0, BORDER_DEFAULT ); //dy
-	convertScaleAbs( grad_y, abs_grad_y );
-	addWeighted( abs_grad_x, 0.5, abs_grad_y, 0.5, 0, grad );	//|dx| + |dy|
-	//Set what "strong" gradient means
-	Scalar mean,std;
-	meanStdDev(grad, mean, std);
-	uchar thresh = (uchar)(mean[0] + std[0]*1.1);
-	CALCFEAT_DEBUG_3(
-		cout << ", mean = " << mean[0] << ", std = " << std[0] << endl;
-		cout << "thresh = " << (int)thresh << endl;
-		minMaxLoc(grad, &minVal, &maxVal);
-		cout << "grad min = " << minVal << ", grad max = " << maxVal << endl;
-		);
-	//PRODUCE THE COLOR LINE MOD FEATURE IMAGE
-	Mat_<uchar>::iterator h = HLS[0].begin<uchar>(),he = HLS[0].end<uchar>();
-	Mat_<uchar>::iterator c = Icolorord.begin<uchar>();
-	Mat_<uchar>::iterator g = grad.begin<uchar>();
-	if(Mask.empty()) //if no mask
+	//Set what "strong" gradient means: up front if we can estimate it, else from the sums gathered below
+	double t = 0;
+	bool known = te.previous(&t, 1);
+	if(!known && te.method == THRESH_SUBSAMPLE)
 	{
-		CALCFEAT_DEBUG_3(cout << "No mask" << endl;);
-		for(int i = 0; h != he;++h,++c,++g,++i)
+		te.clear();
+		for(int y = 0; y < rows; y += te.subsample)
 		{
-			if((*g) > thresh)	//We only compute colors where gradients are large enough
-			{
-				int rshift = (int)((float)(*h)/22.5); //Break Hue [0,179] into 8 parts
-				*c = (uchar)(1<<rshift);              //Convert this to a single bit
-				CALCFEAT_DEBUG_3(*h = (uchar)(rshift*18 + 128););
-			}
-			else
-			{
-				*c = 0;
-				CALCFEAT_DEBUG_3(*h = 0;);
-			}
-//			if(*c != 0&&*c != 1&&*c != 2&&*c != 4&&*c!=8&&*c!=16&&*c!=32&&*c!=64&&*c!=128)
-//				cout << i<<": bad value of c:"<<(int)*c<<endl;
+			int ly = load_rows(y, src.in_place() ? rows : 1);
+			lgrad_row(Lband, ly, grad.ptr<uchar>(y));
+			te.add(grad.ptr<uchar>(y), cols, 1);
 		}
-	} else { //If mask
-		Mat_<uchar>::const_iterator m = temp.begin<uchar>();
-		CALCFEAT_DEBUG_3(cout << "Use mask" << endl;);
-		for(int i = 0; h != he;++h,++c,++g,++m,++i)
+		t = te.thresh(0, 1.1);
+		known = true;
+	}
+	uchar thresh = (uchar)t;
+	bool gather = !known || te.method == THRESH_PREVIOUS;
+	bool keep_hue = !known && !src.in_place(); //Camera rows are gone by the time the threshold is known
+	if(keep_hue && (hbits.rows != rows || hbits.cols != cols))
+		hbits.create(sz,CV_8UC1);
+	te.clear();
+	//|dL/dx| + |dL/dy| (Scharr), its statistics and, if the threshold is known, the features in one pass
+	for(int y = 0; y < rows; ++y)
+	{
+		uchar *g = grad.ptr<uchar>(y);
+		lgrad_row(Lband, load_rows(y, span), g);
+		if(gather) te.add(g, cols, 1);
+		if(known)
+			color_row(src.row(y), g, temp.empty() ? 0 : temp.ptr<uchar>(y), Icolorord.ptr<uchar>(y), cols, thresh);
+		else if(keep_hue)
+			hue_row(src.row(y), hbits.ptr<uchar>(y), cols);
+	}
+	if(!known)
+	{
+		thresh = (uchar)te.thresh(0, 1.1);
+		//PRODUCE THE COLOR LINE MOD FEATURE IMAGE
+		for(int y = 0; y < rows; ++y)
 		{
-			if(!(*m)) continue;  //Only compute pixels with corresponding
-			if((*g) > thresh)	 //We only compute colors where gradients are large enough
-			{
-				int rshift = (int)((float)(*h)/22.5);//Break Hue [0,179] into 8 parts
-				*c = (uchar)(1<<rshift);             //Convert this to a single bit
-				CALCFEAT_DEBUG_3(*h = (uchar)(rshift*18 + 128););
-			}
+			if(keep_hue)
+				color_bits_row(hbits.ptr<uchar>(y), grad.ptr<uchar>(y), temp.empty() ? 0 : temp.ptr<uchar>(y), Icolorord.ptr<uchar>(y), cols, thresh);
 			else
-			{
-				*c = 0;
-				CALCFEAT_DEBUG_3(*h = 0;);
-			}
-//			if(*c != 0&&*c != 1&&*c != 2&&*c != 4&&*c!=8&&*c!=16&&*c!=32&&*c!=64&&*c!=128)
-//				cout << i<<": bad value of c:"<<(int)*c<<endl;
+				color_row(src.row(y), grad.ptr<uchar>(y), temp.empty() ? 0 : temp.ptr<uchar>(y), Icolorord.ptr<uchar>(y), cols, thresh);
 		}
 	}
-	mmod_general gen;
+	if(te.method == THRESH_PREVIOUS)
+		te.keep(1, 1.1);
+	CALCFEAT_DEBUG_3(
+		cout << "thresh = " << (int)thresh << endl;
+		minMaxLoc(grad, &minVal, &maxVal);
+		cout << "grad min = " << minVal << ", grad max = " << maxVal << endl;
+		);
 	if(mode != "none")
 		gen.SumAroundEachPixel8UC1(Icolorord,Icolorord,3,1); //Clean the features of spurious gradients
 	if(mode == "test")
 		gen.SumAroundEachPixel8UC1(Icolorord,Icolorord,ORAMT,0); //Spread features by ORing
+	//Check that our temporaries stayed put
+	ws.add(Itmp); ws.add(grad); ws.add(hbits); ws.add(gray_mask);
+	src.add_workspace(ws);
+	gen.add_workspace(ws);
+	ws.end_frame();
 
 	CALCFEAT_DEBUG_3(
-		namedWindow("H",0);
-		namedWindow("L",0);
-		namedWindow("S",0);
-		imshow("H",HLS[0]);
-		imshow("L",HLS[1]);
-		imshow("S",HLS[2]);
-		waitKey();
-		destroyWindow("H");
-		destroyWindow("L");
-		destroyWindow("S");
+		if(!HLS.empty())
+		{
+			namedWindow("H",0);
+			namedWindow("L",0);
+			namedWindow("S",0);
+			imshow("H",HLS[0]);
+			imshow("L",HLS[1]);
+			imshow("S",HLS[2]);
+			waitKey();
+			destroyWindow("H");
+			destroyWindow("L");
+			destroyWindow("S");
+		}
 	);
 	CALCFEAT_DEBUG_2(cout << "Exit colorhls::computeColorHLS" << end;);
 }
@@ -159,155 +710,177 @@ void colorhls::computeColorHLS(const cv::Mat &Iin, cv::Mat &Icolorord, const cv:
  * @param mode  If "test", noise reduce and blur the resulting image, "none": do nothing, else noise reduce for training
  */
 void gradients::computeGradients(const cv::Mat &Iin, cv::Mat &Icolorord, const cv::Mat Mask, std::string mode)
+{
+	CALCFEAT_DEBUG_1(cout << "In gradients::computeGradients" << endl;);
+	src.set(Iin, -1, Iin.rows);
+	compute(Icolorord, Mask, mode);
+}
+
+/**
+ * \brief computeGradients straight from a camera image, converted to BGR a band of rows at a time. Same result as
+ * converting the whole frame with cvtColor first.
+ * @param Iraw			NV12 (CV_8UC1, Y plane on top of interleaved UV) or Bayer mosaic (CV_8UC1)
+ * @param code			cvtColor code from Iraw to BGR: CV_YUV2BGR_NV12, CV_BayerBG2BGR, CV_BayerGB2BGR, CV_BayerRG2BGR or CV_BayerGR2BGR
+ * @param Icolorord		Output CV_8UC1 image
+ * @param Mask			compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+ * @param mode  If "test", noise reduce and blur the resulting image, "none": do nothing, else noise reduce for training
+ */
+void gradients::computeGradients(const cv::Mat &Iraw, int code, cv::Mat &Icolorord, const cv::Mat Mask, std::string mode)
+{
+	CALCFEAT_DEBUG_1(cout << "In gradients::computeGradients (camera input)" << endl;);
+	if(src.set(Iraw, code, BAND_ROWS + 2) < 0)
+		return;
+	compute(Icolorord, Mask, mode);
+}
+
+//Scharr of image rows [y, y+span) (clipped, with a row more each side as halo) into grad_x, grad_y, unless already
+//there. Returns the grad_x row of image row y.
+int gradients::load_rows(int y, int span)
+{
+	if(y < gfirst || y >= gend)
+	{
+		gend = std::min(y + span, src.rows);
+		const Mat &B = src.band(y - 1, gend + 1);
+		//A converted band sits in a bigger buffer whose other rows must not be taken for the image's border rows
+		int border = src.in_place() ? BORDER_DEFAULT : BORDER_DEFAULT | BORDER_ISOLATED;
+		//All three planes in one call per direction, no split. Scharr of 8U is exact in 32F, and fits in 16S.
+		Mat dx = grad_x.rowRange(0, B.rows), dy = grad_y.rowRange(0, B.rows);
+		Scharr( B, dx, grad_x.depth(), 1, 0, 1, 0, border ); //dx
+		Scharr( B, dy, grad_y.depth(), 0, 1, 1, 0, border ); //dy
+		gfirst = y;
+		goff = src.band_first();
+	}
+	return y - goff;
+}
+
+//computeGradients on the rows src hands out
+void gradients::compute(cv::Mat &Icolorord, const cv::Mat &Mask, const std::string &mode)
 {
 	//CHECK INPUTS
-	CALCFEAT_DEBUG_1(cout << "In colorhls::computeColorHLS" << end;);
-//	if(Itmp.empty() || Iin.rows != Itmp.rows || Iin.cols != Itmp.cols)
-//	{
-//		Itmp.create(Iin.size(),CV_8UC1);
-//	}
-	if(Icolorord.empty() || Iin.rows != Icolorord.rows || Iin.cols != Icolorord.cols)
+	const int rows = src.rows, cols = src.cols;
+	const cv::Size sz(cols, rows);
+	if(Icolorord.empty() || rows != Icolorord.rows || cols != Icolorord.cols)
 	{
-		Icolorord.create(Iin.size(),CV_8UC1);
+		Icolorord.create(sz,CV_8UC1);
 	}
-	Icolorord = Scalar::all(0); //else make sure it's zero
+	//Every pixel of Icolorord gets written below, so no need to zero it first
 	cv::Mat temp;
 	if (!Mask.empty()) //We have a mask
 	{
-		if (Iin.size() != Mask.size())
+		if (sz != Mask.size())
 		{
 			cerr << "ERROR: Mask in computeColorOrder size != Iina" << endl;
+			Icolorord = Scalar::all(0);
 			return;
 		}
 		if (Mask.type() == CV_8UC3)
 		{
 			//don't write into the Mask, as its supposed to be const.
-			cv::cvtColor(Mask, temp, CV_RGB2GRAY);
+			cv::cvtColor(Mask, gray_mask, CV_RGB2GRAY);
+			temp = gray_mask;
 		}
 		else
 			temp = Mask;
 	}
-	//FIND THE MAX GRADIENT RESPONSE ACROSS COLORS
-//	cvtColor(Iin, Itmp, CV_RGB2GRAY);
-	vector<Mat> RGB;
-	split(Iin, RGB);
-
-	Scharr( RGB[0], grad_x, CV_32F, 1, 0, 1, 0, BORDER_DEFAULT ); //dx
-	Scharr( RGB[0], grad_y, CV_32F, 0, 1, 1, 0, BORDER_DEFAULT ); //dy
-	cartToPolar(grad_x, grad_y, mag0, phase0, true); //True => in degrees not radians
-	Scharr( RGB[1], grad_x, CV_32F, 1, 0, 1, 0, BORDER_DEFAULT ); //dx
-	Scharr( RGB[1], grad_y, CV_32F, 0, 1, 1, 0, BORDER_DEFAULT ); //dy
-	cartToPolar(grad_x, grad_y, mag1, phase1, true); //True => in degrees not radians
-	Scharr( RGB[2], grad_x, CV_32F, 1, 0, 1, 0, BORDER_DEFAULT ); //dx
-	Scharr( RGB[2], grad_y, CV_32F, 0, 1, 1, 0, BORDER_DEFAULT ); //dy
-	cartToPolar(grad_x, grad_y, mag2, phase2, true); //True => in degrees not radians
-
-	//COMPUTE RESONABLE THRESHOLDS
-	Scalar mean0,std0,mean1,std1,mean2,std2;
-	meanStdDev(mag0, mean0, std0);
-	meanStdDev(mag1, mean1, std1);
-	meanStdDev(mag2, mean2, std2);
-#define stdmul 0.1
-	float thresh0 = (float)(mean0[0] + std0[0]*stdmul);///1.25);
-	float thresh1 = (float)(mean1[0] + std1[0]*stdmul);///1.25);
-	float thresh2 = (float)(mean2[0] + std2[0]*stdmul);///1.25);
-	double minVal0,maxVal0,minVal1,maxVal1,minVal2,maxVal2;
-	CALCFEAT_DEBUG_3(
-		cout <<"     means(B,G,R) ("<<mean0[0]<<", "<<mean1[0]<<", "<<mean2[0]<<")"<<endl;
-		cout <<"     std(B,G,R)   ("<<std0[0]<<", "<<std1[0]<<", "<<std2[0]<<")"<<endl;
-		minMaxLoc(mag0, &minVal0, &maxVal0);
-		minMaxLoc(mag1, &minVal1, &maxVal1);
-		minMaxLoc(mag2, &minVal2, &maxVal2);
-		cout <<"        minVals(B,G,R) ("<<minVal0<<", "<<minVal1<<", "<<minVal2<<")"<<endl;
-		cout <<"        maxVals(B,G,R) ("<<maxVal0<<", "<<maxVal1<<", "<<maxVal2<<")"<<endl;
-		cout <<"       thresh(B,G,R) ("<<thresh0<<", "<<thresh1<<", "<<thresh2<<")"<<endl;
-	);
+	//FIND THE MAX GRADIENT RESPONSE ACROSS COLORS (Scharr done in load_rows)
+	//Whole image if we have it in place, else one band (and its halo) at a time
+	const int span = src.in_place() ? rows : BAND_ROWS;
+	grad_x.create(std::min(span + 2, rows), cols, fixed_point ? CV_16SC3 : CV_32FC3);
+	grad_y.create(grad_x.size(), grad_x.type());
+	gfirst = gend = 0;
+	if(fixed_point)
+		magrow.create(1, cols, CV_32FC3);
+	const int wtype = fixed_point ? CV_32SC1 : CV_32FC1; //Squared magnitudes if fixed_point, else magnitudes
+	wmrow.create(1, cols, wtype);
+	coderow.create(1, cols, CV_8UC1);
 
-	//CREATE BINARIZED OUTPUT IMAGE
-	MatIterator_<float> mit0 = mag0.begin<float>(), mit_end = mag0.end<float>();
-	MatIterator_<float> pit0 = phase0.begin<float>();
-	MatIterator_<float> mit1 = mag1.begin<float>();
-	MatIterator_<float> pit1 = phase1.begin<float>();
-	MatIterator_<float> mit2 = mag2.begin<float>();
-	MatIterator_<float> pit2 = phase2.begin<float>();
-	MatIterator_<uchar> bit = Icolorord.begin<uchar>();
-	float angle;
-	if(Mask.empty()) //if no mask
+	//COMPUTE RESONABLE THRESHOLDS: up front if we can estimate them, else from the sums gathered below
+#define stdmul 0.1
+	double t[3] = {0,0,0};
+	bool known = te.previous(t, 3);
+	if(!known && te.method == THRESH_SUBSAMPLE)
 	{
-		for(; mit0 != mit_end; ++mit0, ++pit0,++mit1, ++pit1, ++mit2, ++pit2, ++bit)
+		te.clear();
+		for(int y = 0; y < rows; y += te.subsample)
 		{
-			if(*mit0 > *mit1)
-			{
-				if(*mit0 > *mit2) //mit0 is max
-				{
-					if(*mit0 < thresh0) continue; //Ignore small gradients
-					angle = *pit0;
-				}
-				else // mit2 is max
-				{
-					if(*mit2 < thresh2) continue;  //Ignore small gradients
-					angle = *pit2;
-				}
-			}
-			else //if(*mit1 > *mit2)//mit1 is max
-			{
-				if(*mit1 > *mit2) //mit1 is max
-				{
-					if(*mit1 < thresh1) continue; //Ignore small gradients
-					angle = *pit1;
-				}
-				else //mit2 is max
-				{
-					if(*mit2 < thresh2) continue;  //Ignore small gradients
-					angle = *pit2;
-				}
-			}
-			if(angle >= 180.0) angle -= 180.0; //We ignore polarity of the angle
-			*bit = 1 << (int)(angle*0.044444444); //This is the floor of angle/(180.0/8) to put the angle into one of 8 bits. Set that bit
+			winner_row(load_rows(y, src.in_place() ? rows : 1), wmrow.ptr<uchar>(0), coderow.ptr<uchar>(0), true);
+			te.add(magrow.ptr<float>(0), cols, 3);
 		}
+		for(int k = 0; k < 3; ++k) t[k] = te.thresh(k, stdmul);
+		known = true;
+	}
+	float thresh[3] = {(float)t[0], (float)t[1], (float)t[2]};
+	int64 tsq[3] = {squared_thresh(thresh[0]), squared_thresh(thresh[1]), squared_thresh(thresh[2])};
+	bool gather = !known || te.method == THRESH_PREVIOUS;
+	te.clear();
+	if(!known && (wmag.rows != rows || wmag.cols != cols || wmag.type() != wtype))
+	{
+		wmag.create(sz,wtype);
+		wcode.create(sz,CV_8UC1);
+	}
+
+	//MAGNITUDES, THEIR STATISTICS AND THE BINARIZED OUTPUT (OR EACH PIXEL'S STRONGEST PLANE) IN ONE PASS
+	for(int y = 0; y < rows; ++y)
+	{
+		uchar *wm = known ? wmrow.ptr<uchar>(0) : wmag.ptr<uchar>(y);
+		uchar *code = known ? coderow.ptr<uchar>(0) : wcode.ptr<uchar>(y);
+		winner_row(load_rows(y, span), wm, code, gather);
+		if(gather) te.add(magrow.ptr<float>(0), cols, 3);
+		if(known)
+			winner_bits(wm, code, temp.empty() ? 0 : temp.ptr<uchar>(y), Icolorord.ptr<uchar>(y), thresh, tsq);
 	}
-	else //There is a mask
+	if(!known)
 	{
-		Mat_<uchar>::const_iterator m = temp.begin<uchar>();
-		for(; mit0 != mit_end; ++mit0, ++pit0,++mit1, ++pit1, ++mit2, ++pit2, ++bit, ++m)
+		for(int k = 0; k < 3; ++k)
 		{
-			if(!(*m)) continue;  //Only compute pixels with corresponding mask pixel set
-			if(*mit0 > *mit1)
-			{
-				if(*mit0 > *mit2) //mit0 is max
-				{
-					if(*mit0 < thresh0) continue; //Ignore small gradients
-					angle = *pit0;
-				}
-				else // mit2 is max
-				{
-					if(*mit2 < thresh2) continue;  //Ignore small gradients
-					angle = *pit2;
-				}
-			}
-			else //if(*mit1 > *mit2)//mit1 is max
-			{
-				if(*mit1 > *mit2) //mit1 is max
-				{
-					if(*mit1 < thresh1) continue; //Ignore small gradients
-					angle = *pit1;
-				}
-				else //mit2 is max
-				{
-					if(*mit2 < thresh2) continue;  //Ignore small gradients
-					angle = *pit2;
-				}
-			}
-			if(angle >= 180.0) angle -= 180.0; //We ignore polarity of the angle
-			*bit = 1 << (int)(angle*0.044444444); //This is the floor of angle/(180.0/8) to put the angle into one of 8 bits. Set that bit
+			thresh[k] = (float)te.thresh(k, stdmul);
+			tsq[k] = squared_thresh(thresh[k]);
 		}
+		//CREATE BINARIZED OUTPUT IMAGE, reading only the strongest plane of each pixel
+		for(int y = 0; y < rows; ++y)
+			winner_bits(wmag.ptr<uchar>(y), wcode.ptr<uchar>(y), temp.empty() ? 0 : temp.ptr<uchar>(y),
+					Icolorord.ptr<uchar>(y), thresh, tsq);
 	}
+	if(te.method == THRESH_PREVIOUS)
+		te.keep(3, stdmul);
+	CALCFEAT_DEBUG_3(
+		cout <<"       thresh(B,G,R) ("<<thresh[0]<<", "<<thresh[1]<<", "<<thresh[2]<<")"<<endl;
+	);
 	//Output feature adjustments
-	mmod_general g;
 	if(mode != "none")
-		g.SumAroundEachPixel8UC1(Icolorord,Icolorord,3,1); //Clean the features of spurious gradients
+		gen.SumAroundEachPixel8UC1(Icolorord,Icolorord,3,1); //Clean the features of spurious gradients
 	if(mode == "test")
-		g.SumAroundEachPixel8UC1(Icolorord,Icolorord,ORAMT,0); //Spread features by ORing
+		gen.SumAroundEachPixel8UC1(Icolorord,Icolorord,ORAMT,0); //Spread features by ORing
+	//Check that our temporaries stayed put
+	ws.add(grad_x); ws.add(grad_y); ws.add(magrow); ws.add(phaserow); ws.add(wmag); ws.add(wcode);
+	ws.add(wmrow); ws.add(coderow); ws.add(gray_mask);
+	src.add_workspace(ws);
+	gen.add_workspace(ws);
+	ws.end_frame();
+}
+
+//Strongest plane's magnitude (int squared magnitude if fixed_point) into wm and bin | plane<<3 into code for each
+//pixel of grad_x row gy. If stats, all 3 plane magnitudes are left in magrow (the fixed point path only needs a sqrt then)
+void gradients::winner_row(int gy, uchar *wm, uchar *code, bool stats)
+{
+	if(fixed_point)
+		grad_winner_row_16s(grad_x.ptr<short>(gy), grad_y.ptr<short>(gy), stats ? magrow.ptr<float>(0) : 0,
+				(int *)wm, code, grad_x.cols);
+	else
+	{
+		cartToPolar(grad_x.row(gy), grad_y.row(gy), magrow, phaserow, true); //True => in degrees not radians
+		grad_winner_row(magrow.ptr<float>(0), phaserow.ptr<float>(0), (float *)wm, code, grad_x.cols);
+	}
+}
+
+//Binarized output row from what winner_row kept: magnitudes against thresh, or squared magnitudes against tsq
+void gradients::winner_bits(const uchar *wm, const uchar *code, const uchar *m, uchar *bit, const float *thresh,
+		const int64 *tsq) const
+{
+	if(fixed_point)
+		grad_winner_bits_sq((const int *)wm, code, m, bit, src.cols, tsq);
+	else
+		grad_winner_bits((const float *)wm, code, m, bit, src.cols, thresh);
 }
 
 
@@ -337,61 +910,1090 @@ void depthgrad::computeDepthGradients(const cv::Mat &Iin, cv::Mat &Icolorord, co
 	{
 		Icolorord.create(Iin.size(),CV_8UC1);
 	}
-	Icolorord = Scalar::all(0); //else make sure it's zero
+	//Every pixel of Icolorord gets written below, so no need to zero it first
 	cv::Mat temp;
 	if (!Mask.empty()) //We have a mask
 	{
 		if (Iin.size() != Mask.size())
 		{
 			cerr << "ERROR: Mask in computeColorOrder size != Iina" << endl;
+			Icolorord = Scalar::all(0);
 			return;
 		}
 		if (Mask.type() == CV_8UC3)
 		{
 			//don't write into the Mask, as its supposed to be const.
-			cv::cvtColor(Mask, temp, CV_RGB2GRAY);
+			cv::cvtColor(Mask, gray_mask, CV_RGB2GRAY);
+			temp = gray_mask;
 		}
 		else
 			temp = Mask;
 	}
-	//FIND THE MAX GRADIENT RESPONSE ACROSS COLORS
-	Scharr( Iin, grad_x, CV_32F, 1, 0, 1, 0, BORDER_DEFAULT ); //dx
-	Scharr( Iin, grad_y, CV_32F, 0, 1, 1, 0, BORDER_DEFAULT ); //dy
-	cartToPolar(grad_x, grad_y, mag0, phase0, true); //True => in degrees not radians
+	//FIND THE GRADIENT (fixed point does it a row at a time in magnitude_row)
+	if(!fixed_point)
+	{
+		Scharr( Iin, grad_x, CV_32F, 1, 0, 1, 0, BORDER_DEFAULT ); //dx
+		Scharr( Iin, grad_y, CV_32F, 0, 1, 1, 0, BORDER_DEFAULT ); //dy
+	}
+	const int rows = Iin.rows, cols = Iin.cols;
+	if(fixed_point)
+	{
+		magrow.create(1, cols, CV_32FC1);
+		sqrow.create(1, cols, CV_64FC1);
+	}
+	bitrow.create(1, cols, CV_8UC1);
+	const int mtype = fixed_point ? CV_64FC1 : CV_32FC1; //int64 squared magnitudes if fixed_point, else magnitudes
 
-	//COMPUTE RESONABLE THRESHOLDS
-	Scalar mean0,std0;
-	meanStdDev(mag0, mean0, std0);
+	//COMPUTE RESONABLE THRESHOLDS: up front if we can estimate them, else from the sums gathered below
 #define stdmul2 0.1
-	float thresh0 = (float)(mean0[0] + std0[0]*stdmul2);
-	//CREATE BINARIZED OUTPUT IMAGE
-	MatIterator_<float> mit0 = mag0.begin<float>(), mit_end = mag0.end<float>();
-	MatIterator_<float> pit0 = phase0.begin<float>();
-	MatIterator_<uchar> bit = Icolorord.begin<uchar>();
-	if(Mask.empty()) //if no mask
+	double t = 0;
+	bool known = te.previous(&t, 1);
+	if(!known && te.method == THRESH_SUBSAMPLE)
 	{
-		for(; mit0 != mit_end; ++mit0, ++pit0, ++bit)
+		te.clear();
+		for(int y = 0; y < rows; y += te.subsample)
 		{
-			if(*mit0 < thresh0) continue; //Ignore small gradients
-			*bit = 1 << (int)((*pit0)*0.022222222); //This is the floor of angle/(360.0/8) to put the angle into one of 8 bits. Set that bit
+			magnitude_row(Iin, y, bitrow.ptr<uchar>(0), true);
+			te.add(magrow.ptr<float>(0), cols, 1);
 		}
+		t = te.thresh(0, stdmul2);
+		known = true;
+	}
+	float thresh0 = (float)t;
+	int64 tsq0 = squared_thresh(thresh0);
+	bool gather = !known || te.method == THRESH_PREVIOUS;
+	te.clear();
+	if(!known && (mag0.rows != rows || mag0.cols != cols || mag0.type() != mtype))
+	{
+		mag0.create(Iin.size(),mtype);
+		bit0.create(Iin.size(),CV_8UC1);
+	}
+
+	//MAGNITUDE, ITS STATISTICS AND THE BINARIZED OUTPUT (OR MAGNITUDE AND ORIENTATION BIT) IN ONE PASS
+	for(int y = 0; y < rows; ++y)
+	{
+		uchar *bits = known ? bitrow.ptr<uchar>(0) : bit0.ptr<uchar>(y);
+		const uchar *mg = magnitude_row(Iin, y, bits, gather);
+		if(gather) te.add(magrow.ptr<float>(0), cols, 1);
+		if(known)
+			threshold_row(mg, bits, temp.empty() ? 0 : temp.ptr<uchar>(y), Icolorord.ptr<uchar>(y), cols, thresh0, tsq0);
+		else
+			memcpy(mag0.ptr<uchar>(y), mg, cols*mag0.elemSize());
+	}
+	if(!known)
+	{
+		thresh0 = (float)te.thresh(0, stdmul2);
+		tsq0 = squared_thresh(thresh0);
+		//CREATE BINARIZED OUTPUT IMAGE
+		for(int y = 0; y < rows; ++y)
+			threshold_row(mag0.ptr<uchar>(y), bit0.ptr<uchar>(y), temp.empty() ? 0 : temp.ptr<uchar>(y),
+					Icolorord.ptr<uchar>(y), cols, thresh0, tsq0);
+	}
+	if(te.method == THRESH_PREVIOUS)
+		te.keep(1, stdmul2);
+	//Output feature adjustments
+	if(mode != "none")
+		gen.SumAroundEachPixel8UC1(Icolorord,Icolorord,3,1); //Clean the features of spurious gradients
+	if(mode == "test")
+		gen.SumAroundEachPixel8UC1(Icolorord,Icolorord,ORAMT,0); //Spread features by ORing
+	//Check that our temporaries stayed put
+	ws.add(grad_x); ws.add(grad_y); ws.add(magrow); ws.add(phaserow); ws.add(sqrow); ws.add(bitrow); ws.add(mag0);
+	ws.add(bit0); ws.add(gray_mask);
+	gen.add_workspace(ws);
+	ws.end_frame();
+}
+
+//Gradient magnitudes of row y of the depth image Iin (returned, valid until the next call: int64 squared magnitudes
+//if fixed_point, else floats) and their orientation bits. If stats, the float magnitudes are also left in magrow
+const uchar *depthgrad::magnitude_row(const cv::Mat &Iin, int y, uchar *bits, bool stats)
+{
+	if(fixed_point)
+	{
+		depth_row_16u(Iin, y, (int64 *)sqrow.ptr<uchar>(0), stats ? magrow.ptr<float>(0) : 0, bits);
+		return sqrow.ptr<uchar>(0);
+	}
+	cartToPolar(grad_x.row(y), grad_y.row(y), magrow, phaserow, true); //True => in degrees not radians
+	depth_bits_row(phaserow.ptr<float>(0), bits, Iin.cols);
+	return magrow.ptr<uchar>(0);
+}
+
+//Binarized output row from a row magnitude_row returned: magnitudes against thresh, or squared magnitudes against tsq
+void depthgrad::threshold_row(const uchar *mg, const uchar *bits, const uchar *m, uchar *bit, int cols, float thresh,
+		int64 tsq) const
+{
+	if(fixed_point)
+		depth_threshold_row_sq((const int64 *)mg, bits, m, bit, cols, tsq);
+	else
+		depth_threshold_row((const float *)mg, bits, m, bit, cols, thresh);
+}
+
+
+
+
+////////////////////////DEPTH NORMAL FEATURES//////////////////////////////////////////////
+/**
+ * \brief Set up the normal estimation
+ * @param focal_length		Focal length in pixels of the depth images that will be passed in (525 for a full size Kinect frame)
+ * @param neighbor_step		Distance in pixels to the 8 neighbors (horizontal, vertical, diagonal) each normal is fit to
+ * @param max_depth_diff	Neighbors differing from the center by more than this (depth units, mm for Kinect) are ignored
+ * @param min_tilt_deg		Surfaces tilted less than this from facing the camera have no reliable orientation and get no feature
+ */
+depthnormals::depthnormals(int focal_length, int neighbor_step, int max_depth_diff, float min_tilt_deg)
+	: focal(focal_length), step(std::max(neighbor_step,1)), max_difference(max_depth_diff)
+{
+	double t = std::tan(min_tilt_deg*CV_PI/180.0);
+	tilt_k = (t > 0) ? (double)focal*focal/(t*t) : 1e30;
+}
+
+//floor(angle/45) for the angle in [0,360) of (x,y) != (0,0), using compares only
+static inline int octant(int64 x, int64 y)
+{
+	if(y >= 0)
+	{
+		if(x > 0) return (y < x) ? 0 : 1;
+		if(y == 0) return 4;			//180 degrees
+		return (y > -x) ? 2 : 3;
+	}
+	if(x < 0) return (-y < -x) ? 4 : 5;
+	return (x < -y) ? 6 : 7;
+}
+
+/**
+ * \brief Compute linemod features from quantized surface normal orientations of a depth image (CV_16UC1)
+ *
+ * A plane is fit by integer least squares to the depth differences to the 8 neighbors of each pixel, skipping
+ * neighbors with no depth or across a depth discontinuity. The direction of the normal's tilt is put into one of 8
+ * bits with integer compares. Pixels with no depth, too few good neighbors or a surface facing the camera get 0.
+ * @param Iin			Input depth image, CV_16UC1, 0 => no depth
+ * @param Icolorord		Output CV_8UC1 of surface normal features
+ * @param Mask			compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+ * @param mode  		If "test", noise reduce and blur the resulting image (DEFAULT), "none": do nothing, else noise reduce for training
+ */
+void depthnormals::computeDepthNormals(const cv::Mat &Iin, cv::Mat &Icolorord, const cv::Mat Mask, std::string mode)
+{
+	//CHECK INPUTS
+	CALCFEAT_DEBUG_1(cout << "In depthnormals::computeDepthNormals" << endl;);
+	if(Iin.type() != CV_16UC1)
+	{
+		cerr << "ERROR: Depth image is not of type CV_16UC1" << endl;
+		return;
 	}
-	else //There is a mask
+	if(Icolorord.empty() || Iin.rows != Icolorord.rows || Iin.cols != Icolorord.cols)
 	{
-		Mat_<uchar>::const_iterator m = temp.begin<uchar>();
-		for(; mit0 != mit_end; ++mit0, ++pit0, ++bit, ++m)
+		Icolorord.create(Iin.size(),CV_8UC1);
+	}
+	//Every pixel of Icolorord gets written below, so no need to zero it first
+	cv::Mat temp;
+	if (!Mask.empty()) //We have a mask
+	{
+		if (Iin.size() != Mask.size())
 		{
-			if(!(*m)) continue;  //Only compute pixels with corresponding mask pixel set
-			if(*mit0 < thresh0) continue; //Ignore small gradients
-			*bit = 1 << (int)((*pit0)*0.022222222); //This is the floor of angle/(360.0/8) to put the angle into one of 8 bits. Set that bit
+			cerr << "ERROR: Mask in computeDepthNormals size != Iin" << endl;
+			Icolorord = Scalar::all(0);
+			return;
+		}
+		if (Mask.type() == CV_8UC3)
+		{
+			//don't write into the Mask, as its supposed to be const.
+			cv::cvtColor(Mask, gray_mask, CV_RGB2GRAY);
+			temp = gray_mask;
+		}
+		else
+			temp = Mask;
+	}
+	//THE 8 NEIGHBORS THE PLANE IS FIT TO
+	const int s = step, rows = Iin.rows, cols = Iin.cols;
+	const int ndx[8] = {-s, 0, s, -s, s, -s, 0, s};
+	const int ndy[8] = {-s, -s, -s, 0, 0, s, s, s};
+	int noff[8];
+	for(int k = 0; k < 8; ++k)
+		noff[k] = ndy[k]*(int)(Iin.step/sizeof(ushort)) + ndx[k];
+
+	//FIT, CHECK TILT, QUANTIZE
+	for(int y = 0; y < rows; ++y)
+	{
+		uchar *bit = Icolorord.ptr<uchar>(y);
+		memset(bit, 0, cols); //Until we find a good enough normal
+		if(y < s || y >= rows - s) continue; //Not all neighbors are in the image
+		const ushort *d = Iin.ptr<ushort>(y);
+		const uchar *m = temp.empty() ? 0 : temp.ptr<uchar>(y);
+		for(int x = s; x < cols - s; ++x)
+		{
+			if(m && !m[x]) continue;  //Only compute pixels with corresponding mask pixel set
+			int d0 = d[x];
+			if(!d0) continue; //No depth
+			int n = 0, sxx = 0, syy = 0, sxy = 0, sxd = 0, syd = 0;
+			for(int k = 0; k < 8; ++k)
+			{
+				int dq = d[x + noff[k]];
+				int diff = dq - d0;
+				if(!dq || diff > max_difference || diff < -max_difference) continue; //No depth or across an edge
+				int dx = ndx[k], dy = ndy[k];
+				++n;
+				sxx += dx*dx; syy += dy*dy; sxy += dx*dy;
+				sxd += dx*diff; syd += dy*diff;
+			}
+			if(n < 3) continue; //Too close to an edge to trust
+			//Least squares depth gradient (gx,gy)/det of diff = gx*dx + gy*dy
+			int64 det = (int64)sxx*syy - (int64)sxy*sxy;
+			if(det <= 0) continue; //Neighbors all on a line
+			int64 gx = (int64)syy*sxd - (int64)sxy*syd;
+			int64 gy = (int64)sxx*syd - (int64)sxy*sxd;
+			//tan(tilt) = |gradient|*focal/depth, skip if under tan(min_tilt)
+			if((double)(gx*gx + gy*gy)*tilt_k < (double)d0*d0*(double)det*det) continue;
+			bit[x] = (uchar)(1 << octant(gx, gy));
 		}
 	}
 	//Output feature adjustments
-	mmod_general g;
 	if(mode != "none")
-		g.SumAroundEachPixel8UC1(Icolorord,Icolorord,3,1); //Clean the features of spurious gradients
+		gen.SumAroundEachPixel8UC1(Icolorord,Icolorord,3,1); //Clean the features of spurious normals
 	if(mode == "test")
-		g.SumAroundEachPixel8UC1(Icolorord,Icolorord,ORAMT,0); //Spread features by ORing
+		gen.SumAroundEachPixel8UC1(Icolorord,Icolorord,ORAMT,0); //Spread features by ORing
+	//Check that our temporaries stayed put
+	ws.add(gray_mask);
+	gen.add_workspace(ws);
+	ws.end_frame();
+}
+
+
+////////////Shared color + gradient pipeline////////////////////////////////////
+/**
+ * \brief Compute several linemod feature images from one BGR frame, sharing the work between them.
+ *
+ * The BGR image is filtered once for all its planes, the gradient statistics of every modality are collected
+ * in one pass and all requested feature images are written in one more pass. Output is identical to running
+ * gradients::computeGradients and colorhls::computeColorHLS separately.
+ * @param Iin			Input BGR image CV_8UC3
+ * @param Mask			compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+ * @param modalities	FEAT_GRADIENTS and/or FEAT_COLORHLS
+ * @param gradfeat		Output CV_8UC1 gradient features (untouched if FEAT_GRADIENTS isn't requested, released if Iin
+ * 						isn't CV_8UC3)
+ * @param colorfeat		Output CV_8UC1 color features (untouched if FEAT_COLORHLS isn't requested, released if Iin
+ * 						isn't CV_8UC3)
+ * @param mode  		If "test", noise reduce and blur the resulting images (DEFAULT), "none": do nothing, else noise reduce for training
+ */
+void feature_pipeline::compute(const cv::Mat &Iin, const cv::Mat &Mask, int modalities, cv::Mat &gradfeat,
+		cv::Mat &colorfeat, std::string mode)
+{
+	//CHECK INPUTS
+	CALCFEAT_DEBUG_1(cout << "In feature_pipeline::compute" << endl;);
+	bool do_grad = (modalities & FEAT_GRADIENTS) != 0, do_color = (modalities & FEAT_COLORHLS) != 0;
+	if(Iin.type() != CV_8UC3)
+	{
+		cerr << "ERROR: feature_pipeline::compute input image is not of type CV_8UC3" << endl;
+		//Don't leave the last frame's features there to be taken for this one's
+		if(do_grad) gradfeat.release();
+		if(do_color) colorfeat.release();
+		return;
+	}
+	if(do_grad && (gradfeat.empty() || Iin.rows != gradfeat.rows || Iin.cols != gradfeat.cols))
+		gradfeat.create(Iin.size(),CV_8UC1);
+	if(do_color && (colorfeat.empty() || Iin.rows != colorfeat.rows || Iin.cols != colorfeat.cols))
+		colorfeat.create(Iin.size(),CV_8UC1);
+	//Every pixel of the outputs gets written below, so no need to zero them first
+	cv::Mat temp;
+	if(!mask_8UC1(Mask, Iin.size(), gray_mask, temp, "feature_pipeline::compute"))
+	{
+		if(do_grad) gradfeat = Scalar::all(0);
+		if(do_color) colorfeat = Scalar::all(0);
+		return;
+	}
+	const int rows = Iin.rows, cols = Iin.cols;
+	const int brows = std::min(BAND_ROWS + 2, rows);	//A band and its halo row each side
+	if(do_grad)
+	{
+		grad_x.create(brows, cols, CV_32FC3);
+		grad_y.create(brows, cols, CV_32FC3);
+		if(wmag.rows != rows || wmag.cols != cols)
+		{
+			wmag.create(Iin.size(),CV_32FC1);
+			wcode.create(Iin.size(),CV_8UC1);
+		}
+	}
+	if(do_color)
+	{
+		L.create(brows, cols, CV_8UC1);
+		if(lgrad.rows != rows || lgrad.cols != cols)
+			lgrad.create(Iin.size(),CV_8UC1);
+	}
+
+	//STATISTICS PASS, A BAND OF ROWS AT A TIME: each pixel's strongest gradient plane for gradients, the L gradient
+	//for color, and the sums of both for their thresholds. Both modalities read the band's BGR rows while they are in
+	//cache; they filter different images (the BGR planes, L) so there is no filter output they could share.
+	gte.clear();
+	cte.clear();
+	for(int y0 = 0; y0 < rows; y0 += BAND_ROWS)
+	{
+		const int y1 = std::min(y0 + BAND_ROWS, rows);
+		const int a = std::max(y0 - 1, 0), b = std::min(y1 + 1, rows);
+		const Mat B = Iin.rowRange(a, b);
+		if(do_grad)
+		{
+			//All three planes in one call per direction, no split. Scharr of 8U is exact in 32F. Rows outside
+			//the band are read as in the full frame.
+			Mat dx = grad_x.rowRange(0, b - a), dy = grad_y.rowRange(0, b - a);
+			Scharr( B, dx, CV_32F, 1, 0, 1, 0, BORDER_DEFAULT ); //dx
+			Scharr( B, dy, CV_32F, 0, 1, 1, 0, BORDER_DEFAULT ); //dy
+		}
+		Mat Lband;
+		if(do_color)
+		{
+			Lband = L.rowRange(0, b - a);
+			lightness_rows(B, Lband, 0, b - a);
+		}
+		for(int y = y0; y < y1; ++y)
+		{
+			if(do_grad)
+			{
+				cartToPolar(grad_x.row(y - a), grad_y.row(y - a), magrow, phaserow, true); //True => in degrees not radians
+				grad_winner_row(magrow.ptr<float>(0), phaserow.ptr<float>(0), wmag.ptr<float>(y), wcode.ptr<uchar>(y), cols);
+				gte.add(magrow.ptr<float>(0), cols, 3);
+			}
+			if(do_color)
+			{
+				lgrad_row(Lband, y - a, lgrad.ptr<uchar>(y));
+				cte.add(lgrad.ptr<uchar>(y), cols, 1);
+			}
+		}
+	}
+	float thresh[3] = {0,0,0};
+	if(do_grad)
+	{
+		for(int k = 0; k < 3; ++k)
+			thresh[k] = (float)gte.thresh(k, stdmul); //Same as computeGradients
+		CALCFEAT_DEBUG_3(cout <<"       thresh(B,G,R) ("<<thresh[0]<<", "<<thresh[1]<<", "<<thresh[2]<<")"<<endl;);
+	}
+	uchar lthresh = 0;
+	if(do_color)
+	{
+		lthresh = (uchar)cte.thresh(0, 1.1); //Same as computeColorHLS
+		CALCFEAT_DEBUG_3(cout << "color thresh = " << (int)lthresh << endl;);
+	}
+
+	//OUTPUT PASS: every requested feature image, row by row
+	for(int y = 0; y < rows; ++y)
+	{
+		const uchar *m = temp.empty() ? 0 : temp.ptr<uchar>(y);
+		if(do_grad)
+			grad_winner_bits(wmag.ptr<float>(y), wcode.ptr<uchar>(y), m, gradfeat.ptr<uchar>(y), cols, thresh);
+		if(do_color)
+			color_row(Iin.ptr<uchar>(y), lgrad.ptr<uchar>(y), m, colorfeat.ptr<uchar>(y), cols, lthresh);
+	}
+
+	//Output feature adjustments, one set of accumulators for all outputs
+	if(mode != "none")
+	{
+		if(do_grad) gen.SumAroundEachPixel8UC1(gradfeat,gradfeat,3,1); //Clean the features of spurious gradients
+		if(do_color) gen.SumAroundEachPixel8UC1(colorfeat,colorfeat,3,1);
+	}
+	if(mode == "test")
+	{
+		if(do_grad) gen.SumAroundEachPixel8UC1(gradfeat,gradfeat,ORAMT,0); //Spread features by ORing
+		if(do_color) gen.SumAroundEachPixel8UC1(colorfeat,colorfeat,ORAMT,0);
+	}
+	//Check that our temporaries stayed put
+	ws.add(grad_x); ws.add(grad_y); ws.add(magrow); ws.add(phaserow); ws.add(wmag); ws.add(wcode);
+	ws.add(L); ws.add(lgrad); ws.add(gray_mask);
+	gen.add_workspace(ws);
+	ws.end_frame();
+}
+
+
+////////////Concurrent multi-modality extraction////////////////////////////////
+#define SCHED_GRAD  0		//Modality indices inside feature_scheduler, FEAT_* == 1 << index
+#define SCHED_COLOR 1
+#define SCHED_DEPTH 2
+#define SCHED_MIN_STRIPE 32	//Don't cut images into stripes of fewer rows than this
+
+/**
+ * \brief Start the thread pool
+ * @param nthreads	Threads to extract with. 0 => one per hardware thread
+ */
+feature_scheduler::feature_scheduler(int nthreads) : pool(nthreads)
+{
+	for(int i = 0; i < 3; ++i) out[i] = 0;
+}
+
+//Cut rows into about one stripe per thread (at least SCHED_MIN_STRIPE rows each), keeping the stripe state we had
+void feature_scheduler::split_rows(int mi, int rows)
+{
+	int n = std::max(1, std::min(pool.size(), rows/SCHED_MIN_STRIPE));
+	if((int)stripes[mi].size() != n)
+		stripes[mi].resize(n);
+	for(int s = 0; s < n; ++s)
+	{
+		stripes[mi][s].y0 = (rows*s)/n;
+		stripes[mi][s].y1 = (rows*(s+1))/n;
+	}
+}
+
+//PHASE 1: Scharr/cartToPolar (with one row of halo) or lightness of a stripe
+void feature_scheduler::filter(int mi, int s)
+{
+	stripe &st = stripes[mi][s];
+	if(mi == SCHED_COLOR)
+	{
+		lightness_rows(bgr, L, st.y0, st.y1);
+		return;
+	}
+	const Mat &I = (mi == SCHED_GRAD) ? bgr : depth;
+	Mat &M = (mi == SCHED_GRAD) ? mag : dmag, &P = (mi == SCHED_GRAD) ? phase : dphase;
+	int a = std::max(st.y0 - 1, 0), b = std::min(st.y1 + 1, I.rows);
+	Scharr( I.rowRange(a, b), st.grad_x, CV_32F, 1, 0, 1, 0, BORDER_DEFAULT ); //dx
+	Scharr( I.rowRange(a, b), st.grad_y, CV_32F, 0, 1, 1, 0, BORDER_DEFAULT ); //dy
+	Mat mroi = M.rowRange(st.y0, st.y1), proi = P.rowRange(st.y0, st.y1);
+	cartToPolar(st.grad_x.rowRange(st.y0 - a, st.y1 - a), st.grad_y.rowRange(st.y0 - a, st.y1 - a), mroi, proi, true);
+}
+
+//PHASE 2: Partial threshold sums of a stripe's rows, added up by compute in stripe order. The integer L gradient
+//sums come out exact; the float magnitude sums can differ from meanStdDev's whole image order in the last bits of
+//the double, far below the float the thresholds are rounded to.
+void feature_scheduler::statistics(int mi, int s)
+{
+	stripe &st = stripes[mi][s];
+	if(mi == SCHED_COLOR)
+	{
+		st.s = st.sq = 0;
+		lgrad_rows(L, lgrad, st.y0, st.y1, st.s, st.sq);
+		return;
+	}
+	for(int k = 0; k < 3; ++k) st.ms[k] = st.msq[k] = 0;
+	mag_sums((mi == SCHED_GRAD) ? mag : dmag, st.y0, st.y1, st.ms, st.msq);
+}
+
+//PHASE 3: Binarized features of a stripe
+void feature_scheduler::binarize(int mi, int s)
+{
+	stripe &st = stripes[mi][s];
+	Mat &B = *bin[mi];
+	const Mat &msk = mask[mi];
+	for(int y = st.y0; y < st.y1; ++y)
+	{
+		const uchar *m = msk.empty() ? 0 : msk.ptr<uchar>(y);
+		if(mi == SCHED_GRAD)
+			grad_row(mag.ptr<float>(y), phase.ptr<float>(y), m, B.ptr<uchar>(y), B.cols, thresh[mi]);
+		else if(mi == SCHED_COLOR)
+			color_row(bgr.ptr<uchar>(y), lgrad.ptr<uchar>(y), m, B.ptr<uchar>(y), B.cols, cthresh);
+		else
+			depth_row(dmag.ptr<float>(y), dphase.ptr<float>(y), m, B.ptr<uchar>(y), B.cols, thresh[mi][0]);
+	}
+}
+
+//PHASE 4: Clean up and spread a stripe. Works on the stripe plus enough halo rows that the stripe's own rows come
+//out exactly as if the whole image had been done at once.
+void feature_scheduler::finish(int mi, int s)
+{
+	stripe &st = stripes[mi][s];
+	const Mat &B = *bin[mi];
+	const int halo = 2 + ORAMT/2;
+	int a = std::max(st.y0 - halo, 0), b = std::min(st.y1 + halo, B.rows);
+	B.rowRange(a, b).copyTo(st.buf);
+	gen.SumAroundEachPixel8UC1(st.buf,st.buf,3,1,st.work); //Clean the features of spurious gradients
+	if(run_mode == "test")
+		gen.SumAroundEachPixel8UC1(st.buf,st.buf,ORAMT,0,st.work); //Spread features by ORing
+	Mat oroi = out[mi]->rowRange(st.y0, st.y1);
+	st.buf.rowRange(st.y0 - a, st.y1 - a).copyTo(oroi);
+}
+
+//Queue step for every stripe of every active modality and run them all
+void feature_scheduler::run_phase(void (feature_scheduler::*step)(int, int))
+{
+	batch.clear();
+	for(int mi = 0; mi < 3; ++mi)
+	{
+		if(!out[mi]) continue;
+		int n = (int)stripes[mi].size();
+		for(int s = 0; s < n; ++s)
+			batch.push_back(boost::bind(step, this, mi, s));
+	}
+	pool.run(batch);
+}
+
+/**
+ * \brief Compute the requested linemod feature images concurrently and return them together.
+ *
+ * Each modality is cut into row stripes and the stripes of all modalities are run on the thread pool in four
+ * phases (filter, statistics, binarize, clean up and spread). Results are identical to colorhls::computeColorHLS,
+ * gradients::computeGradients and depthgrad::computeDepthGradients (the stripes' partial magnitude sums are only
+ * added in another order: a few ulps of the double sums, far below the float the thresholds are rounded to).
+ * @param Iin			Input BGR image CV_8UC3 (can be left empty if neither FEAT_GRADIENTS nor FEAT_COLORHLS is asked for)
+ * @param Depth			Input depth image CV_16UC1 (can be left empty if FEAT_DEPTHGRAD isn't asked for)
+ * @param Mask			compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok. Must match the size of the inputs used
+ * @param modalities	FEAT_GRADIENTS, FEAT_COLORHLS and/or FEAT_DEPTHGRAD
+ * @param gradfeat		Output CV_8UC1 gradient features (untouched if FEAT_GRADIENTS isn't requested)
+ * @param colorfeat		Output CV_8UC1 color features (untouched if FEAT_COLORHLS isn't requested)
+ * @param depthfeat		Output CV_8UC1 depth features (untouched if FEAT_DEPTHGRAD isn't requested)
+ * @param mode  		If "test", noise reduce and blur the resulting images (DEFAULT), "none": do nothing, else noise reduce for training
+ * @return				0 on success, -1 on bad input (outputs whose input was fine are still computed)
+ */
+int feature_scheduler::compute(const cv::Mat &Iin, const cv::Mat &Depth, const cv::Mat &Mask, int modalities,
+		cv::Mat &gradfeat, cv::Mat &colorfeat, cv::Mat &depthfeat, std::string mode)
+{
+	CALCFEAT_DEBUG_1(cout << "In feature_scheduler::compute" << endl;);
+	int ret = 0;
+	run_mode = mode;
+	bgr = Iin;
+	depth = Depth;
+	cv::Mat *feats[3] = {&gradfeat, &colorfeat, &depthfeat};
+	for(int mi = 0; mi < 3; ++mi)
+	{
+		out[mi] = 0;
+		if(!(modalities & (1 << mi))) continue;
+		const Mat &I = (mi == SCHED_DEPTH) ? depth : bgr;
+		if(I.type() != ((mi == SCHED_DEPTH) ? CV_16UC1 : CV_8UC3) || I.empty())
+		{
+			cerr << "ERROR: feature_scheduler::compute input for modality " << mi << " has the wrong type" << endl;
+			ret = -1;
+			continue;
+		}
+		Mat &F = *feats[mi];
+		if(F.empty() || I.rows != F.rows || I.cols != F.cols)
+			F.create(I.size(),CV_8UC1);
+		if(!mask_8UC1(Mask, I.size(), gray_mask[mi], mask[mi], "feature_scheduler::compute"))
+		{
+			F = Scalar::all(0);
+			ret = -1;
+			continue;
+		}
+		out[mi] = &F;
+		//"none" binarizes straight into the output, otherwise into raw for the clean up phase
+		if(mode == "none")
+			bin[mi] = &F;
+		else
+		{
+			if(raw[mi].rows != I.rows || raw[mi].cols != I.cols)
+				raw[mi].create(I.size(),CV_8UC1);
+			bin[mi] = &raw[mi];
+		}
+		split_rows(mi, I.rows);
+	}
+	//Full size intermediates, written stripe by stripe
+	if(out[SCHED_GRAD])
+	{
+		mag.create(bgr.size(), CV_32FC3);
+		phase.create(bgr.size(), CV_32FC3);
+	}
+	if(out[SCHED_COLOR])
+	{
+		L.create(bgr.size(), CV_8UC1);
+		lgrad.create(bgr.size(), CV_8UC1);
+	}
+	if(out[SCHED_DEPTH])
+	{
+		dmag.create(depth.size(), CV_32FC1);
+		dphase.create(depth.size(), CV_32FC1);
+	}
+
+	run_phase(&feature_scheduler::filter);
+	run_phase(&feature_scheduler::statistics);
+	for(int mi = 0; mi < 3; mi += 2)
+	{
+		if(!out[mi]) continue;
+		const Mat &M = (mi == SCHED_GRAD) ? mag : dmag;
+		double sum[3] = {0,0,0}, sq[3] = {0,0,0};
+		for(size_t i = 0; i < stripes[mi].size(); ++i)
+			for(int k = 0; k < 3; ++k)
+			{
+				sum[k] += stripes[mi][i].ms[k];
+				sq[k] += stripes[mi][i].msq[k];
+			}
+		for(int k = 0; k < M.channels(); ++k)
+			thresh[mi][k] = (float)mean_plus_std(sum[k], sq[k], (double)M.rows*M.cols, (mi == SCHED_GRAD) ? stdmul : stdmul2);
+	}
+	if(out[SCHED_COLOR])
+	{
+		int64 s = 0, sq = 0;
+		for(size_t i = 0; i < stripes[SCHED_COLOR].size(); ++i)
+		{
+			s += stripes[SCHED_COLOR][i].s;
+			sq += stripes[SCHED_COLOR][i].sq;
+		}
+		cthresh = (uchar)mean_plus_std((double)s, (double)sq, (double)bgr.rows*bgr.cols, 1.1);
+	}
+	run_phase(&feature_scheduler::binarize);
+	if(mode != "none")
+		run_phase(&feature_scheduler::finish);
+
+	//Check that our temporaries stayed put
+	ws.add(mag); ws.add(phase); ws.add(L); ws.add(lgrad); ws.add(dmag); ws.add(dphase);
+	for(int mi = 0; mi < 3; ++mi)
+	{
+		ws.add(raw[mi]); ws.add(gray_mask[mi]);
+		for(size_t s = 0; s < stripes[mi].size(); ++s)
+		{
+			stripe &st = stripes[mi][s];
+			ws.add(st.grad_x); ws.add(st.grad_y); ws.add(st.buf);
+			st.work.add_workspace(ws);
+		}
+	}
+	ws.end_frame();
+	//Don't hold on to the caller's images
+	bgr = Mat(); depth = Mat();
+	for(int mi = 0; mi < 3; ++mi) { mask[mi] = Mat(); out[mi] = bin[mi] = 0; }
+	return ret;
+}
+
+
+////////////Tile streaming extraction///////////////////////////////////////////
+#define STREAM_GRAD  0		//Modality indices inside feature_stream, FEAT_* == 1 << index
+#define STREAM_COLOR 1
+#ifdef FLOATLUT
+#define STREAM_RESP_TYPE CV_32FC1	//Response images hold matchLUT entries
+typedef float stream_resp_t;
+typedef float stream_lut_t;
+#else
+#define STREAM_RESP_TYPE CV_8UC1	//Integer matchLUT entries are 0 to 100
+typedef uchar stream_resp_t;
+typedef int stream_lut_t;
+#endif
+
+/**
+ * \brief Set up the streaming
+ * @param rows_per_tile		Output rows per tile. Each tile also cleans up and spreads 2 + ORAMT/2 rows either side
+ */
+feature_stream::feature_stream(int rows_per_tile) : tile_rows(std::max(rows_per_tile, 1)), win(0), bfirst(0), bend(0), goff(0)
+{
+}
+
+/**
+ * \brief Choose how the gradient thresholds are set, see THRESH_EXACT, THRESH_SUBSAMPLE and THRESH_PREVIOUS.
+ * THRESH_EXACT needs the frame's statistics before the first tile, so it reads the input twice.
+ */
+void feature_stream::setThresholdMethod(int method, int subsample)
+{
+	for(int mi = 0; mi < 2; ++mi)
+	{
+		mods[mi].te.method = method;
+		mods[mi].te.subsample = std::max(subsample,1);
+	}
+}
+
+/**
+ * \brief Compute the requested linemod feature images a tile at a time.
+ * @param Iin			Input BGR image CV_8UC3
+ * @param Mask			compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+ * @param modalities	FEAT_GRADIENTS and/or FEAT_COLORHLS
+ * @param gradfeat		Output CV_8UC1 gradient features (untouched if FEAT_GRADIENTS isn't requested)
+ * @param colorfeat		Output CV_8UC1 color features (untouched if FEAT_COLORHLS isn't requested)
+ * @param mode  		If "test", noise reduce and blur the resulting images (DEFAULT), "none": do nothing, else noise reduce for training
+ * @param respsink		If set, called with the responses of every tile of the modalities in respmodalities, while the
+ * 						tile's features are still in cache. The responses are never held for the whole frame
+ * @param respmodalities	FEAT_GRADIENTS and/or FEAT_COLORHLS (of those computed) to hand responses out for
+ * @return				0 on success, -1 on bad input
+ */
+int feature_stream::compute(const cv::Mat &Iin, const cv::Mat &Mask, int modalities, cv::Mat &gradfeat, cv::Mat &colorfeat,
+		std::string mode, const response_sink &respsink, int respmodalities)
+{
+	CALCFEAT_DEBUG_1(cout << "In feature_stream::compute" << endl;);
+	if(Iin.type() != CV_8UC3 || Iin.empty())
+	{
+		cerr << "ERROR: feature_stream::compute input image is not of type CV_8UC3" << endl;
+		return -1;
+	}
+	src.set(Iin, -1, Iin.rows);
+	run_mode = mode;
+	sink = respsink;
+	for(int mi = 0; mi < 2; ++mi) mods[mi].want_resp = !sink.empty() && (respmodalities & (1 << mi));
+	return run(Mask, modalities, gradfeat, colorfeat);
+}
+
+/**
+ * \brief compute straight from a camera image, converted to BGR a tile at a time
+ * @param Iraw			NV12 (CV_8UC1, Y plane on top of interleaved UV) or Bayer mosaic (CV_8UC1)
+ * @param code			cvtColor code from Iraw to BGR: CV_YUV2BGR_NV12, CV_BayerBG2BGR, CV_BayerGB2BGR, CV_BayerRG2BGR or CV_BayerGR2BGR
+ * Other parameters and the return value as above
+ */
+int feature_stream::compute(const cv::Mat &Iraw, int code, const cv::Mat &Mask, int modalities, cv::Mat &gradfeat,
+		cv::Mat &colorfeat, std::string mode, const response_sink &respsink, int respmodalities)
+{
+	CALCFEAT_DEBUG_1(cout << "In feature_stream::compute (camera input)" << endl;);
+	if(Iraw.empty() || src.set(Iraw, code, tile_rows + 2*(2 + ORAMT/2) + 2) < 0)
+		return -1;
+	run_mode = mode;
+	sink = respsink;
+	for(int mi = 0; mi < 2; ++mi) mods[mi].want_resp = !sink.empty() && (respmodalities & (1 << mi));
+	return run(Mask, modalities, gradfeat, colorfeat);
+}
+
+//Filter image rows [y0,y1) with a row of halo each side: Scharr for gradients, L for color
+void feature_stream::load_rows(int y0, int y1)
+{
+	const Mat &B = src.band(y0 - 1, y1 + 1);
+	goff = src.band_first();
+	if(mods[STREAM_GRAD].out)
+	{
+		//A converted band sits in a bigger buffer whose other rows must not be taken for the image's border rows
+		int border = src.in_place() ? BORDER_DEFAULT : BORDER_DEFAULT | BORDER_ISOLATED;
+		Mat dx = grad_x.rowRange(0, B.rows), dy = grad_y.rowRange(0, B.rows);
+		Scharr( B, dx, CV_32F, 1, 0, 1, 0, border ); //dx
+		Scharr( B, dy, CV_32F, 0, 1, 1, 0, border ); //dy
+	}
+	if(mods[STREAM_COLOR].out)
+	{
+		Lband = Lbuf.rowRange(0, B.rows);
+		lightness_rows(B, Lband, 0, B.rows);
+	}
 }
 
+//Add loaded image row y to the threshold sums of the modalities asked for
+void feature_stream::row_stats(int y, bool gather_grad, bool gather_color)
+{
+	if(gather_grad)
+	{
+		cartToPolar(grad_x.row(y - goff), grad_y.row(y - goff), magrow, phaserow, true); //True => in degrees not radians
+		mods[STREAM_GRAD].te.add(magrow.ptr<float>(0), src.cols, 3);
+	}
+	if(gather_color)
+	{
+		lgrad_row(Lband, y - goff, lgrow.ptr<uchar>(0));
+		mods[STREAM_COLOR].te.add(lgrow.ptr<uchar>(0), src.cols, 1);
+	}
+}
 
+//Binarized features of image rows [y0,y1) into the bin rows from bfirst on, adding to the sums of modalities that gather
+void feature_stream::binarize_rows(int y0, int y1)
+{
+	load_rows(y0, y1);
+	const int cols = src.cols;
+	for(int y = y0; y < y1; ++y)
+	{
+		const uchar *m = mask.empty() ? 0 : mask.ptr<uchar>(y);
+		modality &g = mods[STREAM_GRAD], &c = mods[STREAM_COLOR];
+		if(g.out)
+		{
+			cartToPolar(grad_x.row(y - goff), grad_y.row(y - goff), magrow, phaserow, true);
+			if(g.gather) g.te.add(magrow.ptr<float>(0), cols, 3);
+			grad_row(magrow.ptr<float>(0), phaserow.ptr<float>(0), m, g.bin.ptr<uchar>(y - bfirst), cols, g.thresh);
+		}
+		if(c.out)
+		{
+			lgrad_row(Lband, y - goff, lgrow.ptr<uchar>(0));
+			if(c.gather) c.te.add(lgrow.ptr<uchar>(0), cols, 1);
+			color_row(src.row(y), lgrow.ptr<uchar>(0), m, c.bin.ptr<uchar>(y - bfirst), cols, (uchar)c.thresh[0]);
+		}
+	}
+}
+
+//Clean up and spread the window of image rows starting at a (held in bin), then copy out rows [y0,y1) and hand
+//their responses to the sink. The window has enough halo around [y0,y1) for those rows to come out as in the whole
+//frame.
+void feature_stream::finish_tile(int mi, int y0, int y1, int a)
+{
+	modality &md = mods[mi];
+	Mat *F = &md.bin;
+	if(run_mode != "none")
+	{
+		md.bin.copyTo(md.work);
+		md.gen.SumAroundEachPixel8UC1(md.work,md.work,3,1); //Clean the features of spurious gradients
+		if(run_mode == "test")
+			md.gen.SumAroundEachPixel8UC1(md.work,md.work,ORAMT,0); //Spread features by ORing
+		F = &md.work;
+	}
+	Mat oroi = md.out->rowRange(y0, y1);
+	F->rowRange(y0 - a, y1 - a).copyTo(oroi);
+	if(!md.want_resp)
+		return;
+	//Response of each model orientation to the tile, while its features are still in cache
+	for(int y = y0; y < y1; ++y)
+	{
+		const uchar *f = F->ptr<uchar>(y - a);
+		for(int o = 0; o < 8; ++o)
+		{
+			const stream_lut_t *lut = &md.gen.matchLUT[o][0];
+			stream_resp_t *r = md.resp[o].ptr<stream_resp_t>(y - y0);
+			for(int x = 0; x < F->cols; ++x)
+				r[x] = (stream_resp_t)lut[f[x]];
+		}
+	}
+	for(int o = 0; o < 8; ++o)
+		md.resp_rows[o] = md.resp[o].rowRange(0, y1 - y0);
+	sink(1 << mi, y0, md.resp_rows);
+}
+
+//compute on the rows src hands out
+int feature_stream::run(const cv::Mat &Mask, int modalities, cv::Mat &gradfeat, cv::Mat &colorfeat)
+{
+	const int rows = src.rows, cols = src.cols;
+	const cv::Size sz(cols, rows);
+	const int halo = 2 + ORAMT/2;
+	cv::Mat *feats[2] = {&gradfeat, &colorfeat};
+	win = std::min(tile_rows + 2*halo, rows);
+	for(int mi = 0; mi < 2; ++mi)
+	{
+		modality &md = mods[mi];
+		md.out = 0;
+		if(!(modalities & (1 << mi))) { md.want_resp = false; continue; }
+		Mat &F = *feats[mi];
+		if(F.empty() || rows != F.rows || cols != F.cols)
+			F.create(sz,CV_8UC1);
+		md.out = &F;
+		if(md.bin.rows != win || md.bin.cols != cols)
+		{
+			md.bin.create(win, cols, CV_8UC1);
+			md.work.create(win, cols, CV_8UC1);
+		}
+		if(md.want_resp)
+		{
+			md.resp.resize(8);
+			md.resp_rows.resize(8);
+			for(int o = 0; o < 8; ++o)
+				md.resp[o].create(std::min(tile_rows, rows), cols, STREAM_RESP_TYPE);
+		}
+	}
+	modality &g = mods[STREAM_GRAD], &c = mods[STREAM_COLOR];
+	if(!mask_8UC1(Mask, sz, gray_mask, mask, "feature_stream::compute"))
+	{
+		for(int mi = 0; mi < 2; ++mi)
+			if(mods[mi].out) *mods[mi].out = Scalar::all(0);
+		return -1;
+	}
+	//Filter buffers hold a window's rows plus halo
+	const int lrows = std::min(win + 2, rows);
+	if(g.out)
+	{
+		grad_x.create(lrows, cols, CV_32FC3);
+		grad_y.create(lrows, cols, CV_32FC3);
+	}
+	if(c.out)
+	{
+		Lbuf.create(lrows, cols, CV_8UC1);
+		lgrow.create(1, cols, CV_8UC1);
+	}
+
+	//THRESHOLDS: from the last frame, a subsample of the rows, or a statistics pass over all rows (which recomputes
+	//the magnitudes a window at a time rather than storing them). Sums are added in meanStdDev's order.
+	double t[3] = {0,0,0};
+	bool need[2] = {false, false};
+	for(int mi = 0; mi < 2; ++mi)
+	{
+		modality &md = mods[mi];
+		if(!md.out) continue;
+		int cn = (mi == STREAM_GRAD) ? 3 : 1;
+		need[mi] = !md.te.previous(t, cn);
+		if(!need[mi])
+			for(int k = 0; k < cn; ++k) md.thresh[k] = (mi == STREAM_GRAD) ? (float)t[k] : (float)(uchar)t[k];
+		else
+			md.te.clear();
+	}
+	if(need[STREAM_GRAD] || need[STREAM_COLOR])
+	{
+		int method = (need[STREAM_GRAD] ? g : c).te.method;
+		if(method == THRESH_SUBSAMPLE)
+		{
+			for(int y = 0; y < rows; y += g.te.subsample)
+			{
+				load_rows(y, y + 1);
+				row_stats(y, need[STREAM_GRAD], need[STREAM_COLOR]);
+			}
+		}
+		else
+		{
+			for(int y0 = 0; y0 < rows; y0 += win)
+			{
+				int y1 = std::min(y0 + win, rows);
+				load_rows(y0, y1);
+				for(int y = y0; y < y1; ++y)
+					row_stats(y, need[STREAM_GRAD], need[STREAM_COLOR]);
+			}
+		}
+		if(need[STREAM_GRAD])
+			for(int k = 0; k < 3; ++k) g.thresh[k] = (float)g.te.thresh(k, stdmul); //Same as computeGradients
+		if(need[STREAM_COLOR])
+			c.thresh[0] = (uchar)c.te.thresh(0, 1.1); //Same as computeColorHLS
+	}
+	CALCFEAT_DEBUG_3(cout <<"       thresh(B,G,R) ("<<g.thresh[0]<<", "<<g.thresh[1]<<", "<<g.thresh[2]<<"), color "<<c.thresh[0]<<endl;);
+	//THRESH_PREVIOUS sums this frame as its tiles go by, unless the statistics pass already did
+	for(int mi = 0; mi < 2; ++mi)
+	{
+		modality &md = mods[mi];
+		md.gather = md.out && md.te.method == THRESH_PREVIOUS && !need[mi];
+		if(md.gather) md.te.clear();
+	}
+
+	//TILES: binarize the rows the tile's window hasn't got yet, then clean up, spread and copy out the tile.
+	//Windows are all win rows (moved in from the image's edges), so the clean up accumulators keep their size.
+	bfirst = bend = 0;
+	for(int y0 = 0; y0 < rows; y0 += tile_rows)
+	{
+		int y1 = std::min(y0 + tile_rows, rows);
+		int a = std::max(0, std::min(y0 - halo, rows - win)), b = a + win;
+		if(a > bfirst)
+		{
+			//Slide the binarized rows this window shares with the last one to the top
+			int keep = std::max(bend - a, 0);
+			for(int mi = 0; mi < 2; ++mi)
+				if(mods[mi].out && keep)
+					memmove(mods[mi].bin.ptr<uchar>(0), mods[mi].bin.ptr<uchar>(a - bfirst), (size_t)keep*cols);
+			bfirst = a;
+			bend = a + keep;
+		}
+		if(bend < b)
+		{
+			binarize_rows(bend, b);
+			bend = b;
+		}
+		for(int mi = 0; mi < 2; ++mi)
+			if(mods[mi].out)
+				finish_tile(mi, y0, y1, a);
+	}
+	if(g.out && g.te.method == THRESH_PREVIOUS)
+		g.te.keep(3, stdmul);
+	if(c.out && c.te.method == THRESH_PREVIOUS)
+		c.te.keep(1, 1.1);
+
+	//Check that our temporaries stayed put
+	ws.add(grad_x); ws.add(grad_y); ws.add(magrow); ws.add(phaserow); ws.add(Lbuf); ws.add(lgrow); ws.add(gray_mask);
+	for(int mi = 0; mi < 2; ++mi)
+	{
+		ws.add(mods[mi].bin); ws.add(mods[mi].work);
+		for(size_t o = 0; o < mods[mi].resp.size(); ++o) ws.add(mods[mi].resp[o]);
+		mods[mi].gen.add_workspace(ws);
+	}
+	src.add_workspace(ws);
+	ws.end_frame();
+	//Don't hold on to the caller's images or sink
+	mask = Mat();
+	src.set(Mat(), -1, 0);
+	sink = response_sink();
+	for(int mi = 0; mi < 2; ++mi)
+	{
+		mods[mi].out = 0;
+		mods[mi].want_resp = false;
+		for(size_t o = 0; o < mods[mi].resp_rows.size(); ++o) mods[mi].resp_rows[o] = Mat();
+	}
+	return 0;
+}
+
+
+////////////Feature pyramid/////////////////////////////////////////////////////
+//One pixel of a pooled level from the n (1 to 4) features of its block
+static inline uchar pool_block(const uchar *f, int n, int pooling)
+{
+	if(pooling == POOL_OR)
+	{
+		uchar v = 0;
+		for(int i = 0; i < n; ++i) v |= f[i];
+		return v;
+	}
+	int cnt[8] = {0,0,0,0,0,0,0,0};
+	for(int i = 0; i < n; ++i)
+		for(int b = 0; b < 8; ++b)
+			if(f[i] & (1 << b)) ++cnt[b];
+	int max = 0, maxpos = 0;
+	for(int b = 0; b < 8; ++b)
+		if(cnt[b] > max) { max = cnt[b]; maxpos = b; }
+	return max ? (uchar)(1 << maxpos) : 0;
+}
+
+//Pool fine 2x2 into coarse, sized as pyrDown sizes it (odd last rows and columns pool what they have)
+static void pool_level(const Mat &fine, Mat &coarse, int pooling)
+{
+	Size csz((fine.cols + 1)/2, (fine.rows + 1)/2);
+	if(coarse.size() != csz || coarse.type() != CV_8UC1)
+		coarse.create(csz, CV_8UC1);
+	for(int y = 0; y < csz.height; ++y)
+	{
+		const uchar *r0 = fine.ptr<uchar>(2*y);
+		const uchar *r1 = (2*y + 1 < fine.rows) ? fine.ptr<uchar>(2*y + 1) : 0;
+		uchar *c = coarse.ptr<uchar>(y);
+		for(int x = 0; x < csz.width; ++x)
+		{
+			uchar f[4];
+			int n = 0, x0 = 2*x;
+			bool x1 = x0 + 1 < fine.cols;
+			f[n++] = r0[x0];
+			if(x1) f[n++] = r0[x0+1];
+			if(r1)
+			{
+				f[n++] = r1[x0];
+				if(x1) f[n++] = r1[x0+1];
+			}
+			c[x] = pool_block(f, n, pooling);
+		}
+	}
+}
+
+//OR of the span x span window (clipped to the image) around each pixel, separably. Same as SumAroundEachPixel8UC1's
+//OR for one bit pixels, but keeps every bit of OR pooled pixels. orrow is CV_8UC1 the size of in
+static void or_spread(const Mat &in, Mat &out, Mat &orrow, int span)
+{
+	const int r = span/2, rows = in.rows, cols = in.cols;
+	if(out.size() != in.size() || out.type() != CV_8UC1)
+		out.create(in.size(), CV_8UC1);
+	for(int y = 0; y < rows; ++y)
+	{
+		const uchar *p = in.ptr<uchar>(y);
+		uchar *h = orrow.ptr<uchar>(y);
+		for(int x = 0; x < cols; ++x)
+		{
+			uchar v = 0;
+			for(int k = std::max(x - r, 0), e = std::min(x + r, cols - 1); k <= e; ++k) v |= p[k];
+			h[x] = v;
+		}
+	}
+	for(int y = 0; y < rows; ++y)
+	{
+		uchar *o = out.ptr<uchar>(y);
+		memset(o, 0, cols);
+		for(int k = std::max(y - r, 0), e = std::min(y + r, rows - 1); k <= e; ++k)
+		{
+			const uchar *h = orrow.ptr<uchar>(k);
+			for(int x = 0; x < cols; ++x) o[x] |= h[x];
+		}
+	}
+}
+
+/**
+ * \brief Build all levels of a feature pyramid from binarized features
+ * @param feat		Finest level features, CV_8UC1, as binarized by an extractor run with mode "none"
+ * @param maxlevel	Levels to make below the finest, as in buildPyramid
+ * @param pyr		Output: maxlevel+1 CV_8UC1 feature images, pyr[0] the same as the extractor run with mode
+ * @param mode  	If "test", noise reduce and blur the resulting images (DEFAULT), "none": do nothing, else noise reduce for training
+ * 					(training always pools by POOL_MAJORITY: templates are learned from one bit per pixel)
+ * @return			0 on success, -1 on bad input
+ */
+int feature_pyramid::build(const cv::Mat &feat, int maxlevel, std::vector<cv::Mat> &pyr, std::string mode)
+{
+	CALCFEAT_DEBUG_1(cout << "In feature_pyramid::build" << endl;);
+	if(feat.type() != CV_8UC1 || feat.empty() || maxlevel < 0)
+	{
+		cerr << "ERROR: feature_pyramid::build needs a CV_8UC1 feature image and maxlevel >= 0" << endl;
+		return -1;
+	}
+	pyr.resize(maxlevel + 1);
+	if((int)clean.size() != maxlevel + 1)
+		clean.resize(maxlevel + 1);
+	//Finest level: cleaned up exactly as the extractors do
+	feat.copyTo(clean[0]);
+	if(mode != "none")
+		gen.SumAroundEachPixel8UC1(clean[0],clean[0],3,1); //Clean the features of spurious gradients
+	//Coarser levels pooled from the cleaned up level above. They are not cleaned up again: majority cleanup takes one bit
+	//pixels, and the block they came from was already voted on.
+	//Templates are learned from one bit pixels, so training pools by majority whatever the pooling set
+	int pool = (mode != "test" && mode != "none") ? POOL_MAJORITY : pooling;
+	for(int l = 1; l <= maxlevel; ++l)
+		pool_level(clean[l-1], clean[l], pool);
+	if(mode == "test" && maxlevel > 0 && orrow.size() != clean[1].size())
+		orrow.create(clean[1].size(), CV_8UC1); //Biggest pooled level, the others use its top left corner
+	for(int l = 0; l <= maxlevel; ++l)
+	{
+		if(mode != "test")
+			clean[l].copyTo(pyr[l]);
+		else if(l == 0)
+		{
+			clean[0].copyTo(pyr[0]);
+			gen.SumAroundEachPixel8UC1(pyr[0],pyr[0],ORAMT,0); //Spread features by ORing
+		}
+		else
+		{
+			Mat h = orrow(Rect(0, 0, clean[l].cols, clean[l].rows));
+			or_spread(clean[l], pyr[l], h, ORAMT); //Spread, keeping all bits of pooled pixels
+		}
+	}
+	//Check that our temporaries stayed put
+	for(size_t l = 0; l < clean.size(); ++l) ws.add(clean[l]);
+	ws.add(orrow);
+	gen.add_workspace(ws);
+	ws.end_frame();
+	return 0;
+}
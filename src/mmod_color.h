@@ -42,12 +42,128 @@
 
 
 
+////////////Gradient threshold estimate//////////////////////////////////////////
+//How the extractors set their "strong gradient" threshold, mean + k*std of the gradient magnitudes
+#define THRESH_EXACT     0	//Statistics of this frame, gathered while the magnitudes are computed (DEFAULT)
+#define THRESH_SUBSAMPLE 1	//Statistics of every subsample'th row of this frame, taken first so the features need one pass
+#define THRESH_PREVIOUS  2	//Statistics of the previous frame (the first frame as THRESH_EXACT), features need one pass
+
+class thresh_estimate {
+	double s[3], sq[3];			//Per plane sums of the magnitudes added since clear()
+	double n;					//Pixels per plane added since clear()
+	double prev[3];				//Thresholds of the last frame, for THRESH_PREVIOUS
+	bool have_prev;
+public:
+	int method;					//THRESH_EXACT, THRESH_SUBSAMPLE or THRESH_PREVIOUS
+	int subsample;				//Row step for THRESH_SUBSAMPLE
+
+	thresh_estimate() : n(0), have_prev(false), method(THRESH_EXACT), subsample(8) { clear(); }
+
+	/**
+	 * \brief Start summing a new frame
+	 */
+	void clear();
+
+	/**
+	 * \brief Add a row of magnitudes, in the order meanStdDev would
+	 * @param mg	cols pixels of cn interleaved planes
+	 */
+	void add(const float *mg, int cols, int cn);
+	void add(const uchar *mg, int cols, int cn);
+
+	/**
+	 * \brief mean + nstd*std of plane k of what was added since clear(), computed as meanStdDev does
+	 */
+	double thresh(int k, double nstd) const;
+
+	/**
+	 * \brief If we are in THRESH_PREVIOUS and have seen a frame, copy its cn thresholds into t and return true
+	 */
+	bool previous(double *t, int cn) const;
+
+	/**
+	 * \brief Remember the thresholds of what was added since clear() for the next frame
+	 */
+	void keep(int cn, double nstd);
+};
+
+
+////////////Camera input////////////////////////////////////////////////////////
+/**
+ * \brief BGR rows of an input image, a band of rows at a time. BGR images are handed out in place. NV12 and Bayer
+ * mosaics are converted by cvtColor one band (plus the rows the conversion needs around it) at a time, so no full
+ * size BGR copy of a camera frame is ever made. The rows come out the same as from converting the whole frame.
+ */
+class bgr_bands {
+	cv::Mat raw;					//Image as passed in
+	int code;						//cvtColor code to BGR, -1 => raw is BGR already
+	cv::Mat packed;					//NV12 band's Y and UV rows put back together the way cvtColor takes them
+	cv::Mat bgr;					//Converted band
+	cv::Mat cur;					//Rows handed out by the last band() call (in raw or bgr)
+	int first;						//Image row of cur's row 0
+public:
+	int rows, cols;					//Image size (for NV12, that of the Y plane)
+
+	bgr_bands() : code(-1), first(0), rows(0), cols(0) {}
+
+	/**
+	 * \brief Hand out rows of I
+	 * @param I				BGR CV_8UC3 if code is -1, else CV_8UC1 NV12 (Y plane on top of interleaved UV, height*3/2 rows) or Bayer mosaic
+	 * @param cvt_code		-1, CV_YUV2BGR_NV12, CV_BayerBG2BGR, CV_BayerGB2BGR, CV_BayerRG2BGR or CV_BayerGR2BGR
+	 * @param band_rows		Most rows that will be asked for in one band() call
+	 * @return				0, or -1 (and complains) if I and cvt_code don't go together
+	 */
+	int set(const cv::Mat &I, int cvt_code, int band_rows);
+
+	/**
+	 * \brief True if the rows come straight out of the input image (so any band size is free)
+	 */
+	bool in_place() const { return code < 0; }
+
+	/**
+	 * \brief Make image rows [a,b), clipped to the image, available in BGR
+	 * @return  CV_8UC3 rows, valid until the next call. Its row 0 is image row band_first()
+	 */
+	const cv::Mat &band(int a, int b);
+	int band_first() const { return first; }
+
+	/**
+	 * \brief BGR image row y, which must be in the last band
+	 */
+	const uchar *row(int y) const { return cur.ptr<uchar>(y - first); }
+
+	void add_workspace(mmod_workspace &ws) { ws.add(packed); ws.add(bgr); }
+};
+
 ////////////COLOR HLS///////////////////////////////////////////////////////////
 class colorhls {
-	cv::Mat Itmp;
-	cv::Mat grad_x, grad_y, grad;
-	cv::Mat abs_grad_x, abs_grad_y;
+	cv::Mat Itmp;												//L of HLS (hue is only worked out near strong gradients)
+	cv::Mat Lband;												//Rows of Itmp filled by load_rows()
+	int lfirst, lend;											//Image rows [lfirst,lend) have their L gradient computable from Lband
+	cv::Mat grad;												//(|dL/dx| + |dL/dy|)/2
+	cv::Mat hbits;												//Hue bit of every pixel, kept for camera input when the threshold comes at the end
+	std::vector<cv::Mat> HLS;									//Just temp store split (debug display only)
+	cv::Mat gray_mask;											//Mask converted to 8UC1 if it came in as 8UC3
+	bgr_bands src;												//Input rows
+	thresh_estimate te;											//Strong gradient threshold
+	mmod_general gen;											//Feature clean up and spreading (keeps its accumulators)
+	mmod_workspace ws;											//Allocation check of the above
+
+	int load_rows(int y, int span);
+	void compute(cv::Mat &Icolorord, const cv::Mat &Mask, const std::string &mode);
 public:
+	colorhls() : lfirst(0), lend(0) {}
+
+	/**
+	 * \brief Calls in which our work images got new buffers, see mmod_workspace
+	 */
+	int workspace_allocations() const { return ws.allocations; }
+
+	/**
+	 * \brief Choose how the gradient threshold is set, see THRESH_EXACT, THRESH_SUBSAMPLE and THRESH_PREVIOUS
+	 */
+	void setThresholdMethod(int method, int subsample = 8) { te.method = method; te.subsample = std::max(subsample,1); }
+
 	/**
 	 * \brief Compute a color linemod feature based on Hue values near gradients
 	 * @param Iin  Input BGR image CV_8UC3
@@ -56,14 +172,59 @@ public:
 	 * @param mode  If "test", noise reduce and blur the resulting image (DEFAULT), "none": do nothing, else noise reduce for training
 	 */
 	void computeColorHLS(const cv::Mat &Iin, cv::Mat &Icolorord, const cv::Mat &Mask, std::string mode = "test");
+
+	/**
+	 * \brief computeColorHLS straight from a camera image, converted to BGR a band of rows at a time. Same result as
+	 * converting the whole frame with cvtColor first.
+	 * @param Iraw  NV12 (CV_8UC1, Y plane on top of interleaved UV) or Bayer mosaic (CV_8UC1)
+	 * @param code  cvtColor code from Iraw to BGR: CV_YUV2BGR_NV12, CV_BayerBG2BGR, CV_BayerGB2BGR, CV_BayerRG2BGR or CV_BayerGR2BGR
+	 * @param Icolorord Result image CV_8UC1
+	 * @param Mask  compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+	 * @param mode  If "test", noise reduce and blur the resulting image (DEFAULT), "none": do nothing, else noise reduce for training
+	 */
+	void computeColorHLS(const cv::Mat &Iraw, int code, cv::Mat &Icolorord, const cv::Mat &Mask, std::string mode = "test");
 };
 
 ////////////Gradients///////////////////////////////////////////////////////////
 class gradients {
-	cv::Mat mag0, phase0, mag1, phase1, mag2, phase2;			//Temp store for gradient processing
-	cv::Mat grad_x, grad_y;
-	std::vector<cv::Mat> RGB;									//Just temp store split
+	cv::Mat grad_x, grad_y;										//3 channel Scharr of the BGR image, CV_32F or CV_16S if fixed_point
+	cv::Mat magrow, phaserow;									//Magnitude and phase of the row being worked on
+	cv::Mat wmag, wcode;										//Per pixel strongest plane: its magnitude (int squared if fixed_point), and orientation bin | plane<<3
+	cv::Mat wmrow, coderow;										//Same for just one row, when the thresholds are known up front
+	int gfirst, gend;											//Image rows [gfirst,gend) have their derivatives in grad_x, grad_y
+	int goff;													//Image row of grad_x's row 0
+	cv::Mat gray_mask;											//Mask converted to 8UC1 if it came in as 8UC3
+	bgr_bands src;												//Input rows
+	thresh_estimate te;											//Per plane gradient thresholds
+	bool fixed_point;											//Integer derivatives and orientation bins
+	mmod_general gen;											//Feature clean up and spreading (keeps its accumulators)
+	mmod_workspace ws;											//Allocation check of the above
+
+	int load_rows(int y, int span);
+	void winner_row(int gy, uchar *wm, uchar *code, bool stats);
+	void winner_bits(const uchar *wm, const uchar *code, const uchar *m, uchar *bit, const float *thresh,
+			const int64 *tsq) const;
+	void compute(cv::Mat &Icolorord, const cv::Mat &Mask, const std::string &mode);
 public:
+	gradients() : gfirst(0), gend(0), goff(0), fixed_point(false) {}
+
+	/**
+	 * \brief Calls in which our work images got new buffers, see mmod_workspace
+	 */
+	int workspace_allocations() const { return ws.allocations; }
+
+	/**
+	 * \brief Choose how the gradient threshold is set, see THRESH_EXACT, THRESH_SUBSAMPLE and THRESH_PREVIOUS
+	 */
+	void setThresholdMethod(int method, int subsample = 8) { te.method = method; te.subsample = std::max(subsample,1); }
+
+	/**
+	 * \brief Compute with CV_16S derivatives and integer orientation binning instead of CV_32F planes and cartToPolar.
+	 * The strongest plane is picked and thresholded on int squared magnitudes (against the squared thresholds), so a
+	 * float magnitude is only worked out for the rows the threshold statistics are gathered from. Same features, except
+	 * that pixels within cartToPolar's angle (or float magnitude) error of a bin edge (or threshold) come out exactly.
+	 */
+	void setFixedPoint(bool on) { fixed_point = on; }
 
 	////////////////////////GRADIENT FEATURES//////////////////////////////////////////////
 	/**
@@ -75,15 +236,56 @@ public:
 	 */
 	void computeGradients(const cv::Mat &Iin, cv::Mat &Icolorord, const cv::Mat Mask, std::string mode = "test" );
 
+	/**
+	 * \brief computeGradients straight from a camera image, converted to BGR a band of rows at a time. Same result as
+	 * converting the whole frame with cvtColor first.
+	 * @param Iraw			NV12 (CV_8UC1, Y plane on top of interleaved UV) or Bayer mosaic (CV_8UC1)
+	 * @param code			cvtColor code from Iraw to BGR: CV_YUV2BGR_NV12, CV_BayerBG2BGR, CV_BayerGB2BGR, CV_BayerRG2BGR or CV_BayerGR2BGR
+	 * @param Icolorord		Output CV_8UC1 image
+	 * @param Mask			compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+	 * @param mode  If "test", noise reduce and blur the resulting image (DEFAULT), "none": do nothing, else noise reduce for training
+	 */
+	void computeGradients(const cv::Mat &Iraw, int code, cv::Mat &Icolorord, const cv::Mat Mask, std::string mode = "test" );
+
 };
 
 
 ////////////Depth Gradients/////////////////////////////////////////////////////
 class depthgrad {
-	cv::Mat mag0, phase0;			//Temp store for gradient processing
-	cv::Mat grad_x, grad_y;
+	cv::Mat grad_x, grad_y;			//CV_32F Scharr (not used if fixed_point)
+	cv::Mat magrow, phaserow;		//Magnitude and phase of the row being worked on
+	cv::Mat sqrow;					//Its int64 squared magnitudes if fixed_point (CV_64F sized: OpenCV has no 64 bit int)
+	cv::Mat bitrow;					//Orientation bits of the row, when the threshold is known up front
+	cv::Mat mag0, bit0;				//Magnitude (sqrow's if fixed_point) and orientation bit, kept when the threshold isn't known until the end
+	cv::Mat gray_mask;				//Mask converted to 8UC1 if it came in as 8UC3
+	thresh_estimate te;				//Gradient threshold
+	bool fixed_point;				//Integer derivatives (straight from the depth rows) and orientation bins
+	mmod_general gen;				//Feature clean up and spreading (keeps its accumulators)
+	mmod_workspace ws;				//Allocation check of the above
 
+	const uchar *magnitude_row(const cv::Mat &Iin, int y, uchar *bits, bool stats);
+	void threshold_row(const uchar *mg, const uchar *bits, const uchar *m, uchar *bit, int cols, float thresh,
+			int64 tsq) const;
 public:
+	depthgrad() : fixed_point(false) {}
+
+	/**
+	 * \brief Calls in which our work images got new buffers, see mmod_workspace
+	 */
+	int workspace_allocations() const { return ws.allocations; }
+
+	/**
+	 * \brief Choose how the gradient threshold is set, see THRESH_EXACT, THRESH_SUBSAMPLE and THRESH_PREVIOUS
+	 */
+	void setThresholdMethod(int method, int subsample = 8) { te.method = method; te.subsample = std::max(subsample,1); }
+
+	/**
+	 * \brief Compute the derivatives in integers a row at a time (no derivative images) and bin orientations with integer
+	 * compares instead of cartToPolar. Thresholding compares int64 squared magnitudes with the squared threshold, so a
+	 * float magnitude is only worked out for the rows the threshold statistics are gathered from. Same features, except
+	 * that pixels within cartToPolar's angle (or float magnitude) error of a bin edge (or the threshold) come out exactly.
+	 */
+	void setFixedPoint(bool on) { fixed_point = on; }
 
 	////////////////////////DEPTH FEATURES//////////////////////////////////////////////
 	//THIS IS NOT TESTED YET.  FOR INSTANCE, I MIGHT DECIDE NOT TO USE THRESHOLDS BELOW AT ALL
@@ -100,4 +302,304 @@ public:
 };
 
 
+////////////Depth Surface Normals///////////////////////////////////////////////
+class depthnormals {
+	int focal;						//Focal length in pixels of the depth image passed in (halve per pyramid level)
+	int step;						//Distance in pixels to the 8 neighbors the local plane is fit to
+	int max_difference;				//Neighbors further than this in depth (depth image units) are across a discontinuity
+	double tilt_k;					//focal^2/tan^2(min_tilt), see computeDepthNormals
+	cv::Mat gray_mask;				//Mask converted to 8UC1 if it came in as 8UC3
+	mmod_general gen;				//Feature clean up and spreading (keeps its accumulators)
+	mmod_workspace ws;				//Allocation check of the above
+
+public:
+	/**
+	 * \brief Set up the normal estimation
+	 * @param focal_length		Focal length in pixels of the depth images that will be passed in (525 for a full size Kinect frame)
+	 * @param neighbor_step		Distance in pixels to the 8 neighbors (horizontal, vertical, diagonal) each normal is fit to
+	 * @param max_depth_diff	Neighbors differing from the center by more than this (depth units, mm for Kinect) are ignored
+	 * @param min_tilt_deg		Surfaces tilted less than this from facing the camera have no reliable orientation and get no feature
+	 */
+	depthnormals(int focal_length = 525, int neighbor_step = 2, int max_depth_diff = 50, float min_tilt_deg = 10.0f);
+
+	/**
+	 * \brief Calls in which our work images got new buffers, see mmod_workspace
+	 */
+	int workspace_allocations() const { return ws.allocations; }
+
+	////////////////////////DEPTH NORMAL FEATURES//////////////////////////////////////////////
+	/**
+	 * \brief Compute linemod features from quantized surface normal orientations of a depth image (CV_16UC1)
+	 *
+	 * A plane is fit by integer least squares to the depth differences to the 8 neighbors of each pixel, skipping
+	 * neighbors with no depth or across a depth discontinuity. The direction of the normal's tilt is put into one of 8
+	 * bits with integer compares. Pixels with no depth, too few good neighbors or a surface facing the camera get 0.
+	 * One pass over the image in integer math, so this keeps up with a full VGA depth stream on one core.
+	 * Output is the usual one bit per pixel CV_8UC1 image, so it can be used as e.g. the "Depth" mode in mmod_objects.
+	 * @param Iin			Input depth image, CV_16UC1, 0 => no depth
+	 * @param Icolorord		Output CV_8UC1 of surface normal features
+	 * @param Mask			compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+	 * @param mode  		If "test", noise reduce and blur the resulting image (DEFAULT), "none": do nothing, else noise reduce for training
+	 */
+	void computeDepthNormals(const cv::Mat &Iin, cv::Mat &Icolorord, const cv::Mat Mask, std::string mode = "test");
+};
+
+
+////////////Shared color + gradient pipeline////////////////////////////////////
+//Modalities that feature_pipeline::compute can produce, OR them together
+#define FEAT_GRADIENTS 1	//Same features as gradients::computeGradients
+#define FEAT_COLORHLS  2	//Same features as colorhls::computeColorHLS
+#define FEAT_DEPTHGRAD 4	//Same features as depthgrad::computeDepthGradients (feature_scheduler only)
+
+class feature_pipeline {
+	cv::Mat grad_x, grad_y;			//3 channel Scharr of a band of rows plus one row of halo each side
+	cv::Mat magrow, phaserow;		//Magnitude and phase of the row being worked on
+	cv::Mat wmag, wcode;			//Per pixel strongest plane: its magnitude, and orientation bin | plane<<3
+	cv::Mat L;						//L of BGR->HLS for the band and its halo (hue is only worked out where color features are made)
+	cv::Mat lgrad;					//(|dL/dx| + |dL/dy|)/2, filled in the statistics pass
+	cv::Mat gray_mask;				//Mask converted to 8UC1 if it came in as 8UC3
+	thresh_estimate gte, cte;		//Gradient (per plane) and L gradient threshold sums
+	mmod_general gen;				//Feature clean up and spreading, shared by all outputs
+	mmod_workspace ws;				//Allocation check of the above
+public:
+	/**
+	 * \brief Calls in which our work images got new buffers, see mmod_workspace
+	 */
+	int workspace_allocations() const { return ws.allocations; }
+
+	/**
+	 * \brief Compute several linemod feature images from one BGR frame, sharing the work between them.
+	 *
+	 * One pass over the frame, a band of rows at a time, gathers the statistics of every modality while the band's
+	 * BGR rows are in cache, keeping only each pixel's strongest gradient plane and the L gradient at full size; one
+	 * more pass writes all requested feature images. The modalities filter different images (BGR planes vs L) so no
+	 * filter output is shared, only the input rows, the mask and the clean up. Output is identical to running
+	 * gradients::computeGradients and colorhls::computeColorHLS separately.
+	 * @param Iin			Input BGR image CV_8UC3
+	 * @param Mask			compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+	 * @param modalities	FEAT_GRADIENTS and/or FEAT_COLORHLS
+	 * @param gradfeat		Output CV_8UC1 gradient features (untouched if FEAT_GRADIENTS isn't requested, released if Iin
+	 * 						isn't CV_8UC3)
+	 * @param colorfeat		Output CV_8UC1 color features (untouched if FEAT_COLORHLS isn't requested, released if Iin
+	 * 						isn't CV_8UC3)
+	 * @param mode  		If "test", noise reduce and blur the resulting images (DEFAULT), "none": do nothing, else noise reduce for training
+	 */
+	void compute(const cv::Mat &Iin, const cv::Mat &Mask, int modalities, cv::Mat &gradfeat, cv::Mat &colorfeat,
+			std::string mode = "test");
+};
+
+
+////////////Concurrent multi-modality extraction////////////////////////////////
+class feature_scheduler {
+	struct stripe {
+		int y0, y1;						//Rows of the feature image this stripe produces
+		cv::Mat grad_x, grad_y;			//Scharr of the stripe plus one row of halo
+		cv::Mat buf;					//Features of the stripe plus halo during clean up and spreading
+		int64 s, sq;					//Partial L gradient sums (integer, so they add up exactly in any order)
+		double ms[3], msq[3];			//Partial per plane magnitude sums of the stripe's rows
+		mmod_spread_work work;			//Each stripe cleans and spreads with its own accumulators
+		stripe() : y0(0), y1(0), s(0), sq(0) { for(int k = 0; k < 3; ++k) ms[k] = msq[k] = 0; }
+	};
+	const mmod_general gen;				//Clean up and spreading, shared by the stripes (only its tables are read)
+	mmod_thread_pool pool;
+	std::vector<stripe> stripes[3];		//Per modality: gradients, color, depth
+	std::vector<boost::function<void()> > batch;
+	//This frame
+	cv::Mat bgr, depth;					//Inputs (headers only, released at the end of compute)
+	cv::Mat mask[3];					//8UC1 mask per modality, empty => everything
+	cv::Mat *out[3];					//Requested outputs, NULL if not asked for
+	cv::Mat *bin[3];					//Where the binarized features go before clean up (raw[] or out[])
+	std::string run_mode;
+	float thresh[3][3];					//Gradient magnitude thresholds per modality and plane
+	uchar cthresh;						//L gradient threshold for color
+	//Full size intermediates, kept from frame to frame
+	cv::Mat mag, phase;					//Gradients, 3 channel
+	cv::Mat L, lgrad;					//Color
+	cv::Mat dmag, dphase;				//Depth
+	cv::Mat raw[3];						//Binarized features before clean up and spreading
+	cv::Mat gray_mask[3];				//Mask converted to 8UC1 if it came in as 8UC3
+	mmod_workspace ws;					//Allocation check of all of the above
+
+	void split_rows(int mi, int rows);
+	void filter(int mi, int s);
+	void statistics(int mi, int s);
+	void binarize(int mi, int s);
+	void finish(int mi, int s);
+	void run_phase(void (feature_scheduler::*step)(int, int));
+public:
+	/**
+	 * \brief Start the thread pool
+	 * @param nthreads	Threads to extract with. 0 => one per hardware thread
+	 */
+	feature_scheduler(int nthreads = 0);
+
+	/**
+	 * \brief Calls in which our work images got new buffers, see mmod_workspace
+	 */
+	int workspace_allocations() const { return ws.allocations; }
+
+	/**
+	 * \brief Compute the requested linemod feature images concurrently and return them together.
+	 *
+	 * Each modality is cut into row stripes and the stripes of all modalities are run on the thread pool in four
+	 * phases (filter, statistics, binarize, clean up and spread), so a frame takes about as long as its slowest
+	 * modality divided by the threads. Results are identical to colorhls::computeColorHLS,
+	 * gradients::computeGradients and depthgrad::computeDepthGradients (the stripes' partial magnitude sums are only
+	 * added in another order: a few ulps of the double sums, far below the float the thresholds are rounded to).
+	 * @param Iin			Input BGR image CV_8UC3 (can be left empty if neither FEAT_GRADIENTS nor FEAT_COLORHLS is asked for)
+	 * @param Depth			Input depth image CV_16UC1 (can be left empty if FEAT_DEPTHGRAD isn't asked for)
+	 * @param Mask			compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok. Must match the size of the inputs used
+	 * @param modalities	FEAT_GRADIENTS, FEAT_COLORHLS and/or FEAT_DEPTHGRAD
+	 * @param gradfeat		Output CV_8UC1 gradient features (untouched if FEAT_GRADIENTS isn't requested)
+	 * @param colorfeat		Output CV_8UC1 color features (untouched if FEAT_COLORHLS isn't requested)
+	 * @param depthfeat		Output CV_8UC1 depth features (untouched if FEAT_DEPTHGRAD isn't requested)
+	 * @param mode  		If "test", noise reduce and blur the resulting images (DEFAULT), "none": do nothing, else noise reduce for training
+	 * @return				0 on success, -1 on bad input (outputs whose input was fine are still computed)
+	 */
+	int compute(const cv::Mat &Iin, const cv::Mat &Depth, const cv::Mat &Mask, int modalities,
+			cv::Mat &gradfeat, cv::Mat &colorfeat, cv::Mat &depthfeat, std::string mode = "test");
+};
+
+
+////////////Tile streaming extraction///////////////////////////////////////////
+/**
+ * \brief Gradient and color features made one horizontal tile at a time, from input pixels to cleaned up and spread
+ * features (and, if asked for, per orientation match responses), so a tile's intermediates stay in cache.
+ *
+ * Every input row is filtered and binarized once. Each tile is cleaned up and spread together with enough rows either
+ * side that its own rows come out exactly as if the whole frame were done at once, so the outputs are identical to
+ * gradients::computeGradients and colorhls::computeColorHLS. No temporary is more than a few tiles tall.
+ */
+class feature_stream {
+public:
+	/**
+	 * \brief Receives the responses of one tile as it is finished: for each model orientation o, resp[o] holds rows
+	 * \brief [y0, y0 + resp[o].rows) of the response image of modality (FEAT_GRADIENTS or FEAT_COLORHLS), each pixel
+	 * \brief mmod_general::matchLUT[o][feature] (CV_32FC1 with FLOATLUT, else CV_8UC1). Only valid during the call
+	 */
+	typedef boost::function<void(int modality, int y0, const std::vector<cv::Mat> &resp)> response_sink;
+private:
+	struct modality {
+		thresh_estimate te;				//Gradient threshold(s)
+		float thresh[3];				//Threshold(s) used this frame
+		bool gather;					//Add this frame's rows to te as they are binarized (THRESH_PREVIOUS)
+		cv::Mat bin;					//Binarized features (before clean up) of image rows [bfirst, bend)
+		cv::Mat work;					//Window being cleaned up and spread
+		cv::Mat *out;					//Requested output, NULL if not asked for
+		bool want_resp;					//Hand this modality's responses to the sink
+		std::vector<cv::Mat> resp;		//Responses of the tile being finished, one tile tall,
+		std::vector<cv::Mat> resp_rows;	//  and the rows of them the tile has (the last tile may be shorter)
+		mmod_general gen;				//Feature clean up and spreading (keeps its accumulators)
+		modality() : gather(false), out(0), want_resp(false) { thresh[0] = thresh[1] = thresh[2] = 0; }
+	};
+	int tile_rows;						//Output rows per tile
+	int win;							//Rows cleaned up and spread per tile: the tile and its halo, clipped to the image
+	modality mods[2];					//Gradients, color
+	int bfirst, bend;
+	bgr_bands src;						//Input rows
+	cv::Mat grad_x, grad_y;				//Scharr of the rows being binarized, plus one row of halo
+	cv::Mat magrow, phaserow;			//Magnitude and phase of one row of the above
+	cv::Mat Lbuf, Lband, lgrow;			//L of the same rows (Lband: the rows in use), L gradient of one row
+	int goff;							//Image row of grad_x's (and Lband's) row 0
+	cv::Mat gray_mask, mask;			//Mask converted to 8UC1 if it came in as 8UC3, the 8UC1 mask in use
+	std::string run_mode;
+	response_sink sink;					//Where tile responses go, empty if nobody wants them
+	mmod_workspace ws;					//Allocation check of all of the above
+
+	void load_rows(int y0, int y1);
+	void row_stats(int y, bool gather_grad, bool gather_color);
+	void binarize_rows(int y0, int y1);
+	void finish_tile(int mi, int y0, int y1, int a);
+	int run(const cv::Mat &Mask, int modalities, cv::Mat &gradfeat, cv::Mat &colorfeat);
+public:
+	/**
+	 * \brief Set up the streaming
+	 * @param rows_per_tile		Output rows per tile. Each tile also cleans up and spreads 2 + ORAMT/2 rows either side
+	 */
+	feature_stream(int rows_per_tile = 64);
+
+	/**
+	 * \brief Calls in which our work images got new buffers, see mmod_workspace
+	 */
+	int workspace_allocations() const { return ws.allocations; }
+
+	/**
+	 * \brief Choose how the gradient thresholds are set, see THRESH_EXACT, THRESH_SUBSAMPLE and THRESH_PREVIOUS.
+	 * THRESH_EXACT needs the frame's statistics before the first tile, so it reads the input twice.
+	 */
+	void setThresholdMethod(int method, int subsample = 8);
+
+	/**
+	 * \brief Compute the requested linemod feature images a tile at a time.
+	 * @param Iin			Input BGR image CV_8UC3
+	 * @param Mask			compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+	 * @param modalities	FEAT_GRADIENTS and/or FEAT_COLORHLS
+	 * @param gradfeat		Output CV_8UC1 gradient features (untouched if FEAT_GRADIENTS isn't requested)
+	 * @param colorfeat		Output CV_8UC1 color features (untouched if FEAT_COLORHLS isn't requested)
+	 * @param mode  		If "test", noise reduce and blur the resulting images (DEFAULT), "none": do nothing, else noise reduce for training
+	 * @param respsink		If set, called with the responses of every tile of the modalities in respmodalities, while the
+	 * 						tile's features are still in cache. The responses are never held for the whole frame
+	 * @param respmodalities	FEAT_GRADIENTS and/or FEAT_COLORHLS (of those computed) to hand responses out for
+	 * @return				0 on success, -1 on bad input
+	 */
+	int compute(const cv::Mat &Iin, const cv::Mat &Mask, int modalities, cv::Mat &gradfeat, cv::Mat &colorfeat,
+			std::string mode = "test", const response_sink &respsink = response_sink(),
+			int respmodalities = FEAT_GRADIENTS | FEAT_COLORHLS);
+
+	/**
+	 * \brief compute straight from a camera image, converted to BGR a tile at a time
+	 * @param Iraw			NV12 (CV_8UC1, Y plane on top of interleaved UV) or Bayer mosaic (CV_8UC1)
+	 * @param code			cvtColor code from Iraw to BGR: CV_YUV2BGR_NV12, CV_BayerBG2BGR, CV_BayerGB2BGR, CV_BayerRG2BGR or CV_BayerGR2BGR
+	 * Other parameters and the return value as above
+	 */
+	int compute(const cv::Mat &Iraw, int code, const cv::Mat &Mask, int modalities, cv::Mat &gradfeat, cv::Mat &colorfeat,
+			std::string mode = "test", const response_sink &respsink = response_sink(),
+			int respmodalities = FEAT_GRADIENTS | FEAT_COLORHLS);
+};
+
+
+////////////Feature pyramid/////////////////////////////////////////////////////
+//How feature_pyramid makes a coarse pixel from a 2x2 block of the level above
+#define POOL_OR       0	//Every orientation in the block (DEFAULT)
+#define POOL_MAJORITY 1	//The most common orientation in the block, ties to the lowest bit (one bit per pixel, like the finest level)
+
+/**
+ * \brief Coarser feature levels pooled 2x2 from the finest level's features, instead of extracting features again on
+ * every level of an image pyramid. Gradient extraction is paid for once per frame, at full scale.
+ *
+ * Levels are pooled from the cleaned up but unspread features of the level above, then each is spread by ORAMT in
+ * "test" mode, so every level is ready for the matcher. Level i is the size of buildPyramid's level i.
+ */
+class feature_pyramid {
+	std::vector<cv::Mat> clean;			//Cleaned up, unspread features of each level (what the next level is pooled from)
+	cv::Mat orrow;						//Horizontal OR pass of the spreading of pooled levels (level 1 sized)
+	int pooling;						//POOL_OR or POOL_MAJORITY
+	mmod_general gen;					//Clean up and spreading of the finest level (keeps its accumulators)
+	mmod_workspace ws;					//Allocation check of the above
+public:
+	feature_pyramid(int pool = POOL_OR) : pooling(pool) {}
+
+	/**
+	 * \brief Calls in which our work images got new buffers, see mmod_workspace
+	 */
+	int workspace_allocations() const { return ws.allocations; }
+
+	/**
+	 * \brief Choose POOL_OR or POOL_MAJORITY (of the "test" and "none" modes, see build)
+	 */
+	void setPooling(int pool) { pooling = pool; }
+
+	/**
+	 * \brief Build all levels of a feature pyramid from binarized features
+	 * @param feat		Finest level features, CV_8UC1, as binarized by an extractor run with mode "none"
+	 * @param maxlevel	Levels to make below the finest, as in buildPyramid
+	 * @param pyr		Output: maxlevel+1 CV_8UC1 feature images, pyr[0] the same as the extractor run with mode
+	 * @param mode  	If "test", noise reduce and blur the resulting images (DEFAULT), "none": do nothing, else noise reduce for training
+	 * 					(training always pools by POOL_MAJORITY: templates are learned from one bit per pixel)
+	 * @return			0 on success, -1 on bad input
+	 */
+	int build(const cv::Mat &feat, int maxlevel, std::vector<cv::Mat> &pyr, std::string mode = "test");
+};
+
+
 #endif /* MMOD_COLOR_H_ */
@@ -0,0 +1,105 @@
+// Offline model compaction: drop views that other views of the same object already cover.
+//
+// console application.
+//
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+
+#include "mmod_objects.h"
+
+using namespace cv;
+using namespace std;
+
+static void help()
+{
+	cout << "Usage: mmod_compact [-t] [-j threads] sim_thresh objects_in objects_out [filters_in filters_out]\n"
+	        "  Drops the views of each object that a kept view of the same object and mode matches above sim_thresh\n"
+	        "  (as learn_a_template with learn_thresh = sim_thresh would have), and the filter views of dropped frames.\n"
+	        "  -t          archives are text (MyMMod) instead of binary (MModPersister, ModelWriter)\n"
+	        "  -j threads  threads to match with, default one per hardware thread" << endl;
+}
+
+template<class T> static bool load(const string &name, T &t, bool text)
+{
+	ifstream ifs(name.c_str(), ios::binary);
+	if (!ifs) { cerr << "ERROR: couldn't read " << name << endl; return false; }
+	if (text) { boost::archive::text_iarchive ia(ifs); ia >> t; }
+	else { boost::archive::binary_iarchive ia(ifs); ia >> t; }
+	return true;
+}
+
+template<class T> static bool save(const string &name, const T &t, bool text)
+{
+	ofstream ofs(name.c_str(), ios::binary);
+	if (!ofs) { cerr << "ERROR: couldn't write " << name << endl; return false; }
+	if (text) { boost::archive::text_oarchive oa(ofs); oa << t; }
+	else { boost::archive::binary_oarchive oa(ofs); oa << t; }
+	return true;
+}
+
+//Views and features per mode, summed over objects
+static void count(mmod_objects &O, map<string, pair<long, long> > &c)
+{
+	c.clear();
+	for (mmod_objects::ModelsForModes::iterator mit = O.modes.begin(); mit != O.modes.end(); ++mit)
+		for (mmod_mode::ObjectModels::iterator oit = mit->second.objs.begin(); oit != mit->second.objs.end(); ++oit) {
+			pair<long, long> &vf = c[mit->first];
+			vf.first += oit->second.size();
+			for (int i = 0; i < oit->second.size(); ++i)
+				vf.second += (long)oit->second.features[i].size();
+		}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[]) {
+	bool text = false;
+	int nthreads = 0, a = 1;
+	for (; a < argc && argv[a][0] == '-'; ++a) {
+		if (!strcmp(argv[a], "-t")) text = true;
+		else if (!strcmp(argv[a], "-j") && a + 1 < argc) nthreads = atoi(argv[++a]);
+		else { help(); return -1; }
+	}
+	int nargs = argc - a;
+	if (nargs != 3 && nargs != 5) { help(); return -1; }
+	float sim_thresh = (float)atof(argv[a]);
+	string objects_in = argv[a + 1], objects_out = argv[a + 2];
+
+	mmod_objects Objs;
+	mmod_filters filt;
+	if (!load(objects_in, Objs, text)) return -1;
+	if (nargs == 5 && !load(argv[a + 3], filt, text)) return -1;
+	long filt_before = 0, filt_after = 0;
+	for (mmod_filters::ObjFilters::iterator it = filt.ObjViews.begin(); it != filt.ObjViews.end(); ++it)
+		filt_before += it->second.size();
+
+	map<string, pair<long, long> > before, after;
+	count(Objs, before);
+	double t = (double)getTickCount();
+	int dropped = Objs.compact(sim_thresh, nargs == 5 ? &filt : 0, nthreads);
+	t = ((double)getTickCount() - t) / getTickFrequency();
+	count(Objs, after);
+	for (mmod_filters::ObjFilters::iterator it = filt.ObjViews.begin(); it != filt.ObjViews.end(); ++it)
+		filt_after += it->second.size();
+
+	//REPORT: matching tries every feature of every view, so the speedup is about the ratio of features
+	printf("Compacted at sim_thresh %.3f in %.2f s, dropped %d views\n", sim_thresh, t, dropped);
+	long fb = 0, fa = 0;
+	for (map<string, pair<long, long> >::iterator it = before.begin(); it != before.end(); ++it) {
+		pair<long, long> &b = it->second, &f = after[it->first];
+		printf("  %-10s views %6ld -> %6ld (%5.1f%%), features %9ld -> %9ld\n", it->first.c_str(), b.first, f.first,
+		       b.first ? 100.0 * f.first / b.first : 100.0, b.second, f.second);
+		fb += b.second; fa += f.second;
+	}
+	if (nargs == 5)
+		printf("  filters    views %6ld -> %6ld\n", filt_before, filt_after);
+	printf("Estimated matching speedup: %.2fx\n", fa ? (double)fb / fa : 1.0);
+
+	if (!save(objects_out, Objs, text)) return -1;
+	if (nargs == 5 && !save(argv[a + 4], filt, text)) return -1;
+	return 0;
+}
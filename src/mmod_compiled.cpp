@@ -0,0 +1,1043 @@
+/*
+ * mmod_compiled.cpp
+ *
+ *  Created on: Oct 19, 2026
+ */
+#include "mmod_compiled.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace cv;
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * \brief Empty all vectors.
+ */
+void mmod_matches::clear()
+{
+	rv.clear();
+	scores.clear();
+	ids.clear();
+	frame_nums.clear();
+	modes_used.clear();
+	feature_indices.clear();
+}
+
+/**
+ *\brief  cout all matches. This function is for debug
+ *@return Total number of matches
+ */
+int mmod_matches::cout_matches() const
+{
+	for(size_t i = 0; i < rv.size(); ++i)
+		cout << ids[i] << ": score = " << scores[i] << " at R(" << rv[i].x << ", " << rv[i].y << ", " << rv[i].width
+		     << ", " << rv[i].height << ")" << endl;
+	return (int)rv.size();
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+//Views largest first; among equal sizes in learned order
+static bool larger_view(const mmod_compiled::view &a, const mmod_compiled::view &b)
+{
+	return a.count != b.count ? a.count > b.count : a.index < b.index;
+}
+
+//Filter views by frame number; among equal frames in learned order
+static bool earlier_frame(const mmod_compiled::view &a, const mmod_compiled::view &b)
+{
+	return a.frame != b.frame ? a.frame < b.frame : a.index < b.index;
+}
+
+//PACKED FEATURES: bits 0-3 matchLUT row, 4-17 x offset, 18-31 y offset (two's complement)
+#define FEAT_OFFSET_MAX 8191	//Largest |x|, |y| offset from the center a packed feature holds
+#define WORD_OFFSET_MAX ((1 << 27) - 1) //Largest |pointer offset| a layout word holds
+
+static inline uint32_t pack_feature(int code, const Point &off)
+{
+	return (uint32_t)code | (((uint32_t)off.x & 0x3fff) << 4) | ((uint32_t)off.y << 18);
+}
+static inline int feature_code(uint32_t f) { return (int)(f & 15); }
+static inline int feature_x(uint32_t f) { return (int32_t)(f << 14) >> 18; }
+static inline int feature_y(uint32_t f) { return (int32_t)f >> 18; }
+
+mmod_compiled::mmod_compiled()
+{
+	boost::shared_ptr<arrays> a(new arrays);
+	a->vrange.push_back(0);
+	a->frange.push_back(0);
+	bind(a);
+}
+
+/**
+ * \brief Compile trained models
+ *
+ * @param objs			Trained object models
+ * @param filters		Trained filters to verify recognitions with (can be NULL)
+ * @param resolutions	Image sizes to precompute feature words for. Other sizes still work, decoding offsets on the fly (slower)
+ * @param channels		Channels of the feature images at those sizes (>1 for interleave_features images)
+ */
+mmod_compiled::mmod_compiled(const mmod_objects &objs, const mmod_filters *filters,
+		const vector<Size> &resolutions, int channels)
+{
+	mmod_general g;
+	boost::shared_ptr<arrays> a(new arrays);
+
+	//IDS: modes in name order, objects learned in any mode in name order
+	set<string> names;
+	for(mmod_objects::ModelsForModes::const_iterator mit = objs.modes.begin(); mit != objs.modes.end(); ++mit)
+	{
+		modes.push_back(mit->first);
+		for(mmod_mode::ObjectModels::const_iterator oit = mit->second.objs.begin(); oit != mit->second.objs.end(); ++oit)
+			names.insert(oit->first);
+	}
+	objects.assign(names.begin(), names.end());
+
+	//VIEWS: per object, per mode, largest first
+	a->vrange.push_back(0);
+	for(size_t o = 0; o < objects.size(); ++o)
+	{
+		for(mmod_objects::ModelsForModes::const_iterator mit = objs.modes.begin(); mit != objs.modes.end(); ++mit)
+		{
+			mmod_mode::ObjectModels::const_iterator oit = mit->second.objs.find(objects[o]);
+			if(oit != mit->second.objs.end())
+				add_views(oit->second, a->views, true, g, *a);
+			a->vrange.push_back((int)a->views.size());
+		}
+	}
+
+	//FILTERS: per object, by frame number
+	if(filters)
+		filter_mode = filters->mode;
+	a->frange.push_back(0);
+	for(size_t o = 0; o < objects.size(); ++o)
+	{
+		mmod_filters::ObjFilters::const_iterator fit;
+		if(filters && (fit = filters->ObjViews.find(objects[o])) != filters->ObjViews.end())
+		{
+			size_t start = a->fviews.size();
+			add_views(fit->second, a->fviews, false, g, *a);
+			stable_sort(a->fviews.begin() + start, a->fviews.end(), earlier_frame);
+		}
+		a->frange.push_back((int)a->fviews.size());
+	}
+
+	//FEATURE WORDS for the declared resolutions
+	for(vector<Size>::const_iterator rit = resolutions.begin(); rit != resolutions.end(); ++rit)
+	{
+		layout l;
+		l.cn = channels;
+		l.step = rit->width*channels;
+		add_layout(l, *a);
+	}
+	bind(a);
+}
+
+/**
+ * \brief Append the views of f to vs (and their packed features to a), sorted largest first if by_size
+ */
+void mmod_compiled::add_views(const mmod_features &f, vector<view> &vs, bool by_size, const mmod_general &g, arrays &a)
+{
+	size_t start = vs.size();
+	for(int i = 0; i < (int)f.features.size(); ++i)
+	{
+		view v;
+		v.frame = f.frame_number[i];
+		v.index = i;
+		v.bbox = f.bbox[i];
+		v.first = (int)a.feats.size();
+		for(size_t k = 0; k < f.features[i].size(); ++k)
+		{
+			const Point &off = f.offsets[i][k];
+			if(abs(off.x) > FEAT_OFFSET_MAX || abs(off.y) > FEAT_OFFSET_MAX)
+			{
+				cerr << "ERROR, in mmod_compiled, a feature of view " << i << " of " << f.object_ID << " is (" << off.x
+				     << ", " << off.y << ") from the center, beyond " << FEAT_OFFSET_MAX << ", dropped" << endl;
+				continue;
+			}
+			a.feats.push_back(pack_feature(g.lut[f.features[i][k]], off));
+		}
+		v.count = (int)a.feats.size() - v.first;
+		v.norm = (float)v.count;
+		vs.push_back(v);
+	}
+	if(by_size)
+		stable_sort(vs.begin() + start, vs.end(), larger_view);
+}
+
+/**
+ * \brief Add the feature words of layout l to a, unless a has it already or its pointer offsets don't fit a word
+ */
+void mmod_compiled::add_layout(const layout &l, arrays &a)
+{
+	for(size_t i = 0; i < a.layouts.size(); ++i)
+		if(a.layouts[i].step == l.step && a.layouts[i].cn == l.cn) return;
+	size_t start = a.words.size();
+	for(size_t i = 0; i < a.feats.size(); ++i)
+	{
+		int poff = feature_x(a.feats[i])*l.cn + feature_y(a.feats[i])*l.step;
+		if(abs(poff) > WORD_OFFSET_MAX)
+		{
+			cerr << "ERROR, in mmod_compiled, images with row step " << l.step << " are too wide for feature words" << endl;
+			a.words.resize(start);
+			return;
+		}
+		a.words.push_back((int)((uint32_t)poff << 4) | feature_code(a.feats[i]));
+	}
+	a.layouts.push_back(l);
+}
+
+/**
+ * \brief Fill mlut from mmod_general::matchLUT
+ */
+void mmod_compiled::init_lut()
+{
+	mmod_general g;
+	mlut.assign(16*256, 0); //Rows 9-15 aren't codes: they only keep a corrupt feature word inside the table
+	for(int c = 0; c < 9; ++c)
+		for(int b = 0; b < 256; ++b)
+			mlut[c*256 + b] = g.matchLUT[c][b];
+}
+
+//Pointer to the data of v, NULL if it is empty
+template<class T> static const T *data_of(const vector<T> &v)
+{
+	return v.empty() ? 0 : &v[0];
+}
+
+/**
+ * \brief Point the arrays at a, which the model then shares
+ */
+void mmod_compiled::bind(const boost::shared_ptr<arrays> &a)
+{
+	init_lut();
+	nviews = (int)a->views.size();
+	nfviews = (int)a->fviews.size();
+	nfeatures = (int)a->feats.size();
+	nlayouts = (int)a->layouts.size();
+	vrange = data_of(a->vrange);
+	views = data_of(a->views);
+	frange = data_of(a->frange);
+	fviews = data_of(a->fviews);
+	feats = data_of(a->feats);
+	layouts = data_of(a->layouts);
+	words = data_of(a->words);
+	mapped = false;
+	backing = a;
+}
+
+/**
+ * \brief Copy the arrays out (for boost serialization)
+ */
+void mmod_compiled::copy_arrays(arrays &a) const
+{
+	a.vrange.assign(vrange, vrange + objects.size()*modes.size() + 1);
+	a.frange.assign(frange, frange + objects.size() + 1);
+	a.views.assign(views, views + nviews);
+	a.fviews.assign(fviews, fviews + nfviews);
+	a.feats.assign(feats, feats + nfeatures);
+	a.layouts.assign(layouts, layouts + nlayouts);
+	a.words.assign(words, words + nlayouts*nfeatures);
+}
+
+/**
+ * \brief ID of object name, -1 if there is no such object
+ */
+int mmod_compiled::object_id(const string &name) const
+{
+	vector<string>::const_iterator it = lower_bound(objects.begin(), objects.end(), name);
+	return (it != objects.end() && *it == name) ? (int)(it - objects.begin()) : -1;
+}
+
+/**
+ * \brief ID of mode name, -1 if there is no such mode
+ */
+int mmod_compiled::mode_id(const string &name) const
+{
+	vector<string>::const_iterator it = lower_bound(modes.begin(), modes.end(), name);
+	return (it != modes.end() && *it == name) ? (int)(it - modes.begin()) : -1;
+}
+
+/**
+ * \brief Bytes the model's arrays take (the mapped file, if mapped), for budgeting model memory
+ */
+size_t mmod_compiled::memory_bytes() const
+{
+	size_t bytes = mlut.size()*sizeof(lut_type) + (objects.size()*modes.size() + objects.size() + 2)*sizeof(int);
+	bytes += (nviews + nfviews)*sizeof(view) + nfeatures*sizeof(uint32_t);
+	bytes += nlayouts*(sizeof(layout) + nfeatures*sizeof(int));
+	for(size_t i = 0; i < objects.size(); ++i) bytes += objects[i].size();
+	for(size_t i = 0; i < modes.size(); ++i) bytes += modes[i].size();
+	return bytes;
+}
+
+/**
+ * \brief Precomputed feature words for I, NULL if I's resolution wasn't declared
+ */
+const int *mmod_compiled::layout_words(const Mat &I) const
+{
+	for(int i = 0; i < nlayouts; ++i)
+		if(layouts[i].step == (int)I.step1() && layouts[i].cn == I.channels())
+			return words + i*nfeatures;
+	return 0;
+}
+
+/**
+ * \brief Best view of object o in mode m at point p of (channel of) I, as mmod_general::match_a_patch_bruteforce
+ * @return	score of the best view, its view number (-1 if none scored) in match_index and its slot in views in
+ * 			match_view
+ */
+float mmod_compiled::match_an_object(int o, int m, const Mat &I, const int *lwords, const Point &p, int channel,
+		int &match_index, int &match_view) const
+{
+	match_index = -1;
+	match_view = -1;
+	float maxmatch = 0;
+	int r = o*(int)modes.size() + m;
+	int vbegin = vrange[r], vend = vrange[r+1];
+	if(vbegin == vend) return 0.0;
+	const int cn = I.channels(), step = (int)I.step1();
+	const int rows = I.rows, cols = I.cols;
+	Rect imgRect(0,0,cols,rows);
+	const uchar *at = I.ptr<uchar>(p.y) + p.x*cn + channel;
+	const uchar *atstart = I.ptr<uchar>(0) + channel;
+	const uchar *atend = I.ptr<uchar>(rows - 1) + (cols - 1)*cn + channel;
+	const lut_type *lut = &mlut[0];
+	for(int k = vbegin; k < vend; ++k)
+	{
+		const view &v = views[k];
+		const uint32_t *feat = feats + v.first;
+		const int *word = lwords ? lwords + v.first : 0;
+		Rect Rpatch(p.x + v.bbox.x, p.y + v.bbox.y, v.bbox.width, v.bbox.height);
+		Rect Ri = imgRect & Rpatch; //Intersection between patch and image
+		int Risize = Ri.width * Ri.height;
+		int Rpsize = Rpatch.width * Rpatch.height;
+		lut_type match = 0;
+		float norm = 0;
+		if(Risize == Rpsize) //The whole view is in the image
+		{
+			norm = v.norm;
+			if(word)
+			{
+				for(int i = 0; i < v.count; ++i)
+					match += lut[((word[i] & 15) << 8) + at[word[i] >> 4]]; //matchLUT[lut[model_uchar]][test_uchar]
+			}
+			else
+			{
+				for(int i = 0; i < v.count; ++i)
+					match += lut[(feature_code(feat[i]) << 8) + at[feature_x(feat[i])*cn + feature_y(feat[i])*step]];
+			}
+		}
+		else if(Risize >= (int)(Rpsize*0.7)) //Don't try to match too small of areas at the edge
+		{
+			int n = 0;
+			for(int i = 0; i < v.count; ++i)
+			{
+				const uchar *get = at + (word ? word[i] >> 4 : feature_x(feat[i])*cn + feature_y(feat[i])*step);
+				if((get < atstart)||(get > atend)) continue;
+				match += lut[(feature_code(feat[i]) << 8) + *get];
+				++n;
+			}
+			norm = (float)n;
+		}
+		if(0 == norm) norm = 1;
+#ifdef FLOATLUT
+		float fmatch = match/norm;
+#else
+		float fmatch = (float)match/(norm*100.0);
+#endif
+		if(fmatch > maxmatch || (fmatch == maxmatch && match_index > v.index)) //Ties go to the earliest learned view
+		{
+			maxmatch = fmatch;
+			match_index = v.index;
+			match_view = k;
+		}
+	}
+	return maxmatch;
+}
+
+/**
+ * \brief Shared by the match_all_objects: channel[k] of I[k] holds mode mode_ids[k] (-1 => not in the model)
+ */
+int mmod_compiled::match_all(const vector<const Mat *> &I, const vector<int> &channel,
+		const vector<string> &mode_names, const Mat &Mask, float match_threshold, float frac_overlap,
+		int skipX, int skipY, mmod_matches &matches, int *rawmatches) const
+{
+	matches.clear();
+	//Modes we have, with their image, channel and feature words
+	vector<int> mids, chans;
+	vector<const Mat *> imgs;
+	vector<const int *> lwords;
+	for(size_t k = 0; k < mode_names.size(); ++k)
+	{
+		int m = mode_id(mode_names[k]);
+		if(m < 0) continue;
+		matches.modes_used.push_back(mode_names[k]);
+		mids.push_back(m);
+		imgs.push_back(I[k]);
+		chans.push_back(channel[k]);
+		lwords.push_back(layout_words(*I[k]));
+	}
+	float norm = (float)mode_names.size();
+	int rows = I[0]->rows, cols = I[0]->cols;
+	Rect R;
+	int frame_number = 0;
+	vector<int> match_indices;
+	for(int y = 0; y < rows; y += skipY)
+	{
+		const uchar *msk = Mask.empty() ? 0 : Mask.ptr<uchar>(y);
+		for(int x = 0; x < cols; x += skipX)
+		{
+			if(msk && !msk[x]) continue; //Mask doesn't cover this point
+			Point pp(x, y);
+			for(int o = 0; o < (int)objects.size(); ++o)
+			{
+				if(!first_mode_object(o)) continue; //mmod_objects only matches the first mode's objects
+				float score = 0.0;
+				match_indices.clear();
+				for(size_t k = 0; k < mids.size(); ++k)
+				{
+					int match_index, match_view;
+					score += match_an_object(o, mids[k], *imgs[k], lwords[k], pp, chans[k], match_index, match_view);
+					match_indices.push_back(match_index);
+					if(match_view >= 0) //Bounding box and frame of the matching view (the last mode's, as mmod_objects)
+					{
+						R = views[match_view].bbox;
+						frame_number = views[match_view].frame;
+					}
+				}
+				score /= norm; //Normalize by number of modes
+				if(score > match_threshold) //If we have a match, enter it as a contender
+				{
+					matches.rv.push_back(Rect(R.x + x, R.y + y, R.width, R.height));
+					matches.scores.push_back(score);
+					matches.ids.push_back(objects[o]);
+					matches.frame_nums.push_back(frame_number);
+					matches.feature_indices.push_back(match_indices);
+				}
+			}
+		}
+	}
+	if(rawmatches)
+		*rawmatches = (int)matches.rv.size();
+	mmod_general g;
+	return g.nonMaxRectSuppress(matches.rv, matches.scores, matches.ids, matches.frame_nums, matches.feature_indices,
+			frac_overlap);
+}
+
+/**
+ * \brief mmod_objects::match_all_objects on the compiled model. Same parameters, same results (into matches)
+ *
+ * @param I					For each mode, Feature image of uchar bytes where only one or zero bits are on.
+ * @param mode_names		List of names of the modes of the above features
+ * @param Mask				Mask of where to search. If empty, search the whole image. If not empty, it must be CV_8UC1 with same size as I
+ * @param match_threshold	Matches have to be above this score [0,1] to be considered a match
+ * @param frac_overlap		the fraction of overlap between 2 above threshold feature's bounding box rectangles that constitutes overlap
+ * @param skipX				In the search, jump over this many pixels X
+ * @param skipY				In the search, jump over this many pixels Y
+ * @param matches			Output: non-max suppressed recognitions
+ * @param rawmatches		If set, fill this with the total number of matches before non-max suppression.
+ * @return					Number of surviving non-max suppressed object matches, -1 on bad input
+ */
+int mmod_compiled::match_all_objects(const vector<Mat> &I, const vector<string> &mode_names, const Mat &Mask,
+		float match_threshold, float frac_overlap, int skipX, int skipY, mmod_matches &matches, int *rawmatches) const
+{
+	matches.clear();
+	if(I.empty() || I.size() != mode_names.size())
+	{
+		cerr << "ERROR, in mmod_compiled::match_all_objects, " << I.size() << " feature images for "
+		     << mode_names.size() << " modes." << endl;
+		return -1;
+	}
+	vector<const Mat *> imgs;
+	for(size_t k = 0; k < I.size(); ++k)
+	{
+		if(I[k].type() != CV_8UC1 || I[k].size() != I[0].size() || (!Mask.empty() && I[k].size() != Mask.size()))
+		{
+			cerr << "ERROR in mmod_compiled::match_all_objects: I[" << mode_names[k] << "] is not CV_8UC1 of the size of "
+			     << "the other feature images (and Mask)" << endl;
+			return -1;
+		}
+		imgs.push_back(&I[k]);
+	}
+	if(!Mask.empty() && Mask.type() != CV_8UC1)
+	{
+		cerr << "ERROR in mmod_compiled::match_all_objects: Mask must be CV_8UC1" << endl;
+		return -1;
+	}
+	return match_all(imgs, vector<int>(I.size(), 0), mode_names, Mask, match_threshold, frac_overlap, skipX, skipY,
+			matches, rawmatches);
+}
+
+/**
+ * \brief match_all_objects on an interleaved feature image (see mmod_general::interleave_features),
+ * \brief channel i holding the features of mode_names[i]. Other parameters as above
+ */
+int mmod_compiled::match_all_objects(const Mat &Ifeat, const vector<string> &mode_names, const Mat &Mask,
+		float match_threshold, float frac_overlap, int skipX, int skipY, mmod_matches &matches, int *rawmatches) const
+{
+	matches.clear();
+	if(Ifeat.empty() || Ifeat.depth() != CV_8U || Ifeat.channels() != (int)mode_names.size())
+	{
+		cerr << "ERROR, in mmod_compiled::match_all_objects, interleaved feature image is empty, not 8U or has "
+		     << Ifeat.channels() << " channels for " << mode_names.size() << " modes." << endl;
+		return -1;
+	}
+	if(!Mask.empty() && (Mask.size() != Ifeat.size() || Mask.type() != CV_8UC1))
+	{
+		cerr << "ERROR in mmod_compiled::match_all_objects: Mask must be CV_8UC1 of the size of the feature image" << endl;
+		return -1;
+	}
+	vector<int> chans;
+	for(int c = 0; c < (int)mode_names.size(); ++c)
+		chans.push_back(c);
+	return match_all(vector<const Mat *>(mode_names.size(), &Ifeat), chans, mode_names, Mask, match_threshold,
+			frac_overlap, skipX, skipY, matches, rawmatches);
+}
+
+/**
+ * \brief mmod_objects::match_all_objects_at_a_point on the compiled model, results into matches (no non-max suppression)
+ * @return	Number of object matches above match_threshold
+ */
+int mmod_compiled::match_all_objects_at_a_point(const vector<Mat> &I, const vector<string> &mode_names,
+		const Point &pp, float match_threshold, mmod_matches &matches) const
+{
+	matches.clear();
+	vector<int> mids;
+	vector<const int *> lwords;
+	for(size_t k = 0; k < mode_names.size() && k < I.size(); ++k)
+	{
+		int m = mode_id(mode_names[k]);
+		mids.push_back(m);
+		lwords.push_back(m < 0 ? 0 : layout_words(I[k]));
+		if(m >= 0) matches.modes_used.push_back(mode_names[k]);
+	}
+	float norm = (float)I.size();
+	Rect R;
+	int frame_number = 0;
+	vector<int> match_indices;
+	for(int o = 0; o < (int)objects.size(); ++o)
+	{
+		if(!first_mode_object(o)) continue; //As match_all
+		float score = 0.0;
+		match_indices.clear();
+		for(size_t k = 0; k < mids.size(); ++k)
+		{
+			if(mids[k] < 0) continue;
+			int match_index, match_view;
+			score += match_an_object(o, mids[k], I[k], lwords[k], pp, 0, match_index, match_view);
+			match_indices.push_back(match_index);
+			if(match_view >= 0)
+			{
+				R = views[match_view].bbox;
+				frame_number = views[match_view].frame;
+			}
+		}
+		score /= norm; //Normalize by number of modes
+		if(score > match_threshold)
+		{
+			matches.rv.push_back(Rect(R.x + R.width / 2, R.y + R.height / 2, R.width, R.height));
+			matches.scores.push_back(score);
+			matches.ids.push_back(objects[o]);
+			matches.frame_nums.push_back(frame_number);
+			matches.feature_indices.push_back(match_indices);
+		}
+	}
+	return (int)matches.rv.size();
+}
+
+/**
+ * \brief Score of filter view v with its center at the center of R, as mmod_general::match_one_feature
+ */
+float mmod_compiled::match_filter_view(const view &v, const Mat &I, const Rect &R) const
+{
+	Point p(R.x + R.width/2, R.y + R.height/2);
+	int rows = I.rows, cols = I.cols;
+	Rect Ri = Rect(0,0,cols,rows) & R; //Intersection between the recognition and image
+	int Risize = Ri.width * Ri.height;
+	int Rpsize = R.width * R.height;
+	const uint32_t *feat = feats + v.first;
+	const lut_type *lut = &mlut[0];
+	lut_type match = 0;
+	float norm = 0;
+	if(Risize == Rpsize)
+	{
+		norm = v.norm;
+		for(int i = 0; i < v.count; ++i)
+			match += lut[(feature_code(feat[i]) << 8) + I.at<uchar>(p.y + feature_y(feat[i]), p.x + feature_x(feat[i]))];
+	}
+	else if(Risize >= (int)(Rpsize*0.7)) //Don't try to match too small of areas at the edge
+	{
+		int n = 0;
+		for(int i = 0; i < v.count; ++i)
+		{
+			int xx = p.x + feature_x(feat[i]), yy = p.y + feature_y(feat[i]);
+			if((xx < 0)||(xx >= cols)||(yy < 0)||(yy >= rows)) continue;
+			match += lut[(feature_code(feat[i]) << 8) + I.at<uchar>(yy,xx)];
+			++n;
+		}
+		norm = (float)n;
+	}
+	if(0 == norm) norm = 1;
+#ifdef FLOATLUT
+	return match/norm;
+#else
+	return (float)match/(norm*100.0);
+#endif
+}
+
+/**
+ * \brief mmod_filters::filter_object_recognitions on the compiled filters: drop the matches whose filter view
+ * \brief scores below thresh at the match. Does nothing if compiled without filters
+ * @param filt_features		8UC1 binarized feature image of the filters' mode
+ * @param matches			Recognitions to filter
+ * @param thresh			The matching threshold for the filter
+ * @return					Number of remaining matches
+ */
+int mmod_compiled::filter_object_recognitions(const Mat &filt_features, mmod_matches &matches, float thresh) const
+{
+	if(filter_mode.empty()) return (int)matches.rv.size();
+	size_t kept = 0;
+	for(size_t i = 0; i < matches.rv.size(); ++i)
+	{
+		float fscore = 0.0; //No filter views for this object
+		int o = object_id(matches.ids[i]);
+		if(o >= 0 && frange[o] < frange[o+1])
+		{
+			fscore = -1; //No filter view for this frame
+			view key;
+			key.frame = matches.frame_nums[i];
+			key.index = -1;
+			const view *it = lower_bound(fviews + frange[o], fviews + frange[o+1], key, earlier_frame);
+			for(; it != fviews + frange[o+1] && it->frame == key.frame; ++it)
+			{
+				float score = match_filter_view(*it, filt_features, matches.rv[i]);
+				if(fscore < score) fscore = score;
+			}
+		}
+		if(fscore < thresh) continue; //Too low
+		matches.rv[kept] = matches.rv[i];
+		matches.scores[kept] = matches.scores[i];
+		matches.ids[kept] = matches.ids[i];
+		matches.frame_nums[kept] = matches.frame_nums[i];
+		matches.feature_indices[kept] = matches.feature_indices[i];
+		++kept;
+	}
+	matches.rv.resize(kept);
+	matches.scores.resize(kept);
+	matches.ids.resize(kept);
+	matches.frame_nums.resize(kept);
+	matches.feature_indices.resize(kept);
+	return (int)kept;
+}
+
+/**
+ *\brief  Draw matches (mmod_objects::draw_matches). This function is for visualization
+ * @param I   		Image you want to draw onto, must be CV_8UC3.
+ * @param matches	Recognitions of this model
+ * @param o   		Offset for drawing
+ */
+void mmod_compiled::draw_matches(Mat &I, const mmod_matches &matches, Point o) const
+{
+	int fontFace = FONT_HERSHEY_SCRIPT_SIMPLEX;
+	int len = matches.rv.empty() ? 1 : (int)matches.rv.size();
+	int Dcolor = 150 / len;
+	Scalar color(255, 255, 255);
+	int num_modes = matches.modes_used.empty() ? 1 : (int)matches.modes_used.size();
+	int dmode = 150 / num_modes;
+	for(size_t i = 0; i < matches.rv.size(); ++i)
+	{
+		color[i % 3] -= Dcolor; //Provide changing color
+		Rect R(matches.rv[i].x + o.x, matches.rv[i].y + o.y, matches.rv[i].width, matches.rv[i].height);
+		int cx = R.x + R.width / 2, cy = R.y + R.height / 2;
+		rectangle(I, R, color);
+		stringstream ss;
+		ss << matches.scores[i];
+		putText(I, matches.ids[i], Point(R.x, R.y - 2), fontFace, 0.3, color, 1, 8); //Object ID, and then score
+		putText(I, ss.str(), Point(R.x + 1, R.y + R.height / 2), fontFace, 0.2, color, 1, 8);
+		//DRAW THE MATCHING VIEWS' FEATURES
+		int obj = object_id(matches.ids[i]);
+		for(size_t k = 0; obj >= 0 && k < matches.modes_used.size(); ++k)
+		{
+			int m = mode_id(matches.modes_used[k]);
+			int r = obj*(int)modes.size() + m;
+			for(int v = vrange[r]; v < vrange[r+1]; ++v)
+			{
+				if(views[v].index != matches.feature_indices[i][k]) continue;
+				for(int f = views[v].first; f < views[v].first + views[v].count; ++f)
+				{
+					int Y = feature_y(feats[f]) + cy, X = feature_x(feats[f]) + cx;
+					if(Y < 0 || Y >= I.rows || X < 0 || X >= I.cols) continue;
+					I.at<Vec3b>(Y,X)[1] = 255 - k * dmode; //draw in decreasing color for each mode
+				}
+				break;
+			}
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+// MODEL FILE FORMAT (write_binary, read_binary). All numbers are little endian 32 bit unless noted, and every
+// section starts MMOD_MODEL_ALIGN aligned, so that once the file is mapped the matcher uses the arrays in place:
+//   header    magic[8] MMOD_MODEL_MAGIC, version, header bytes, #objects, #modes, #views, #filter views, #features,
+//             #layouts, string bytes, reserved, 64 bit file bytes, 2 reserved (64 bytes)
+//   strings   objects, modes, then the filter mode: each a length and its characters
+//   vrange    #objects*#modes + 1
+//   frange    #objects + 1
+//   views     #views views: frame, index, bbox x, y, width, height, first, count, float norm
+//   fviews    #filter views views
+//   feats     #features packed features: matchLUT row | x << 4 | y << 18
+//   layouts   #layouts (step, cn)
+//   words     #layouts*#features feature words: (x*cn + y*step) << 4 | matchLUT row
+// Version 1 files (still read, by copying them in) had unpacked features instead of feats and words:
+//   offsets (#features (x, y)) before layouts, then poffs (#layouts*#features x*cn + y*step), codes (#features bytes)
+#define MMOD_MODEL_MAGIC "MMODMDL"
+#define MMOD_MODEL_VERSION 2
+#define MMOD_MODEL_HEADER 64
+#define MMOD_MODEL_ALIGN 16
+#define MMOD_VIEW_WORDS 9
+enum { SEC_STRINGS, SEC_VRANGE, SEC_FRANGE, SEC_VIEWS, SEC_FVIEWS, SEC_FEATS, SEC_OFFSETS, SEC_LAYOUTS, SEC_WORDS,
+	SEC_POFFS, SEC_CODES, NUM_SECTIONS }; //Sections of all versions, empty in the versions that don't have them
+enum { H_VERSION = 2, H_HEADER, H_OBJECTS, H_MODES, H_VIEWS, H_FVIEWS, H_FEATURES, H_LAYOUTS, H_STRINGS, H_RESERVED,
+	H_FILE_LO, H_FILE_HI };
+
+static void put32(uchar *p, uint32_t v)
+{
+	p[0] = (uchar)v; p[1] = (uchar)(v >> 8); p[2] = (uchar)(v >> 16); p[3] = (uchar)(v >> 24);
+}
+
+static uint32_t get32(const uchar *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void write_view(uchar *p, const mmod_compiled::view &v)
+{
+	uint32_t norm;
+	memcpy(&norm, &v.norm, 4);
+	int w[MMOD_VIEW_WORDS] = {v.frame, v.index, v.bbox.x, v.bbox.y, v.bbox.width, v.bbox.height, v.first, v.count, 0};
+	for(int i = 0; i < MMOD_VIEW_WORDS - 1; ++i)
+		put32(p + 4*i, (uint32_t)w[i]);
+	put32(p + 4*(MMOD_VIEW_WORDS - 1), norm);
+}
+
+static mmod_compiled::view read_view(const uchar *p)
+{
+	mmod_compiled::view v;
+	v.frame = (int)get32(p); v.index = (int)get32(p + 4);
+	v.bbox = Rect((int)get32(p + 8), (int)get32(p + 12), (int)get32(p + 16), (int)get32(p + 20));
+	v.first = (int)get32(p + 24); v.count = (int)get32(p + 28);
+	uint32_t norm = get32(p + 32);
+	memcpy(&v.norm, &norm, 4);
+	return v;
+}
+
+//Where each section starts (and, at NUM_SECTIONS, where the file ends) for the version and counts in header h
+static void section_offsets(const uint32_t *h, uint64_t off[NUM_SECTIONS + 1])
+{
+	uint64_t nobj = h[H_OBJECTS], nfeat = h[H_FEATURES];
+	bool v1 = h[H_VERSION] == 1;
+	uint64_t bytes[NUM_SECTIONS];
+	bytes[SEC_STRINGS] = h[H_STRINGS];
+	bytes[SEC_VRANGE] = 4*(nobj*h[H_MODES] + 1);
+	bytes[SEC_FRANGE] = 4*(nobj + 1);
+	bytes[SEC_VIEWS] = 4*MMOD_VIEW_WORDS*(uint64_t)h[H_VIEWS];
+	bytes[SEC_FVIEWS] = 4*MMOD_VIEW_WORDS*(uint64_t)h[H_FVIEWS];
+	bytes[SEC_FEATS] = v1 ? 0 : 4*nfeat;
+	bytes[SEC_OFFSETS] = v1 ? 8*nfeat : 0;
+	bytes[SEC_LAYOUTS] = 8*(uint64_t)h[H_LAYOUTS];
+	bytes[SEC_WORDS] = v1 ? 0 : 4*nfeat*h[H_LAYOUTS];
+	bytes[SEC_POFFS] = v1 ? 4*nfeat*h[H_LAYOUTS] : 0;
+	bytes[SEC_CODES] = v1 ? nfeat : 0;
+	off[0] = MMOD_MODEL_HEADER;
+	for(int s = 0; s < NUM_SECTIONS; ++s)
+	{
+		uint64_t end = off[s] + bytes[s];
+		off[s+1] = (s + 1 < NUM_SECTIONS) ? (end + MMOD_MODEL_ALIGN - 1)/MMOD_MODEL_ALIGN*MMOD_MODEL_ALIGN : end;
+	}
+}
+
+static bool host_little_endian()
+{
+	const uint32_t one = 1;
+	return *(const uchar *)&one == 1;
+}
+
+/**
+ * \brief Write the model as a model file (MMOD_MODEL_MAGIC, see mmod_compiled.cpp) that read_binary can map
+ * @param filename	File to write
+ * @return			Bytes written, -1 on error
+ */
+long mmod_compiled::write_binary(const string &filename) const
+{
+	uint32_t h[MMOD_MODEL_HEADER/4];
+	memset(h, 0, sizeof(h));
+	memcpy(h, MMOD_MODEL_MAGIC, 8);
+	vector<const string *> strs;
+	for(size_t i = 0; i < objects.size(); ++i) strs.push_back(&objects[i]);
+	for(size_t i = 0; i < modes.size(); ++i) strs.push_back(&modes[i]);
+	strs.push_back(&filter_mode);
+	uint32_t string_bytes = 0;
+	for(size_t i = 0; i < strs.size(); ++i)
+		string_bytes += 4 + (uint32_t)strs[i]->size();
+	h[H_VERSION] = MMOD_MODEL_VERSION;
+	h[H_HEADER] = MMOD_MODEL_HEADER;
+	h[H_OBJECTS] = (uint32_t)objects.size();
+	h[H_MODES] = (uint32_t)modes.size();
+	h[H_VIEWS] = nviews;
+	h[H_FVIEWS] = nfviews;
+	h[H_FEATURES] = nfeatures;
+	h[H_LAYOUTS] = nlayouts;
+	h[H_STRINGS] = string_bytes;
+	uint64_t off[NUM_SECTIONS + 1];
+	section_offsets(h, off);
+	h[H_FILE_LO] = (uint32_t)off[NUM_SECTIONS];
+	h[H_FILE_HI] = (uint32_t)(off[NUM_SECTIONS] >> 32);
+
+	vector<uchar> buf((size_t)off[NUM_SECTIONS], 0);
+	uchar *b = &buf[0];
+	memcpy(b, h, 8);
+	for(int i = 2; i < MMOD_MODEL_HEADER/4; ++i)
+		put32(b + 4*i, h[i]);
+	uchar *p = b + off[SEC_STRINGS];
+	for(size_t i = 0; i < strs.size(); ++i)
+	{
+		put32(p, (uint32_t)strs[i]->size());
+		memcpy(p + 4, strs[i]->data(), strs[i]->size());
+		p += 4 + strs[i]->size();
+	}
+	for(size_t i = 0; i < objects.size()*modes.size() + 1; ++i)
+		put32(b + off[SEC_VRANGE] + 4*i, (uint32_t)vrange[i]);
+	for(size_t i = 0; i < objects.size() + 1; ++i)
+		put32(b + off[SEC_FRANGE] + 4*i, (uint32_t)frange[i]);
+	for(int i = 0; i < nviews; ++i)
+		write_view(b + off[SEC_VIEWS] + 4*MMOD_VIEW_WORDS*i, views[i]);
+	for(int i = 0; i < nfviews; ++i)
+		write_view(b + off[SEC_FVIEWS] + 4*MMOD_VIEW_WORDS*i, fviews[i]);
+	for(int i = 0; i < nfeatures; ++i)
+		put32(b + off[SEC_FEATS] + 4*i, feats[i]);
+	for(int i = 0; i < nlayouts; ++i)
+	{
+		put32(b + off[SEC_LAYOUTS] + 8*i, (uint32_t)layouts[i].step);
+		put32(b + off[SEC_LAYOUTS] + 8*i + 4, (uint32_t)layouts[i].cn);
+	}
+	for(long i = 0; i < (long)nlayouts*nfeatures; ++i)
+		put32(b + off[SEC_WORDS] + 4*i, (uint32_t)words[i]);
+
+	ofstream ofs(filename.c_str(), ios::binary);
+	if(!ofs || !ofs.write((const char *)b, buf.size()))
+	{
+		cerr << "ERROR, in mmod_compiled::write_binary, couldn't write " << filename << endl;
+		return -1;
+	}
+	return (long)buf.size();
+}
+
+//A read only mapping of a whole file, unmapped when the last model using it goes
+struct mmod_mapped_file
+{
+	void *addr;
+	size_t len;
+	mmod_mapped_file() : addr(MAP_FAILED), len(0) {}
+	~mmod_mapped_file() { if(addr != MAP_FAILED) munmap(addr, len); }
+};
+
+//Ranges increasing from 0 to last, views' features inside the feature arrays and, as the matchers take for granted
+//once a view's bbox is inside the image, their offsets inside the view's bbox
+static bool valid_model(const int *range, size_t nrange, int last, const mmod_compiled::view *v, int nv,
+		const uint32_t *feats, int nfeat)
+{
+	if(range[0] != 0 || range[nrange - 1] != last) return false;
+	for(size_t i = 1; i < nrange; ++i)
+		if(range[i] < range[i-1]) return false;
+	for(int i = 0; i < nv; ++i)
+	{
+		if(v[i].first < 0 || v[i].count < 0 || v[i].first > nfeat - v[i].count) return false;
+		const cv::Rect &bb = v[i].bbox;
+		if(bb.width < 0 || bb.height < 0) return false;
+		for(int k = v[i].first; k < v[i].first + v[i].count; ++k)
+		{
+			int x = feature_x(feats[k]), y = feature_y(feats[k]);
+			if(x < bb.x || y < bb.y || (int64)x >= (int64)bb.x + bb.width || (int64)y >= (int64)bb.y + bb.height)
+				return false;
+		}
+	}
+	return true;
+}
+
+//Features are matchLUT rows, layouts are image geometries and every layout word is the one its feature makes
+//(a word is dereferenced unchecked, so one the features don't vouch for could point anywhere). This reads all the
+//words once per load; matching reads them anyway. mlut has a row for each of the 16 codes a word can hold
+static bool valid_features(const uint32_t *feats, int nfeat, const mmod_compiled::layout *ly, int nlay,
+		const int *words)
+{
+	for(int i = 0; i < nfeat; ++i)
+		if(feature_code(feats[i]) >= 9) return false;
+	for(int l = 0; l < nlay; ++l)
+	{
+		if(ly[l].cn < 1 || ly[l].step < ly[l].cn) return false;
+		const int *w = words + (long)l*nfeat;
+		for(int i = 0; i < nfeat; ++i)
+		{
+			int64 poff = (int64)feature_x(feats[i])*ly[l].cn + (int64)feature_y(feats[i])*ly[l].step;
+			if(poff > WORD_OFFSET_MAX || poff < -WORD_OFFSET_MAX ||
+					w[i] != ((int)((uint32_t)poff << 4) | feature_code(feats[i])))
+				return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * \brief Replace this model by the model file written by write_binary. The file is mmap'd and matched in place:
+ * \brief nothing is allocated per view or feature (on a big endian host, or for an older version file, it is copied in)
+ * @param filename	Model file to map
+ * @return			Number of objects, -1 on error (the model is left unchanged)
+ */
+int mmod_compiled::read_binary(const string &filename)
+{
+	boost::shared_ptr<mmod_mapped_file> mf(new mmod_mapped_file);
+	int fd = open(filename.c_str(), O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0 || st.st_size < MMOD_MODEL_HEADER)
+	{
+		cerr << "ERROR, in mmod_compiled::read_binary, couldn't read " << filename << endl;
+		if(fd >= 0) close(fd);
+		return -1;
+	}
+	mf->len = (size_t)st.st_size;
+	mf->addr = mmap(0, mf->len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mf->addr == MAP_FAILED)
+	{
+		cerr << "ERROR, in mmod_compiled::read_binary, couldn't map " << filename << endl;
+		return -1;
+	}
+	const uchar *b = (const uchar *)mf->addr;
+
+	//HEADER
+	uint32_t h[MMOD_MODEL_HEADER/4];
+	for(int i = 0; i < MMOD_MODEL_HEADER/4; ++i)
+		h[i] = get32(b + 4*i);
+	if(memcmp(b, MMOD_MODEL_MAGIC, 8) != 0)
+	{
+		cerr << "ERROR, in mmod_compiled::read_binary, " << filename << " is not an mmod model file" << endl;
+		return -1;
+	}
+	if(h[H_VERSION] < 1 || h[H_VERSION] > MMOD_MODEL_VERSION || h[H_HEADER] != MMOD_MODEL_HEADER)
+	{
+		cerr << "ERROR, in mmod_compiled::read_binary, " << filename << " is model file version " << h[H_VERSION]
+		     << ", this reads versions 1 to " << MMOD_MODEL_VERSION << endl;
+		return -1;
+	}
+	uint64_t off[NUM_SECTIONS + 1];
+	section_offsets(h, off);
+	uint64_t file_bytes = h[H_FILE_LO] | ((uint64_t)h[H_FILE_HI] << 32);
+	if(file_bytes != off[NUM_SECTIONS] || file_bytes != (uint64_t)mf->len)
+	{
+		cerr << "ERROR, in mmod_compiled::read_binary, " << filename << " is " << mf->len << " bytes, its header says "
+		     << file_bytes << " (needs " << off[NUM_SECTIONS] << ")" << endl;
+		return -1;
+	}
+
+	//STRINGS
+	size_t nobj = h[H_OBJECTS], nmodes = h[H_MODES];
+	vector<string> strs;
+	const uchar *p = b + off[SEC_STRINGS], *pend = p + h[H_STRINGS];
+	while(strs.size() < nobj + nmodes + 1 && p + 4 <= pend && get32(p) <= (uint32_t)(pend - p - 4))
+	{
+		strs.push_back(string((const char *)p + 4, get32(p)));
+		p += 4 + strs.back().size();
+	}
+	if(strs.size() != nobj + nmodes + 1)
+	{
+		cerr << "ERROR, in mmod_compiled::read_binary, " << filename << " has a bad string table" << endl;
+		return -1;
+	}
+
+	//ARRAYS: in place if the file's layout is this host's, else copied in
+	int nv = h[H_VIEWS], nfv = h[H_FVIEWS], nfeat = h[H_FEATURES], nlay = h[H_LAYOUTS];
+	boost::shared_ptr<arrays> a;
+	const int *vr, *fr, *wd;
+	const view *vw, *fv;
+	const uint32_t *ft;
+	const layout *ly;
+	bool in_place = h[H_VERSION] == MMOD_MODEL_VERSION && host_little_endian() && sizeof(int) == 4 &&
+			sizeof(float) == 4 && sizeof(view) == 4*MMOD_VIEW_WORDS && sizeof(layout) == 8;
+	if(in_place)
+	{
+		vr = (const int *)(b + off[SEC_VRANGE]);
+		fr = (const int *)(b + off[SEC_FRANGE]);
+		vw = (const view *)(b + off[SEC_VIEWS]);
+		fv = (const view *)(b + off[SEC_FVIEWS]);
+		ft = (const uint32_t *)(b + off[SEC_FEATS]);
+		ly = (const layout *)(b + off[SEC_LAYOUTS]);
+		wd = (const int *)(b + off[SEC_WORDS]);
+	}
+	else
+	{
+		a.reset(new arrays);
+		for(size_t i = 0; i < nobj*nmodes + 1; ++i) a->vrange.push_back((int)get32(b + off[SEC_VRANGE] + 4*i));
+		for(size_t i = 0; i < nobj + 1; ++i) a->frange.push_back((int)get32(b + off[SEC_FRANGE] + 4*i));
+		for(int i = 0; i < nv; ++i) a->views.push_back(read_view(b + off[SEC_VIEWS] + 4*MMOD_VIEW_WORDS*i));
+		for(int i = 0; i < nfv; ++i) a->fviews.push_back(read_view(b + off[SEC_FVIEWS] + 4*MMOD_VIEW_WORDS*i));
+		vector<layout> lays;
+		for(int i = 0; i < nlay; ++i)
+		{
+			layout l;
+			l.step = (int)get32(b + off[SEC_LAYOUTS] + 8*i);
+			l.cn = (int)get32(b + off[SEC_LAYOUTS] + 8*i + 4);
+			lays.push_back(l);
+		}
+		if(h[H_VERSION] == 1) //Pack the features, then redo the layouts' words from them
+		{
+			for(int i = 0; i < nfeat; ++i)
+			{
+				Point off1((int)get32(b + off[SEC_OFFSETS] + 8*i), (int)get32(b + off[SEC_OFFSETS] + 8*i + 4));
+				int code = b[off[SEC_CODES] + i];
+				a->feats.push_back(abs(off1.x) <= FEAT_OFFSET_MAX && abs(off1.y) <= FEAT_OFFSET_MAX && code < 9 ?
+						pack_feature(code, off1) : 15); //15: not a matchLUT row, the model is rejected below
+			}
+			for(int i = 0; i < nlay; ++i)
+				add_layout(lays[i], *a);
+		}
+		else
+		{
+			for(int i = 0; i < nfeat; ++i) a->feats.push_back(get32(b + off[SEC_FEATS] + 4*i));
+			a->layouts = lays;
+			for(long i = 0; i < (long)nlay*nfeat; ++i) a->words.push_back((int)get32(b + off[SEC_WORDS] + 4*i));
+		}
+		nlay = (int)a->layouts.size();
+		vr = data_of(a->vrange); fr = data_of(a->frange); vw = data_of(a->views); fv = data_of(a->fviews);
+		ft = data_of(a->feats); ly = data_of(a->layouts); wd = data_of(a->words);
+	}
+	if(!valid_model(vr, nobj*nmodes + 1, nv, vw, nv, ft, nfeat) || !valid_model(fr, nobj + 1, nfv, fv, nfv, ft, nfeat) ||
+			!valid_features(ft, nfeat, ly, nlay, wd))
+	{
+		cerr << "ERROR, in mmod_compiled::read_binary, " << filename << " is corrupt" << endl;
+		return -1;
+	}
+
+	//COMMIT
+	if(a)
+		bind(a);
+	else
+	{
+		init_lut();
+		nviews = nv; nfviews = nfv; nfeatures = nfeat; nlayouts = nlay;
+		vrange = vr; frange = fr; views = vw; fviews = fv; feats = ft; layouts = ly; words = wd;
+		mapped = true;
+		backing = mf;
+	}
+	objects.assign(strs.begin(), strs.begin() + nobj);
+	modes.assign(strs.begin() + nobj, strs.begin() + nobj + nmodes);
+	filter_mode = strs.back();
+	return (int)nobj;
+}
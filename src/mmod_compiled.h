@@ -0,0 +1,303 @@
+/*
+ * mmod_compiled.h
+ *
+ * Read only runtime form of a trained model. mmod_objects and mmod_filters stay what training learns into and
+ * what gets archived; mmod_compiled is made from them once ("compiled") and then only matched against:
+ * objects and modes get integer IDs, all views live in flat arrays (the views of an object in a mode sorted by
+ * size, each with its precomputed norm), each feature is packed into 32 bits (its matchLUT row and its x, y offset),
+ * and for the image resolutions declared at compile time into a 32 bit word of its pointer offset and matchLUT row
+ * that the matcher uses directly. Being const it can be shared between threads;
+ * results go to an mmod_matches instead of into the model. write_binary/read_binary store it as a model file that is
+ * mmap'd and matched in place, so loading a model library costs about nothing (see mmod_convert).
+ *
+ *  Created on: Oct 19, 2026
+ */
+
+#ifndef MMOD_COMPILED_H_
+#define MMOD_COMPILED_H_
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/serialization/split_member.hpp>
+#include "mmod_objects.h"
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ *\brief Recognitions of an mmod_compiled model, the same lists mmod_objects keeps after match_all_objects
+ */
+struct mmod_matches
+{
+	std::vector<cv::Rect> rv;			//vector of rectangle bounding boxes from an image match_all_objects
+	std::vector<float> scores;			//the scores from the above
+	std::vector<std::string> ids; 		//the matched object's IDs
+	std::vector<int> frame_nums;		//the matched object's frame number
+	std::vector<std::string> modes_used;//the modes used for match_all_objects
+	std::vector<std::vector<int> > feature_indices;	//For each match, index of the matching view in each mode
+
+	/**
+	 * \brief Empty all vectors.
+	 */
+	void clear();
+
+	/**
+	 *\brief  cout all matches. This function is for debug
+	 *@return Total number of matches
+	 */
+	int cout_matches() const;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ *\brief Immutable, lookup friendly model compiled from trained mmod_objects (and optionally mmod_filters)
+ */
+class mmod_compiled
+{
+public:
+	struct view								//One learned view (template). 9 little endian 32 bit words in a model file
+	{
+		int frame;							//Frame number it was learned from
+		int index;							//Its index in the mmod_features it came from (what recognitions report)
+		cv::Rect bbox;						//Bounding box, relative to the center
+		int first, count;					//Its features are feats[first, first+count)
+		float norm;							//Norm of a match with all features inside the image (count)
+		template<class Archive> void serialize(Archive & ar, const unsigned int version)
+		{
+			ar & frame & index & bbox & first & count & norm;
+		}
+	};
+
+	struct layout							//Features are precomputed as words for images of one row step
+	{
+		int step, cn;						//Row step (cv::Mat::step1()) and channels (interleaved feature images)
+		template<class Archive> void serialize(Archive & ar, const unsigned int version)
+		{
+			ar & step & cn;
+		}
+	};
+
+#ifdef FLOATLUT
+	typedef float lut_type;
+#else
+	typedef int lut_type;
+#endif
+
+	mmod_compiled();
+
+	/**
+	 * \brief Compile trained models
+	 *
+	 * @param objs			Trained object models
+	 * @param filters		Trained filters to verify recognitions with (can be NULL)
+	 * @param resolutions	Image sizes to precompute feature words for. Other sizes still work, decoding offsets on the fly (slower)
+	 * @param channels		Channels of the feature images at those sizes (>1 for interleave_features images)
+	 */
+	mmod_compiled(const mmod_objects &objs, const mmod_filters *filters = 0,
+			const std::vector<cv::Size> &resolutions = std::vector<cv::Size>(), int channels = 1);
+
+	//SERIALIZATION
+	template<class Archive>
+	void save(Archive & ar, const unsigned int version) const
+	{
+		arrays a;
+		copy_arrays(a);
+		ar << objects << modes << filter_mode << a;
+	}
+	template<class Archive>
+	void load(Archive & ar, const unsigned int version)
+	{
+		boost::shared_ptr<arrays> a(new arrays);
+		ar >> objects >> modes >> filter_mode >> *a;
+		bind(a);
+	}
+	BOOST_SERIALIZATION_SPLIT_MEMBER()
+
+	/**
+	 * \brief Write the model as a model file (MMOD_MODEL_MAGIC, see mmod_compiled.cpp) that read_binary can map
+	 * @param filename	File to write
+	 * @return			Bytes written, -1 on error
+	 */
+	long write_binary(const std::string &filename) const;
+
+	/**
+	 * \brief Replace this model by the model file written by write_binary. The file is mmap'd and matched in place:
+	 * \brief nothing is allocated per view or feature (on a big endian host, or for an older version file, it is copied in)
+	 * @param filename	Model file to map
+	 * @return			Number of objects, -1 on error (the model is left unchanged)
+	 */
+	int read_binary(const std::string &filename);
+
+	const std::vector<std::string> &object_names() const { return objects; }
+	const std::vector<std::string> &mode_names() const { return modes; }
+	const std::string &filters_mode() const { return filter_mode; }
+	int num_objects() const { return (int)objects.size(); }
+	int num_modes() const { return (int)modes.size(); }
+	int total_views() const { return nviews; }
+	int total_filter_views() const { return nfviews; }
+	int total_features() const { return nfeatures; }
+	bool is_mapped() const { return mapped; }
+
+	/**
+	 * \brief Bytes the model's arrays take (the mapped file, if mapped), for budgeting model memory
+	 */
+	size_t memory_bytes() const;
+
+	/**
+	 * \brief ID of object name, -1 if there is no such object
+	 */
+	int object_id(const std::string &name) const;
+
+	/**
+	 * \brief ID of mode name, -1 if there is no such mode
+	 */
+	int mode_id(const std::string &name) const;
+
+	/**
+	 * \brief Number of views of object o in mode m (both IDs)
+	 */
+	int num_views(int o, int m) const { return vrange[o*modes.size() + m + 1] - vrange[o*modes.size() + m]; }
+
+	/**
+	 * \brief View k (largest first) of object o in mode m
+	 */
+	const view &get_view(int o, int m, int k) const { return views[vrange[o*modes.size() + m] + k]; }
+
+	/**
+	 * \brief mmod_objects::match_all_objects on the compiled model. Same parameters, same results (into matches):
+	 * \brief like mmod_objects, only the objects learned in the first mode (by name) are searched for
+	 *
+	 * @param I					For each mode, Feature image of uchar bytes where only one or zero bits are on.
+	 * @param mode_names		List of names of the modes of the above features
+	 * @param Mask				Mask of where to search. If empty, search the whole image. If not empty, it must be CV_8UC1 with same size as I
+	 * @param match_threshold	Matches have to be above this score [0,1] to be considered a match
+	 * @param frac_overlap		the fraction of overlap between 2 above threshold feature's bounding box rectangles that constitutes overlap
+	 * @param skipX				In the search, jump over this many pixels X
+	 * @param skipY				In the search, jump over this many pixels Y
+	 * @param matches			Output: non-max suppressed recognitions
+	 * @param rawmatches		If set, fill this with the total number of matches before non-max suppression.
+	 * @return					Number of surviving non-max suppressed object matches, -1 on bad input
+	 */
+	int match_all_objects(const std::vector<cv::Mat> &I, const std::vector<std::string> &mode_names, const cv::Mat &Mask,
+			float match_threshold, float frac_overlap, int skipX, int skipY, mmod_matches &matches, int *rawmatches = 0) const;
+
+	/**
+	 * \brief match_all_objects on an interleaved feature image (see mmod_general::interleave_features),
+	 * \brief channel i holding the features of mode_names[i]. Other parameters as above
+	 */
+	int match_all_objects(const cv::Mat &Ifeat, const std::vector<std::string> &mode_names, const cv::Mat &Mask,
+			float match_threshold, float frac_overlap, int skipX, int skipY, mmod_matches &matches, int *rawmatches = 0) const;
+
+	/**
+	 * \brief mmod_objects::match_all_objects_at_a_point on the compiled model, results into matches (no non-max suppression)
+	 * @return	Number of object matches above match_threshold
+	 */
+	int match_all_objects_at_a_point(const std::vector<cv::Mat> &I, const std::vector<std::string> &mode_names,
+			const cv::Point &pp, float match_threshold, mmod_matches &matches) const;
+
+	/**
+	 * \brief mmod_filters::filter_object_recognitions on the compiled filters: drop the matches whose filter view
+	 * \brief scores below thresh at the match. Does nothing if compiled without filters
+	 * @param filt_features		8UC1 binarized feature image of the filters' mode
+	 * @param matches			Recognitions to filter
+	 * @param thresh			The matching threshold for the filter
+	 * @return					Number of remaining matches
+	 */
+	int filter_object_recognitions(const cv::Mat &filt_features, mmod_matches &matches, float thresh) const;
+
+	/**
+	 *\brief  Draw matches (mmod_objects::draw_matches). This function is for visualization
+	 * @param I   		Image you want to draw onto, must be CV_8UC3.
+	 * @param matches	Recognitions of this model
+	 * @param o   		Offset for drawing
+	 */
+	void draw_matches(cv::Mat &I, const mmod_matches &matches, cv::Point o = cv::Point(0,0)) const;
+
+private:
+	struct arrays							//Owned storage of a compiled (or boost loaded) model
+	{
+		std::vector<int> vrange, frange;
+		std::vector<view> views, fviews;
+		std::vector<uint32_t> feats;
+		std::vector<layout> layouts;
+		std::vector<int> words;
+		template<class Archive> void serialize(Archive & ar, const unsigned int version)
+		{
+			ar & vrange & frange & views & fviews & feats & layouts & words;
+		}
+	};
+
+	std::vector<std::string> objects;		//Object ID => object name
+	std::vector<std::string> modes;			//Mode ID => mode name
+	std::string filter_mode;				//Mode of the filters, empty if compiled without filters
+	std::vector<lut_type> mlut;				//matchLUT, 9 rows of 256: mlut[code*256 + image byte] (+7 rows of 0)
+	int nviews, nfviews, nfeatures, nlayouts;
+	bool mapped;							//Arrays below point into a mapped model file
+	boost::shared_ptr<const void> backing;	//Keeps what the arrays below point into alive (arrays or a mapped file)
+	const int *vrange;						//Views of object o in mode m are views[vrange[o*nmodes+m], vrange[o*nmodes+m+1])
+	const view *views;						//All object views, per object then mode, largest first
+	const int *frange;						//Filter views of object o are fviews[frange[o], frange[o+1]), by frame number
+	const view *fviews;						//All filter views
+	const uint32_t *feats;					//Every feature of views and fviews: matchLUT row (mmod_general::lut) | x << 4 | y << 18
+	const layout *layouts;					//Declared resolutions ...
+	const int *words;						//... and for each, (x*cn + y*step) << 4 | matchLUT row of every feature
+
+	/**
+	 * \brief Add the feature words of layout l to a, unless a has it already or its pointer offsets don't fit a word
+	 */
+	static void add_layout(const layout &l, arrays &a);
+
+	/**
+	 * \brief Fill mlut from mmod_general::matchLUT
+	 */
+	void init_lut();
+
+	/**
+	 * \brief Point the arrays at a, which the model then shares
+	 */
+	void bind(const boost::shared_ptr<arrays> &a);
+
+	/**
+	 * \brief Copy the arrays out (for boost serialization)
+	 */
+	void copy_arrays(arrays &a) const;
+
+	/**
+	 * \brief Append the views of f to vs (and their packed features to a), sorted largest first if by_size
+	 */
+	void add_views(const mmod_features &f, std::vector<view> &vs, bool by_size, const mmod_general &g, arrays &a);
+
+	/**
+	 * \brief True if object o has views in mode 0, the first mode by name. mmod_objects matches only the objects of
+	 * \brief its first mode, so the compiled matcher skips the others to give the same results
+	 */
+	bool first_mode_object(int o) const { return !modes.empty() && num_views(o, 0) > 0; }
+
+	/**
+	 * \brief Precomputed feature words for I, NULL if I's resolution wasn't declared
+	 */
+	const int *layout_words(const cv::Mat &I) const;
+
+	/**
+	 * \brief Best view of object o in mode m at point p of (channel of) I, as mmod_general::match_a_patch_bruteforce
+	 * @return	score of the best view, its view number (-1 if none scored) in match_index and its slot in views in
+	 * 			match_view
+	 */
+	float match_an_object(int o, int m, const cv::Mat &I, const int *lwords, const cv::Point &p, int channel,
+			int &match_index, int &match_view) const;
+
+	/**
+	 * \brief Score of filter view v with its center at the center of R, as mmod_general::match_one_feature
+	 */
+	float match_filter_view(const view &v, const cv::Mat &I, const cv::Rect &R) const;
+
+	/**
+	 * \brief Shared by the match_all_objects: channel[k] of I[k] holds mode mode_ids[k] (-1 => not in the model)
+	 */
+	int match_all(const std::vector<const cv::Mat *> &I, const std::vector<int> &channel,
+			const std::vector<std::string> &mode_names, const cv::Mat &Mask, float match_threshold, float frac_overlap,
+			int skipX, int skipY, mmod_matches &matches, int *rawmatches) const;
+};
+
+#endif /* MMOD_COMPILED_H_ */
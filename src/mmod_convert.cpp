@@ -0,0 +1,74 @@
+// Convert boost archived models (mmod_objects, optionally with their mmod_filters) into a model file that
+// mmod_compiled::read_binary maps and matches in place.
+//
+// console application.
+//
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <fstream>
+#include <stdio.h>
+#include <string.h>
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/text_iarchive.hpp>
+
+#include "mmod_objects.h"
+#include "mmod_compiled.h"
+
+using namespace cv;
+using namespace std;
+
+static void help()
+{
+	cout << "Usage: mmod_convert [-t] [-r WxH]... [-c channels] objects_in [filters_in] model_out\n"
+	        "  Compiles the archived objects (and filters) and writes them as a mappable model file.\n"
+	        "  -t           archives are text (MyMMod) instead of binary (MModPersister, ModelWriter)\n"
+	        "  -r WxH       precompute pointer offsets for feature images of this size (repeatable), default 640x480\n"
+	        "  -c channels  channels of those feature images (interleave_features), default 1" << endl;
+}
+
+template<class T> static bool load(const string &name, T &t, bool text)
+{
+	ifstream ifs(name.c_str(), ios::binary);
+	if (!ifs) { cerr << "ERROR: couldn't read " << name << endl; return false; }
+	if (text) { boost::archive::text_iarchive ia(ifs); ia >> t; }
+	else { boost::archive::binary_iarchive ia(ifs); ia >> t; }
+	return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[]) {
+	bool text = false;
+	int channels = 1, a = 1;
+	vector<Size> resolutions;
+	for (; a < argc && argv[a][0] == '-'; ++a) {
+		int w, h;
+		if (!strcmp(argv[a], "-t")) text = true;
+		else if (!strcmp(argv[a], "-r") && a + 1 < argc && sscanf(argv[++a], "%dx%d", &w, &h) == 2 && w > 0 && h > 0)
+			resolutions.push_back(Size(w, h));
+		else if (!strcmp(argv[a], "-c") && a + 1 < argc && (channels = atoi(argv[++a])) > 0) ;
+		else { help(); return -1; }
+	}
+	int nargs = argc - a;
+	if (nargs != 2 && nargs != 3) { help(); return -1; }
+	if (resolutions.empty()) resolutions.push_back(Size(640, 480));
+
+	mmod_objects Objs;
+	mmod_filters filt;
+	double t = (double)getTickCount();
+	if (!load(argv[a], Objs, text)) return -1;
+	if (nargs == 3 && !load(argv[a + 1], filt, text)) return -1;
+	double tload = ((double)getTickCount() - t) / getTickFrequency();
+	mmod_compiled C(Objs, nargs == 3 ? &filt : 0, resolutions, channels);
+	long bytes = C.write_binary(argv[argc - 1]);
+	if (bytes < 0) return -1;
+
+	//CHECK: map it back in
+	t = (double)getTickCount();
+	mmod_compiled M;
+	if (M.read_binary(argv[argc - 1]) != C.num_objects()) return -1;
+	double tmap = ((double)getTickCount() - t) / getTickFrequency();
+	printf("Wrote %s: %ld bytes, %d objects, %d modes, %d views (%d filter views), %d features\n", argv[argc - 1], bytes,
+	       M.num_objects(), M.num_modes(), M.total_views(), M.total_filter_views(), M.total_features());
+	printf("Archive load %.3f s, model file map %.6f s%s\n", tload, tmap, M.is_mapped() ? "" : " (copied in)");
+	return 0;
+}
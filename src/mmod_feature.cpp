@@ -37,6 +37,7 @@ mmod_features::mmod_features(string &sID, string &oID)
 		max_bounds.width = -1;
 		max_bounds.height = -1;
 		wstep = 0; //Since we're learning new features, reset flag to convert offsets from cv::Point to uchar*
+		wcn = 0;
 	}
 
 	/**
@@ -73,9 +74,10 @@ mmod_features::mmod_features(string &sID, string &oID)
 	 * @param index		the index of which feature we want inserted here from f above
 	 * @return			the index into which the indexed value from f was inserted. -1 => error
 	 */
-	int mmod_features::insert(mmod_features &f, int index)
+	int mmod_features::insert(const mmod_features &f, int index)
 	{
 		wstep = 0; //Since we're learning new features, reset flag to convert offsets from cv::Point to uchar*
+		wcn = 0;
 		int size = (int)f.features.size();
 		if(index >= size)
 		{
@@ -90,6 +92,9 @@ mmod_features::mmod_features(string &sID, string &oID)
 		quadUR.push_back(f.quadUR[index]);
 		quadLR.push_back(f.quadLR[index]);
 		quadLL.push_back(f.quadLL[index]);
+		budget.push_back(index < (int)f.budget.size() ? f.budget[index] : 0);
+		candidates.push_back(index < (int)f.candidates.size() ? f.candidates[index] : (int)f.features[index].size());
+		spacing.push_back(index < (int)f.spacing.size() ? f.spacing[index] : 0);
 		Rect R = f.bbox[index];
 		if(R.width > max_bounds.width) max_bounds.width = R.width;
 		if(R.height > max_bounds.height) max_bounds.height = R.height;
@@ -98,18 +103,111 @@ mmod_features::mmod_features(string &sID, string &oID)
 		return ((int)features.size() - 1);
 	}
 
+	/**
+	 * \brief Keep only some of the views, in the given order, dropping the rest (max_bounds is recomputed)
+	 *
+	 * @param views		indices of the views to keep
+	 * @return			number of views left. -1 => error, an index was out of range (nothing is changed)
+	 */
+	int mmod_features::keep_views(const vector<int> &views)
+	{
+		for(vector<int>::const_iterator it = views.begin(); it != views.end(); ++it)
+		{
+			if(*it < 0 || *it >= size())
+			{
+				cerr << "ERROR, in mmod_features.keep_views, view " << *it << " is not in [0," << size() << ")" << endl;
+				return -1;
+			}
+		}
+		mmod_features kept(session_ID, object_ID);
+		for(vector<int>::const_iterator it = views.begin(); it != views.end(); ++it)
+			kept.insert(*this, *it);
+		*this = kept;
+		return size();
+	}
+
+	//Hash of view i of f: its features and offsets
+	static size_t view_hash(const mmod_features &f, int i)
+	{
+		size_t h = 2166136261u;
+		for(size_t k = 0; k < f.features[i].size(); ++k)
+			h = (h ^ f.features[i][k]) * 16777619u;
+		for(size_t k = 0; k < f.offsets[i].size(); ++k)
+			h = (((h ^ (size_t)f.offsets[i][k].x) * 16777619u) ^ (size_t)f.offsets[i][k].y) * 16777619u;
+		return h;
+	}
+
+	/**
+	 * \brief Append all the views of f (e.g. the same object learned in another session), in their order
+	 *
+	 * Frame numbers tie a view to the views of the same frame in other modes and in the filters, so views learned
+	 * separately (numbered from the same start) must be renumbered consistently everywhere: see
+	 * mmod_objects::merge, mmod_filters::merge.
+	 *
+	 * @param f				views to add
+	 * @param dedup			skip the views of f identical (features and offsets) to one already here
+	 * @param frame_offset	added to the frame numbers of the views of f
+	 * @return				number of views added
+	 */
+	int mmod_features::merge(const mmod_features &f, bool dedup, int frame_offset)
+	{
+		int n = (int)f.features.size(), added = 0;
+		size_t total = features.size() + n;
+		frame_number.reserve(total); features.reserve(total); offsets.reserve(total); bbox.reserve(total);
+		quadUL.reserve(total); quadUR.reserve(total); quadLL.reserve(total); quadLR.reserve(total);
+		budget.reserve(total); candidates.reserve(total); spacing.reserve(total);
+		multimap<size_t, int> seen; //(view_hash, view) of the views here
+		if(dedup)
+			for(int i = 0; i < size(); ++i)
+				seen.insert(pair<size_t, int>(view_hash(*this, i), i));
+		for(int i = 0; i < n; ++i)
+		{
+			if(dedup)
+			{
+				size_t h = view_hash(f, i);
+				bool dup = false;
+				pair<multimap<size_t, int>::iterator, multimap<size_t, int>::iterator> r = seen.equal_range(h);
+				for(multimap<size_t, int>::iterator it = r.first; it != r.second && !dup; ++it)
+					dup = features[it->second] == f.features[i] && offsets[it->second] == f.offsets[i];
+				if(dup)
+				{
+					FEAT_DEBUG_2(cout << object_ID << ": view " << i << " (frame " << f.frame_number[i] << ") is already here" << endl;);
+					continue;
+				}
+				seen.insert(pair<size_t, int>(h, size()));
+			}
+			insert(f, i);
+			frame_number.back() += frame_offset;
+			++added;
+		}
+		return added;
+	}
+
+	/**
+	 * \brief Widen [lo, hi] to take in the frame numbers of these views (left alone if there are none)
+	 */
+	void mmod_features::frame_range(int &lo, int &hi) const
+	{
+		for(vector<int>::const_iterator it = frame_number.begin(); it != frame_number.end(); ++it)
+		{
+			if(*it < lo) lo = *it;
+			if(*it > hi) hi = *it;
+		}
+	}
+
 	/**
 	 * \brief  Thus function is called automatically from mmod_general::match_a_patch_bruteforce
 	 * \brief  it converts cv::Point offsets into uchar offsets for faster lookup
 	 *
 	 * This function is purely to optimize matching speed using pre-computed pointer offsets
 	 *
-	 * @param I Any image whose size is the same as currently being used for matching
+	 * @param I Any image whose size (and channels) are the same as currently being used for matching
 	 */
 	void mmod_features::convertPoint2PointerOffsets(const Mat &I)
 	{
-		if(I.step1() == wstep) return;  //This was already set
+		if((int)I.step1() == wstep && I.channels() == wcn && poff.size() == offsets.size()) return;  //This was already set
 		wstep = I.step1();				//New row step size of image
+		wcn = I.channels();				//Pixel step of interleaved feature images
 		poff.clear(); 					//Reset former pointer offset vector
 		vector<int> _poff;
 		int yy,xx;
@@ -122,7 +220,7 @@ mmod_features::mmod_features(string &sID, string &oID)
 			{
 			    yy = (*_oit).y;
 			    xx = (*_oit).x;
-			    _poff.push_back(xx + yy*wstep);
+			    _poff.push_back(xx*wcn + yy*wstep);
 			}
 			poff.push_back(_poff);
 		}
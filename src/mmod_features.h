@@ -16,6 +16,7 @@
 #include <boost/archive/text_iarchive.hpp>
 #include <boost/serialization/vector.hpp>
 #include <boost/serialization/string.hpp>
+#include <boost/serialization/version.hpp>
 
 namespace boost {
 namespace serialization {
@@ -81,9 +82,15 @@ public:
 	std::vector<cv::Rect>  bbox;						//bounding box of the features
 	std::vector<std::vector<int> > quadUL,quadUR,quadLL,quadLR;//List of features in each quadrant
 	cv::Rect max_bounds;								//This rectangle contains the maximum width and and height spanned by all the bbox rectangles
+	//Feature selection of each view (see mmod_general::feature_budget), to compare models learned with different budgets
+	std::vector<int> budget;							//Feature budget the view was learned with, 0 => all features kept
+	std::vector<int> candidates;						//Features in the mask before selection
+	std::vector<int> spacing;							//Minimum distance (pixels) between the kept features, 0 if not selected
 	//---temp--- These were created to optimize feature matching//
 	int wstep;											//Flag to convert offsets from cv::Point to uchar*
 														//   when set, it is set to the row size of images
+	int wcn;											//  and this to their channels (interleaved images). poff is
+														//  reused only for images of this wstep and wcn, 0 => convert
 	std::vector<std::vector<int> > poff;				//Pointer offsets computed from cv::Point offests above.
 
 	mmod_features();
@@ -118,7 +125,22 @@ public:
         ar & quadLL;
         ar & quadLR;
         ar & max_bounds;
+        if(version >= 1)
+        {
+            ar & budget;
+            ar & candidates;
+            ar & spacing;
+        }
+        else //Learned before feature selection: every feature was kept
+        {
+            budget.assign(features.size(), 0);
+            spacing.assign(features.size(), 0);
+            candidates.clear();
+            for(size_t i = 0; i < features.size(); ++i)
+                candidates.push_back((int)features[i].size());
+        }
         wstep = 0;
+        wcn = 0;
     }
 
 	/**
@@ -143,17 +165,45 @@ public:
 	 * @param index		the index of which feature we want inserted here from f above
 	 * @return			the index into which the indexed value from f was inserted. -1 => error
 	 */
-	int insert(mmod_features &f, int index);
+	int insert(const mmod_features &f, int index);
 
 	/**
 	 * \brief  Thus function is called automatically from mmod_general::match_a_patch_bruteforce
 	 * \brief  it converts cv::Point offsets into uchar offsets for faster lookup
 	 *
 	 * This function is purely to optimize matching speed using pre-computed pointer offsets
-	 * @param I Any image whose size is the same as currently being used for matching
+	 * @param I Any image whose size (and channels) are the same as currently being used for matching
 	 */
 	void convertPoint2PointerOffsets(const cv::Mat &I);
 
+	/**
+	 * \brief Keep only some of the views, in the given order, dropping the rest (max_bounds is recomputed)
+	 *
+	 * @param views		indices of the views to keep
+	 * @return			number of views left. -1 => error, an index was out of range (nothing is changed)
+	 */
+	int keep_views(const std::vector<int> &views);
+
+	/**
+	 * \brief Append all the views of f (e.g. the same object learned in another session), in their order
+	 *
+	 * Frame numbers tie a view to the views of the same frame in other modes and in the filters, so views learned
+	 * separately (numbered from the same start) must be renumbered consistently everywhere: see
+	 * mmod_objects::merge, mmod_filters::merge.
+	 *
+	 * @param f				views to add
+	 * @param dedup			skip the views of f identical (features and offsets) to one already here
+	 * @param frame_offset	added to the frame numbers of the views of f
+	 * @return				number of views added
+	 */
+	int merge(const mmod_features &f, bool dedup = false, int frame_offset = 0);
+
+	/**
+	 * \brief Widen [lo, hi] to take in the frame numbers of these views (left alone if there are none)
+	 */
+	void frame_range(int &lo, int &hi) const;
+
 };
+BOOST_CLASS_VERSION(mmod_features, 1) //1: feature selection metadata (budget, candidates, spacing)
 
 #endif /* MMOD_FEATURES_H_ */
@@ -5,6 +5,13 @@
  *      Author: Gary Bradski
  */
 #include "mmod_general.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <boost/bind.hpp>
+#ifdef MMOD_SSE2
+#include <emmintrin.h>
+#endif
 using namespace cv;
 using namespace std;
 //////////////////////////////////////////////////////////////////////////////////////////////
@@ -14,7 +21,7 @@ using namespace std;
 	 *
 	 * @return
 	 */
-mmod_general::mmod_general()
+mmod_general::mmod_general() : feature_budget(0)
 	{
 		fillCosDist();
 	}
@@ -196,13 +203,14 @@ mmod_general::mmod_general()
 	 *
 	 * Do a brute force match of all the templates in a given mmod_features at a given pixel (Point) in an image.  It does bounds checking for you.
 	 *
-	 * @param I				Input image or patch
+	 * @param I				Input image or patch, CV_8UC1 or an interleaved CV_8UC(n) feature image (see interleave_features)
 	 * @param p				Point(x,y) at which to match
 	 * @param f				trained mmod_features reference to match against
 	 * @param match_index   which feature had the maximal match score
+	 * @param channel		which channel (modality) of an interleaved I to match against
 	 * @return				score of maximal match. If f is empty, return 0 (nothing matches)
 	 */
-	float mmod_general::match_a_patch_bruteforce(const Mat &I, const Point &p, mmod_features &f, int &match_index)
+	float mmod_general::match_a_patch_bruteforce(const Mat &I, const Point &p, mmod_features &f, int &match_index, int channel)
 	{
 	  GENL_DEBUG_1(cout<<"mmod_general::match_a_patch_bruteforde"<<endl;);
 		match_index = -1;
@@ -230,9 +238,10 @@ mmod_general::mmod_general()
 
 		//PRECOMPUTE OFFSETS
 		f.convertPoint2PointerOffsets(I); //This is a noop if it is already set. For optimization
-		const uchar *at = (I.ptr<uchar> (p.y)) + p.x;
-		const uchar *atstart = I.ptr<uchar>(0);
-		const uchar *atend = (I.ptr<uchar>(rows - 1)) + cols - 1;
+		const int cn = I.channels();		//Interleaved feature images: every cn'th byte is ours, starting at channel
+		const uchar *at = (I.ptr<uchar> (p.y)) + p.x*cn + channel;
+		const uchar *atstart = I.ptr<uchar>(0) + channel;
+		const uchar *atend = (I.ptr<uchar>(rows - 1)) + (cols - 1)*cn + channel;
 
 		GENL_DEBUG_1(
 			static double total_time = 0;
@@ -372,9 +381,107 @@ mmod_general::mmod_general()
 		return maxmatch;
 	}
 
+	/**
+	 * \brief match_a_patch_bruteforce over only some of the views (templates) in f, e.g. those a view_index proposed
+	 *
+	 * @param I				Input image or patch, CV_8UC1
+	 * @param p				Point(x,y) at which to match
+	 * @param f				trained mmod_features reference to match against
+	 * @param views			indices of the views in f to match
+	 * @param match_index   which feature had the maximal match score, -1 if none scored
+	 * @return				score of maximal match over views. If views is empty, return 0 (nothing matches)
+	 */
+	float mmod_general::match_a_patch_views(const Mat &I, const Point &p, mmod_features &f, const vector<int> &views,
+			int &match_index)
+	{
+		GENL_DEBUG_1(cout<<"mmod_general::match_a_patch_views, "<<views.size()<<" views"<<endl;);
+		match_index = -1;
+		float maxmatch = 0;
+		if(f.features.empty() || views.empty()) return(0.0);
+		f.convertPoint2PointerOffsets(I);
+		int rows = I.rows, cols = I.cols;
+		Rect imgRect(0,0,cols,rows);
+		const uchar *at = (I.ptr<uchar> (p.y)) + p.x;
+		const uchar *atstart = I.ptr<uchar>(0);
+		const uchar *atend = (I.ptr<uchar>(rows - 1)) + cols - 1;
+		for(vector<int>::const_iterator vit = views.begin(); vit != views.end(); ++vit)
+		{
+			int k = *vit;
+			if(k < 0 || k >= (int)f.features.size()) continue;
+			const Rect &bb = f.bbox[k];
+			const vector<uchar> &feat = f.features[k];
+			const vector<int> &po = f.poff[k];
+			Rect Rpatch(p.x + bb.x,p.y + bb.y,bb.width,bb.height);
+			Rect Ri = imgRect & Rpatch; //Intersection between patch and image
+			int Risize = Ri.width * Ri.height;
+			int Rpsize = Rpatch.width * Rpatch.height;
+#ifdef FLOATLUT
+			float match = 0;
+#else
+			int match = 0;
+#endif
+			int norm = 0;
+			if(Risize == Rpsize) //No bounds check needed
+			{
+				norm = (int)feat.size();
+				for(int i = 0; i < norm; ++i)
+					match += matchLUT[lut[feat[i]]][at[po[i]]]; //matchLUT[lut[model_uchar]][test_uchar]
+			}
+			else if(Risize >= (int)(Rpsize*0.7)) //Don't try to match too small of areas at the edge
+			{
+				for(int i = 0; i < (int)feat.size(); ++i)
+				{
+					const uchar *get = at + po[i];
+					if((get < atstart)||(get > atend)) continue;
+					match += matchLUT[lut[feat[i]]][*get];
+					++norm;
+				}
+			}
+			if(0 == norm) norm = 1;
+#ifdef FLOATLUT
+			float fmatch = match/(float)norm;
+#else
+			float fmatch = (float)match/((float)norm*100.0);
+#endif
+			if(fmatch > maxmatch)
+			{
+				maxmatch = fmatch;
+				match_index = k;
+			}
+		}
+		GENL_DEBUG_2(cout << "Max match over views = "<<maxmatch<<endl;);
+		return maxmatch;
+	}
 
 
 
+
+	/**
+	 * \brief Interleave CV_8UC1 feature images of several modalities into one CV_8UC(n) image, one byte per modality
+	 * \brief per pixel, so matching all modalities at a point reads the same cache lines
+	 * @param I				For each modality, a CV_8UC1 feature image, all the same size
+	 * @param out			Interleaved feature image, channel i is I[i]
+	 * @return				0, or -1 (and complains) if the images don't fit together
+	 */
+	int mmod_general::interleave_features(const vector<Mat> &I, Mat &out)
+	{
+		if(I.empty() || (int)I.size() > CV_CN_MAX)
+		{
+			cerr << "ERROR: interleave_features needs 1 to " << CV_CN_MAX << " feature images" << endl;
+			return -1;
+		}
+		for(vector<Mat>::const_iterator it = I.begin(); it != I.end(); ++it)
+		{
+			if(it->type() != CV_8UC1 || it->size() != I[0].size())
+			{
+				cerr << "ERROR: interleave_features images must all be CV_8UC1 of the same size" << endl;
+				return -1;
+			}
+		}
+		merge(I, out);
+		return 0;
+	}
+
 	/**
 	 * \brief Brute force match a linemod filter template at (centered on) a particular point in an image
 	 *
@@ -468,10 +575,40 @@ mmod_general::mmod_general()
 	 *  out -- output "cleaned up" image (can be the same as co and is faster that way)
 	 *  span -- the size of the spanXspan window in which to calulate the majority
 	 *  Or0_Max1 -- If 0, compute the span x span OR, else compute the Majority bit type in a span x span window.
+	 *
+	 *  The majority case is routed to MajorityAroundEachPixel8UC1() which gives the same output without the
+	 *  8 int32 box sum planes. The OR case (and images smaller than span) use BoxSumAroundEachPixel8UC1().
 	 */
 	void mmod_general::SumAroundEachPixel8UC1(Mat &co, Mat &out, int span, int Or0_Max1)
 	{
-		GENL_DEBUG_1(cout << "In mmod_general::SumAroundEachPixel8UC1"<<endl;);
+		SumAroundEachPixel8UC1(co,out,span,Or0_Max1,work);
+	}
+
+	/**
+	 * \brief SumAroundEachPixel8UC1 with the caller's work images, so that threads can share one mmod_general
+	 * @param w	work images, kept by the caller from call to call
+	 */
+	void mmod_general::SumAroundEachPixel8UC1(Mat &co, Mat &out, int span, int Or0_Max1, mmod_spread_work &w) const
+	{
+		if(Or0_Max1 && co.type() == CV_8UC1 && co.rows >= span && co.cols >= span && span > 0 && span <= 255)
+			MajorityAroundEachPixel8UC1(co,out,span,w);
+		else
+			BoxSumAroundEachPixel8UC1(co,out,span,Or0_Max1,w);
+	}
+
+	/**
+	 * \brief Reference implementation of SumAroundEachPixel8UC1 using 8 int32 box sum planes (acc, acc2).
+	 *
+	 * Kept so that the faster majority filter can be checked and timed against it (see mmod_bench).
+	 */
+	void mmod_general::BoxSumAroundEachPixel8UC1(Mat &co, Mat &out, int span, int Or0_Max1)
+	{
+		BoxSumAroundEachPixel8UC1(co,out,span,Or0_Max1,work);
+	}
+	void mmod_general::BoxSumAroundEachPixel8UC1(Mat &co, Mat &out, int span, int Or0_Max1, mmod_spread_work &w) const
+	{
+		GENL_DEBUG_1(cout << "In mmod_general::BoxSumAroundEachPixel8UC1"<<endl;);
+		std::vector<Mat> &acc = w.acc, &acc2 = w.acc2;
 		//Allocate or reallocate accumulation arrays
 		if(8 != (int)acc.size())
 		{
@@ -493,8 +630,8 @@ mmod_general::mmod_general()
 
 		//SUM ACROSS ROWS -> for each y
 		int span05 = span/2;
-		vector<int *> a(9); //accumulators
-		vector <int *>::iterator it, itend = a.end() - 1; 	//-1 since we only want to iterate over 8 accumulators. The 9th allows for
+		int *a[9]; //accumulators (plain arrays so we do not allocate on every call)
+		int **it, **itend = a + 8; 	//a + 8 since we only want to iterate over 8 accumulators. The 9th allows for
 		 	 	 	 	 	 	 	 	 	 	 	 	 	 // illegal lut table values (=8)
 		int accIllegalVal;									//If we get a lut[*e] or lut[*s] value = 8, accumulate it here (shouldn't happen)
 
@@ -507,7 +644,7 @@ mmod_general::mmod_general()
 			uchar *e = o;
 			//Accum pointer set and set first position to zero
 			int i;
-			for(i = 0, it = a.begin(); it != itend; ++it, ++i)
+			for(i = 0, it = a; it != itend; ++it, ++i)
 			{
 				*it = acc[i].ptr<int> (y); //Set to point at their row start
 				*(*it) = 0;
@@ -522,14 +659,14 @@ mmod_general::mmod_general()
 					*(a[lut[*e]]) += 1; //Accumulate a hit for this bit
 			}
 			//Move the accumulator pointers across a column
-			for(it=a.begin(); it != itend; ++it)
+			for(it=a; it != itend; ++it)
 				*it += 1;
 			GENL_DEBUG_3(cout << "Done with [1]"<<endl;);
 			//[2]All counts from half the window out to the window span do not move the starting pointer but do move the accumulator pointers
 			for(int x = span05+1; x < span; ++x, ++e)
 			{
 				//Copy the previous accumulation to the current position
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*(*it) = *((*it)-1);
 				//Sum in the new value
 				if(*e != 0)
@@ -537,7 +674,7 @@ mmod_general::mmod_general()
 					*(a[lut[*e]]) += 1; //accumulate
 				}
 				//Increment the accumulator pointers
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*it += 1;
 			}
 			GENL_DEBUG_3(cout << "[2] done, span = " <<span<< endl;);
@@ -545,7 +682,7 @@ mmod_general::mmod_general()
 			for (int x = span; x < co.cols; ++x, ++s, ++e)
 			{
 				//Copy the previous accumulation to the current position
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*(*it) = *((*it)-1);
 				//Sum in the new value
 				if(*e != 0)
@@ -554,7 +691,7 @@ mmod_general::mmod_general()
 					*(a[lut[*s]]) -= 1; //Get rid of trailing edge of accumulation window
 
 				//Increment the accumulator pointers
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*it += 1;
 			}
 			GENL_DEBUG_3(cout <<"[3] done"<<endl;);
@@ -562,7 +699,7 @@ mmod_general::mmod_general()
 			for(int x = co.cols-span05; x<co.cols; ++x, ++s)
 			{
 				//Copy the previous accumulation to the current position
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*(*it) = *((*it)-1);
 				//Sum in the new value
 				if(*s != 0)
@@ -570,7 +707,7 @@ mmod_general::mmod_general()
 					*(a[lut[*s]]) -= 1; //Get rid of trailing edge of accumulation window
 				}
 				//Increment the accumulator pointers
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*it += 1;
 			}
 			GENL_DEBUG_3(cout << "[4] done"<<endl;);
@@ -578,21 +715,21 @@ mmod_general::mmod_general()
 
 
 		//SUM THE ACCUMULATOR ARRAYS ACROSS COLS
-		vector<int *> as(8),ae(8);  //Start and end pointers for windows
-		vector <int *>::iterator aeit,asit;
+		int *as[8],*ae[8];  //Start and end pointers for windows
+		int **aeit,**asit;
 		int jj;
 		GENL_DEBUG_3(cout << "Sum x across cols("<<acc[0].cols<<")"<<endl;);
 		for (int x = 0; x < acc[0].cols; ++x)
 		{
 			//Sum over a column window of len span, set the pointers to top of column x
-			for(jj = 0, aeit = ae.begin(), asit = as.begin(); aeit != ae.end(); ++aeit,++asit,++jj)
+			for(jj = 0, aeit = ae, asit = as; aeit != ae + 8; ++aeit,++asit,++jj)
 			{
 				*asit = acc[jj].ptr<int>(0) + x;
 				*aeit = *asit;
 			}
 			//Set pointers into the acc2 array and set first position to zero
 			int i;
-			for(i = 0, it = a.begin(); it != itend; ++it, ++i)
+			for(i = 0, it = a; it != itend; ++it, ++i)
 			{
 				*it = acc2[i].ptr<int> (0) + x; //Set to point at their column start
 				*(*it) = 0;
@@ -602,32 +739,32 @@ mmod_general::mmod_general()
 			for(int y = 0; y<=span05; ++y)
 			{
 				//Accumulate step  y as window slides down
-				for(it = a.begin(), aeit = ae.begin(); it != itend; ++it, ++aeit)
+				for(it = a, aeit = ae; it != itend; ++it, ++aeit)
 				{
 					*(*it) += *(*aeit);
 					*aeit += acc[0].step1();
 				}
 			}
 			//Move the accumulator pointers down a row
-			for(it=a.begin(); it != itend; ++it)
+			for(it=a; it != itend; ++it)
 				*it += acc2[0].step1();
 			GENL_DEBUG_3(cout << "x: Done with [1]"<<endl;);
 			//[2]All counts from half the window out to the window span do not move the starting pointer but do move the accumulator pointers
 			for(int y = span05+1; y < span; ++y)
 			{
 				//Copy the previous accumulation one row up to the current position
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*(*it) = *((*it)-acc2[0].step1());
 				//Sum in the new values
-				for(it = a.begin(), aeit = ae.begin(); it != itend; ++it, ++aeit)
+				for(it = a, aeit = ae; it != itend; ++it, ++aeit)
 				{
 					*(*it) += *(*aeit);
 				}
 				//Increment the accumulator pointers
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*it += acc2[0].step1();
 				//Increment the end pointers
-				for(aeit = ae.begin(); aeit != ae.end(); ++aeit)
+				for(aeit = ae; aeit != ae + 8; ++aeit)
 					*aeit += acc[0].step1();
 			}
 			GENL_DEBUG_3(cout << "x: Done with [2]"<<endl;);
@@ -635,20 +772,20 @@ mmod_general::mmod_general()
 			for (int y = span; y < co.rows; ++y)
 			{
 				//Copy the previous one row up accumulation to the current position
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*(*it) = *((*it)-acc2[0].step1());
 
 				//Sum in the new value on bottom of window, subtract old value on top
-				for(it = a.begin(), aeit = ae.begin(), asit = as.begin(); it != itend; ++it, ++aeit, ++asit)
+				for(it = a, aeit = ae, asit = as; it != itend; ++it, ++aeit, ++asit)
 				{
 					*(*it) += *(*aeit);
 					*(*it) -= *(*asit);
 				}
 				//Increment the accumulator pointers to the next row
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*it += acc2[0].step1();
 				//Increment the window start and end pointers
-				for(aeit = ae.begin(),asit = as.begin(); aeit != ae.end(); ++aeit,++asit)
+				for(aeit = ae,asit = as; aeit != ae + 8; ++aeit,++asit)
 				{
 					*aeit += acc[0].step1();
 					*asit += acc[0].step1();
@@ -659,16 +796,16 @@ mmod_general::mmod_general()
 			for(int y = co.rows-span05; y<co.rows; ++y)
 			{
 				//Copy the previous accumulation one row up to the current position
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*(*it) = *((*it)-acc2[0].step1());
 				//Get rid of the tailing edge of the accumulation window
-				for(it = a.begin(), asit = as.begin(); it != itend; ++it, ++asit)
+				for(it = a, asit = as; it != itend; ++it, ++asit)
 					*(*it) -= *(*asit);
 				//Increment the accumulator pointers
-				for(it=a.begin(); it != itend; ++it)
+				for(it=a; it != itend; ++it)
 					*it += acc2[0].step1();
 				//Increment the window start and end pointers
-				for(asit = as.begin(); asit != as.end(); ++asit)
+				for(asit = as; asit != as + 8; ++asit)
 					*asit += acc[0].step1();
 			}
 			GENL_DEBUG_3(cout << "x: Done with [4]"<<endl;);
@@ -687,7 +824,7 @@ mmod_general::mmod_general()
 				uchar *in = co.ptr<uchar> (y);
 				//Set the accumulation pointers
 				int i;
-				for(i = 0, it = a.begin(); it != itend; ++it, ++i)
+				for(i = 0, it = a; it != itend; ++it, ++i)
 				{
 					*it = acc2[i].ptr<int> (y); //Set to point at their row start
 				}
@@ -695,7 +832,7 @@ mmod_general::mmod_general()
 				for (int x = 0; x < co.cols; ++x, ++o, ++in)
 				{
 					//Find the max orientation
-					for(it=a.begin(), max = 0, maxpos = 0, pos = 0; it != itend; ++it, ++pos)
+					for(it=a, max = 0, maxpos = 0, pos = 0; it != itend; ++it, ++pos)
 					{
 						if(*(*it) > max)
 						{
@@ -709,7 +846,7 @@ mmod_general::mmod_general()
 					else
 						*o = *in; //Retain previous input
 					//Increment the accumulator pointers across columns in this row
-					for(it=a.begin(); it != itend; ++it)
+					for(it=a; it != itend; ++it)
 						*it += 1;
 				}
 			}
@@ -723,7 +860,7 @@ mmod_general::mmod_general()
 				uchar *in = co.ptr<uchar> (y);
 				//Set the accumulation pointers
 				int i;
-				for(i = 0, it = a.begin(); it != itend; ++it, ++i)
+				for(i = 0, it = a; it != itend; ++it, ++i)
 				{
 					*it = acc2[i].ptr<int> (y); //Set to point at their row start
 				}
@@ -734,7 +871,7 @@ mmod_general::mmod_general()
 				{
 						*o = 0;
 						//Find the max orientation
-						for(it=a.begin(), pos = 0; it != itend; ++it, ++pos)
+						for(it=a, pos = 0; it != itend; ++it, ++pos)
 						{
 							if(*(*it) > 0)
 							{
@@ -742,14 +879,275 @@ mmod_general::mmod_general()
 							}
 						}
 					//Increment the accumulator pointers across columns in this row
-					for(it=a.begin(); it != itend; ++it)
+					for(it=a; it != itend; ++it)
 						*it += 1;
 				}
 			}
 			GENL_DEBUG_3(cout << "Done with OR output loop"<<endl;);
 		}
 		GENL_DEBUG_2(cout << "Exit SumAroundEachPixel8UC1\n"<<endl;);
-	}//End SumAroundEachPixel8UC1 method
+	}//End BoxSumAroundEachPixel8UC1 method
+
+
+	//Load image row r of co into a zero padded row buffer (pad bytes on the left). Rows off the image are all zero.
+	static inline void loadPaddedRow(const Mat &co, int r, uchar *dst, int pad)
+	{
+		if(r < 0 || r >= co.rows)
+			memset(dst + pad, 0, co.cols);
+		else
+			memcpy(dst + pad, co.ptr<uchar>(r), co.cols);
+	}
+
+	//Scalar majority decision for one pixel given its 8 orientation counts. Ties go to the lowest bit, exactly as
+	//in the accumulator version: the majority bit is kept only if it was seen more than once and the pixel is on.
+	template<typename CT> static inline uchar majorityOut(const CT *cnt, uchar in)
+	{
+		int max = 0, maxpos = 0;
+		for(int b = 0; b<8; ++b)
+		{
+			if(cnt[b] > max) { max = cnt[b]; maxpos = b; }
+		}
+		if((max > 1)&&(in)) return (uchar)(1<<maxpos);
+		return in;
+	}
+
+	//3x3 majority: 9 neighbors are compared against each orientation bit, counts stay in uchar registers.
+	static void majority3x3_8UC1(const Mat &co, Mat &out, Mat &ring)
+	{
+		int cols = co.cols, rows = co.rows;
+		ring.create(3, cols + 2 + 16, CV_8UC1);
+		ring = Scalar::all(0);
+		//Row r of the image lives in ring row (r+1)%3, with one zero pixel to the left and right
+		loadPaddedRow(co, -1, ring.ptr<uchar>(0), 1);
+		loadPaddedRow(co, 0, ring.ptr<uchar>(1), 1);
+		for(int y = 0; y < rows; ++y)
+		{
+			//Read ahead one row before writing row y so that out can be co
+			loadPaddedRow(co, y + 1, ring.ptr<uchar>((y + 2)%3), 1);
+			const uchar *r0 = ring.ptr<uchar>(y%3), *r1 = ring.ptr<uchar>((y + 1)%3), *r2 = ring.ptr<uchar>((y + 2)%3);
+			uchar *o = out.ptr<uchar>(y);
+			int x = 0;
+#ifdef MMOD_SSE2
+			const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+			for(; x <= cols - 16; x += 16)
+			{
+				__m128i v[9];
+				v[0] = _mm_loadu_si128((const __m128i*)(r0 + x));
+				v[1] = _mm_loadu_si128((const __m128i*)(r0 + x + 1));
+				v[2] = _mm_loadu_si128((const __m128i*)(r0 + x + 2));
+				v[3] = _mm_loadu_si128((const __m128i*)(r1 + x));
+				v[4] = _mm_loadu_si128((const __m128i*)(r1 + x + 1)); //center
+				v[5] = _mm_loadu_si128((const __m128i*)(r1 + x + 2));
+				v[6] = _mm_loadu_si128((const __m128i*)(r2 + x));
+				v[7] = _mm_loadu_si128((const __m128i*)(r2 + x + 1));
+				v[8] = _mm_loadu_si128((const __m128i*)(r2 + x + 2));
+				__m128i maxv = zero, pos = zero;
+				for(int b = 0; b<8; ++b)
+				{
+					__m128i m = _mm_set1_epi8((char)(1<<b));
+					__m128i cnt = zero;
+					for(int k = 0; k<9; ++k)
+						cnt = _mm_sub_epi8(cnt, _mm_cmpeq_epi8(v[k], m)); //cmpeq gives -1 on a hit
+					__m128i gt = _mm_cmpgt_epi8(cnt, maxv);                //counts are <= 9, signed compare is fine
+					maxv = _mm_or_si128(_mm_and_si128(gt, cnt), _mm_andnot_si128(gt, maxv));
+					pos = _mm_or_si128(_mm_and_si128(gt, m), _mm_andnot_si128(gt, pos));
+				}
+				__m128i keep = _mm_andnot_si128(_mm_cmpeq_epi8(v[4], zero), _mm_cmpgt_epi8(maxv, one));
+				_mm_storeu_si128((__m128i*)(o + x), _mm_or_si128(_mm_and_si128(keep, pos), _mm_andnot_si128(keep, v[4])));
+			}
+#endif
+			for(; x < cols; ++x)
+			{
+				uchar cnt[8] = {0,0,0,0,0,0,0,0};
+				for(int b = 0; b<8; ++b)
+				{
+					uchar m = (uchar)(1<<b);
+					cnt[b] = (r0[x] == m) + (r0[x+1] == m) + (r0[x+2] == m) +
+					         (r1[x] == m) + (r1[x+1] == m) + (r1[x+2] == m) +
+					         (r2[x] == m) + (r2[x+1] == m) + (r2[x+2] == m);
+				}
+				o[x] = majorityOut(cnt, r1[x+1]);
+			}
+		}
+	}
+
+	//General span majority: a sliding histogram. For each orientation bit, count[b] holds the number of hits in the
+	//span rows of the window for every column (zero padded left and right), updated by adding the row entering
+	//and subtracting the row leaving. The horizontal window sum is then taken straight from those counts.
+	//CT is uchar when span*span fits in a byte, else ushort.
+	template<typename CT> static void majorityNxN_8UC1(const Mat &co, Mat &out, int span, Mat &ring, Mat &count)
+	{
+		int cols = co.cols, rows = co.rows;
+		int hi = span/2, lo = span - 1 - hi; //Window covers [p-lo, p+hi], the same as the accumulator version
+		int W = cols + span - 1;             //Padded width of the counts: lo zeros left, hi zeros right
+		ring.create(span, cols + 16, CV_8UC1);
+		count.create(8, (W + 16)*(int)sizeof(CT), CV_8UC1);
+		count = Scalar::all(0);
+		CT *cnt[8];
+		for(int b = 0; b<8; ++b)
+			cnt[b] = (CT*)count.ptr<uchar>(b);
+		//Prime the window for output row 0: rows [-lo, hi-1] (rows off the image count nothing)
+		for(int r = 0; r < hi; ++r)
+		{
+			if(r >= rows) break;
+			uchar *rr = ring.ptr<uchar>(r%span);
+			loadPaddedRow(co, r, rr, 0);
+			for(int b = 0; b<8; ++b)
+			{
+				uchar m = (uchar)(1<<b);
+				CT *c = cnt[b] + lo;
+				for(int x = 0; x < cols; ++x) c[x] += (rr[x] == m);
+			}
+		}
+		CT hist[8];
+		for(int y = 0; y < rows; ++y)
+		{
+			//Slide the window down: row y+hi comes in, row y-lo-1 leaves. Both share the same ring slot.
+			int rin = y + hi, rout = y - lo - 1;
+			uchar *slot = ring.ptr<uchar>((rin%span + span)%span);
+			if(rout >= 0)
+			{
+				for(int b = 0; b<8; ++b)
+				{
+					uchar m = (uchar)(1<<b);
+					CT *c = cnt[b] + lo;
+					int x = 0;
+#ifdef MMOD_SSE2
+					if(sizeof(CT) == 1)
+					{
+						__m128i vm = _mm_set1_epi8((char)m);
+						for(; x <= cols - 16; x += 16)
+						{
+							__m128i v = _mm_loadu_si128((const __m128i*)(slot + x));
+							__m128i cv = _mm_loadu_si128((const __m128i*)((uchar*)c + x));
+							_mm_storeu_si128((__m128i*)((uchar*)c + x), _mm_add_epi8(cv, _mm_cmpeq_epi8(v, vm)));
+						}
+					}
+#endif
+					for(; x < cols; ++x) c[x] -= (slot[x] == m);
+				}
+			}
+			if(rin < rows)
+			{
+				loadPaddedRow(co, rin, slot, 0);
+				for(int b = 0; b<8; ++b)
+				{
+					uchar m = (uchar)(1<<b);
+					CT *c = cnt[b] + lo;
+					int x = 0;
+#ifdef MMOD_SSE2
+					if(sizeof(CT) == 1)
+					{
+						__m128i vm = _mm_set1_epi8((char)m);
+						for(; x <= cols - 16; x += 16)
+						{
+							__m128i v = _mm_loadu_si128((const __m128i*)(slot + x));
+							__m128i cv = _mm_loadu_si128((const __m128i*)((uchar*)c + x));
+							_mm_storeu_si128((__m128i*)((uchar*)c + x), _mm_sub_epi8(cv, _mm_cmpeq_epi8(v, vm)));
+						}
+					}
+#endif
+					for(; x < cols; ++x) c[x] += (slot[x] == m);
+				}
+			}
+			//The center row is still held in its ring slot (co may already be overwritten by out)
+			const uchar *in = ring.ptr<uchar>(y%span);
+			uchar *o = out.ptr<uchar>(y);
+			int x = 0;
+#ifdef MMOD_SSE2
+			if(sizeof(CT) == 1)
+			{
+				const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1), sign = _mm_set1_epi8((char)0x80);
+				for(; x <= cols - 16; x += 16)
+				{
+					__m128i maxv = zero, pos = zero;
+					for(int b = 0; b<8; ++b)
+					{
+						const uchar *c = (const uchar*)cnt[b] + x;
+						__m128i h = zero;
+						for(int k = 0; k < span; ++k)
+							h = _mm_add_epi8(h, _mm_loadu_si128((const __m128i*)(c + k)));
+						//Counts can go up to 225, so compare as unsigned by flipping the sign bit
+						__m128i gt = _mm_cmpgt_epi8(_mm_xor_si128(h, sign), _mm_xor_si128(maxv, sign));
+						__m128i m = _mm_set1_epi8((char)(1<<b));
+						maxv = _mm_or_si128(_mm_and_si128(gt, h), _mm_andnot_si128(gt, maxv));
+						pos = _mm_or_si128(_mm_and_si128(gt, m), _mm_andnot_si128(gt, pos));
+					}
+					__m128i vin = _mm_loadu_si128((const __m128i*)(in + x));
+					__m128i keep = _mm_andnot_si128(_mm_cmpeq_epi8(vin, zero),
+					                                _mm_cmpgt_epi8(_mm_xor_si128(maxv, sign), _mm_xor_si128(one, sign)));
+					_mm_storeu_si128((__m128i*)(o + x), _mm_or_si128(_mm_and_si128(keep, pos), _mm_andnot_si128(keep, vin)));
+				}
+			}
+#endif
+			for(; x < cols; ++x)
+			{
+				for(int b = 0; b<8; ++b)
+				{
+					const CT *c = cnt[b] + x;
+					int h = 0;
+					for(int k = 0; k < span; ++k) h += c[k];
+					hist[b] = (CT)h;
+				}
+				o[x] = majorityOut(hist, in[x]);
+			}
+		}
+	}
+
+	/**
+	 * \brief Replace each on pixel of an 8UC1 single bit image by the bit in the majority within a span x span window.
+	 *
+	 * Same output as SumAroundEachPixel8UC1(co,out,span,1), but computed from small uchar (ushort for span > 15)
+	 * counters: span 3 is done entirely in registers, other spans with a sliding histogram of the window
+	 * columns. co must be at least span x span.
+	 *
+	 * @param co	input 8UC1 image where each pixel is a byte with at most 1 bit on
+	 * @param out	output "cleaned up" image (can be the same as co)
+	 * @param span	the size of the spanXspan window in which to calulate the majority
+	 */
+	void mmod_general::MajorityAroundEachPixel8UC1(const Mat &co, Mat &out, int span)
+	{
+		MajorityAroundEachPixel8UC1(co,out,span,work);
+	}
+	void mmod_general::MajorityAroundEachPixel8UC1(const Mat &co, Mat &out, int span, mmod_spread_work &w) const
+	{
+		GENL_DEBUG_1(cout << "In mmod_general::MajorityAroundEachPixel8UC1"<<endl;);
+		if(out.empty()||(out.size() != co.size())||(out.type()!=co.type()))
+		{
+			out.create(co.size(),co.type());
+		}
+		if(3 == span)
+			majority3x3_8UC1(co, out, w.majring);
+		else if(span <= 15)
+			majorityNxN_8UC1<uchar>(co, out, span, w.majring, w.majcount);
+		else
+			majorityNxN_8UC1<ushort>(co, out, span, w.majring, w.majcount);
+	}
+
+
+	/**
+	 * \brief Add this class's work images (accumulators and majority filter buffers) to a workspace check
+	 * @param ws	workspace to add them to
+	 */
+	void mmod_general::add_workspace(mmod_workspace &ws)
+	{
+		work.add_workspace(ws);
+	}
+
+	/**
+	 * \brief Add the work images to a workspace check
+	 * @param ws	workspace to add them to
+	 */
+	void mmod_spread_work::add_workspace(mmod_workspace &ws)
+	{
+		for(int i = 0; i<(int)acc.size(); ++i)
+		{
+			ws.add(acc[i]);
+			ws.add(acc2[i]);
+		}
+		ws.add(majring);
+		ws.add(majcount);
+	}
 
 
 	/**
@@ -937,6 +1335,53 @@ mmod_general::mmod_general()
 
 
 
+	/**
+	 * \brief Choose at most budget of the candidate features in selpt/selval/selconf, well spread and most confident first
+	 *
+	 * Scattered selection as in LINE-MOD: go through the candidates from most to least confident (selconf), keeping
+	 * one only if it is at least a distance away from all kept so far. Start with a distance that would about fit
+	 * budget features along the candidates and shrink it until budget features fit.
+	 *
+	 * @param budget	Features to keep. <= 0, or at least as many as there are candidates => keep all
+	 * @return			The distance the kept features are apart, 0 if all were kept. selkeep[i] is set if candidate i is kept
+	 */
+	int mmod_general::select_scattered_features(int budget)
+	{
+		int n = (int)selpt.size();
+		selkeep.assign(n, 1);
+		if(budget <= 0 || n <= budget) return 0;
+		//Most confident first, raster order among equals
+		selorder.resize(n);
+		for(int i = 0; i < n; ++i) selorder[i] = ((8 - selconf[i]) << 24) | i;
+		std::sort(selorder.begin(), selorder.end());
+		for(int i = 0; i < n; ++i) selorder[i] &= 0xffffff;
+		int dist = n/budget + 1;
+		for(; dist > 0; --dist)
+		{
+			selkeep.assign(n, 0);
+			int kept = 0, d2 = dist*dist;
+			selchosen.clear();
+			for(int i = 0; i < n && kept < budget; ++i)
+			{
+				const Point &p = selpt[selorder[i]];
+				bool far = true;
+				for(vector<int>::const_iterator it = selchosen.begin(); it != selchosen.end(); ++it)
+				{
+					int dx = selpt[*it].x - p.x, dy = selpt[*it].y - p.y;
+					if(dx*dx + dy*dy < d2) { far = false; break; }
+				}
+				if(!far) continue;
+				selchosen.push_back(selorder[i]);
+				selkeep[selorder[i]] = 1;
+				++kept;
+			}
+			if(kept >= budget) break;
+		}
+		GENL_DEBUG_2(cout << "select_scattered_features: kept " << budget << " of " << n << " at distance " << dist << endl;);
+		return dist;
+	}
+
+
 	/**
 	 * \brief Given a binarized feature image and a mask of where to collect features, learn a template there (no matter if other templates match it well).
 	 *
@@ -947,6 +1392,9 @@ mmod_general::mmod_general()
 	 * (found by using mmod_general::display_feature and then mmod_general::match_a_patch_bruteforce or by using
 	 * scalable matching).
 	 *
+	 * If feature_budget is set, only that many well spread, confident features are kept (select_scattered_features);
+	 * the budget, number of candidates and spacing are recorded with the template.
+	 *
 	 * @param Ifeatures   Input image 8U_C1 of binarized features
 	 * @param Mask		  Mask 8U_C1 of where the object is
 	 * @param framenum	  frame number of this view
@@ -980,60 +1428,74 @@ mmod_general::mmod_general()
 	    if(R.width > features.max_bounds.width) { features.max_bounds.width = R.width; features.max_bounds.x = R.x;}
 	    if(R.height > features.max_bounds.height) { features.max_bounds.height = R.height; features.max_bounds.y = R.y;}
 
-	    int featN = features.features.size() + 1;
-	    vector<uchar> fv;
-	    vector<Point> ov;
-	    vector<int> UL,UR,LL,LR;
-	    int index = 0;
+	    //COLLECT CANDIDATES: every masked pixel with a feature, with how many of its 8 neighbors agree on the orientation
+	    //(no magnitude is left in the feature image; agreement is our stand in for a strong, clean edge)
+	    selpt.clear(); selval.clear(); selconf.clear();
 	    GENL_DEBUG_3(cout << "Total possible pushbacks = " << R.width*R.height << endl;);
 	    int mcnt = 0,fcnt = 0;
 		for (int y = 0; y < Imroi.rows; y++)
 		{
-			//Output
-			uchar *f = Ifroi.ptr<uchar> (y);
-			uchar *m = Imroi.ptr<uchar> (y);
-			for (int x = 0; x < Imroi.cols; ++x, ++f, ++m)
+			const uchar *f = Ifroi.ptr<uchar> (y);
+			const uchar *fu = y > 0 ? Ifroi.ptr<uchar> (y-1) : 0;
+			const uchar *fd = y < Imroi.rows-1 ? Ifroi.ptr<uchar> (y+1) : 0;
+			const uchar *m = Imroi.ptr<uchar> (y);
+			for (int x = 0; x < Imroi.cols; ++x)
 			{
 				GENL_DEBUG_3(
-					if(*m) ++mcnt;
-					if(*f) ++fcnt;
+					if(m[x]) ++mcnt;
+					if(f[x]) ++fcnt;
 				);
-
-				if(*m && *f)
+				if(m[x] && f[x])
 				{
-					int ox = x-xc, oy = y-yc; //Feature offsets are relative to the center
-					ov.push_back(Point(ox,oy));
-					//Find quadrent of this point
-					if(oy<0) //U
+					uchar v = f[x];
+					int conf = 0;
+					for(int dx = -1; dx <= 1; ++dx)
 					{
-						if(ox<0) //UL
-						{
-							UL.push_back(index);
-						}
-						else //UR
-						{
-							UR.push_back(index);
-						}
-					}
-					else //L
-					{
-						if(ox<0) //LL
-						{
-							LL.push_back(index);
-						}
-						else //LR
-						{
-							LR.push_back(index);
-						}
+						int xx = x + dx;
+						if(xx < 0 || xx >= Imroi.cols) continue;
+						if(fu && fu[xx] == v) ++conf;
+						if(fd && fd[xx] == v) ++conf;
+						if(dx && f[xx] == v) ++conf;
 					}
-					fv.push_back(*f);
-					++index;
+					selpt.push_back(Point(x-xc,y-yc)); //Feature offsets are relative to the center
+					selval.push_back(v);
+					selconf.push_back(conf);
 				}//end IF in mask
-				//cout << endl;
 			}//end for x
 		}//end for y
+		int ncand = (int)selpt.size();
+		int spacing = select_scattered_features(feature_budget);
+
+		//KEEP THE SELECTED FEATURES, in raster order, and sort them into quadrants
+	    vector<uchar> fv;
+	    vector<Point> ov;
+	    vector<int> UL,UR,LL,LR;
+	    int index = 0;
+		for(int i = 0; i < ncand; ++i)
+		{
+			if(!selkeep[i]) continue;
+			int ox = selpt[i].x, oy = selpt[i].y;
+			ov.push_back(selpt[i]);
+			//Find quadrent of this point
+			if(oy<0) //U
+			{
+				if(ox<0) //UL
+					UL.push_back(index);
+				else //UR
+					UR.push_back(index);
+			}
+			else //L
+			{
+				if(ox<0) //LL
+					LL.push_back(index);
+				else //LR
+					LR.push_back(index);
+			}
+			fv.push_back(selval[i]);
+			++index;
+		}
 		GENL_DEBUG_3(
-				cout << "Pushed back " << fv.size() << " feature values with maskcnt = " << mcnt << "and fcnt = " << fcnt << endl;
+				cout << "Pushed back " << fv.size() << " of " << ncand << " feature values with maskcnt = " << mcnt << "and fcnt = " << fcnt << endl;
 		);
 		features.features.push_back(fv);
 		features.offsets.push_back(ov);
@@ -1041,6 +1503,9 @@ mmod_general::mmod_general()
 		features.quadUR.push_back(UR);
 		features.quadLL.push_back(LL);
 		features.quadLR.push_back(LR);
+		features.budget.push_back(feature_budget > 0 ? feature_budget : 0);
+		features.candidates.push_back(ncand);
+		features.spacing.push_back(spacing);
 		features.bbox.push_back(R);
 		GENL_DEBUG_2(
 			cout << "At end: features.features[" << features.features.size() - 1 << "] =" << features.features[features.features.size() - 1].size() << endl;
@@ -1110,3 +1575,72 @@ mmod_general::mmod_general()
 
 
 
+
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * \brief Start the workers
+ * @param nthreads	Threads to compute with, counting the caller of run(). 0 => one per hardware thread
+ */
+mmod_thread_pool::mmod_thread_pool(int nthreads) : tasks(0), next(0), pending(0), quit(false)
+{
+	if(nthreads <= 0) nthreads = (int)boost::thread::hardware_concurrency();
+	for(int i = 1; i < nthreads; ++i)
+		threads.create_thread(boost::bind(&mmod_thread_pool::worker, this));
+}
+
+mmod_thread_pool::~mmod_thread_pool()
+{
+	{
+		boost::lock_guard<boost::mutex> lock(mtx);
+		quit = true;
+	}
+	work_cv.notify_all();
+	threads.join_all();
+}
+
+//Take the next task of the batch, if any, and run it with the lock released. Returns false if there was none.
+bool mmod_thread_pool::run_one(boost::unique_lock<boost::mutex> &lock)
+{
+	if(!tasks || next >= tasks->size()) return false;
+	boost::function<void()> &task = (*tasks)[next++];
+	lock.unlock();
+	string what;
+	try { task(); }
+	catch(std::exception &e) { what = e.what(); if(what.empty()) what = "unknown error"; }
+	catch(...) { what = "unknown error"; }
+	lock.lock();
+	if(!what.empty() && error.empty()) error = what;
+	if(--pending == 0) done_cv.notify_all();
+	return true;
+}
+
+void mmod_thread_pool::worker()
+{
+	boost::unique_lock<boost::mutex> lock(mtx);
+	while(!quit)
+	{
+		if(!run_one(lock))
+			work_cv.wait(lock);
+	}
+}
+
+/**
+ * \brief Run all tasks and wait for them to finish. Throws std::runtime_error if a task threw.
+ * @param batch	Tasks to run, in no particular order
+ */
+void mmod_thread_pool::run(std::vector<boost::function<void()> > &batch)
+{
+	if(batch.empty()) return;
+	boost::unique_lock<boost::mutex> lock(mtx);
+	tasks = &batch;
+	next = 0;
+	pending = batch.size();
+	error.clear();
+	work_cv.notify_all();
+	while(run_one(lock)) {}	//Help out, then wait for the stragglers
+	while(pending) done_cv.wait(lock);
+	tasks = 0;
+	if(!error.empty())
+		throw std::runtime_error("mmod_thread_pool task failed: " + error);
+}
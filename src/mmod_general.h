@@ -11,6 +11,9 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <string>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
 #include "mmod_features.h"
 
 //DEFINES
@@ -41,11 +44,111 @@
 #define GENL_DEBUG_4(X) do{}while(false)
 #endif
 #define FLOATLUT  //Appears that this is faster.
+#if defined(__SSE2__)
+#define MMOD_SSE2 //Use the SSE2 kernels where we have them. Comment out to run only the plain C++ loops
+#endif
+//////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ *\brief Keeps track of whether the work images of a class had to be (re)allocated during a frame.
+ *
+ * Classes that keep their temporary images from call to call (mmod_general, the feature classes in mmod_color.h)
+ * add() each of them at the end of a frame and then call end_frame(). allocations counts the frames in which
+ * any of those images got a new buffer, so once the first frame has sized everything it should stop growing.
+ * Only the buffers of the images added are watched (Mat::data): other heap use, such as std::vector growth or
+ * the temporaries of the OpenCV calls made, is not counted.
+ *
+ * The feature classes hand out their count as workspace_allocations(): 1 after any number of calls on images of
+ * one size. A call that needs a work image it hasn't got yet (another size, a first CV_8UC3 mask, ...) adds one.
+ */
+class mmod_workspace
+{
+	std::vector<const uchar*> bufs;	//Buffer of each work image as of the last frame
+	size_t n;						//Images added so far this frame
+	bool moved;						//Some buffer changed this frame
+public:
+	int allocations;				//Number of frames in which some work image was (re)allocated
+
+	mmod_workspace() : n(0), moved(false), allocations(0) {}
+
+	void add(const cv::Mat &m)
+	{
+		if(n == bufs.size()) { bufs.push_back(m.data); moved = true; }
+		else if(bufs[n] != m.data) { bufs[n] = m.data; moved = true; }
+		++n;
+	}
+
+	void end_frame()
+	{
+		if(moved) ++allocations;
+		moved = false;
+		n = 0;
+	}
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ *\brief Fixed set of worker threads that run batches of independent tasks.
+ *
+ * run() hands out the tasks of one batch to the workers (the calling thread helps too) and returns once all of
+ * them are done, so consecutive run() calls act as barriers between the phases of a computation.
+ */
+class mmod_thread_pool
+{
+	boost::thread_group threads;
+	boost::mutex mtx;
+	boost::condition_variable work_cv, done_cv;
+	std::vector<boost::function<void()> > *tasks;	//Current batch, NULL when idle
+	size_t next;									//Next task of the batch to hand out
+	size_t pending;									//Tasks of the batch not finished yet
+	bool quit;
+	std::string error;								//what() of the first task that threw in this batch
+
+	void worker();
+	bool run_one(boost::unique_lock<boost::mutex> &lock);
+	mmod_thread_pool(const mmod_thread_pool &);				//Not copyable
+	mmod_thread_pool &operator=(const mmod_thread_pool &);
+public:
+	/**
+	 * \brief Start the workers
+	 * @param nthreads	Threads to compute with, counting the caller of run(). 0 => one per hardware thread
+	 */
+	mmod_thread_pool(int nthreads = 0);
+	~mmod_thread_pool();
+
+	/**
+	 * \brief Number of threads that work on a batch, including the caller of run()
+	 */
+	int size() const { return (int)threads.size() + 1; }
+
+	/**
+	 * \brief Run all tasks and wait for them to finish. Throws std::runtime_error if a task threw.
+	 * @param batch	Tasks to run, in no particular order
+	 */
+	void run(std::vector<boost::function<void()> > &batch);
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ *\brief Work images of mmod_general::SumAroundEachPixel8UC1. Threads that clean up and spread with one shared
+ *\brief const mmod_general each bring their own.
+ */
+struct mmod_spread_work
+{
+	std::vector<cv::Mat> acc,acc2; //Box sum planes for BoxSumAroundEachPixel8UC1
+	cv::Mat majring, majcount; //Row ring buffer and per orientation column counts for MajorityAroundEachPixel8UC1
+
+	/**
+	 * \brief Add the work images to a workspace check
+	 * @param ws	workspace to add them to
+	 */
+	void add_workspace(mmod_workspace &ws);
+};
+
 //////////////////////////////////////////////////////////////////////////////////////////////
 class mmod_general
 {
 public:
-	std::vector<cv::Mat> acc,acc2;
+	mmod_spread_work work; //SumAroundEachPixel8UC1 work images, when the caller doesn't pass its own
 	int lut[256];//Lookup table converting bit position in a byte (the equivalent number) to its actual bit position
 #ifdef FLOATLUT
 	std::vector<std::vector<float> > matchLUT; //matchLUT[lut[model_uchar]][image_uchar];
@@ -53,6 +156,12 @@ public:
 	std::vector<std::vector<int> > matchLUT; //matchLUT[lut[model_uchar]][image_uchar];
 #endif
 //	std::vector<std::vector<char> > matchLUT; //matchLUT[lut[model_uchar]][image_uchar];
+	int feature_budget; //learn_a_template keeps at most this many features per template (well spread ones). 0 => keep all
+	std::vector<cv::Point> selpt;		//learn_a_template work: candidate feature offsets,
+	std::vector<uchar> selval;			//  their values,
+	std::vector<int> selconf;			//  confidence (neighbors with the same orientation)
+	std::vector<int> selorder, selchosen;//  and select_scattered_features' visiting order and kept list
+	std::vector<uchar> selkeep;			//  Kept candidates
 
 	/**
 	 * \brief mmod_general constructor. Fills Cos distances in matchLUT.
@@ -120,13 +229,36 @@ public:
 	 *
 	 * Do a brute force match of all the templates in a given mmod_features at a given pixel (Point) in an image.  It does bounds checking for you.
 	 *
-	 * @param I				Input image or patch
+	 * @param I				Input image or patch, CV_8UC1 or an interleaved CV_8UC(n) feature image (see interleave_features)
 	 * @param p				Point(x,y) at which to match
 	 * @param f				trained mmod_features reference to match against
 	 * @param match_index   which feature had the maximal match score
+	 * @param channel		which channel (modality) of an interleaved I to match against
 	 * @return				score of maximal match. If f is empty, return 0 (nothing matches)
 	 */
-	float match_a_patch_bruteforce(const cv::Mat &I, const cv::Point &p, mmod_features &f, int &match_index);
+	float match_a_patch_bruteforce(const cv::Mat &I, const cv::Point &p, mmod_features &f, int &match_index, int channel = 0);
+
+	/**
+	 * \brief match_a_patch_bruteforce over only some of the views (templates) in f, e.g. those a view_index proposed
+	 *
+	 * @param I				Input image or patch, CV_8UC1
+	 * @param p				Point(x,y) at which to match
+	 * @param f				trained mmod_features reference to match against
+	 * @param views			indices of the views in f to match
+	 * @param match_index   which feature had the maximal match score, -1 if none scored
+	 * @return				score of maximal match over views. If views is empty, return 0 (nothing matches)
+	 */
+	float match_a_patch_views(const cv::Mat &I, const cv::Point &p, mmod_features &f, const std::vector<int> &views,
+			int &match_index);
+
+	/**
+	 * \brief Interleave CV_8UC1 feature images of several modalities into one CV_8UC(n) image, one byte per modality
+	 * \brief per pixel, so matching all modalities at a point reads the same cache lines
+	 * @param I				For each modality, a CV_8UC1 feature image, all the same size
+	 * @param out			Interleaved feature image, channel i is I[i]
+	 * @return				0, or -1 (and complains) if the images don't fit together
+	 */
+	int interleave_features(const std::vector<cv::Mat> &I, cv::Mat &out);
 
 
 	/**
@@ -155,6 +287,38 @@ public:
 	 */
 	void SumAroundEachPixel8UC1(cv::Mat &co, cv::Mat &out, int span = 8, int Or0_Max1 = 0);
 
+	/**
+	 * \brief SumAroundEachPixel8UC1 with the caller's work images, so that threads can share one mmod_general
+	 * @param w	work images, kept by the caller from call to call
+	 */
+	void SumAroundEachPixel8UC1(cv::Mat &co, cv::Mat &out, int span, int Or0_Max1, mmod_spread_work &w) const;
+
+	/**
+	 * \brief The original SumAroundEachPixel8UC1, which box sums 8 int32 accumulator planes for both the OR and
+	 * \brief the majority case. Same arguments as SumAroundEachPixel8UC1.
+	 */
+	void BoxSumAroundEachPixel8UC1(cv::Mat &co, cv::Mat &out, int span = 8, int Or0_Max1 = 0);
+	void BoxSumAroundEachPixel8UC1(cv::Mat &co, cv::Mat &out, int span, int Or0_Max1, mmod_spread_work &w) const;
+
+	/**
+	 * \brief Replace each on pixel of an 8UC1 single bit image by the bit in the majority within a span x span window.
+	 *
+	 * Same output as SumAroundEachPixel8UC1(co,out,span,1) (the one it calls for Or0_Max1 = 1) using small
+	 * uchar/ushort counters instead of int32 planes. span 3 has its own kernel. co must be at least span x span.
+	 *
+	 * @param co	input 8UC1 image where each pixel is a byte with at most 1 bit on
+	 * @param out	output "cleaned up" image (can be the same as co)
+	 * @param span	the size of the spanXspan window in which to calulate the majority
+	 */
+	void MajorityAroundEachPixel8UC1(const cv::Mat &co, cv::Mat &out, int span = 3);
+	void MajorityAroundEachPixel8UC1(const cv::Mat &co, cv::Mat &out, int span, mmod_spread_work &w) const;
+
+	/**
+	 * \brief Add this class's work images (accumulators and majority filter buffers) to a workspace check
+	 * @param ws	workspace to add them to
+	 */
+	void add_workspace(mmod_workspace &ws);
+
 
 
 	/**
@@ -198,6 +362,18 @@ public:
 	int  nonMaxRectSuppress(std::vector<cv::Rect> &rv, std::vector<float> &scores, std::vector<std::string> &object_ID, std::vector<int> &frame_number,
 			std::vector<std::vector<int> > &feature_indices, float frac_overlap);
 
+	/**
+	 * \brief Choose at most budget of the candidate features in selpt/selval/selconf, well spread and most confident first
+	 *
+	 * Scattered selection as in LINE-MOD: go through the candidates from most to least confident (selconf), keeping
+	 * one only if it is at least a distance away from all kept so far. Start with a distance that would about fit
+	 * budget features along the candidates and shrink it until budget features fit.
+	 *
+	 * @param budget	Features to keep. <= 0, or at least as many as there are candidates => keep all
+	 * @return			The distance the kept features are apart, 0 if all were kept. selkeep[i] is set if candidate i is kept
+	 */
+	int select_scattered_features(int budget);
+
 	/**
 	 * \brief Given a binarized feature image and a mask of where to collect features, learn a template there (no matter if other templates match it well).
 	 *
@@ -208,6 +384,9 @@ public:
 	 * (found by using mmod_general::display_feature and then mmod_general::match_a_patch_bruteforce or by using
 	 * scalable matching).
 	 *
+	 * If feature_budget is set, only that many well spread, confident features are kept (select_scattered_features);
+	 * the budget, number of candidates and spacing are recorded with the template.
+	 *
 	 * @param Ifeatures   Input image 8U_C1 of binarized features
 	 * @param Mask		  Mask 8U_C1 of where the object is
 	 * @param framenum	  frame number of this view
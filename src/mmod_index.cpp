@@ -0,0 +1,126 @@
+/*
+ * mmod_index.cpp
+ *
+ *  Created on: Oct 19, 2026
+ */
+#include "mmod_index.h"
+#include <algorithm>
+#include <climits>
+using namespace cv;
+using namespace std;
+
+//32 bit integer mixer (finalizer of MurmurHash3)
+static inline unsigned int mix32(unsigned int h)
+{
+	h ^= h >> 16; h *= 0x85ebca6bU;
+	h ^= h >> 13; h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+//Cell of an offset coordinate, rounding toward minus infinity so cells don't double up around the center
+static inline int cell_of(int v)
+{
+	return v >= 0 ? v / INDEX_CELL : -((-v + INDEX_CELL - 1) / INDEX_CELL);
+}
+
+view_index::view_index()
+{
+	nviews = 0;
+	sig.resize(INDEX_BANDS*INDEX_ROWS);
+}
+
+/**
+ * \brief Forget all views
+ */
+void view_index::clear()
+{
+	buckets.clear();
+	nviews = 0;
+}
+
+/**
+ * \brief Fill sig with the MinHash signature of the view with features feat at offsets off
+ */
+void view_index::signature(const vector<uchar> &feat, const vector<Point> &off)
+{
+	//TOKENS: (cell x, cell y, feature value). The feature byte is kept whole, it has one bit on
+	tokens.clear();
+	size_t n = min(feat.size(), off.size());
+	for(size_t i = 0; i < n; ++i)
+	{
+		unsigned int t = ((unsigned int)(cell_of(off[i].x) & 0x3ff) << 18) |
+		                 ((unsigned int)(cell_of(off[i].y) & 0x3ff) << 8) | feat[i];
+		tokens.push_back(t);
+	}
+	sort(tokens.begin(), tokens.end());
+	tokens.erase(unique(tokens.begin(), tokens.end()), tokens.end());
+	//MINHASH: one salted hash per signature entry, keep the minimum over the tokens
+	for(size_t h = 0; h < sig.size(); ++h)
+	{
+		unsigned int salt = mix32((unsigned int)h + 0x9e3779b9U);
+		unsigned int m = UINT_MAX;
+		for(vector<unsigned int>::const_iterator it = tokens.begin(); it != tokens.end(); ++it)
+		{
+			unsigned int v = mix32(*it ^ salt);
+			if(v < m) m = v;
+		}
+		sig[h] = m;
+	}
+}
+
+/**
+ * \brief Bucket key of band b of sig
+ */
+unsigned int view_index::band_key(int b) const
+{
+	unsigned int k = mix32((unsigned int)b + 1);
+	for(int r = 0; r < INDEX_ROWS; ++r)
+		k = mix32(k ^ (sig[b*INDEX_ROWS + r] + 0x9e3779b9U + (k << 6) + (k >> 2)));
+	return k;
+}
+
+/**
+ * \brief Add a view as number size()
+ * @param feat		the view's features (one bit on per feature), as in mmod_features::features
+ * @param off		their offsets, as in mmod_features::offsets
+ */
+void view_index::add(const vector<uchar> &feat, const vector<Point> &off)
+{
+	signature(feat, off);
+	for(int b = 0; b < INDEX_BANDS; ++b)
+		buckets[band_key(b)].push_back(nviews);
+	++nviews;
+}
+
+/**
+ * \brief Add the views of f that are not in the index yet. If f has fewer views than the index, rebuild it from f
+ * @param f			views to index, in order
+ */
+void view_index::sync(const mmod_features &f)
+{
+	int n = (int)f.features.size();
+	if(n < nviews) clear();
+	for(int i = nviews; i < n; ++i)
+		add(f.features[i], f.offsets[i]);
+}
+
+/**
+ * \brief Views that share at least one band with the view (feat, off)
+ * @param feat		features of the query view
+ * @param off		their offsets
+ * @param views		Output: candidate view numbers, increasing
+ */
+void view_index::candidates(const vector<uchar> &feat, const vector<Point> &off, vector<int> &views)
+{
+	views.clear();
+	signature(feat, off);
+	for(int b = 0; b < INDEX_BANDS; ++b)
+	{
+		Buckets::const_iterator it = buckets.find(band_key(b));
+		if(it != buckets.end())
+			views.insert(views.end(), it->second.begin(), it->second.end());
+	}
+	sort(views.begin(), views.end());
+	views.erase(unique(views.begin(), views.end()), views.end());
+}
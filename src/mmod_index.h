@@ -0,0 +1,85 @@
+/*
+ * mmod_index.h
+ *
+ * Approximate similarity index over the learned views (templates) of one object in one mode. Each view is turned
+ * into a set of (offset cell, orientation) tokens and summarized by a MinHash signature, which is cut into bands
+ * and hashed into buckets (locality sensitive hashing). Views sharing a bucket with a query are the candidates that
+ * mmod_mode::learn_a_template then checks exactly, instead of matching against every view learned so far.
+ *
+ *  Created on: Oct 19, 2026
+ */
+
+#ifndef MMOD_INDEX_H_
+#define MMOD_INDEX_H_
+#include <opencv2/opencv.hpp>
+#include <map>
+#include <vector>
+#include "mmod_general.h"
+
+//DEFINES
+#define INDEX_CELL   ORAMT	//Offsets are quantized to cells of this many pixels, about what ORing tolerates
+#define INDEX_BANDS  8		//LSH bands. A view is a candidate if all rows of any one band agree with the query
+#define INDEX_ROWS   2		//MinHashes per band. Chance a view with token overlap (Jaccard) J is proposed: 1-(1-J^R)^B
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ *\brief MinHash/LSH index of the views of an mmod_features, proposing the views likely to match a new one.
+ *
+ * Views are numbered in the order they are added, which is meant to be their index in mmod_features::features.
+ * The index is approximate: a view it doesn't propose may still have matched, never the other way around since
+ * every candidate is scored exactly by the caller.
+ */
+class view_index
+{
+	typedef std::map<unsigned int, std::vector<int> > Buckets; //(band hash, views in that bucket)
+	Buckets buckets;
+	int nviews;								//Views added so far
+	std::vector<unsigned int> tokens;		//Work: tokens of the view being hashed
+	std::vector<unsigned int> sig;			//Work: its MinHash signature
+
+	/**
+	 * \brief Fill sig with the MinHash signature of the view with features feat at offsets off
+	 */
+	void signature(const std::vector<uchar> &feat, const std::vector<cv::Point> &off);
+
+	/**
+	 * \brief Bucket key of band b of sig
+	 */
+	unsigned int band_key(int b) const;
+
+public:
+	view_index();
+
+	/**
+	 * \brief Number of views added
+	 */
+	int size() const { return nviews; }
+
+	/**
+	 * \brief Forget all views
+	 */
+	void clear();
+
+	/**
+	 * \brief Add a view as number size()
+	 * @param feat		the view's features (one bit on per feature), as in mmod_features::features
+	 * @param off		their offsets, as in mmod_features::offsets
+	 */
+	void add(const std::vector<uchar> &feat, const std::vector<cv::Point> &off);
+
+	/**
+	 * \brief Add the views of f that are not in the index yet. If f has fewer views than the index, rebuild it from f
+	 * @param f			views to index, in order
+	 */
+	void sync(const mmod_features &f);
+
+	/**
+	 * \brief Views that share at least one band with the view (feat, off)
+	 * @param feat		features of the query view
+	 * @param off		their offsets
+	 * @param views		Output: candidate view numbers, increasing
+	 */
+	void candidates(const std::vector<uchar> &feat, const std::vector<cv::Point> &off, std::vector<int> &views);
+};
+
+#endif /* MMOD_INDEX_H_ */
@@ -0,0 +1,464 @@
+/*
+ * mmod_journal.cpp
+ *
+ *  Created on: Oct 19, 2026
+ */
+#include "mmod_journal.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+using namespace std;
+
+////////////////////////////////////////////////////////////////////////////////
+// JOURNAL FILE FORMAT. Numbers are little endian 32 bit:
+//   header    magic[8] MMOD_JOURNAL_MAGIC, version, reserved (16 bytes)
+//   records   payload bytes, FNV-1a checksum of the payload, payload: a headerless boost binary archive of the kind
+//             (JOURNAL_OBJECT_VIEW, JOURNAL_FILTER_VIEW), mode, object, view number and an mmod_features of that one view
+// Records are only ever appended; one cut short (or failing its checksum) is where a crash interrupted the journal.
+#define MMOD_JOURNAL_MAGIC "MMODJNL"
+#define MMOD_JOURNAL_VERSION 1
+#define MMOD_JOURNAL_HEADER 16
+enum { JOURNAL_OBJECT_VIEW, JOURNAL_FILTER_VIEW };
+
+typedef map<string, mmod_features> Views; //mmod_mode::ObjectModels, mmod_filters::ObjFilters
+typedef map<pair<string, string>, pair<int, int> > Persisted;
+
+static void put32(char *p, uint32_t v)
+{
+	p[0] = (char)v; p[1] = (char)(v >> 8); p[2] = (char)(v >> 16); p[3] = (char)(v >> 24);
+}
+
+static uint32_t get32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+static uint32_t checksum(const char *p, size_t n)
+{
+	uint32_t h = 2166136261u;
+	for(size_t i = 0; i < n; ++i)
+		h = (h ^ (unsigned char)p[i]) * 16777619u;
+	return h;
+}
+
+//The views of object in mode, NULL if there are none
+static const mmod_features *views_of(int kind, const string &mode, const string &object, const mmod_objects &objs,
+		const mmod_filters &filters)
+{
+	const Views *v = &filters.ObjViews;
+	if(kind == JOURNAL_OBJECT_VIEW)
+	{
+		mmod_objects::ModelsForModes::const_iterator mit = objs.modes.find(mode);
+		if(mit == objs.modes.end()) return 0;
+		v = &mit->second.objs;
+	}
+	else if(mode != filters.mode) return 0;
+	Views::const_iterator it = v->find(object);
+	return it == v->end() ? 0 : &it->second;
+}
+
+//(views, frame of the last one) of every object of a mode
+static void count_views(const string &mode, const Views &v, Persisted &done)
+{
+	for(Views::const_iterator it = v.begin(); it != v.end(); ++it)
+	{
+		int n = (int)it->second.features.size();
+		if(n > 0) done[make_pair(mode, it->first)] = make_pair(n, it->second.frame_number[n - 1]);
+	}
+}
+
+//True if the views in done are all still there, unchanged as far as the frame of the last one tells
+static bool only_added(int kind, const Persisted &done, const mmod_objects &objs, const mmod_filters &filters)
+{
+	for(Persisted::const_iterator it = done.begin(); it != done.end(); ++it)
+	{
+		const mmod_features *f = views_of(kind, it->first.first, it->first.second, objs, filters);
+		int n = it->second.first;
+		if(!f || (int)f->features.size() < n || f->frame_number[n - 1] != it->second.second) return false;
+	}
+	return true;
+}
+
+//Append a record of view i of f to buf
+static void add_record(int kind, const string &mode, const string &object, const mmod_features &f, int i, string &buf)
+{
+	mmod_features v;
+	v.session_ID = f.session_ID;
+	v.object_ID = f.object_ID;
+	v.insert(f, i);
+	ostringstream ss;
+	{
+		boost::archive::binary_oarchive oa(ss, boost::archive::no_header);
+		const mmod_features &cv = v;
+		oa << kind << mode << object << i << cv;
+	}
+	string payload = ss.str();
+	char h[8];
+	put32(h, (uint32_t)payload.size());
+	put32(h + 4, checksum(payload.data(), payload.size()));
+	buf.append(h, 8);
+	buf += payload;
+}
+
+//Records of the views of v past those in done, done updated
+static int add_records(int kind, const string &mode, const Views &v, Persisted &done, string &buf)
+{
+	int n = 0;
+	for(Views::const_iterator it = v.begin(); it != v.end(); ++it)
+	{
+		const mmod_features &f = it->second;
+		if(f.features.empty()) continue;
+		pair<int, int> &d = done[make_pair(mode, it->first)];
+		for(int i = d.first; i < (int)f.features.size(); ++i, ++n)
+			add_record(kind, mode, it->first, f, i, buf);
+		d = make_pair((int)f.features.size(), f.frame_number.back());
+	}
+	return n;
+}
+
+//Sync a file (or directory) already written, by name
+static bool sync_path(const string &name)
+{
+	int fd = ::open(name.c_str(), O_RDONLY);
+	if(fd < 0) return false;
+	bool ok = fsync(fd) == 0;
+	::close(fd);
+	return ok;
+}
+
+//Directory of a file name, for syncing a rename into it
+static string dir_of(const string &name)
+{
+	size_t slash = name.rfind('/');
+	if(slash == string::npos) return ".";
+	return slash == 0 ? "/" : name.substr(0, slash);
+}
+
+//Write t as a binary archive, to a temporary file synced then renamed over name, and sync the rename: once this
+//returns, name holds t even if the machine goes down
+template<class T> static bool save(const string &name, const T &t)
+{
+	string tmp = name + ".tmp";
+	{
+		ofstream ofs(tmp.c_str(), ios::binary);
+		if(!ofs)
+		{
+			cerr << "ERROR, in mmod_journal, couldn't write " << tmp << endl;
+			return false;
+		}
+		boost::archive::binary_oarchive oa(ofs);
+		oa << t;
+		ofs.flush();
+		if(!ofs)
+		{
+			cerr << "ERROR, in mmod_journal, couldn't write " << tmp << endl;
+			return false;
+		}
+	}
+	if(!sync_path(tmp))
+	{
+		cerr << "ERROR, in mmod_journal, couldn't sync " << tmp << endl;
+		return false;
+	}
+	if(rename(tmp.c_str(), name.c_str()) != 0)
+	{
+		cerr << "ERROR, in mmod_journal, couldn't rename " << tmp << " to " << name << endl;
+		return false;
+	}
+	if(!sync_path(dir_of(name)))
+	{
+		cerr << "ERROR, in mmod_journal, couldn't sync the directory of " << name << endl;
+		return false;
+	}
+	return true;
+}
+
+//Size of a file, -1 if there is none
+static long file_size(const string &name)
+{
+	struct stat st;
+	return stat(name.c_str(), &st) == 0 ? (long)st.st_size : -1;
+}
+
+//Read a binary archive into t. A missing file leaves t alone
+template<class T> static bool load(const string &name, T &t)
+{
+	ifstream ifs(name.c_str(), ios::binary);
+	if(!ifs) return true;
+	try
+	{
+		boost::archive::binary_iarchive ia(ifs);
+		ia >> t;
+	}
+	catch(std::exception &e)
+	{
+		cerr << "ERROR, in mmod_journal, couldn't read " << name << ": " << e.what() << endl;
+		return false;
+	}
+	return true;
+}
+
+//Write and sync
+static bool write_synced(FILE *fp, const string &buf)
+{
+	return fwrite(buf.data(), 1, buf.size(), fp) == buf.size() && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+}
+
+mmod_journal::mmod_journal() : fp(0), npending(0), nbytes(0)
+{
+}
+
+/**
+ * \brief Closes the journal (what was appended stays on disk, see fold to merge it into the archives)
+ */
+mmod_journal::~mmod_journal()
+{
+	close();
+}
+
+/**
+ * \brief Close the journal file
+ */
+void mmod_journal::close()
+{
+	if(fp) fclose(fp);
+	fp = 0;
+}
+
+/**
+ * \brief Persist to these files. The first append (or compact) then writes both archives and starts the journal
+ * \brief afresh, replacing what they held. A journal still holding views (of a run that never folded it) is not
+ * \brief replaced: it and the archives are the only copy of that model, mmod_recover them first
+ * @param objects_file	Binary archive of the mmod_objects
+ * @param filters_file	Binary archive of the mmod_filters
+ * @param journal_file	Journal of the views learned since the archives were written
+ * @return	0, -1 => journal_file holds views, nothing will be written
+ */
+int mmod_journal::open(const string &objects_file, const string &filters_file, const string &journal_file)
+{
+	close();
+	this->objects_file = objects_file;
+	this->filters_file = filters_file;
+	this->journal_file = journal_file;
+	objects_done.clear();
+	filters_done.clear();
+	npending = 0;
+	nbytes = 0;
+	if(file_size(journal_file) > MMOD_JOURNAL_HEADER)
+	{
+		cerr << "ERROR, in mmod_journal::open, " << journal_file << " holds views not in " << objects_file << ", "
+		     << filters_file << " (an interrupted run): run mmod_recover on them and move them away first" << endl;
+		this->objects_file.clear(); //Not open: compact won't touch them
+		this->filters_file.clear();
+		this->journal_file.clear();
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * \brief Journal the views learned since the last append or compact (compacting if views were dropped or changed)
+ * @return	Views appended, -1 => error
+ */
+int mmod_journal::append(const mmod_objects &objs, const mmod_filters &filters)
+{
+	if(!fp || !only_added(JOURNAL_OBJECT_VIEW, objects_done, objs, filters)
+			|| !only_added(JOURNAL_FILTER_VIEW, filters_done, objs, filters))
+		return compact(objs, filters) < 0 ? -1 : 0;
+	string buf;
+	int n = 0;
+	for(mmod_objects::ModelsForModes::const_iterator mit = objs.modes.begin(); mit != objs.modes.end(); ++mit)
+		n += add_records(JOURNAL_OBJECT_VIEW, mit->first, mit->second.objs, objects_done, buf);
+	n += add_records(JOURNAL_FILTER_VIEW, filters.mode, filters.ObjViews, filters_done, buf);
+	if(!n) return 0;
+	if(!write_synced(fp, buf))
+	{
+		cerr << "ERROR, in mmod_journal::append, couldn't write " << journal_file << endl;
+		close(); //Next time compact, rewriting everything
+		return -1;
+	}
+	npending += n;
+	nbytes += (long)buf.size();
+	return n;
+}
+
+/**
+ * \brief Write both archives (each to a temporary file synced and renamed over the old one) and empty the journal
+ * @return	0, -1 => error
+ */
+int mmod_journal::compact(const mmod_objects &objs, const mmod_filters &filters)
+{
+	close();
+	if(objects_file.empty())
+	{
+		cerr << "ERROR, in mmod_journal::compact, not open" << endl;
+		return -1;
+	}
+	if(!save(objects_file, objs) || !save(filters_file, filters)) return -1;
+	fp = fopen(journal_file.c_str(), "wb");
+	char h[MMOD_JOURNAL_HEADER];
+	memset(h, 0, sizeof(h));
+	memcpy(h, MMOD_JOURNAL_MAGIC, 8);
+	put32(h + 8, MMOD_JOURNAL_VERSION);
+	if(!fp || !write_synced(fp, string(h, sizeof(h))))
+	{
+		cerr << "ERROR, in mmod_journal::compact, couldn't write " << journal_file << endl;
+		close();
+		return -1;
+	}
+	JOURNAL_DEBUG_1(cout << "mmod_journal: compacted " << npending << " journaled views into " << objects_file << ", "
+			<< filters_file << endl;);
+	objects_done.clear();
+	filters_done.clear();
+	for(mmod_objects::ModelsForModes::const_iterator mit = objs.modes.begin(); mit != objs.modes.end(); ++mit)
+		count_views(mit->first, mit->second.objs, objects_done);
+	count_views(filters.mode, filters.ObjViews, filters_done);
+	npending = 0;
+	nbytes = MMOD_JOURNAL_HEADER;
+	return 0;
+}
+
+/**
+ * \brief Merge the journal into the archives, without the model in hand: recover, write both archives, empty the
+ * \brief journal
+ * @return	Views replayed, -1 => error
+ */
+int mmod_journal::fold()
+{
+	close();
+	if(objects_file.empty())
+	{
+		cerr << "ERROR, in mmod_journal::fold, not open" << endl;
+		return -1;
+	}
+	objects_done.clear();
+	filters_done.clear();
+	npending = 0;
+	nbytes = 0;
+	return fold(objects_file, filters_file, journal_file);
+}
+
+/**
+ * \brief fold() of these files
+ */
+int mmod_journal::fold(const string &objects_file, const string &filters_file, const string &journal_file)
+{
+	mmod_objects objs;
+	mmod_filters filters;
+	int n = recover(objects_file, filters_file, journal_file, objs, filters);
+	if(n < 0) return -1;
+	mmod_journal j; //Not open(), which refuses a journal holding views: they are in objs and filters now
+	j.objects_file = objects_file;
+	j.filters_file = filters_file;
+	j.journal_file = journal_file;
+	return j.compact(objs, filters) < 0 ? -1 : n;
+}
+
+//Add view view of object in mode: 1 if added, 0 if the archives already had it, -1 => out of sequence
+static int replay_view(int kind, const string &mode, const string &object, int view, const mmod_features &v,
+		mmod_objects &objs, mmod_filters &filters)
+{
+	Views *views = &filters.ObjViews;
+	if(kind == JOURNAL_OBJECT_VIEW)
+	{
+		if(objs.modes.count(mode) == 0)
+			objs.modes.insert(pair<string, mmod_mode>(mode, mmod_mode(mode)));
+		views = &objs.modes[mode].objs;
+	}
+	else
+	{
+		if(filters.mode.empty() && filters.ObjViews.empty()) filters.mode = mode;
+		if(mode != filters.mode) return -1;
+	}
+	Views::iterator it = views->find(object);
+	int n = it == views->end() ? 0 : it->second.size();
+	if(view < n) return 0;
+	if(view > n || v.features.size() != 1) return -1;
+	if(it == views->end()) views->insert(pair<string, mmod_features>(object, v));
+	else it->second.insert(v, 0);
+	return 1;
+}
+
+/**
+ * \brief Replay a journal into objs and filters
+ * @return	Views added, -1 => error (not a journal, or a record out of sequence). A record cut short by a crash
+ * 			ends the replay
+ */
+int mmod_journal::replay(const string &journal_file, mmod_objects &objs, mmod_filters &filters)
+{
+	FILE *f = fopen(journal_file.c_str(), "rb");
+	if(!f) return 0; //No journal, nothing learned since the archives
+	vector<char> b;
+	char chunk[65536];
+	size_t got;
+	while((got = fread(chunk, 1, sizeof(chunk), f)) > 0)
+		b.insert(b.end(), chunk, chunk + got);
+	fclose(f);
+	if(b.size() < MMOD_JOURNAL_HEADER || memcmp(&b[0], MMOD_JOURNAL_MAGIC, 8) != 0
+			|| get32(&b[8]) != MMOD_JOURNAL_VERSION)
+	{
+		cerr << "ERROR, in mmod_journal::replay, " << journal_file << " is not a version " << MMOD_JOURNAL_VERSION
+		     << " journal" << endl;
+		return -1;
+	}
+	int added = 0, records = 0;
+	size_t at = MMOD_JOURNAL_HEADER;
+	while(at < b.size())
+	{
+		size_t len = b.size() - at < 8 ? 0 : get32(&b[at]);
+		if(b.size() - at < 8 || b.size() - at - 8 < len || checksum(&b[at + 8], len) != get32(&b[at + 4]))
+		{
+			cout << "mmod_journal: " << journal_file << " ends in an incomplete record (" << b.size() - at
+			     << " bytes, an interrupted write), ignored" << endl;
+			break;
+		}
+		int kind, view, r = -1;
+		string mode, object;
+		mmod_features v;
+		try
+		{
+			istringstream ss(string(&b[at + 8], len));
+			boost::archive::binary_iarchive ia(ss, boost::archive::no_header);
+			ia >> kind >> mode >> object >> view >> v;
+			r = replay_view(kind, mode, object, view, v, objs, filters);
+		}
+		catch(std::exception &e)
+		{
+			cerr << "ERROR, in mmod_journal::replay: " << e.what() << endl;
+		}
+		if(r < 0)
+		{
+			cerr << "ERROR, in mmod_journal::replay, record " << records << " of " << journal_file
+			     << " doesn't follow the views already there" << endl;
+			return -1;
+		}
+		added += r;
+		++records;
+		at += 8 + len;
+	}
+	filters.update_viewindex();
+	JOURNAL_DEBUG_1(cout << "mmod_journal: replayed " << records << " records of " << journal_file << ", "
+			<< added << " views added" << endl;);
+	return added;
+}
+
+/**
+ * \brief Load a model persisted through a journal: read both archives (either may be missing if the first
+ * \brief compaction never finished) and replay the journal (if any) over them
+ * @return	Views replayed, -1 => error
+ */
+int mmod_journal::recover(const string &objects_file, const string &filters_file, const string &journal_file,
+		mmod_objects &objs, mmod_filters &filters)
+{
+	if(!load(objects_file, objs) || !load(filters_file, filters)) return -1;
+	return replay(journal_file, objs, filters);
+}
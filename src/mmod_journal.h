@@ -0,0 +1,118 @@
+/*
+ * mmod_journal.h
+ *
+ * Incremental persistence of a model being learned. Instead of rewriting the complete objects and filters archives
+ * every frame, append() writes only the views learned since its last call to an append only journal file; every so
+ * often compact() writes the complete archives again and empties the journal. Saving a frame then costs about what
+ * was learned in it, and a training run that dies loses at most the record being written: recover() reads the
+ * archives and replays the journal over them.
+ *
+ *  Created on: Oct 19, 2026
+ */
+
+#ifndef MMOD_JOURNAL_H_
+#define MMOD_JOURNAL_H_
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <utility>
+#include "mmod_objects.h"
+
+//VERBOSE
+// 1 Compactions and replays
+#define JOURNAL_VERBOSE 0
+
+#if JOURNAL_VERBOSE >= 1
+#define JOURNAL_DEBUG_1(X) do{X}while(false)
+#else
+#define JOURNAL_DEBUG_1(X) do{}while(false)
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ *\brief Append only journal of the views learned into an mmod_objects and its mmod_filters, compacted into their
+ *\brief (binary) archives
+ *
+ * Training only ever adds views, so append() journals, for each object of each mode (and of the filters), the views
+ * past the ones already persisted. If views were dropped or changed instead (e.g. mmod_objects::compact), append()
+ * compacts. Each journal record is one view with its object, mode and view number, checksummed and synced to disk.
+ * Replaying skips the views the archives already hold, so a crash during a compaction loses nothing either.
+ */
+class mmod_journal
+{
+public:
+	mmod_journal();
+
+	/**
+	 * \brief Closes the journal (what was appended stays on disk, see fold to merge it into the archives)
+	 */
+	~mmod_journal();
+
+	/**
+	 * \brief Persist to these files. The first append (or compact) then writes both archives and starts the journal
+	 * \brief afresh, replacing what they held. A journal still holding views (of a run that never folded it) is not
+	 * \brief replaced: it and the archives are the only copy of that model, mmod_recover them first
+	 * @param objects_file	Binary archive of the mmod_objects
+	 * @param filters_file	Binary archive of the mmod_filters
+	 * @param journal_file	Journal of the views learned since the archives were written
+	 * @return	0, -1 => journal_file holds views, nothing will be written
+	 */
+	int open(const std::string &objects_file, const std::string &filters_file, const std::string &journal_file);
+
+	/**
+	 * \brief Journal the views learned since the last append or compact (compacting if views were dropped or changed)
+	 * @return	Views appended, -1 => error
+	 */
+	int append(const mmod_objects &objs, const mmod_filters &filters);
+
+	/**
+	 * \brief Write both archives (each to a temporary file synced and renamed over the old one) and empty the journal
+	 * @return	0, -1 => error
+	 */
+	int compact(const mmod_objects &objs, const mmod_filters &filters);
+
+	/**
+	 * \brief Merge the journal into the archives, without the model in hand: recover, write both archives, empty the
+	 * \brief journal
+	 * @return	Views replayed, -1 => error
+	 */
+	int fold();
+
+	int pending() const { return npending; }			//Views in the journal
+	long journal_bytes() const { return nbytes; }		//Size of the journal file
+
+	/**
+	 * \brief Replay a journal into objs and filters
+	 * @return	Views added, -1 => error (not a journal, or a record out of sequence). A record cut short by a crash
+	 * 			ends the replay
+	 */
+	static int replay(const std::string &journal_file, mmod_objects &objs, mmod_filters &filters);
+
+	/**
+	 * \brief Load a model persisted through a journal: read both archives (either may be missing if the first
+	 * \brief compaction never finished) and replay the journal (if any) over them
+	 * @return	Views replayed, -1 => error
+	 */
+	static int recover(const std::string &objects_file, const std::string &filters_file,
+			const std::string &journal_file, mmod_objects &objs, mmod_filters &filters);
+
+	/**
+	 * \brief fold() of these files
+	 */
+	static int fold(const std::string &objects_file, const std::string &filters_file, const std::string &journal_file);
+
+private:
+	typedef std::map<std::pair<std::string, std::string>, std::pair<int, int> > Persisted; //(mode, object) => (views, frame of the last one)
+	Persisted objects_done, filters_done;		//What the archives and journal hold
+	std::string objects_file, filters_file, journal_file;
+	FILE *fp;								//Journal, NULL until the first compaction
+	int npending;
+	long nbytes;
+
+	/**
+	 * \brief Close the journal file
+	 */
+	void close();
+};
+
+#endif /* MMOD_JOURNAL_H_ */
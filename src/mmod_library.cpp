@@ -0,0 +1,316 @@
+/*
+ * mmod_library.cpp
+ *
+ *  Created on: Oct 19, 2026
+ */
+#include "mmod_library.h"
+#include <boost/bind.hpp>
+#include "mmod_general.h"
+using namespace std;
+
+//Loader of a model file
+static bool load_model_file(const string &model_file, mmod_compiled &m)
+{
+	return m.read_binary(model_file) >= 0;
+}
+
+/**
+ * \brief Library keeping at most max_bytes of models loaded (0 => no cap)
+ */
+mmod_library::mmod_library(size_t max_bytes) : max_bytes(max_bytes), bytes(0), nloads(0), nevictions(0),
+		background_running(false)
+{
+}
+
+/**
+ * \brief Waits for a background load to finish
+ */
+mmod_library::~mmod_library()
+{
+	wait();
+}
+
+/**
+ * \brief Change the memory cap (0 => no cap), evicting down to it
+ */
+void mmod_library::set_max_bytes(size_t max)
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	max_bytes = max;
+	shrink(string());
+}
+
+/**
+ * \brief Register object id, to be loaded by load on first use. Registering an id again replaces (and unloads) it
+ */
+void mmod_library::add(const string &id, const loader &load)
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	Entries::iterator it = entries.find(id);
+	if(it == entries.end())
+	{
+		entry e;
+		e.bytes = 0;
+		e.generation = 0;
+		e.loading = false;
+		e.lru = recent.end();
+		it = entries.insert(make_pair(id, e)).first;
+	}
+	unload(it->second);
+	it->second.load = load;
+	++it->second.generation;
+	//A load in flight is of the old registration: whoever waits for it loads the new one instead
+	it->second.loading = false;
+	cond.notify_all();
+}
+
+/**
+ * \brief Register object id, to be mapped from a model file (mmod_compiled::write_binary, mmod_convert) on first use
+ */
+void mmod_library::add_file(const string &id, const string &model_file)
+{
+	add(id, boost::bind(load_model_file, model_file, _1));
+}
+
+/**
+ * \brief The model of object id, loading it if need be. Callers asking for an id that another thread is loading
+ * \brief wait for that load instead of running the loader again
+ * @return	The model, NULL if id isn't registered or failed to load
+ */
+mmod_library::model mmod_library::get(const string &id)
+{
+	loader load;
+	int generation;
+	boost::unique_lock<boost::mutex> lock(mtx);
+	for(;;)
+	{
+		Entries::iterator it = entries.find(id);
+		if(it == entries.end()) return model();
+		entry &e = it->second;
+		if(e.m) //Loaded, now the most recently used
+		{
+			recent.splice(recent.begin(), recent, e.lru);
+			return e.m;
+		}
+		if(!e.loading) //Ours to load
+		{
+			e.loading = true;
+			load = e.load;
+			generation = e.generation;
+			break;
+		}
+		cond.wait(lock); //Being loaded by another thread: look again once it is done
+	}
+	lock.unlock();
+
+	//LOAD without holding the lock, so other objects can be served (or loaded) meanwhile
+	boost::shared_ptr<mmod_compiled> m(new mmod_compiled);
+	bool loaded = false;
+	try { loaded = load && load(*m); }
+	catch(std::exception &e) { cerr << "ERROR, in mmod_library::get: " << e.what() << endl; }
+
+	lock.lock();
+	Entries::iterator it = entries.find(id);
+	bool current = it != entries.end() && it->second.generation == generation;
+	if(current)
+	{
+		it->second.loading = false;
+		cond.notify_all();
+	}
+	if(!loaded) //The next caller tries again
+	{
+		cerr << "ERROR, in mmod_library::get, couldn't load object " << id << endl;
+		return model();
+	}
+	if(!current) return m; //Re-registered meanwhile: don't keep it
+	entry &e = it->second;
+	e.m = m;
+	e.bytes = m->memory_bytes();
+	bytes += e.bytes;
+	++nloads;
+	recent.push_front(id);
+	e.lru = recent.begin();
+	shrink(id);
+	return e.m;
+}
+
+/**
+ * \brief The model of object id if it is loaded, NULL otherwise (it is not loaded)
+ */
+mmod_library::model mmod_library::get_loaded(const string &id)
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	Entries::iterator it = entries.find(id);
+	if(it == entries.end() || !it->second.m) return model();
+	recent.splice(recent.begin(), recent, it->second.lru);
+	return it->second.m;
+}
+
+//A load task: the model is kept by the library
+static void load_one(mmod_library *lib, const string &id)
+{
+	lib->get(id);
+}
+
+/**
+ * \brief Load models ahead of use, several at once, and wait for them. With a memory cap, only the last ones to
+ * \brief load that fit stay loaded
+ * @param ids		Objects to load, in this order of priority. Empty => all registered objects
+ * @param nthreads	Threads to load with. 0 => one per hardware thread
+ * @return			Number of those objects loaded
+ */
+int mmod_library::load(const vector<string> &ids, int nthreads)
+{
+	vector<string> todo = ids.empty() ? this->ids() : ids;
+	vector<boost::function<void()> > batch;
+	for(vector<string>::const_iterator it = todo.begin(); it != todo.end(); ++it)
+		batch.push_back(boost::bind(load_one, this, *it));
+	mmod_thread_pool pool(nthreads);
+	pool.run(batch);
+	int n = 0;
+	for(vector<string>::const_iterator it = todo.begin(); it != todo.end(); ++it)
+		n += is_loaded(*it);
+	return n;
+}
+
+/**
+ * \brief load() in the background: returns at once, get_loaded() hands out models as they come in. Waits for the
+ * \brief previous background load first
+ */
+void mmod_library::load_in_background(const vector<string> &ids, int nthreads)
+{
+	boost::shared_ptr<boost::thread> prev;
+	{
+		boost::unique_lock<boost::mutex> lock(mtx);
+		while(background_running)
+			cond.wait(lock);
+		prev.swap(background);
+		background_running = true;
+		background.reset(new boost::thread(boost::bind(&mmod_library::background_load, this, ids, nthreads)));
+	}
+	if(prev) //Finished, just not joined yet
+		prev->join();
+}
+
+/**
+ * \brief Body of the background load thread
+ */
+void mmod_library::background_load(vector<string> ids, int nthreads)
+{
+	load(ids, nthreads);
+	LIB_DEBUG_1(cout << "mmod_library: background load done, " << num_loaded() << " models loaded" << endl;);
+	boost::lock_guard<boost::mutex> lock(mtx);
+	background_running = false;
+	cond.notify_all();
+}
+
+/**
+ * \brief True while a background load is running
+ */
+bool mmod_library::loading() const
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	return background_running;
+}
+
+/**
+ * \brief Wait for a background load to finish
+ */
+void mmod_library::wait()
+{
+	boost::shared_ptr<boost::thread> t;
+	{
+		boost::unique_lock<boost::mutex> lock(mtx);
+		while(background_running)
+			cond.wait(lock);
+		t.swap(background);
+	}
+	if(t) //Finished, just not joined yet. Joined without the lock: the thread may still be releasing it
+		t->join();
+}
+
+/**
+ * \brief Unload the model of id (it is loaded again on next use). Unload everything if id is empty
+ */
+void mmod_library::evict(const string &id)
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	for(Entries::iterator it = entries.begin(); it != entries.end(); ++it)
+		if(id.empty() || it->first == id)
+			unload(it->second);
+}
+
+/**
+ * \brief Unload e (lock held)
+ */
+void mmod_library::unload(entry &e)
+{
+	if(!e.m) return;
+	recent.erase(e.lru);
+	bytes -= e.bytes;
+	e.bytes = 0;
+	e.m.reset();
+}
+
+/**
+ * \brief Evict least recently used models until within max_bytes, never evicting keep (lock held)
+ */
+void mmod_library::shrink(const string &keep)
+{
+	while(max_bytes && bytes > max_bytes && !recent.empty())
+	{
+		const string &victim = recent.back();
+		if(victim == keep) break; //Only the model just asked for is left
+		unload(entries[victim]);
+		++nevictions;
+	}
+}
+
+/**
+ * \brief Registered object ids, in order
+ */
+vector<string> mmod_library::ids() const
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	vector<string> v;
+	for(Entries::const_iterator it = entries.begin(); it != entries.end(); ++it)
+		v.push_back(it->first);
+	return v;
+}
+
+bool mmod_library::has(const string &id) const
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	return entries.count(id) > 0;
+}
+
+bool mmod_library::is_loaded(const string &id) const
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	Entries::const_iterator it = entries.find(id);
+	return it != entries.end() && it->second.m;
+}
+
+int mmod_library::num_loaded() const
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	return (int)recent.size();
+}
+
+size_t mmod_library::loaded_bytes() const
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	return bytes;
+}
+
+int mmod_library::loads() const
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	return nloads;
+}
+
+int mmod_library::evictions() const
+{
+	boost::lock_guard<boost::mutex> lock(mtx);
+	return nevictions;
+}
@@ -0,0 +1,164 @@
+/*
+ * mmod_library.h
+ *
+ * A library of compiled object models that are only materialized when first asked for. Objects are registered at
+ * startup with a loader (a model file, or any function that can produce the compiled model, e.g. from the DB);
+ * get() loads and compiles on first use and keeps the most recently used models within a memory cap, evicting the
+ * least recently used ones. Hundreds of objects can be registered while only the ones being queried take RAM.
+ *
+ *  Created on: Oct 19, 2026
+ */
+
+#ifndef MMOD_LIBRARY_H_
+#define MMOD_LIBRARY_H_
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+#include "mmod_compiled.h"
+
+//VERBOSE
+// 1 Loads
+#define LIB_VERBOSE 0
+
+#if LIB_VERBOSE >= 1
+#define LIB_DEBUG_1(X) do{X}while(false)
+#else
+#define LIB_DEBUG_1(X) do{}while(false)
+#endif
+
+//////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ *\brief Lazily loaded, LRU evicted set of mmod_compiled models, keyed by object ID. Safe to share between threads.
+ *
+ * Models handed out by get() are shared: one evicted while a caller still holds it stays valid until released.
+ * Models can also be loaded ahead of use, in parallel, either waiting for them (load) or in the background while the
+ * caller keeps serving what is loaded so far (load_in_background, get_loaded).
+ */
+class mmod_library
+{
+public:
+	typedef boost::function<bool (mmod_compiled &)> loader; //Fill the model, false on failure
+	typedef boost::shared_ptr<const mmod_compiled> model;
+
+	/**
+	 * \brief Library keeping at most max_bytes of models loaded (0 => no cap)
+	 */
+	mmod_library(size_t max_bytes = 0);
+
+	/**
+	 * \brief Waits for a background load to finish
+	 */
+	~mmod_library();
+
+	/**
+	 * \brief Change the memory cap (0 => no cap), evicting down to it
+	 */
+	void set_max_bytes(size_t max_bytes);
+
+	/**
+	 * \brief Register object id, to be loaded by load on first use. Registering an id again replaces (and unloads) it
+	 */
+	void add(const std::string &id, const loader &load);
+
+	/**
+	 * \brief Register object id, to be mapped from a model file (mmod_compiled::write_binary, mmod_convert) on first use
+	 */
+	void add_file(const std::string &id, const std::string &model_file);
+
+	/**
+	 * \brief The model of object id, loading it if need be. Callers asking for an id that another thread is loading
+	 * \brief wait for that load instead of running the loader again
+	 * @return	The model, NULL if id isn't registered or failed to load
+	 */
+	model get(const std::string &id);
+
+	/**
+	 * \brief The model of object id if it is loaded, NULL otherwise (it is not loaded)
+	 */
+	model get_loaded(const std::string &id);
+
+	/**
+	 * \brief Load models ahead of use, several at once, and wait for them. With a memory cap, only the last ones to
+	 * \brief load that fit stay loaded
+	 * @param ids		Objects to load, in this order of priority. Empty => all registered objects
+	 * @param nthreads	Threads to load with. 0 => one per hardware thread
+	 * @return			Number of those objects loaded
+	 */
+	int load(const std::vector<std::string> &ids = std::vector<std::string>(), int nthreads = 0);
+
+	/**
+	 * \brief load() in the background: returns at once, get_loaded() hands out models as they come in. Waits for the
+	 * \brief previous background load first
+	 */
+	void load_in_background(const std::vector<std::string> &ids = std::vector<std::string>(), int nthreads = 0);
+
+	/**
+	 * \brief True while a background load is running
+	 */
+	bool loading() const;
+
+	/**
+	 * \brief Wait for a background load to finish
+	 */
+	void wait();
+
+	/**
+	 * \brief Unload the model of id (it is loaded again on next use). Unload everything if id is empty
+	 */
+	void evict(const std::string &id = std::string());
+
+	/**
+	 * \brief Registered object ids, in order
+	 */
+	std::vector<std::string> ids() const;
+
+	bool has(const std::string &id) const;
+	bool is_loaded(const std::string &id) const;
+	int num_loaded() const;
+	size_t loaded_bytes() const;
+	int loads() const;							//Models loaded so far
+	int evictions() const;						//Models evicted so far
+
+private:
+	struct entry
+	{
+		loader load;
+		model m;								//NULL when not loaded
+		size_t bytes;							//m->memory_bytes()
+		std::list<std::string>::iterator lru;	//Position in recent while loaded
+		int generation;							//Bumped when re-registered, so a stale load isn't installed
+		bool loading;							//Some thread is running load for this generation
+	};
+	typedef std::map<std::string, entry> Entries;
+	Entries entries;
+	std::list<std::string> recent;				//Loaded ids, most recently used first
+	size_t max_bytes, bytes;
+	int nloads, nevictions;
+	mutable boost::mutex mtx;					//Guards everything here, background included
+	boost::condition_variable cond;				//Signalled when a load or the background load finishes
+	boost::shared_ptr<boost::thread> background;	//Background load, if any (joined by whoever takes it out)
+	bool background_running;
+
+	/**
+	 * \brief Body of the background load thread
+	 */
+	void background_load(std::vector<std::string> ids, int nthreads);
+
+	/**
+	 * \brief Unload e (lock held)
+	 */
+	void unload(entry &e);
+
+	/**
+	 * \brief Evict least recently used models until within max_bytes, never evicting keep (lock held)
+	 */
+	void shrink(const std::string &keep);
+};
+
+#endif /* MMOD_LIBRARY_H_ */
@@ -0,0 +1,125 @@
+// Merge models trained separately (sessions, worker processes) into one: objects by mode and object, filters by object.
+//
+// console application.
+//
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <fstream>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <boost/archive/binary_oarchive.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+
+#include "mmod_objects.h"
+
+using namespace cv;
+using namespace std;
+
+static void help()
+{
+	cout << "Usage: mmod_merge [-t] [-d] [-s sim_thresh] [-j threads] objects_out objects_in...\n"
+	        "       mmod_merge -f [-t] [-d] [-s sim_thresh] [-j threads] objects_out filters_out (objects_in filters_in)...\n"
+	        "  Merges the archived models, in order: objects new to the merge are copied, views of objects already in it\n"
+	        "  are appended after theirs. The frames of a model that overlap those already merged (models learned\n"
+	        "  separately all count frames from the start) are renumbered past them, in its objects and its filters\n"
+	        "  alike, so views of different frames stay apart.\n"
+	        "  -f            with filters: inputs are pairs of objects and filters archives\n"
+	        "  -t            archives are text (MyMMod) instead of binary (MModPersister, ModelWriter)\n"
+	        "  -d            skip views identical (features and offsets) to one already merged\n"
+	        "  -s sim_thresh then drop the views another view of the same object covers above sim_thresh (mmod_compact)\n"
+	        "  -j threads    threads for -s, default one per hardware thread" << endl;
+}
+
+template<class T> static bool load(const string &name, T &t, bool text)
+{
+	ifstream ifs(name.c_str(), ios::binary);
+	if (!ifs) { cerr << "ERROR: couldn't read " << name << endl; return false; }
+	if (text) { boost::archive::text_iarchive ia(ifs); ia >> t; }
+	else { boost::archive::binary_iarchive ia(ifs); ia >> t; }
+	return true;
+}
+
+template<class T> static bool save(const string &name, const T &t, bool text)
+{
+	ofstream ofs(name.c_str(), ios::binary);
+	if (!ofs) { cerr << "ERROR: couldn't write " << name << endl; return false; }
+	if (text) { boost::archive::text_oarchive oa(ofs); oa << t; }
+	else { boost::archive::binary_oarchive oa(ofs); oa << t; }
+	return true;
+}
+
+//Views over all modes and objects
+static long count(const mmod_objects &O)
+{
+	long n = 0;
+	for (mmod_objects::ModelsForModes::const_iterator mit = O.modes.begin(); mit != O.modes.end(); ++mit)
+		for (mmod_mode::ObjectModels::const_iterator oit = mit->second.objs.begin(); oit != mit->second.objs.end(); ++oit)
+			n += (long)oit->second.features.size();
+	return n;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[]) {
+	bool text = false, dedup = false, with_filters = false;
+	float sim_thresh = -1.0f;
+	int nthreads = 0, a = 1;
+	for (; a < argc && argv[a][0] == '-'; ++a) {
+		if (!strcmp(argv[a], "-t")) text = true;
+		else if (!strcmp(argv[a], "-d")) dedup = true;
+		else if (!strcmp(argv[a], "-f")) with_filters = true;
+		else if (!strcmp(argv[a], "-s") && a + 1 < argc) sim_thresh = (float)atof(argv[++a]);
+		else if (!strcmp(argv[a], "-j") && a + 1 < argc) nthreads = atoi(argv[++a]);
+		else { help(); return -1; }
+	}
+	int nouts = with_filters ? 2 : 1, step = with_filters ? 2 : 1, nins = argc - a - nouts;
+	if (nins < step || nins % step) { help(); return -1; }
+
+	mmod_objects Objs;
+	mmod_filters filt;
+	long views = 0, fviews = 0, added = 0, fadded = 0;
+	double tload = 0, tmerge = 0;
+	for (int i = a + nouts; i < argc; i += step) {
+		mmod_objects O;
+		mmod_filters F;
+		double t = (double)getTickCount();
+		if (!load(argv[i], O, text)) return -1;
+		if (with_filters && !load(argv[i + 1], F, text)) return -1;
+		tload += ((double)getTickCount() - t) / getTickFrequency();
+		t = (double)getTickCount();
+		int lo = INT_MAX, hi = INT_MIN, ilo = INT_MAX, ihi = INT_MIN; //Frames merged so far, of this model
+		Objs.frame_range(lo, hi);
+		filt.frame_range(lo, hi);
+		O.frame_range(ilo, ihi);
+		F.frame_range(ilo, ihi);
+		int offset = lo <= hi && ilo <= hi ? hi + 1 - ilo : 0;
+		long n = Objs.merge(O, dedup, offset), nf = 0;
+		if (with_filters && (nf = filt.merge(F, dedup, false, offset)) < 0) return -1;
+		tmerge += ((double)getTickCount() - t) / getTickFrequency();
+		long c = count(O), cf = 0;
+		for (mmod_filters::ObjFilters::iterator it = F.ObjViews.begin(); it != F.ObjViews.end(); ++it)
+			cf += it->second.size();
+		printf("  %-30s views %6ld, added %6ld", argv[i], c, n);
+		if (with_filters) printf("; filter views %6ld, added %6ld", cf, nf);
+		if (offset) printf("; frames %d.. renumbered from %d", ilo, ilo + offset);
+		printf("\n");
+		views += c; fviews += cf; added += n; fadded += nf;
+	}
+	double t = (double)getTickCount();
+	filt.update_viewindex();
+	tmerge += ((double)getTickCount() - t) / getTickFrequency();
+	printf("Merged %d models in %.3f s (loading them %.3f s): %ld of %ld views", nins / step, tmerge, tload, added, views);
+	if (with_filters) printf(", %ld of %ld filter views", fadded, fviews);
+	printf("\n");
+
+	if (sim_thresh >= 0) {
+		t = (double)getTickCount();
+		int dropped = Objs.compact(sim_thresh, with_filters ? &filt : 0, nthreads);
+		printf("Compacted at sim_thresh %.3f in %.2f s, dropped %d views\n", sim_thresh,
+		       ((double)getTickCount() - t) / getTickFrequency(), dropped);
+	}
+
+	if (!save(argv[a], Objs, text)) return -1;
+	if (with_filters && !save(argv[a + 1], filt, text)) return -1;
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * mmod_modality.cpp
+ *
+ *  Created on: Oct 19, 2026
+ */
+#include "mmod_modality.h"
+#include <sstream>
+using namespace cv;
+using namespace std;
+
+/**
+ * \brief True if I is a non empty image of type, else complains about modality name and returns false
+ */
+bool modality_input_ok(const cv::Mat &I, int type, const std::string &name)
+{
+	if(I.empty() || I.type() != type)
+	{
+		cerr << "ERROR: modality " << name << " input is empty or not of type " << type << endl;
+		return false;
+	}
+	return true;
+}
+
+
+////////////Modality registry///////////////////////////////////////////////////
+/**
+ * \brief Add (or replace) the modality with m's ID and record its name. Takes ownership of m
+ */
+void modality_registry::add(mmod_modality *m)
+{
+	if(!m) return;
+	set_modality_name(m->id(), m->name());
+	mods[m->id()] = boost::shared_ptr<mmod_modality>(m);
+}
+
+/**
+ * \brief Modality with this ID, NULL if none was added
+ */
+mmod_modality *modality_registry::get(int id) const
+{
+	Modalities::const_iterator it = mods.find(id);
+	return it == mods.end() ? 0 : it->second.get();
+}
+
+/**
+ * \brief IDs of all added modalities, in increasing order
+ */
+void modality_registry::ids(std::vector<int> &out) const
+{
+	out.clear();
+	for(Modalities::const_iterator it = mods.begin(); it != mods.end(); ++it)
+		out.push_back(it->first);
+}
+
+/**
+ * \brief Compute the features of modality id
+ * @return	0 on success, -1 (and complains) if there is no such modality or I is of the wrong type
+ */
+int modality_registry::compute(int id, const cv::Mat &I, const cv::Mat &Mask, cv::Mat &F)
+{
+	mmod_modality *m = get(id);
+	if(!m)
+	{
+		cerr << "ERROR: modality_registry has no modality " << id << endl;
+		return -1;
+	}
+	return m->compute(I, Mask, F);
+}
+
+/**
+ * \brief Compute several modalities, each from the input it takes, ready to hand to mmod_objects
+ * @param ids		Modalities to compute, in order
+ * @param bgr		BGR image CV_8UC3 (can be left empty if no modality takes MODALITY_INPUT_BGR)
+ * @param depth		Depth image CV_16UC1 (can be left empty if no modality takes MODALITY_INPUT_DEPTH)
+ * @param Mask		compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+ * @param feats		Output: feature image of each of ids
+ * @param names		Output: mode name of each of ids
+ * @return			0 on success, -1 if any modality failed (the others are still computed)
+ */
+int modality_registry::compute(const std::vector<int> &ids, const cv::Mat &bgr, const cv::Mat &depth,
+		const cv::Mat &Mask, std::vector<cv::Mat> &feats, std::vector<std::string> &names)
+{
+	int ret = 0;
+	feats.resize(ids.size());
+	modality_names(ids, names);
+	for(size_t i = 0; i < ids.size(); ++i)
+	{
+		mmod_modality *m = get(ids[i]);
+		const Mat &I = (m && m->input_type() == MODALITY_INPUT_DEPTH) ? depth : bgr;
+		if(compute(ids[i], I, Mask, feats[i]) < 0)
+			ret = -1;
+	}
+	return ret;
+}
@@ -0,0 +1,180 @@
+/*
+ * mmod_modality.h
+ *
+ * One interface to the feature extractors of mmod_color.h. Each modality has an integer ID, declares the input it
+ * takes and how far its features are spread, and fixes its train/test behaviour at compile time with a policy.
+ * A registry dispatches by ID, so a new modality is a traits specialization and a registry.add() away.
+ *
+ *  Created on: Oct 19, 2026
+ */
+
+#ifndef MMOD_MODALITY_H_
+#define MMOD_MODALITY_H_
+#include <opencv2/opencv.hpp>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include "mmod_general.h"
+#include "mmod_color.h"
+#include "mmod_modality_ids.h"
+
+//Input image types the modalities take
+#define MODALITY_INPUT_BGR    CV_8UC3
+#define MODALITY_INPUT_DEPTH  CV_16UC1
+
+
+////////////Train/test policies/////////////////////////////////////////////////
+//What is done to freshly binarized features, fixed at compile time instead of by a "mode" string
+struct raw_policy   { enum { cleanup = 0, spread = 0 }; static const char *mode() { return "none"; } };	//As binarized
+struct train_policy { enum { cleanup = 1, spread = 0 }; static const char *mode() { return "train"; } };	//Majority cleaned
+struct test_policy  { enum { cleanup = 1, spread = 1 }; static const char *mode() { return "test"; } };	//Cleaned and ORed
+
+
+////////////Extractor traits////////////////////////////////////////////////////
+/**
+ * \brief What the registry needs to know about an extractor class E. Specialize for each new extractor:
+ *	enum { id, input_type, spread }		Modality ID, MODALITY_INPUT_* type, OR spreading amount in test
+ *	static const char *name()			Mode name the models are kept under
+ *	static void binarize(E&, I, Mask, F)	Binarized features only (no clean up or spreading) of I into F
+ */
+template<class E> struct extractor_traits;
+
+template<> struct extractor_traits<gradients> {
+	enum { id = MODALITY_GRADIENTS, input_type = MODALITY_INPUT_BGR, spread = ORAMT };
+	static const char *name() { return MODALITY_GRADIENTS_NAME; }
+	static void binarize(gradients &e, const cv::Mat &I, const cv::Mat &Mask, cv::Mat &F) { e.computeGradients(I, F, Mask, "none"); }
+};
+
+template<> struct extractor_traits<colorhls> {
+	enum { id = MODALITY_COLORHLS, input_type = MODALITY_INPUT_BGR, spread = ORAMT };
+	static const char *name() { return MODALITY_COLORHLS_NAME; }
+	static void binarize(colorhls &e, const cv::Mat &I, const cv::Mat &Mask, cv::Mat &F) { e.computeColorHLS(I, F, Mask, "none"); }
+};
+
+template<> struct extractor_traits<depthgrad> {
+	enum { id = MODALITY_DEPTHGRAD, input_type = MODALITY_INPUT_DEPTH, spread = ORAMT };
+	static const char *name() { return MODALITY_DEPTHGRAD_NAME; }
+	static void binarize(depthgrad &e, const cv::Mat &I, const cv::Mat &Mask, cv::Mat &F) { e.computeDepthGradients(I, F, Mask, "none"); }
+};
+
+template<> struct extractor_traits<depthnormals> {
+	enum { id = MODALITY_DEPTHNORMALS, input_type = MODALITY_INPUT_DEPTH, spread = ORAMT };
+	static const char *name() { return MODALITY_DEPTHNORMALS_NAME; }
+	static void binarize(depthnormals &e, const cv::Mat &I, const cv::Mat &Mask, cv::Mat &F) { e.computeDepthNormals(I, F, Mask, "none"); }
+};
+
+
+////////////Modality interface//////////////////////////////////////////////////
+class mmod_modality {
+public:
+	virtual ~mmod_modality() {}
+
+	virtual int id() const = 0;						//MODALITY_* ID
+	virtual std::string name() const = 0;			//Mode name the models are kept under
+	virtual int input_type() const = 0;				//MODALITY_INPUT_* the input must be
+	virtual int spread() const = 0;					//OR spreading this modality applies, 0 if it doesn't spread
+
+	/**
+	 * \brief Compute this modality's feature image
+	 * @param I			Input image of type input_type()
+	 * @param Mask		compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+	 * @param F			Output CV_8UC1 features
+	 * @return			0 on success, -1 (and complains) if I is not of input_type()
+	 */
+	virtual int compute(const cv::Mat &I, const cv::Mat &Mask, cv::Mat &F) = 0;
+};
+
+/**
+ * \brief True if I is a non empty image of type, else complains about modality name and returns false
+ */
+bool modality_input_ok(const cv::Mat &I, int type, const std::string &name);
+
+/**
+ * \brief Extractor E behind the modality interface. Clean up and spreading follow Policy and are compiled in, so the
+ * result is the same as E run with mode Policy::mode().
+ */
+template<class E, class Policy> class modality : public mmod_modality {
+	typedef extractor_traits<E> traits;
+	E ext;
+	mmod_general gen;				//Feature clean up and spreading (keeps its accumulators)
+public:
+	modality() {}
+	modality(const E &e) : ext(e) {}
+
+	/**
+	 * \brief The extractor, to set it up (e.g. setThresholdMethod)
+	 */
+	E &extractor() { return ext; }
+
+	int id() const { return traits::id; }
+	std::string name() const { return traits::name(); }
+	int input_type() const { return traits::input_type; }
+	int spread() const { return Policy::spread ? (int)traits::spread : 0; }
+
+	int compute(const cv::Mat &I, const cv::Mat &Mask, cv::Mat &F)
+	{
+		if(!modality_input_ok(I, traits::input_type, traits::name()))
+			return -1;
+		traits::binarize(ext, I, Mask, F);
+		if(Policy::cleanup)
+			gen.SumAroundEachPixel8UC1(F,F,3,1); //Clean the features of spurious gradients
+		if(Policy::spread)
+			gen.SumAroundEachPixel8UC1(F,F,traits::spread,0); //Spread features by ORing
+		return 0;
+	}
+};
+
+
+////////////Modality registry///////////////////////////////////////////////////
+class modality_registry {
+	typedef std::map<int, boost::shared_ptr<mmod_modality> > Modalities; //(ID, modality)
+	Modalities mods;
+public:
+	/**
+	 * \brief Add (or replace) the modality with m's ID and record its name. Takes ownership of m
+	 */
+	void add(mmod_modality *m);
+
+	/**
+	 * \brief Modality with this ID, NULL if none was added
+	 */
+	mmod_modality *get(int id) const;
+
+	/**
+	 * \brief IDs of all added modalities, in increasing order
+	 */
+	void ids(std::vector<int> &out) const;
+
+	/**
+	 * \brief Compute the features of modality id
+	 * @return	0 on success, -1 (and complains) if there is no such modality or I is of the wrong type
+	 */
+	int compute(int id, const cv::Mat &I, const cv::Mat &Mask, cv::Mat &F);
+
+	/**
+	 * \brief Compute several modalities, each from the input it takes, ready to hand to mmod_objects
+	 * @param ids		Modalities to compute, in order
+	 * @param bgr		BGR image CV_8UC3 (can be left empty if no modality takes MODALITY_INPUT_BGR)
+	 * @param depth		Depth image CV_16UC1 (can be left empty if no modality takes MODALITY_INPUT_DEPTH)
+	 * @param Mask		compute on masked region (can be left empty) CV_8UC3 or CV_8UC1 ok
+	 * @param feats		Output: feature image of each of ids
+	 * @param names		Output: mode name of each of ids
+	 * @return			0 on success, -1 if any modality failed (the others are still computed)
+	 */
+	int compute(const std::vector<int> &ids, const cv::Mat &bgr, const cv::Mat &depth, const cv::Mat &Mask,
+			std::vector<cv::Mat> &feats, std::vector<std::string> &names);
+};
+
+/**
+ * \brief Add gradients, colorhls, depthgrad and depthnormals (default set up) to reg with train/test Policy
+ */
+template<class Policy> void add_default_modalities(modality_registry &reg)
+{
+	reg.add(new modality<gradients, Policy>());
+	reg.add(new modality<colorhls, Policy>());
+	reg.add(new modality<depthgrad, Policy>());
+	reg.add(new modality<depthnormals, Policy>());
+}
+
+#endif /* MMOD_MODALITY_H_ */
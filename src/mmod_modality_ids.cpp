@@ -0,0 +1,63 @@
+/*
+ * mmod_modality_ids.cpp
+ *
+ *  Created on: Oct 19, 2026
+ */
+#include "mmod_modality_ids.h"
+#include <map>
+#include <sstream>
+#include <boost/thread/mutex.hpp>
+using namespace std;
+
+typedef map<int, string> Names; //(ID, name)
+
+//The built in modalities
+static Names builtin_names()
+{
+	Names names;
+	names[MODALITY_GRADIENTS] = MODALITY_GRADIENTS_NAME;
+	names[MODALITY_COLORHLS] = MODALITY_COLORHLS_NAME;
+	names[MODALITY_DEPTHGRAD] = MODALITY_DEPTHGRAD_NAME;
+	names[MODALITY_DEPTHNORMALS] = MODALITY_DEPTHNORMALS_NAME;
+	return names;
+}
+
+//Both set up at static initialization, before any thread can look a name up
+static Names id_names = builtin_names();
+static boost::mutex names_mtx;			//Guards id_names: modality registries add to it while others read
+
+/**
+ * \brief Name mmod_objects keeps a modality's models under ("Grad", "Color", ...). "Modality<id>" if never named.
+ * \brief Safe to call from several threads, also while set_modality_name runs
+ */
+string modality_name(int id)
+{
+	{
+		boost::mutex::scoped_lock lock(names_mtx);
+		Names::const_iterator it = id_names.find(id);
+		if(it != id_names.end())
+			return it->second;
+	}
+	stringstream ss;
+	ss << "Modality" << id;
+	return ss.str();
+}
+
+/**
+ * \brief Name (or rename) modality id. modality_registry::add does this for every modality it is given
+ */
+void set_modality_name(int id, const string &name)
+{
+	boost::mutex::scoped_lock lock(names_mtx);
+	id_names[id] = name;
+}
+
+/**
+ * \brief modality_name of each of ids, in order, for the mmod_objects calls that take mode names
+ */
+void modality_names(const vector<int> &ids, vector<string> &names)
+{
+	names.clear();
+	for(vector<int>::const_iterator it = ids.begin(); it != ids.end(); ++it)
+		names.push_back(modality_name(*it));
+}
@@ -0,0 +1,44 @@
+/*
+ * mmod_modality_ids.h
+ *
+ * Modality IDs and the mode names mmod_objects keeps their models under. Apart from mmod_modality.h (and so from
+ * the feature extractors), for the code that only has to turn IDs into names.
+ *
+ *  Created on: Oct 19, 2026
+ */
+
+#ifndef MMOD_MODALITY_IDS_H_
+#define MMOD_MODALITY_IDS_H_
+#include <string>
+#include <vector>
+
+////////////Modality IDs////////////////////////////////////////////////////////
+//The FEAT_* masks of mmod_color.h are 1 << these. A new modality takes the next free ID.
+#define MODALITY_GRADIENTS    0
+#define MODALITY_COLORHLS     1
+#define MODALITY_DEPTHGRAD    2
+#define MODALITY_DEPTHNORMALS 3
+
+//Mode names of the built in modalities
+#define MODALITY_GRADIENTS_NAME    "Grad"
+#define MODALITY_COLORHLS_NAME     "Color"
+#define MODALITY_DEPTHGRAD_NAME    "Depth"
+#define MODALITY_DEPTHNORMALS_NAME "Normals"
+
+/**
+ * \brief Name mmod_objects keeps a modality's models under ("Grad", "Color", ...). "Modality<id>" if never named.
+ * \brief Safe to call from several threads, also while set_modality_name runs
+ */
+std::string modality_name(int id);
+
+/**
+ * \brief Name (or rename) modality id. modality_registry::add does this for every modality it is given
+ */
+void set_modality_name(int id, const std::string &name);
+
+/**
+ * \brief modality_name of each of ids, in order, for the mmod_objects calls that take mode names
+ */
+void modality_names(const std::vector<int> &ids, std::vector<std::string> &names);
+
+#endif /* MMOD_MODALITY_IDS_H_ */
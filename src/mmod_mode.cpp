@@ -12,11 +12,13 @@ mmod_mode::mmod_mode()
 	{
 		mode = "NotSet";
 		patch = Mat::zeros(100,100,CV_8UC1); //patch will resize as necessary, just start it at some value
+		index_min_views = MODE_INDEX_MIN_VIEWS;
 	}
 mmod_mode::mmod_mode(const string &mode_name)
 	{
 		mode = mode_name;
 		patch = Mat::zeros(100,100,CV_8UC1); //patch will resize as necessary, just start it at some value
+		index_min_views = MODE_INDEX_MIN_VIEWS;
 	}
 //	/**
 //	 * \brief Empty all vectors.
@@ -64,6 +66,8 @@ mmod_mode::mmod_mode(const string &mode_name)
 	 * @param object_ID			Object name to store if we learn a template
 	 * @param framenum			Frame number of this object, so that we can reconstruct pose from the database
 	 * @param learn_thresh		If no features from f match above this, learn a new template. Set to zero to learn all templates
+	 *                          Once the object has index_min_views views, only the views its view_index proposes are
+	 *                          matched, so an occasional near duplicate view may be learned
 	 * @param Score				If set, fill with patch match score
 	 * @return					Returns index of newly learned template, or -1 if a template already covered
 	 */
@@ -124,7 +128,17 @@ mmod_mode::mmod_mode(const string &mode_name)
 	    {
 			mmod_general g;
 			g.SumAroundEachPixel8UC1(patch,patch,ORAMT,0); //Spread features by ORing
-	    	score = util.match_a_patch_bruteforce(patch, pp, objs[object_ID], match_index);
+			mmod_features &f = objs[object_ID];
+			if(index_min_views >= 0 && f.size() >= index_min_views) //Only check the views the index proposes
+			{
+				view_index &vi = indices[object_ID];
+				vi.sync(f);
+				vi.candidates(ftemp.features[index], ftemp.offsets[index], cands);
+				MODE_DEBUG_2(cout << cands.size() << " of " << f.size() << " views proposed by the index" << endl;);
+				score = util.match_a_patch_views(patch, pp, f, cands, match_index);
+			}
+			else
+				score = util.match_a_patch_bruteforce(patch, pp, f, match_index);
 //	    	patch = Scalar::all(0);
 	    }
 	    if(Score) *Score = score; //Let user see the patch match score
@@ -165,10 +179,11 @@ mmod_mode::mmod_mode(const string &mode_name)
 	 * @param match_index	The index of the match will be returned here
 	 * @param R				if a match, return boundind box of the feature, else leave alone
 	 * @param frame_numb	if a match, return frame_number of feature, else leave alone
+	 * @param channel		which channel of an interleaved feature image I holds this mode (see mmod_general::interleave_features)
 	 * @return				Score of this match
 	 */
 	float mmod_mode::match_an_object(string &object_ID, const Mat &I, const Point &pp, int &match_index,
-	                                 Rect &R, int &frame_numb)
+	                                 Rect &R, int &frame_numb, int channel)
 	{
 	  MODE_DEBUG_1(
 	      cout << "In mmod_mode::match_an_object(ID:"<<object_ID<<", point("<<pp.x<<","<<pp.y<<")"<< endl;
@@ -176,7 +191,7 @@ mmod_mode::mmod_mode(const string &mode_name)
 	  float score = 0.0;
 	  if(objs.count(object_ID)>0) //If this object exits already
 	  {
-	    score = util.match_a_patch_bruteforce(I,pp,objs[object_ID],match_index);
+	    score = util.match_a_patch_bruteforce(I,pp,objs[object_ID],match_index,channel);
 	    R = objs[object_ID].bbox[match_index]; //This is the bounding box of the mask. It needs to be offset by pp:
 	    MODE_DEBUG_2(
 	        cout << "score = " << score << " match_index = " << match_index << endl;
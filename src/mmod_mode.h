@@ -12,6 +12,7 @@
 #include <map>
 #include <vector>
 #include "mmod_general.h"
+#include "mmod_index.h"
 //SERIALIZATION
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -19,6 +20,9 @@
 //VERBOSE
 // 1 Routine list, 2 values out, 3 internal values outside of loops, 4 intenral values in loops
 #define MODE_VERBOSE 0
+//Objects with at least this many views in a mode check new views only against the candidates their view_index
+//proposes (see mmod_index.h) instead of against every view. Below it, brute force is cheap and exact
+#define MODE_INDEX_MIN_VIEWS 32
 
 #if MODE_VERBOSE >= 1
 #define MODE_DEBUG_1(X) do{X}while(false)
@@ -80,6 +84,10 @@ public:
 //	vector<string> ids; 		//the matched object's IDs
 //	vector<int> frame_nums;		//the matched object's frame number
 	cv::Mat patch; 	//This is a patch for use in display_feature.  This is good for speed, bad for thread safety.
+	typedef std::map <std::string, view_index> ViewIndices; //(object_ID, index of its views) Not serialized, rebuilt as needed
+	ViewIndices			indices;		//Learning time dedup index for each object
+	int					index_min_views;//Use the index once an object has this many views. < 0 => never (always brute force)
+	std::vector<int>	cands;			//Work: candidate views from the index
 	mmod_mode();
 
 	mmod_mode(const std::string &mode_name);
@@ -117,6 +125,8 @@ public:
 	 * @param framenum			Frame number of this object, so that we can reconstruct pose from the database
 	 * @param learn_thresh		If no features from f match above this, learn a new template.
 	 *                          Set to zero to learn all templates (no match search is then done)
+	 *                          Once the object has index_min_views views, only the views its view_index proposes are
+	 *                          matched, so an occasional near duplicate view may be learned
 	 * @param Score				If set, fill with patch match score
 	 * @return					Returns index of newly learned template, or -1 if a template already covered
 	 */
@@ -133,10 +143,11 @@ public:
 	 * @param match_index	The index of the match will be returned here
 	 * @param R				if a match, return boundind box of the feature, else leave alone
 	 * @param frame_numb	if a match, return frame_number of feature, else leave alone
+	 * @param channel		which channel of an interleaved feature image I holds this mode (see mmod_general::interleave_features)
 	 * @return				Score of this match
 	 */
 	float match_an_object(std::string &object_ID, const cv::Mat &I, const cv::Point &pp, int &match_index,
-			cv::Rect &R, int &frame_numb);
+			cv::Rect &R, int &frame_numb, int channel = 0);
 
 	//	/**
 	//	 * \brief Find all objects within the masked part of an image. Do non-maximum suppression on the list
@@ -5,6 +5,9 @@
  *      Author: Gary Bradski
  */
 #include "mmod_objects.h"
+#include "mmod_modality_ids.h"
+#include <algorithm>
+#include <set>
 #include <sstream>
 
 using namespace cv;
@@ -435,6 +438,7 @@ int mmod_objects::learn_a_template(vector<Mat> &Ifeat, const vector<string> &mod
     if (modes.count(*mit) > 0) //We have models already for this mode
     {
       OBJS_DEBUG_4(cout << "Have models for this mode" << endl;);
+      modes[*mit].util.feature_budget = util.feature_budget; //Per template feature budget, see mmod_general::learn_a_template
       modes[*mit].learn_a_template(*Iit, Mask, session_ID, object_ID, framenum, learn_thresh, Score);
     }
     else //We have no models for this mode yet. Better insert one
@@ -446,6 +450,7 @@ int mmod_objects::learn_a_template(vector<Mat> &Ifeat, const vector<string> &mod
     	  cout << "modes[*mit].mode = " << modes[*mit].mode << endl;
           cout << "  ... learn a template with the mode. learn_thresh: " << learn_thresh << endl;
       );
+      modes[*mit].util.feature_budget = util.feature_budget; //Per template feature budget, see mmod_general::learn_a_template
       modes[*mit].learn_a_template(*Iit, Mask, session_ID, object_ID, framenum, learn_thresh, Score);
     }
     num_models += (int) (modes[*mit].objs[object_ID].features.size());
@@ -455,6 +460,295 @@ int mmod_objects::learn_a_template(vector<Mat> &Ifeat, const vector<string> &mod
   return num_models;
 }
 
+/**
+ * \brief match_all_objects with the modes given by modality ID (MODALITY_* of mmod_modality_ids.h) instead of by name
+ */
+int
+mmod_objects::match_all_objects(const vector<Mat> &I, const vector<int> &mode_ids, const Mat &Mask,
+                                float match_threshold, float frac_overlap, int skipX, int skipY, int *rawmatches)
+{
+  vector<string> mode_names;
+  modality_names(mode_ids, mode_names);
+  return match_all_objects(I, mode_names, Mask, match_threshold, frac_overlap, skipX, skipY, rawmatches);
+}
+
+/**
+ * \brief match_all_objects on an interleaved feature image (see mmod_general::interleave_features).
+ *
+ * All modes of all objects are matched at a point while that neighborhood of the one image is in cache, instead
+ * of from a separate image per mode. Each mode still picks its own best view, so results are the same as
+ * match_all_objects on the separate feature images.
+ *
+ * @param Ifeat				CV_8UC(n) feature image, channel i holding the features of mode_names[i]
+ * @param mode_names		Vector: List of names of the modes of the channels of Ifeat
+ * Other parameters and return as match_all_objects above
+ */
+int
+mmod_objects::match_all_objects(const Mat &Ifeat, const vector<string> &mode_names, const Mat &Mask,
+                                float match_threshold, float frac_overlap, int skipX, int skipY, int *rawmatches)
+{
+  OBJS_DEBUG_1(
+      cout << "mmod_objects::match_all_objects (interleaved), " << Ifeat.channels() << " modes" << endl;
+      cout << "match_thresh:"<<match_threshold<<" frac_overlap:"<<frac_overlap<< " skipxy="<<skipX<<", "<<skipY<<endl;
+  );
+  clear_matches();
+  if (Ifeat.empty() || Ifeat.depth() != CV_8U || Ifeat.channels() != (int) mode_names.size())
+  {
+    cerr << "ERROR, in match_all_objects, interleaved feature image is empty, not 8U or has " << Ifeat.channels()
+        << " channels for " << mode_names.size() << " modes." << endl;
+    return -1;
+  }
+  if (!Mask.empty() && (Mask.size() != Ifeat.size() || Mask.type() != CV_8UC1))
+  {
+    cerr << "ERROR in match_all_objects: Mask must be CV_8UC1 of the size of the interleaved feature image" << endl;
+    return -1;
+  }
+  //Modes we have models for, with the channel each is in
+  vector<mmod_mode *> mode_ptrs;
+  vector<int> channels;
+  for (int c = 0; c < (int) mode_names.size(); ++c)
+  {
+    ModelsForModes::iterator mit = modes.find(mode_names[c]);
+    if (mit == modes.end()) continue;
+    modes_used.push_back(mode_names[c]);
+    mode_ptrs.push_back(&(mit->second));
+    channels.push_back(c);
+  }
+  if (mode_ptrs.empty())
+    return 0;
+
+  //Collect matches
+  vector<string> obj_names; //To be filled by return_object_names below
+  vector<string>::iterator nit; //obj_names iterator
+  modes.begin()->second.return_object_names(obj_names); //The objects of the first mode, as the per-mode path
+
+  int match_index, frame_number;
+  float score;
+  float norm = (float) mode_names.size();
+  Rect R;
+  vector<int> match_indices;
+  for (int y = 0; y < Ifeat.rows; y += skipY)
+  {
+    const uchar *m = Mask.empty() ? 0 : Mask.ptr<uchar> (y);
+    for (int x = 0; x < Ifeat.cols; x += skipX)
+    {
+      if (m && !m[x]) continue; //Mask doesn't cover this point
+      Point pp = Point(x, y);
+      //go through each object,
+      for (nit = obj_names.begin(); nit != obj_names.end(); ++nit)
+      {
+        score = 0.0;
+        match_indices.clear();
+        //go through each mode, summing scores
+        for (size_t k = 0; k < mode_ptrs.size(); ++k)
+        {
+          score += mode_ptrs[k]->match_an_object(*nit, Ifeat, pp, match_index, R, frame_number, channels[k]);
+          match_indices.push_back(match_index);
+        }
+        score /= norm; //Normalize by number of modes
+        if (score > match_threshold) //If we have a match, enter it as a contender
+        {
+          rv.push_back(Rect(R.x + x, R.y + y, R.width, R.height)); //Our rects are middle based, make this Upper Left based
+          scores.push_back(score);
+          ids.push_back(*nit);
+          frame_nums.push_back(frame_number);
+          feature_indices.push_back(match_indices);
+        }
+      }//end for each obj
+    }//end for x
+  }//end going over rows of the image
+  OBJS_DEBUG_3(cout << "Pre nonMax, we have " << rv.size() << " potential objects" << endl;);
+
+  //Get rid of spurious overlaps:
+  if(rawmatches)
+	  *rawmatches = (int)(rv.size());
+  int num_objs = util.nonMaxRectSuppress(rv, scores, ids, frame_nums, feature_indices, frac_overlap);
+  OBJS_DEBUG_2(cout << "Post nonMax, we have " << rv.size() << " potential objects" << endl;);
+  return num_objs;
+}
+
+/**
+ * \brief learn_a_template with the modes given by modality ID (MODALITY_* of mmod_modality_ids.h) instead of by name
+ */
+int mmod_objects::learn_a_template(vector<Mat> &Ifeat, const vector<int> &mode_ids, Mat &Mask, string &session_ID,
+                                   string &object_ID, int framenum, float learn_thresh, float *Score)
+{
+  vector<string> mode_names;
+  modality_names(mode_ids, mode_names);
+  return learn_a_template(Ifeat, mode_names, Mask, session_ID, object_ID, framenum, learn_thresh, Score);
+}
+
+//One row of compact()'s cover matrix: which views of f score view j, drawn and spread as learn_a_template does, above
+//thresh (one byte per view, the scores themselves aren't needed)
+struct view_cover_row
+{
+  mmod_features *f;
+  int j;
+  Size psize; //Patch size. Same for all rows so the pointer offsets of f, converted up front, fit every patch
+  float thresh;
+  uchar *row;
+  void operator()() const
+  {
+    mmod_general g;
+    Mat patch = Mat::zeros(psize, CV_8UC1);
+    g.display_feature(patch, f->features[j], f->offsets[j], f->bbox[j]);
+    g.SumAroundEachPixel8UC1(patch, patch, ORAMT, 0); //Spread features by ORing
+    Point pp(psize.width / 2, psize.height / 2);
+    vector<int> one(1);
+    int match_index;
+    for (int i = 0; i < f->size(); ++i)
+    {
+      one[0] = i;
+      float score = (i == j) ? 1.0f : g.match_a_patch_views(patch, pp, *f, one, match_index);
+      row[i] = score > thresh;
+    }
+  }
+};
+
+/**
+ * \brief Drop the views of each object that another (kept) view of the same object and mode already covers
+ *
+ * For each mode and object, every view is drawn, spread and matched against every other view as
+ * learn_a_template would (in parallel, one view per task). Views are then visited from the one covering the most
+ * others down; a view is kept if no kept view scores it above sim_thresh, and it then covers those it scores
+ * above sim_thresh. This is learn_a_template with learn_thresh = sim_thresh, applied afterwards to a model
+ * learned with a lower threshold (e.g. 0, every frame).
+ *
+ * @param sim_thresh		Views a kept view matches above this [0,1] are dropped
+ * @param filters			If set, its views of frames no longer learned in any mode of that object are dropped
+ *                          too, so the frame numbers recognition returns still find their filter views
+ * @param nthreads			Threads to match with, 0 => one per hardware thread
+ * @return					Number of object views dropped (over all modes)
+ */
+int
+mmod_objects::compact(float sim_thresh, mmod_filters *filters, int nthreads)
+{
+  OBJS_DEBUG_1(cout << "mmod_objects::compact(sim_thresh:" << sim_thresh << ")" << endl;);
+  mmod_thread_pool pool(nthreads);
+  map<string, set<int> > kept_frames; //(object, frames still learned in some mode)
+  int dropped = 0;
+  for (ModelsForModes::iterator mit = modes.begin(); mit != modes.end(); ++mit)
+  {
+    mmod_mode &m = mit->second;
+    for (mmod_mode::ObjectModels::iterator oit = m.objs.begin(); oit != m.objs.end(); ++oit)
+    {
+      mmod_features &f = oit->second;
+      int n = f.size();
+      if (n > 1)
+      {
+        //COVER MATRIX: cover[j*n + i] = 1 if view i scores view j above sim_thresh
+        f.find_max_template_size();
+        Size psize(f.max_bounds.width + 20, f.max_bounds.height + 20);
+        f.convertPoint2PointerOffsets(Mat::zeros(psize, CV_8UC1));
+        vector<uchar> cover((size_t) n * n, 0);
+        vector<boost::function<void()> > batch;
+        for (int j = 0; j < n; ++j)
+        {
+          view_cover_row r;
+          r.f = &f; r.j = j; r.psize = psize; r.thresh = sim_thresh; r.row = &cover[(size_t) j * n];
+          batch.push_back(r);
+        }
+        pool.run(batch);
+
+        //GREEDY: views covering the most others first, keep a view unless a kept view covers it
+        vector<pair<int, int> > order; //(-number covered, view)
+        for (int i = 0; i < n; ++i)
+        {
+          int c = 0;
+          for (int j = 0; j < n; ++j)
+            if (j != i && cover[(size_t) j * n + i]) ++c;
+          order.push_back(pair<int, int>(-c, i));
+        }
+        sort(order.begin(), order.end());
+        vector<uchar> covered(n, 0);
+        vector<int> keep;
+        for (int k = 0; k < n; ++k)
+        {
+          int i = order[k].second;
+          if (covered[i]) continue;
+          keep.push_back(i);
+          for (int j = 0; j < n; ++j)
+            if (cover[(size_t) j * n + i]) covered[j] = 1;
+        }
+        sort(keep.begin(), keep.end()); //Keep the views in learned (frame) order
+        OBJS_DEBUG_2(cout << mit->first << "/" << oit->first << ": keeping " << keep.size() << " of " << n << " views" << endl;);
+        dropped += n - (int) keep.size();
+        f.keep_views(keep);
+        m.indices.erase(oit->first); //View numbers changed, the learning index is rebuilt when next needed
+      }
+      kept_frames[oit->first].insert(f.frame_number.begin(), f.frame_number.end());
+    }
+  }
+  //FILTERS: drop views of frames recognition can no longer return
+  if (filters)
+  {
+    for (map<string, set<int> >::iterator kit = kept_frames.begin(); kit != kept_frames.end(); ++kit)
+    {
+      mmod_filters::ObjFilters::iterator fit = filters->ObjViews.find(kit->first);
+      if (fit == filters->ObjViews.end()) continue;
+      vector<int> keep;
+      for (int i = 0; i < fit->second.size(); ++i)
+        if (kit->second.count(fit->second.frame_number[i])) keep.push_back(i);
+      fit->second.keep_views(keep);
+      filters->ViewIndex.erase(kit->first);
+      filters->update_viewindex(kit->first);
+    }
+  }
+  return dropped;
+}
+
+/**
+ * \brief Add the objects of o (e.g. learned in another session or process) to these, by mode and object
+ *
+ * Objects new here are copied whole, the views of objects already here are appended after theirs
+ * (mmod_features::merge). The learning indices of the objects changed are rebuilt when next needed.
+ * To also drop views that are similar but not identical, compact() afterwards.
+ * Models learned separately number their frames from the same start: pass a frame_offset that moves the frames of o
+ * past those here (see frame_range), and the same one to mmod_filters::merge of its filters, or views of different
+ * frames get tied together (filtering, compact).
+ *
+ * @param o             Objects to add
+ * @param dedup         Skip views identical (features and offsets) to one already here
+ * @param frame_offset  Added to the frame numbers of the views of o
+ * @return              Number of views added (over all modes)
+ */
+int mmod_objects::merge(const mmod_objects &o, bool dedup, int frame_offset)
+{
+  int added = 0;
+  for (ModelsForModes::const_iterator mit = o.modes.begin(); mit != o.modes.end(); ++mit)
+  {
+    ModelsForModes::iterator m = modes.find(mit->first);
+    if (m == modes.end())
+      m = modes.insert(pair<string, mmod_mode> (mit->first, mmod_mode(mit->first))).first;
+    for (mmod_mode::ObjectModels::const_iterator oit = mit->second.objs.begin(); oit != mit->second.objs.end(); ++oit)
+    {
+      mmod_mode::ObjectModels::iterator f = m->second.objs.find(oit->first);
+      if (f == m->second.objs.end())
+      {
+        f = m->second.objs.insert(*oit).first;
+        for (vector<int>::iterator fit = f->second.frame_number.begin(); fit != f->second.frame_number.end(); ++fit)
+          *fit += frame_offset;
+        added += (int) oit->second.features.size();
+      }
+      else
+        added += f->second.merge(oit->second, dedup, frame_offset);
+      m->second.indices.erase(oit->first); //The learning index is rebuilt when next needed
+    }
+  }
+  OBJS_DEBUG_2(cout << "mmod_objects::merge added " << added << " views" << endl;);
+  return added;
+}
+
+/**
+ * \brief Widen [lo, hi] to take in the frame numbers of all the views (left alone if there are none)
+ */
+void mmod_objects::frame_range(int &lo, int &hi) const
+{
+  for (ModelsForModes::const_iterator mit = modes.begin(); mit != modes.end(); ++mit)
+    for (mmod_mode::ObjectModels::const_iterator oit = mit->second.objs.begin(); oit != mit->second.objs.end(); ++oit)
+      oit->second.frame_range(lo, hi);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // FILTERS
 ////////////////////////////////////////////////////////////////////////////////
@@ -637,3 +931,50 @@ int mmod_filters::filter_object_recognitions(const Mat &filt_features, mmod_obje
 	}
 	return reclen;
 }
+
+/**
+ * \brief Add the filter views of f (of the same mode) to these, by object, as mmod_objects::merge
+ *
+ * @param f					Filters to add. If these have no views yet, they take its mode
+ * @param dedup				Skip views identical (features and offsets) to one already here
+ * @param update_index		Update ViewIndex of the objects changed. Merging many filters, pass false and call
+ * 							update_viewindex() once at the end
+ * @param frame_offset		Added to the frame numbers of the views of f: the one its objects were merged with
+ * @return					Number of views added. -1 => error, f has another mode (nothing is changed)
+ */
+int mmod_filters::merge(const mmod_filters &f, bool dedup, bool update_index, int frame_offset)
+{
+	if(ObjViews.empty())
+		mode = f.mode;
+	else if(f.mode != mode && !f.ObjViews.empty())
+	{
+		cerr << "ERROR, in mmod_filters::merge, can't add filters of mode " << f.mode << " to filters of mode " << mode << endl;
+		return -1;
+	}
+	int added = 0;
+	for(ObjFilters::const_iterator it = f.ObjViews.begin(); it != f.ObjViews.end(); ++it)
+	{
+		ObjFilters::iterator o = ObjViews.find(it->first);
+		if(o == ObjViews.end())
+		{
+			o = ObjViews.insert(*it).first;
+			for(vector<int>::iterator fit = o->second.frame_number.begin(); fit != o->second.frame_number.end(); ++fit)
+				*fit += frame_offset;
+			added += (int)it->second.features.size();
+		}
+		else
+			added += o->second.merge(it->second, dedup, frame_offset);
+		if(update_index)
+			update_viewindex(it->first);
+	}
+	return added;
+}
+
+/**
+ * \brief Widen [lo, hi] to take in the frame numbers of all the filter views (left alone if there are none)
+ */
+void mmod_filters::frame_range(int &lo, int &hi) const
+{
+	for(ObjFilters::const_iterator it = ObjViews.begin(); it != ObjViews.end(); ++it)
+		it->second.frame_range(lo, hi);
+}
@@ -13,6 +13,7 @@
 #include <vector>
 #include "mmod_general.h"
 #include "mmod_mode.h"
+#include <boost/shared_ptr.hpp>
 //SERIALIZATION
 #include <boost/archive/text_oarchive.hpp>
 #include <boost/archive/text_iarchive.hpp>
@@ -54,12 +55,13 @@
  * modes (depth, gradient, ...)  and each mode has it's
  * features for each view
  */
+class mmod_filters;
 class mmod_objects
 {
 public:
 	typedef std::map <std::string, mmod_mode> ModelsForModes; //(mode, models_for_that_mode)
 	ModelsForModes 		modes;			//For each mode, learned objects
-	mmod_general 		util;			//Learning, Matching etc
+	mmod_general 		util;			//Learning, Matching etc. util.feature_budget limits the features of each learned template
 	//Below is just temp storage for match_all_objects* convenience
 	std::vector<cv::Rect> rv;			//vector of rectangle bounding boxes from an image match_all_objects
 	std::vector<float> scores;			//the scores from the above
@@ -135,6 +137,20 @@ public:
 	int match_all_objects(const std::vector<cv::Mat> &I, const std::vector<std::string>& mode_names, const cv::Mat &Mask,
 			float match_threshold, float frac_overlap, int skipX = 7, int skipY = 7, int *rawmatches = 0);
 
+	/**
+	 * \brief match_all_objects on an interleaved feature image (see mmod_general::interleave_features).
+	 *
+	 * All modes of all objects are matched at a point while that neighborhood of the one image is in cache, instead
+	 * of from a separate image per mode. Each mode still picks its own best view, so results are the same as
+	 * match_all_objects on the separate feature images.
+	 *
+	 * @param Ifeat				CV_8UC(n) feature image, channel i holding the features of mode_names[i]
+	 * @param mode_names		Vector: List of names of the modes of the channels of Ifeat
+	 * Other parameters and return as match_all_objects above
+	 */
+	int match_all_objects(const cv::Mat &Ifeat, const std::vector<std::string>& mode_names, const cv::Mat &Mask,
+			float match_threshold, float frac_overlap, int skipX = 7, int skipY = 7, int *rawmatches = 0);
+
 
 
 	/**
@@ -155,6 +171,57 @@ public:
 	int learn_a_template(std::vector<cv::Mat> &Ifeat, const std::vector<std::string> &mode_names, cv::Mat &Mask,
 			std::string &session_ID, std::string &object_ID, int framenum, float learn_thresh, float *Score = 0);
 
+	/**
+	 * \brief match_all_objects with the modes given by modality ID (MODALITY_* of mmod_modality_ids.h) instead of by name
+	 */
+	int match_all_objects(const std::vector<cv::Mat> &I, const std::vector<int>& mode_ids, const cv::Mat &Mask,
+			float match_threshold, float frac_overlap, int skipX = 7, int skipY = 7, int *rawmatches = 0);
+
+	/**
+	 * \brief learn_a_template with the modes given by modality ID (MODALITY_* of mmod_modality_ids.h) instead of by name
+	 */
+	int learn_a_template(std::vector<cv::Mat> &Ifeat, const std::vector<int> &mode_ids, cv::Mat &Mask,
+			std::string &session_ID, std::string &object_ID, int framenum, float learn_thresh, float *Score = 0);
+
+	/**
+	 * \brief Drop the views of each object that another (kept) view of the same object and mode already covers
+	 *
+	 * For each mode and object, every view is drawn, spread and matched against every other view as
+	 * learn_a_template would (in parallel, one view per task). Views are then visited from the one covering the most
+	 * others down; a view is kept if no kept view scores it above sim_thresh, and it then covers those it scores
+	 * above sim_thresh. This is learn_a_template with learn_thresh = sim_thresh, applied afterwards to a model
+	 * learned with a lower threshold (e.g. 0, every frame).
+	 *
+	 * @param sim_thresh		Views a kept view matches above this [0,1] are dropped
+	 * @param filters			If set, its views of frames no longer learned in any mode of that object are dropped
+	 *                          too, so the frame numbers recognition returns still find their filter views
+	 * @param nthreads			Threads to match with, 0 => one per hardware thread
+	 * @return					Number of object views dropped (over all modes)
+	 */
+	int compact(float sim_thresh, mmod_filters *filters = 0, int nthreads = 0);
+
+	/**
+	 * \brief Add the objects of o (e.g. learned in another session or process) to these, by mode and object
+	 *
+	 * Objects new here are copied whole, the views of objects already here are appended after theirs
+	 * (mmod_features::merge). The learning indices of the objects changed are rebuilt when next needed.
+	 * To also drop views that are similar but not identical, compact() afterwards.
+	 * Models learned separately number their frames from the same start: pass a frame_offset that moves the frames
+	 * of o past those here (see frame_range), and the same one to mmod_filters::merge of its filters, or views of
+	 * different frames get tied together (filtering, compact).
+	 *
+	 * @param o					Objects to add
+	 * @param dedup				Skip views identical (features and offsets) to one already here
+	 * @param frame_offset		Added to the frame numbers of the views of o
+	 * @return					Number of views added (over all modes)
+	 */
+	int merge(const mmod_objects &o, bool dedup = false, int frame_offset = 0);
+
+	/**
+	 * \brief Widen [lo, hi] to take in the frame numbers of all the views (left alone if there are none)
+	 */
+	void frame_range(int &lo, int &hi) const;
+
 };
 
 //////////////////////////////////////////////////////////////////////////////////////////////
@@ -247,6 +314,45 @@ public:
 	 * @return					Number of remaining matches
 	 */
 	int filter_object_recognitions(const cv::Mat &filt_features, mmod_objects &Objs, float thresh);
+
+	/**
+	 * \brief Add the filter views of f (of the same mode) to these, by object, as mmod_objects::merge
+	 *
+	 * @param f					Filters to add. If these have no views yet, they take its mode
+	 * @param dedup				Skip views identical (features and offsets) to one already here
+	 * @param update_index		Update ViewIndex of the objects changed. Merging many filters, pass false and call
+	 * 							update_viewindex() once at the end
+	 * @param frame_offset		Added to the frame numbers of the views of f: the one its objects were merged with
+	 * @return					Number of views added. -1 => error, f has another mode (nothing is changed)
+	 */
+	int merge(const mmod_filters &f, bool dedup = false, bool update_index = true, int frame_offset = 0);
+
+	/**
+	 * \brief Widen [lo, hi] to take in the frame numbers of all the filter views (left alone if there are none)
+	 */
+	void frame_range(int &lo, int &hi) const;
 };
 
+//////////////////////////////////////////////////////////////////////////////////////////////
+//Read only snapshots of a model being learned. Training hands these on (e.g. to be saved) without copying the model
+typedef boost::shared_ptr<const mmod_objects> mmod_objects_snapshot;
+typedef boost::shared_ptr<const mmod_filters> mmod_filters_snapshot;
+
+/**
+ * \brief Copy on write: return the model in p for changing, copying it first only if a snapshot of it is still held
+ *
+ * Learn into a boost::shared_ptr<mmod_objects> (or mmod_filters) through this and hand p out as a snapshot. As long as
+ * whoever took the last snapshot has let go of it by the next call, the model is never copied.
+ * @param p		model, created (default constructed) if p is empty
+ * @return		model that only p owns
+ */
+template<class T> T &mutable_model(boost::shared_ptr<T> &p)
+{
+	if(!p)
+		p.reset(new T());
+	else if(!p.unique())
+		p.reset(new T(*p)); //Someone still holds a snapshot of it, leave theirs alone
+	return *p;
+}
+
 #endif /* MMOD_OBJECTS_H_ */
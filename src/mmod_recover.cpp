@@ -0,0 +1,27 @@
+// Recover a model persisted through a training journal (MModPersister filename_journal): replay the journal over the
+// objects and filters archives, write them complete and empty the journal.
+//
+// console application.
+//
+#include <iostream>
+#include <stdio.h>
+
+#include "mmod_journal.h"
+
+using namespace std;
+
+static void help()
+{
+	cout << "Usage: mmod_recover objects filters journal\n"
+	        "  Replays the views learned into journal (e.g. by a training run that was interrupted) over the binary\n"
+	        "  archives objects and filters, rewrites them complete and empties the journal." << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char* argv[]) {
+	if (argc != 4) { help(); return -1; }
+	int n = mmod_journal::fold(argv[1], argv[2], argv[3]);
+	if (n < 0) return -1;
+	printf("Recovered %d views from %s into %s, %s\n", n, argv[3], argv[1], argv[2]);
+	return 0;
+}